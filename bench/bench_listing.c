@@ -0,0 +1,173 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../src/bsdcore.h"
+
+/*
+ * Times get_books_st() and get_notes_st() on a generated tree: one book of many empty notes
+ * next to many empty books, in a temporary $HOME that is removed afterwards. The first call
+ * builds the index, the following ones are answered from it.
+ *
+ *     make bench && ./bin/bench_listing [notes] [books] [calls]
+ */
+
+#define BENCH_DEFAULT_NOTES 100000
+#define BENCH_DEFAULT_BOOKS 200
+#define BENCH_DEFAULT_CALLS 10
+#define BENCH_TREE_AGE_SEC 3600
+
+// Layouts of bsdcore.c, its header only declares the types
+struct Note
+{
+    char* name;
+};
+
+struct Book
+{
+    char* name;
+    Note* notes;
+    int32_t notes_count;
+};
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// An hour old, so the index does not take a book for one still being written
+static int age(const char* path)
+{
+    struct timespec times[2];
+    clock_gettime(CLOCK_REALTIME, &times[0]);
+    times[0].tv_sec -= BENCH_TREE_AGE_SEC;
+    times[1] = times[0];
+    if (utimensat(AT_FDCWD, path, times, 0) != 0) {
+        perror("utimensat");
+        return -1;
+    }
+    return 0;
+}
+
+static int make_tree(const char* root, int notes, int books)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/books", root);
+    if (mkdir(path, 0755) != 0) {
+        perror("mkdir");
+        return -1;
+    }
+    // The big book sorts first, the others are empty
+    snprintf(path, sizeof(path), "%s/books/Big", root);
+    if (mkdir(path, 0755) != 0) {
+        perror("mkdir");
+        return -1;
+    }
+    for (int i = 0; i < notes; i++) {
+        snprintf(path, sizeof(path), "%s/books/Big/note%06d.bdsb", root, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) {
+            perror("open");
+            return -1;
+        }
+        close(fd);
+    }
+    snprintf(path, sizeof(path), "%s/books/Big", root);
+    if (age(path) != 0) {
+        return -1;
+    }
+    for (int i = 1; i < books; i++) {
+        snprintf(path, sizeof(path), "%s/books/book%04d", root, i);
+        if (mkdir(path, 0755) != 0) {
+            perror("mkdir");
+            return -1;
+        }
+        if (age(path) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void free_books(Book* books, int count)
+{
+    for (int i = 0; i < count; i++) {
+        free(books[i].name);
+    }
+    free(books);
+}
+
+static void free_notes(Note* notes, int count)
+{
+    for (int i = 0; i < count; i++) {
+        free(notes[i].name);
+    }
+    free(notes);
+}
+
+// The first call builds $HOME/books/.bsdindex from the tree, the others read it
+static int run(int calls)
+{
+    int count = 0;
+    double start = now_ms();
+    Note* first_notes = get_notes_st("Big", &count);
+    printf("get_notes_st  building  %9.3f ms (%d notes)\n", now_ms() - start, count);
+    free_notes(first_notes, count);
+    start = now_ms();
+    for (int i = 0; i < calls; i++) {
+        Note* notes = get_notes_st("Big", &count);
+        if (!notes) {
+            fprintf(stderr, "get_notes_st failed\n");
+            return -1;
+        }
+        free_notes(notes, count);
+    }
+    printf("get_notes_st  indexed   %9.3f ms per call\n", (now_ms() - start) / calls);
+
+    start = now_ms();
+    for (int i = 0; i < calls; i++) {
+        Book* books = get_books_st(&count);
+        if (!books) {
+            fprintf(stderr, "get_books_st failed\n");
+            return -1;
+        }
+        free_books(books, count);
+    }
+    printf("get_books_st  indexed   %9.3f ms per call (%d books)\n", (now_ms() - start) / calls, count);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    int notes = argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_NOTES;
+    int books = argc > 2 ? atoi(argv[2]) : BENCH_DEFAULT_BOOKS;
+    int calls = argc > 3 ? atoi(argv[3]) : BENCH_DEFAULT_CALLS;
+    if (notes < 0 || books < 1 || calls < 1) {
+        fprintf(stderr, "usage: %s [notes] [books] [calls]\n", argv[0]);
+        return 1;
+    }
+
+    char root[] = "/tmp/bsdbench.XXXXXX";
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    setenv("HOME", root, 1);
+
+    int rc = 1;
+    double start = now_ms();
+    if (make_tree(root, notes, books) == 0) {
+        printf("tree          %d notes, %d books in %.0f ms\n", notes, books, now_ms() - start);
+        rc = run(calls) != 0;
+    }
+    delete_folder_recursive(root);
+    return rc;
+}
@@ -0,0 +1,251 @@
+#include "./bsdcore.h"
+
+#include <pthread.h>
+
+typedef struct BatchRun
+{
+    const char* book_name;
+    const char* const* note_names;
+    NoteBody** bodies;
+    // Notes the cache missed, with the tickets to fill it
+    size_t* misses;
+    unsigned long long* tickets;
+    size_t misses_count;
+    // Next miss to read, shared by the threads
+    size_t next;
+    size_t bytes;
+    size_t max_bytes;
+    int over_budget;
+    // Pool threads still to join the run, and those reading for it; guarded by pool.lock
+    int helpers_wanted;
+    int helpers_running;
+    struct BatchRun* next_run;
+} BatchRun;
+
+// Readers shared by every batch, started on the first one that needs them
+static struct
+{
+    pthread_once_t once;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    // Runs still wanting helpers, oldest first
+    BatchRun* queue;
+    int threads;
+} pool = {
+    .once = PTHREAD_ONCE_INIT,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+// Reads a note that is not going to be cached, NULL on a short read
+static NoteBody* read_body(int fd, const struct stat* st)
+{
+    size_t size = st->st_size;
+    NoteBody* body = malloc(sizeof(NoteBody) + size + 1);
+    if (!body) {
+        perror("malloc");
+        return NULL;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, body->data + done, size - done, done);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            free(body);
+            return NULL;
+        }
+        done += n;
+    }
+    body->data[size] = '\0';
+    body->len = size;
+    body->st = *st;
+    body->refs = 1;
+    return body;
+}
+
+static void read_miss(BatchRun* run, size_t miss)
+{
+    size_t i = run->misses[miss];
+    struct stat st;
+    int fd = open_note(run->book_name, run->note_names[i], &st);
+    if (fd < 0) {
+        return;
+    }
+    // Counted before reading, so a huge book stops without being read into memory
+    size_t bytes = __atomic_add_fetch(&run->bytes, (size_t)st.st_size, __ATOMIC_RELAXED);
+    if (bytes > run->max_bytes) {
+        __atomic_store_n(&run->over_budget, 1, __ATOMIC_RELAXED);
+        close(fd);
+        return;
+    }
+    NoteBody* body = notecache_fill(run->book_name, run->note_names[i], fd, &st, run->tickets[miss]);
+    run->bodies[i] = body ? body : read_body(fd, &st);
+    close(fd);
+}
+
+static void* batch_worker(void* arg)
+{
+    BatchRun* run = arg;
+    while (!__atomic_load_n(&run->over_budget, __ATOMIC_RELAXED)) {
+        size_t miss = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED);
+        if (miss >= run->misses_count) {
+            break;
+        }
+        read_miss(run, miss);
+    }
+    return NULL;
+}
+
+static void unqueue_run(BatchRun* run)
+{
+    for (BatchRun** p = &pool.queue; *p; p = &(*p)->next_run) {
+        if (*p == run) {
+            *p = run->next_run;
+            break;
+        }
+    }
+    run->next_run = NULL;
+}
+
+static void* pool_loop(void* arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&pool.lock);
+    while (1) {
+        while (!pool.queue) {
+            pthread_cond_wait(&pool.work, &pool.lock);
+        }
+        BatchRun* run = pool.queue;
+        if (--run->helpers_wanted == 0) {
+            unqueue_run(run);
+        }
+        run->helpers_running++;
+        pthread_mutex_unlock(&pool.lock);
+        batch_worker(run);
+        pthread_mutex_lock(&pool.lock);
+        if (--run->helpers_running == 0) {
+            pthread_cond_broadcast(&pool.done);
+        }
+    }
+    return NULL;
+}
+
+// A thread that fails to start leaves the batches to the others and their callers
+static void pool_start(void)
+{
+    for (int t = 1; t < BATCH_MAX_THREADS; t++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_loop, NULL) != 0) {
+            continue;
+        }
+        pthread_detach(thread);
+        pool.threads++;
+    }
+}
+
+static int thread_count(int threads, size_t misses_count)
+{
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+    if (threads > BATCH_MAX_THREADS) {
+        threads = BATCH_MAX_THREADS;
+    }
+    size_t useful = misses_count / BATCH_MIN_NOTES_PER_THREAD;
+    if ((size_t)threads > useful) {
+        threads = useful > 0 ? (int)useful : 1;
+    }
+    return threads;
+}
+
+static void release_all(NoteBody** bodies, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        notecache_release(bodies[i]);
+        bodies[i] = NULL;
+    }
+}
+
+long batch_read_notes(const char* book_name, const char* const* note_names, size_t count,
+                      int threads, size_t max_bytes, NoteBody** bodies)
+{
+    BatchRun run;
+    memset(&run, 0, sizeof(run));
+    run.book_name = book_name;
+    run.note_names = note_names;
+    run.bodies = bodies;
+    run.max_bytes = max_bytes;
+    run.misses = malloc((count ? count : 1) * sizeof(*run.misses));
+    run.tickets = malloc((count ? count : 1) * sizeof(*run.tickets));
+    if (!run.misses || !run.tickets) {
+        perror("malloc");
+        free(run.misses);
+        free(run.tickets);
+        memset(bodies, 0, count * sizeof(*bodies));
+        return -1;
+    }
+
+    // Hot notes cost a lookup each, only the rest is worth threads
+    for (size_t i = 0; i < count; i++) {
+        unsigned long long ticket;
+        bodies[i] = notecache_get(book_name, note_names[i], &ticket);
+        if (bodies[i]) {
+            run.bytes += bodies[i]->len;
+        } else {
+            run.misses[run.misses_count] = i;
+            run.tickets[run.misses_count] = ticket;
+            run.misses_count++;
+        }
+    }
+    run.over_budget = run.bytes > max_bytes;
+
+    // The caller is one of the readers, pool threads busy with other batches leave it their share
+    int helpers = thread_count(threads, run.misses_count) - 1;
+    if (helpers > 0) {
+        pthread_once(&pool.once, pool_start);
+        if (helpers > pool.threads) {
+            helpers = pool.threads;
+        }
+    }
+    if (helpers > 0) {
+        pthread_mutex_lock(&pool.lock);
+        run.helpers_wanted = helpers;
+        BatchRun** tail = &pool.queue;
+        while (*tail) {
+            tail = &(*tail)->next_run;
+        }
+        *tail = &run;
+        pthread_cond_broadcast(&pool.work);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    batch_worker(&run);
+    if (helpers > 0) {
+        // Every miss is taken, helpers that have not joined yet are not needed
+        pthread_mutex_lock(&pool.lock);
+        if (run.helpers_wanted > 0) {
+            unqueue_run(&run);
+            run.helpers_wanted = 0;
+        }
+        while (run.helpers_running > 0) {
+            pthread_cond_wait(&pool.done, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+    free(run.misses);
+    free(run.tickets);
+
+    if (run.over_budget) {
+        release_all(bodies, count);
+        return -2;
+    }
+    long found = 0;
+    for (size_t i = 0; i < count; i++) {
+        found += bodies[i] != NULL;
+    }
+    return found;
+}
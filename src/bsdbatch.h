@@ -0,0 +1,68 @@
+/*=================================================================================================
+ *
+ * 	@FILENAME:	      bsdbatch.h
+ * 	@BRIEF:    	      Reads many notes of a book at once.
+ * 	@DESCRIPTION:	  Takes what it can from the note cache, then reads the remaining notes on a
+ * 	                  few threads, so a book preview or export costs one request and about one
+ * 	                  disk round trip per thread instead of one of each per note. The threads are
+ * 	                  a pool shared by every batch, started on the first one.
+ * 	@AUTHOR		      Daniil (TwelveFacedJanus) Ermolaev.
+ * 	   | CONTACT:	  twofaced-janus@yandex.ru
+ *	@CREATED AT:	  10.16.26
+ *	@UPDATED_AT:	  10.16.26
+ *
+ *==================================================================================================*/
+
+#ifndef BSDBATCH_H_
+#define BSDBATCH_H_
+
+#include <stddef.h>
+
+#include "bsdnotecache.h"
+
+// Readers of one batch, the caller included; the pool holds one less
+#define BATCH_MAX_THREADS 8
+// Below this many notes to read per thread, starting another thread costs more than it saves
+#define BATCH_MIN_NOTES_PER_THREAD 16
+// Bytes of note text one batch response may carry
+#define BATCH_MAX_BYTES (64 * 1024 * 1024)
+
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Reads a list of notes of one book.
+ *     @DESCRIPTION:
+ *          Looks every note up in the note cache first. The notes it misses are read by up to
+ *          threads threads, the calling one and idle threads of the shared pool, and cached on
+ *          the way when they fit. Reading stops as soon as the notes read so far exceed max_bytes.
+ *     @PARAMETERS:
+ *          - const char* book_name: Name of the book
+ *          - const char* const* note_names: Names of the notes without .bdsb, already validated
+ *          - size_t count: Number of names
+ *          - int threads: Most threads to use, 0 for one per CPU
+ *          - size_t max_bytes: Most bytes of note text to read
+ *          - NoteBody** bodies: Array of count, bodies[i] is set to note i or NULL if it is missing
+ *     @RETURN:
+ *          - long: Number of notes found
+ *          - -1 if out of memory, -2 if the notes exceed max_bytes; bodies are all NULL then
+ *     @NOTES:
+ *          - Release every body with notecache_release()
+ *          - Thread-safe; concurrent batches share the pool's BATCH_MAX_THREADS - 1 threads
+ *     @EXAMPLE:
+ *          ```c
+ *          const char* names[] = { "C_Tips", "Pointers" };
+ *          NoteBody* bodies[2];
+ *          long found = batch_read_notes("Programming", names, 2, 0, BATCH_MAX_BYTES, bodies);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FIX]:
+ *               Misses are read by a persistent pool instead of threads created per call.
+ *
+ =========================================================================================*/
+long batch_read_notes(const char* book_name, const char* const* note_names, size_t count,
+                      int threads, size_t max_bytes, NoteBody** bodies);
+
+#endif
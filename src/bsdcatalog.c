@@ -0,0 +1,972 @@
+#include "./bsdcore.h"
+
+#include <pthread.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
+#define CATALOG_NOTE_EXT ".bdsb"
+#define CATALOG_NOTE_EXT_LEN 5
+
+#if defined(__linux__)
+#define CATALOG_ROOT_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+#define CATALOG_BOOK_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB)
+#endif
+
+typedef struct CatalogNote
+{
+    char* name;
+    off_t size;
+    time_t mtime;
+} CatalogNote;
+
+// Entry of the newest-first order, name is shared with the CatalogNote
+typedef struct CatalogRecent
+{
+    time_t mtime;
+    char* name;
+} CatalogRecent;
+
+typedef struct CatalogBook
+{
+    char* name;
+    CatalogNote* notes;
+    int notes_count;
+    int notes_cap;
+    // The same notes by mtime, newest first, then by name; notes_count entries
+    CatalogRecent* recent;
+    int recent_cap;
+    int wd;
+    time_t dir_mtime;
+} CatalogBook;
+
+static struct
+{
+    pthread_rwlock_t lock;
+    pthread_mutex_t start_lock;
+    int ready;
+    char* root;
+    CatalogBook* books;
+    int books_count;
+    int books_cap;
+    unsigned long long generation;
+    // Moves only when a book or note appears or goes away, not when a note is written
+    unsigned long long names_generation;
+    int names_changed;
+    int inotify_fd;
+    time_t root_mtime;
+    time_t started;
+} catalog = {
+    .lock = PTHREAD_RWLOCK_INITIALIZER,
+    .start_lock = PTHREAD_MUTEX_INITIALIZER,
+    .inotify_fd = -1,
+};
+
+static void bump_generation(void)
+{
+    if (catalog.names_changed) {
+        catalog.names_changed = 0;
+        __atomic_add_fetch(&catalog.names_generation, 1, __ATOMIC_RELEASE);
+    }
+    __atomic_add_fetch(&catalog.generation, 1, __ATOMIC_RELEASE);
+}
+
+// Returns the note name length without extension, 0 if the file is not a note
+static size_t note_stem_len(const char* file_name)
+{
+    size_t len = strlen(file_name);
+    if (len <= CATALOG_NOTE_EXT_LEN || strcmp(file_name + len - CATALOG_NOTE_EXT_LEN, CATALOG_NOTE_EXT) != 0) {
+        return 0;
+    }
+    return len - CATALOG_NOTE_EXT_LEN;
+}
+
+// Binary search, returns the index of name or -1 and the insertion point in *pos
+static int find_book(const char* name, int* pos)
+{
+    int lo = 0, hi = catalog.books_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(catalog.books[mid].name, name);
+        if (cmp == 0) {
+            if (pos) *pos = mid;
+            return mid;
+        }
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    if (pos) *pos = lo;
+    return -1;
+}
+
+static int find_note(const CatalogBook* book, const char* name, size_t name_len, int* pos)
+{
+    int lo = 0, hi = book->notes_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        const char* mid_name = book->notes[mid].name;
+        int cmp = strncmp(mid_name, name, name_len);
+        if (cmp == 0 && mid_name[name_len] != '\0') {
+            cmp = 1;
+        }
+        if (cmp == 0) {
+            if (pos) *pos = mid;
+            return mid;
+        }
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    if (pos) *pos = lo;
+    return -1;
+}
+
+// Newest first, equal mtimes by name
+static int recent_cmp(time_t a_mtime, const char* a_name, time_t b_mtime, const char* b_name)
+{
+    if (a_mtime != b_mtime) {
+        return a_mtime > b_mtime ? -1 : 1;
+    }
+    return strcmp(a_name, b_name);
+}
+
+static int compare_recent(const void* a, const void* b)
+{
+    const CatalogRecent* x = a;
+    const CatalogRecent* y = b;
+    return recent_cmp(x->mtime, x->name, y->mtime, y->name);
+}
+
+static int compare_notes(const void* a, const void* b)
+{
+    return strcmp(((const CatalogNote*)a)->name, ((const CatalogNote*)b)->name);
+}
+
+static int find_recent(const CatalogBook* book, time_t mtime, const char* name, int* pos)
+{
+    int lo = 0, hi = book->notes_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = recent_cmp(book->recent[mid].mtime, book->recent[mid].name, mtime, name);
+        if (cmp == 0) {
+            if (pos) *pos = mid;
+            return mid;
+        }
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    if (pos) *pos = lo;
+    return -1;
+}
+
+// Call with notes_count entries before the change, recent must have room for one more
+static void recent_insert(CatalogBook* book, time_t mtime, char* name)
+{
+    int pos;
+    find_recent(book, mtime, name, &pos);
+    memmove(&book->recent[pos + 1], &book->recent[pos], (book->notes_count - pos) * sizeof(CatalogRecent));
+    book->recent[pos].mtime = mtime;
+    book->recent[pos].name = name;
+}
+
+static void recent_remove(CatalogBook* book, time_t mtime, const char* name)
+{
+    int idx = find_recent(book, mtime, name, NULL);
+    if (idx >= 0) {
+        memmove(&book->recent[idx], &book->recent[idx + 1], (book->notes_count - idx - 1) * sizeof(CatalogRecent));
+    }
+}
+
+static int book_index_by_wd(int wd)
+{
+    for (int i = 0; i < catalog.books_count; i++) {
+        if (catalog.books[i].wd == wd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void book_clear_notes(CatalogBook* book)
+{
+    for (int i = 0; i < book->notes_count; i++) {
+        free(book->notes[i].name);
+    }
+    book->notes_count = 0;
+}
+
+// Room for one more note in both orders
+static int book_reserve(CatalogBook* book)
+{
+    if (book->notes_count == book->notes_cap) {
+        int cap = book->notes_cap ? book->notes_cap * 2 : 16;
+        CatalogNote* notes = realloc(book->notes, cap * sizeof(CatalogNote));
+        if (!notes) {
+            perror("realloc");
+            return -1;
+        }
+        book->notes = notes;
+        book->notes_cap = cap;
+    }
+    if (book->notes_count == book->recent_cap) {
+        int cap = book->notes_cap;
+        CatalogRecent* recent = realloc(book->recent, cap * sizeof(CatalogRecent));
+        if (!recent) {
+            perror("realloc");
+            return -1;
+        }
+        book->recent = recent;
+        book->recent_cap = cap;
+    }
+    return 0;
+}
+
+static void note_upsert(CatalogBook* book, const char* name, size_t name_len, const struct stat* st)
+{
+    int pos;
+    int idx = find_note(book, name, name_len, &pos);
+    if (idx >= 0) {
+        CatalogNote* note = &book->notes[idx];
+        if (note->mtime != st->st_mtime) {
+            // Out at the old mtime, back in at the new one; recent has notes_count - 1 between
+            recent_remove(book, note->mtime, note->name);
+            book->notes_count--;
+            recent_insert(book, st->st_mtime, note->name);
+            book->notes_count++;
+        }
+        note->size = st->st_size;
+        note->mtime = st->st_mtime;
+        return;
+    }
+
+    if (book_reserve(book) != 0) {
+        return;
+    }
+    char* copy = strndup(name, name_len);
+    if (!copy) {
+        perror("strndup");
+        return;
+    }
+    recent_insert(book, st->st_mtime, copy);
+    memmove(&book->notes[pos + 1], &book->notes[pos], (book->notes_count - pos) * sizeof(CatalogNote));
+    book->notes[pos].name = copy;
+    book->notes[pos].size = st->st_size;
+    book->notes[pos].mtime = st->st_mtime;
+    book->notes_count++;
+    catalog.names_changed = 1;
+}
+
+static void note_remove(CatalogBook* book, const char* name, size_t name_len)
+{
+    int idx = find_note(book, name, name_len, NULL);
+    if (idx < 0) {
+        return;
+    }
+    recent_remove(book, book->notes[idx].mtime, book->notes[idx].name);
+    free(book->notes[idx].name);
+    memmove(&book->notes[idx], &book->notes[idx + 1], (book->notes_count - idx - 1) * sizeof(CatalogNote));
+    book->notes_count--;
+    catalog.names_changed = 1;
+}
+
+// Reads every note of a book, replacing what the catalog knew about it
+static void scan_book(CatalogBook* book)
+{
+    char book_path[1024];
+    snprintf(book_path, sizeof(book_path), "%s/%s", catalog.root, book->name);
+
+    book_clear_notes(book);
+    DIR* dir = opendir(book_path);
+    if (!dir) {
+        return;
+    }
+
+    struct stat dir_stat;
+    if (fstat(dirfd(dir), &dir_stat) == 0) {
+        book->dir_mtime = dir_stat.st_mtime;
+    }
+
+    // Appended in directory order and sorted once, sorted inserts would be quadratic
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t stem = note_stem_len(entry->d_name);
+        struct stat st;
+        if (!stem || fstatat(dirfd(dir), entry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode) ||
+            book_reserve(book) != 0) {
+            continue;
+        }
+        char* copy = strndup(entry->d_name, stem);
+        if (!copy) {
+            perror("strndup");
+            continue;
+        }
+        CatalogNote* note = &book->notes[book->notes_count];
+        note->name = copy;
+        note->size = st.st_size;
+        note->mtime = st.st_mtime;
+        book->recent[book->notes_count].mtime = st.st_mtime;
+        book->recent[book->notes_count].name = copy;
+        book->notes_count++;
+    }
+    closedir(dir);
+
+    if (book->notes_count > 1) {
+        qsort(book->notes, book->notes_count, sizeof(CatalogNote), compare_notes);
+        qsort(book->recent, book->notes_count, sizeof(CatalogRecent), compare_recent);
+    }
+    catalog.names_changed = 1;
+}
+
+static CatalogBook* book_insert(const char* name)
+{
+    int pos;
+    int idx = find_book(name, &pos);
+    if (idx >= 0) {
+        return &catalog.books[idx];
+    }
+
+    if (catalog.books_count == catalog.books_cap) {
+        int cap = catalog.books_cap ? catalog.books_cap * 2 : 16;
+        CatalogBook* books = realloc(catalog.books, cap * sizeof(CatalogBook));
+        if (!books) {
+            perror("realloc");
+            return NULL;
+        }
+        catalog.books = books;
+        catalog.books_cap = cap;
+    }
+    char* copy = strdup(name);
+    if (!copy) {
+        perror("strdup");
+        return NULL;
+    }
+    memmove(&catalog.books[pos + 1], &catalog.books[pos], (catalog.books_count - pos) * sizeof(CatalogBook));
+    memset(&catalog.books[pos], 0, sizeof(CatalogBook));
+    catalog.books[pos].name = copy;
+    catalog.books[pos].wd = -1;
+    catalog.books_count++;
+    catalog.names_changed = 1;
+    return &catalog.books[pos];
+}
+
+static void book_remove(int idx)
+{
+    CatalogBook* book = &catalog.books[idx];
+#if defined(__linux__)
+    if (book->wd >= 0 && catalog.inotify_fd >= 0) {
+        inotify_rm_watch(catalog.inotify_fd, book->wd);
+    }
+#endif
+    book_clear_notes(book);
+    free(book->notes);
+    free(book->recent);
+    free(book->name);
+    memmove(&catalog.books[idx], &catalog.books[idx + 1], (catalog.books_count - idx - 1) * sizeof(CatalogBook));
+    catalog.books_count--;
+    catalog.names_changed = 1;
+}
+
+// Adds a book, watching it before the scan so notes created meanwhile are not missed
+static void book_add(const char* name)
+{
+    CatalogBook* book = book_insert(name);
+    if (!book) {
+        return;
+    }
+#if defined(__linux__)
+    if (book->wd < 0 && catalog.inotify_fd >= 0) {
+        char book_path[1024];
+        snprintf(book_path, sizeof(book_path), "%s/%s", catalog.root, name);
+        book->wd = inotify_add_watch(catalog.inotify_fd, book_path, CATALOG_BOOK_MASK);
+        if (book->wd < 0) {
+            perror("inotify_add_watch");
+        }
+    }
+#endif
+    scan_book(book);
+}
+
+static int scan_root(void)
+{
+    while (catalog.books_count > 0) {
+        book_remove(catalog.books_count - 1);
+    }
+
+    DIR* dir = opendir(catalog.root);
+    if (!dir) {
+        perror("opendir");
+        return -1;
+    }
+
+    struct stat root_stat;
+    if (fstat(dirfd(dir), &root_stat) == 0) {
+        catalog.root_mtime = root_stat.st_mtime;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        struct stat st;
+        if (fstatat(dirfd(dir), entry->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode)) {
+            book_add(entry->d_name);
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+#if defined(__linux__)
+// A rename is a MOVED_FROM followed by a MOVED_TO with the same cookie; watcher thread only
+static struct
+{
+    int set;
+    uint32_t cookie;
+    char book[256];
+    char note[256];
+} pending_move;
+
+// Changes seen in one read of the watch, recorded once the catalog lock is released; watcher thread only
+static struct
+{
+    Change* list;
+    size_t count;
+    size_t cap;
+    // A change could not be kept, readers are told to resync instead
+    int lost;
+} batch;
+
+static char* batch_name(const char* name, int* failed)
+{
+    if (!name) {
+        return NULL;
+    }
+    char* copy = strdup(name);
+    if (!copy) {
+        *failed = 1;
+    }
+    return copy;
+}
+
+static void batch_clear(Change* c)
+{
+    free(c->book);
+    free(c->note);
+    free(c->from_book);
+    free(c->from_note);
+}
+
+// Names are copied, books and notes of the batch may be gone before it is recorded
+static void queue_change(int type, const char* book, const char* note, const char* from_book, const char* from_note)
+{
+    if (batch.count == batch.cap) {
+        size_t cap = batch.cap ? batch.cap * 2 : 64;
+        Change* list = realloc(batch.list, cap * sizeof(Change));
+        if (!list) {
+            perror("realloc");
+            batch.lost = 1;
+            return;
+        }
+        batch.list = list;
+        batch.cap = cap;
+    }
+    int failed = 0;
+    Change c = {
+        .type = type,
+        .book = batch_name(book, &failed),
+        .note = batch_name(note, &failed),
+        .from_book = batch_name(from_book, &failed),
+        .from_note = batch_name(from_note, &failed),
+    };
+    if (failed) {
+        perror("strdup");
+        batch_clear(&c);
+        batch.lost = 1;
+        return;
+    }
+    batch.list[batch.count++] = c;
+}
+
+// Takes the journal lock, so never called with the catalog lock held
+static void record_batch(void)
+{
+    if (batch.count > 0 && changes_record_many(batch.list, batch.count) == 0) {
+        batch.lost = 1;
+    }
+    for (size_t i = 0; i < batch.count; i++) {
+        batch_clear(&batch.list[i]);
+    }
+    batch.count = 0;
+    if (batch.lost) {
+        batch.lost = 0;
+        changes_record(CHANGE_RESYNC, NULL, NULL, NULL, NULL);
+    }
+}
+
+// A MOVED_FROM without its MOVED_TO left the books: it was a delete
+static void flush_pending_move(void)
+{
+    if (!pending_move.set) {
+        return;
+    }
+    pending_move.set = 0;
+    if (pending_move.note[0]) {
+        queue_change(CHANGE_NOTE_DELETED, pending_move.book, pending_move.note, NULL, NULL);
+    } else {
+        queue_change(CHANGE_BOOK_DELETED, pending_move.book, NULL, NULL, NULL);
+    }
+}
+
+static void hold_move(uint32_t cookie, const char* book, const char* note)
+{
+    flush_pending_move();
+    pending_move.set = 1;
+    pending_move.cookie = cookie;
+    snprintf(pending_move.book, sizeof(pending_move.book), "%s", book);
+    snprintf(pending_move.note, sizeof(pending_move.note), "%s", note ? note : "");
+}
+
+// 1 and the old names in *from_book, *from_note when ev completes a held rename
+static int take_move(const struct inotify_event* ev, int is_note, const char** from_book, const char** from_note)
+{
+    if (!pending_move.set || pending_move.cookie != ev->cookie || (pending_move.note[0] != '\0') != is_note) {
+        return 0;
+    }
+    pending_move.set = 0;
+    *from_book = pending_move.book;
+    *from_note = pending_move.note;
+    return 1;
+}
+
+// Returns 0 for events that do not concern books or notes
+static int apply_event(const struct inotify_event* ev)
+{
+    if (!(ev->mask & IN_MOVED_TO)) {
+        flush_pending_move();
+    }
+    if (ev->mask & IN_Q_OVERFLOW) {
+        // Events were lost, the only safe answer is a full rescan
+        scan_root();
+        notecache_invalidate(NULL, NULL);
+        queue_change(CHANGE_RESYNC, NULL, NULL, NULL, NULL);
+        return 1;
+    }
+    if (ev->len == 0) {
+        return 0;
+    }
+
+    int book_idx = book_index_by_wd(ev->wd);
+    if (book_idx < 0) {
+        // Event on the books root: a book appeared or went away
+        if (!(ev->mask & IN_ISDIR) || strcmp(ev->name, ".") == 0 || strcmp(ev->name, "..") == 0) {
+            return 0;
+        }
+        notecache_invalidate(ev->name, NULL);
+        const char* from_book;
+        const char* from_note;
+        if (ev->mask & IN_MOVED_TO) {
+            if (take_move(ev, 0, &from_book, &from_note)) {
+                queue_change(CHANGE_BOOK_RENAMED, ev->name, NULL, from_book, NULL);
+            } else {
+                flush_pending_move();
+                queue_change(CHANGE_BOOK_CREATED, ev->name, NULL, NULL, NULL);
+            }
+        } else if (ev->mask & IN_CREATE) {
+            queue_change(CHANGE_BOOK_CREATED, ev->name, NULL, NULL, NULL);
+        } else if (ev->mask & IN_MOVED_FROM) {
+            hold_move(ev->cookie, ev->name, NULL);
+        } else if (ev->mask & IN_DELETE) {
+            queue_change(CHANGE_BOOK_DELETED, ev->name, NULL, NULL, NULL);
+        }
+
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+            book_add(ev->name);
+        } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            int idx = find_book(ev->name, NULL);
+            if (idx >= 0) {
+                book_remove(idx);
+            }
+        }
+        return 1;
+    }
+
+    CatalogBook* book = &catalog.books[book_idx];
+    size_t stem = note_stem_len(ev->name);
+    if (!stem) {
+        return 0;
+    }
+    // Any event on a note means its cached body may be stale
+    char note_name[256];
+    if (stem < sizeof(note_name)) {
+        memcpy(note_name, ev->name, stem);
+        note_name[stem] = '\0';
+        notecache_invalidate(book->name, note_name);
+
+        const char* from_book;
+        const char* from_note;
+        if (ev->mask & IN_MOVED_TO) {
+            if (take_move(ev, 1, &from_book, &from_note)) {
+                queue_change(CHANGE_NOTE_RENAMED, book->name, note_name, from_book, from_note);
+            } else {
+                // Editors save by renaming a temporary file over the note
+                flush_pending_move();
+                queue_change(find_note(book, ev->name, stem, NULL) >= 0 ? CHANGE_NOTE_MODIFIED
+                                                                        : CHANGE_NOTE_CREATED,
+                             book->name, note_name, NULL, NULL);
+            }
+        } else if (ev->mask & IN_CREATE) {
+            queue_change(CHANGE_NOTE_CREATED, book->name, note_name, NULL, NULL);
+        } else if (ev->mask & IN_CLOSE_WRITE) {
+            queue_change(CHANGE_NOTE_MODIFIED, book->name, note_name, NULL, NULL);
+        } else if (ev->mask & IN_MOVED_FROM) {
+            hold_move(ev->cookie, book->name, note_name);
+        } else if (ev->mask & IN_DELETE) {
+            queue_change(CHANGE_NOTE_DELETED, book->name, note_name, NULL, NULL);
+        }
+    }
+    if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        note_remove(book, ev->name, stem);
+        return 1;
+    }
+
+    char note_path[1024];
+    struct stat st;
+    snprintf(note_path, sizeof(note_path), "%s/%s/%s", catalog.root, book->name, ev->name);
+    if (stat(note_path, &st) == 0 && S_ISREG(st.st_mode)) {
+        note_upsert(book, ev->name, stem, &st);
+    } else {
+        note_remove(book, ev->name, stem);
+    }
+    return 1;
+}
+
+static void* watch_loop(void* arg)
+{
+    (void)arg;
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        ssize_t n = read(catalog.inotify_fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("inotify read");
+            break;
+        }
+
+        pthread_rwlock_wrlock(&catalog.lock);
+        int changed = 0;
+        for (char* p = buf; p < buf + n; ) {
+            const struct inotify_event* ev = (const struct inotify_event*)p;
+            changed |= apply_event(ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+        flush_pending_move();
+        // Index files written next to the books do not count as changes
+        if (changed) {
+            bump_generation();
+        }
+        pthread_rwlock_unlock(&catalog.lock);
+        record_batch();
+    }
+    return NULL;
+}
+#else
+/*
+ * Without inotify a directory is rescanned when its mtime moves. This catches creates,
+ * deletes and renames, but not in-place edits of a note.
+ */
+static void revalidate(const char* book_name)
+{
+    struct stat st;
+    int stale = 0;
+
+    pthread_rwlock_rdlock(&catalog.lock);
+    if (stat(catalog.root, &st) == 0 && st.st_mtime != catalog.root_mtime) {
+        stale = 1;
+    } else if (book_name) {
+        int idx = find_book(book_name, NULL);
+        char book_path[1024];
+        snprintf(book_path, sizeof(book_path), "%s/%s", catalog.root, book_name);
+        if (idx >= 0 && stat(book_path, &st) == 0 && st.st_mtime != catalog.books[idx].dir_mtime) {
+            stale = 2;
+        }
+    }
+    pthread_rwlock_unlock(&catalog.lock);
+
+    if (!stale) {
+        return;
+    }
+    pthread_rwlock_wrlock(&catalog.lock);
+    if (stale == 1) {
+        scan_root();
+    } else {
+        int idx = find_book(book_name, NULL);
+        if (idx >= 0) {
+            scan_book(&catalog.books[idx]);
+        }
+    }
+    bump_generation();
+    pthread_rwlock_unlock(&catalog.lock);
+    // A rescan does not tell what changed
+    changes_record(CHANGE_RESYNC, NULL, NULL, NULL, NULL);
+}
+#endif
+
+int catalog_start(void)
+{
+    pthread_mutex_lock(&catalog.start_lock);
+    if (catalog.ready) {
+        pthread_mutex_unlock(&catalog.start_lock);
+        return 0;
+    }
+
+    catalog.root = get_default_books_path("/books");
+    if (!catalog.root || catalog.root[0] == '\0') {
+        catalog.root = NULL;
+        pthread_mutex_unlock(&catalog.start_lock);
+        return -1;
+    }
+
+#if defined(__linux__)
+    catalog.inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (catalog.inotify_fd < 0 ||
+        inotify_add_watch(catalog.inotify_fd, catalog.root, CATALOG_ROOT_MASK) < 0) {
+        perror("inotify");
+        goto fail;
+    }
+#endif
+
+    pthread_rwlock_wrlock(&catalog.lock);
+    int rc = scan_root();
+    // Even an empty tree gets a names generation, 0 means none for catalog_visit_notes()
+    catalog.names_changed = 1;
+    bump_generation();
+    pthread_rwlock_unlock(&catalog.lock);
+    if (rc != 0) {
+        goto fail;
+    }
+
+#if defined(__linux__)
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, watch_loop, NULL) != 0) {
+        perror("pthread_create");
+        goto fail;
+    }
+    pthread_detach(thread);
+#endif
+
+    catalog.started = time(NULL);
+    catalog.ready = 1;
+    pthread_mutex_unlock(&catalog.start_lock);
+    return 0;
+
+fail:
+#if defined(__linux__)
+    if (catalog.inotify_fd >= 0) {
+        close(catalog.inotify_fd);
+        catalog.inotify_fd = -1;
+    }
+#endif
+    pthread_rwlock_wrlock(&catalog.lock);
+    while (catalog.books_count > 0) {
+        book_remove(catalog.books_count - 1);
+    }
+    pthread_rwlock_unlock(&catalog.lock);
+    free(catalog.root);
+    catalog.root = NULL;
+    pthread_mutex_unlock(&catalog.start_lock);
+    return -1;
+}
+
+int catalog_ready(void)
+{
+    return catalog.ready;
+}
+
+unsigned long long catalog_generation(void)
+{
+    return __atomic_load_n(&catalog.generation, __ATOMIC_ACQUIRE);
+}
+
+int catalog_etag(const char* book_name, char* dst, size_t dst_size)
+{
+#if !defined(__linux__)
+    revalidate(book_name);
+#endif
+    int n = snprintf(dst, dst_size, "\"%llx.%lx-%llx\"",
+                     (unsigned long long)catalog.started, (unsigned long)getpid(),
+                     catalog_generation());
+    return n > 0 && (size_t)n < dst_size ? n : -1;
+}
+
+int catalog_write_books(JsonWriter* w)
+{
+#if !defined(__linux__)
+    revalidate(NULL);
+#endif
+    pthread_rwlock_rdlock(&catalog.lock);
+    jsonw_array_begin(w);
+    for (int i = 0; i < catalog.books_count; i++) {
+        jsonw_object_begin(w);
+        jsonw_key(w, "name");
+        jsonw_string(w, catalog.books[i].name);
+        jsonw_key(w, "notes_count");
+        jsonw_integer(w, catalog.books[i].notes_count);
+        jsonw_object_end(w);
+    }
+    jsonw_array_end(w);
+    pthread_rwlock_unlock(&catalog.lock);
+    return 0;
+}
+
+int catalog_write_notes(JsonWriter* w, const char* book_name)
+{
+#if !defined(__linux__)
+    revalidate(book_name);
+#endif
+    pthread_rwlock_rdlock(&catalog.lock);
+    int idx = find_book(book_name, NULL);
+    if (idx < 0) {
+        pthread_rwlock_unlock(&catalog.lock);
+        return -1;
+    }
+
+    const CatalogBook* book = &catalog.books[idx];
+    jsonw_array_begin(w);
+    for (int i = 0; i < book->notes_count; i++) {
+        jsonw_object_begin(w);
+        jsonw_key(w, "name");
+        jsonw_string(w, book->notes[i].name);
+        jsonw_object_end(w);
+    }
+    jsonw_array_end(w);
+    pthread_rwlock_unlock(&catalog.lock);
+    return 0;
+}
+
+int catalog_write_notes_page(JsonWriter* w, const char* book_name, int order, const char* cursor,
+                             size_t limit)
+{
+    // Cursors are "n:<name>" or "m:<mtime>:<name>", the sort key of the last note sent
+    time_t cursor_mtime = 0;
+    const char* cursor_name = NULL;
+    if (cursor && order == CATALOG_ORDER_NAME) {
+        if (strncmp(cursor, "n:", 2) != 0) {
+            return -2;
+        }
+        cursor_name = cursor + 2;
+    } else if (cursor) {
+        char* end;
+        errno = 0;
+        long long mtime = strncmp(cursor, "m:", 2) == 0 ? strtoll(cursor + 2, &end, 10) : 0;
+        if (strncmp(cursor, "m:", 2) != 0 || end == cursor + 2 || *end != ':' || errno != 0) {
+            return -2;
+        }
+        cursor_mtime = (time_t)mtime;
+        cursor_name = end + 1;
+    }
+
+#if !defined(__linux__)
+    revalidate(book_name);
+#endif
+    pthread_rwlock_rdlock(&catalog.lock);
+    int idx = find_book(book_name, NULL);
+    if (idx < 0) {
+        pthread_rwlock_unlock(&catalog.lock);
+        return -1;
+    }
+    const CatalogBook* book = &catalog.books[idx];
+
+    // Seek past the cursor key, it need not exist any more
+    int start = 0;
+    if (cursor_name && order == CATALOG_ORDER_NAME) {
+        int pos;
+        int found = find_note(book, cursor_name, strlen(cursor_name), &pos);
+        start = found >= 0 ? found + 1 : pos;
+    } else if (cursor_name) {
+        int pos;
+        int found = find_recent(book, cursor_mtime, cursor_name, &pos);
+        start = found >= 0 ? found + 1 : pos;
+    }
+    int end = book->notes_count;
+    if ((size_t)(end - start) > limit) {
+        end = start + (int)limit;
+    }
+
+    jsonw_object_begin(w);
+    jsonw_key(w, "notes");
+    jsonw_array_begin(w);
+    for (int i = start; i < end; i++) {
+        const CatalogNote* note;
+        if (order == CATALOG_ORDER_NAME) {
+            note = &book->notes[i];
+        } else {
+            note = &book->notes[find_note(book, book->recent[i].name, strlen(book->recent[i].name), NULL)];
+        }
+        jsonw_object_begin(w);
+        jsonw_key(w, "name");
+        jsonw_string(w, note->name);
+        jsonw_key(w, "mtime");
+        jsonw_integer(w, (long long)note->mtime);
+        jsonw_key(w, "size");
+        jsonw_integer(w, (long long)note->size);
+        jsonw_object_end(w);
+    }
+    jsonw_array_end(w);
+
+    jsonw_key(w, "next_cursor");
+    if (end < book->notes_count && end > start) {
+        // Note names are file names, NAME_MAX bytes at most
+        char next[320];
+        int next_len;
+        if (order == CATALOG_ORDER_NAME) {
+            next_len = snprintf(next, sizeof(next), "n:%s", book->notes[end - 1].name);
+        } else {
+            next_len = snprintf(next, sizeof(next), "m:%lld:%s",
+                                (long long)book->recent[end - 1].mtime, book->recent[end - 1].name);
+        }
+        jsonw_string_len(w, next, next_len < (int)sizeof(next) ? (size_t)next_len : sizeof(next) - 1);
+    } else {
+        jsonw_null(w);
+    }
+    jsonw_object_end(w);
+    pthread_rwlock_unlock(&catalog.lock);
+    return 0;
+}
+
+unsigned long long catalog_visit_notes(unsigned long long known, CatalogNoteVisitor visit, void* ctx)
+{
+#if !defined(__linux__)
+    // Every book directory is checked, there are far fewer books than notes
+    revalidate(NULL);
+    pthread_rwlock_rdlock(&catalog.lock);
+    int books_count = catalog.books_count;
+    char** names = calloc(books_count ? books_count : 1, sizeof(char*));
+    for (int i = 0; names && i < books_count; i++) {
+        names[i] = strdup(catalog.books[i].name);
+    }
+    pthread_rwlock_unlock(&catalog.lock);
+    for (int i = 0; names && i < books_count; i++) {
+        if (names[i]) {
+            revalidate(names[i]);
+        }
+        free(names[i]);
+    }
+    free(names);
+#endif
+    pthread_rwlock_rdlock(&catalog.lock);
+    unsigned long long generation = __atomic_load_n(&catalog.names_generation, __ATOMIC_ACQUIRE);
+    if (generation != known) {
+        for (int i = 0; i < catalog.books_count; i++) {
+            const CatalogBook* book = &catalog.books[i];
+            for (int n = 0; n < book->notes_count; n++) {
+                visit(book->name, book->notes[n].name, ctx);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&catalog.lock);
+    return generation;
+}
@@ -0,0 +1,254 @@
+/*=================================================================================================
+ *
+ * 	@FILENAME:	      bsdcatalog.h
+ * 	@BRIEF:    	      Resident catalog of books and notes for bsdbook server.
+ * 	@DESCRIPTION:	  Built once at startup and kept current with inotify, so listing requests
+ * 	                  never touch the filesystem.
+ * 	@AUTHOR		      Daniil (TwelveFacedJanus) Ermolaev.
+ * 	   | CONTACT:	  twofaced-janus@yandex.ru
+ *	@CREATED AT:	  10.16.26
+ *	@UPDATED_AT:	  10.16.26
+ *
+ *==================================================================================================*/
+
+#ifndef BSDCATALOG_H_
+#define BSDCATALOG_H_
+
+#include "bsdjson.h"
+
+#define CATALOG_ORDER_NAME 0
+#define CATALOG_ORDER_MTIME 1
+
+#define CATALOG_ETAG_SIZE 64
+
+/*
+ * Called for every note of the catalog by catalog_visit_notes(). note_name is without .bdsb.
+ */
+typedef void (*CatalogNoteVisitor)(const char* book_name, const char* note_name, void* ctx);
+
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Builds the catalog and starts watching the books directory.
+ *     @DESCRIPTION:
+ *          Scans $HOME/books once, recording every book and the name, size and modification
+ *          time of every note. On Linux an inotify watch is placed on the books root and on
+ *          each book, and a background thread applies create, delete, rename and write events
+ *          to the catalog. Elsewhere the catalog rescans a directory when its mtime changes.
+ *     @PARAMETERS:
+ *          - None
+ *     @RETURN:
+ *          - 0 on success, -1 on error
+ *     @NOTES:
+ *          - Safe to call more than once, later calls do nothing
+ *          - Called by run_http_server_cfg()
+ *     @EXAMPLE:
+ *          ```c
+ *          if (catalog_start() != 0) {
+ *              fprintf(stderr, "catalog disabled\n");
+ *          }
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int catalog_start(void);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Tells whether the catalog is available.
+ *     @DESCRIPTION:
+ *          Request handlers fall back to scanning the filesystem when it is not.
+ *     @PARAMETERS:
+ *          - None
+ *     @RETURN:
+ *          - 1 if catalog_start() succeeded, 0 otherwise
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          int served = catalog_ready() && catalog_write_books(&w) == 0;
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int catalog_ready(void);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Returns the catalog generation.
+ *     @DESCRIPTION:
+ *          The counter is incremented on every change applied to the catalog.
+ *     @PARAMETERS:
+ *          - None
+ *     @RETURN:
+ *          - Current generation
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          unsigned long long gen = catalog_generation();
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+unsigned long long catalog_generation(void);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Returns the entity tag of the catalog listings.
+ *     @DESCRIPTION:
+ *          The tag is made of the catalog start time, the process id and the generation, so it
+ *          changes with every applied change and never repeats across server restarts. Where
+ *          changes are found by polling, the book (or the root for NULL) is revalidated first.
+ *     @PARAMETERS:
+ *          - const char* book_name: Book about to be listed, NULL for the list of books
+ *          - char* dst: Output buffer, quotes included
+ *          - size_t dst_size: Size of dst, CATALOG_ETAG_SIZE is enough
+ *     @RETURN:
+ *          - Length of the tag, -1 if dst is too small
+ *     @NOTES:
+ *          - Take the tag before writing the listing: a change in between makes the next
+ *            request miss the cache instead of keeping a stale listing
+ *     @EXAMPLE:
+ *          ```c
+ *          char etag[CATALOG_ETAG_SIZE];
+ *          catalog_etag(NULL, etag, sizeof(etag));
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int catalog_etag(const char* book_name, char* dst, size_t dst_size);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Writes the books of the catalog as JSON.
+ *     @DESCRIPTION:
+ *          Same layout as books_to_json(): [{"name": ..., "notes_count": ...}], sorted by name,
+ *          written straight to the response while the catalog is read locked.
+ *     @PARAMETERS:
+ *          - JsonWriter* w: Writer of the response
+ *     @RETURN:
+ *          - 0, writer errors are reported by jsonw_finish()
+ *     @NOTES:
+ *          - No jansson tree or serialized copy of the listing is made
+ *     @EXAMPLE:
+ *          ```c
+ *          catalog_write_books(&w);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int catalog_write_books(JsonWriter* w);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Writes the notes of a book from the catalog as JSON.
+ *     @DESCRIPTION:
+ *          Same layout as notes_to_json(): [{"name": ...}], sorted by name.
+ *     @PARAMETERS:
+ *          - JsonWriter* w: Writer of the response
+ *          - const char* book_name: Name of the book
+ *     @RETURN:
+ *          - 0 on success
+ *          - -1 if the book does not exist, nothing is written then
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          if (catalog_write_notes(&w, "Programming") != 0) {
+ *              // 404
+ *          }
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int catalog_write_notes(JsonWriter* w, const char* book_name);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Writes one page of the notes of a book as JSON.
+ *     @DESCRIPTION:
+ *          Writes {"notes": [{"name", "mtime", "size"}...], "next_cursor": ...}. Notes are
+ *          ordered by name, or newest first with ties by name. The catalog keeps both orders
+ *          sorted as notes change, so a page costs a binary search for the cursor plus the
+ *          notes on it, whatever the size of the book. next_cursor is null on the last page.
+ *     @PARAMETERS:
+ *          - JsonWriter* w: Writer of the response
+ *          - const char* book_name: Name of the book
+ *          - int order: CATALOG_ORDER_NAME or CATALOG_ORDER_MTIME
+ *          - const char* cursor: next_cursor of the previous page, NULL for the first page
+ *          - size_t limit: Maximum number of notes on the page, at least 1
+ *     @RETURN:
+ *          - 0 on success
+ *          - -1 if the book does not exist, -2 if the cursor is not one of this order;
+ *            nothing is written then
+ *     @NOTES:
+ *          - A cursor stays valid when its note is deleted; notes created or touched while
+ *            paging show up on a later page or not at all, never twice in the name order
+ *     @EXAMPLE:
+ *          ```c
+ *          catalog_write_notes_page(&w, "Archive", CATALOG_ORDER_MTIME, NULL, 100);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int catalog_write_notes_page(JsonWriter* w, const char* book_name, int order, const char* cursor,
+                             size_t limit);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Visits every note of the catalog if names changed since a known generation.
+ *     @DESCRIPTION:
+ *          The names generation moves when a book or note is created, removed or renamed, but
+ *          not when a note is written. Notes are visited in book and note order under the
+ *          catalog read lock, so a structure built from their names can be kept until the
+ *          returned generation is outdated.
+ *     @PARAMETERS:
+ *          - unsigned long long known: Generation the caller already has, 0 for none
+ *          - CatalogNoteVisitor visit: Called for every note
+ *          - void* ctx: Passed to visit
+ *     @RETURN:
+ *          - Names generation of the visited notes, never 0
+ *          - known if it is still current, nothing is visited then
+ *     @NOTES:
+ *          - visit must not call back into the catalog
+ *     @EXAMPLE:
+ *          ```c
+ *          static void count_note(const char* book, const char* note, void* ctx)
+ *          {
+ *              (*(int*)ctx)++;
+ *          }
+ *
+ *          int count = 0;
+ *          catalog_visit_notes(0, count_note, &count);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+unsigned long long catalog_visit_notes(unsigned long long known, CatalogNoteVisitor visit, void* ctx);
+
+#endif
@@ -0,0 +1,570 @@
+#include "./bsdcore.h"
+
+#include <jansson.h>
+#include <pthread.h>
+#include <sys/file.h>
+
+static struct
+{
+    pthread_mutex_t lock;
+    // Change seq lives in ring[(seq - 1) % CHANGES_CAPACITY], recorded by process pids[...]
+    Change ring[CHANGES_CAPACITY];
+    pid_t pids[CHANGES_CAPACITY];
+    unsigned long long last_seq;
+    // Changes before it were lost, the journal had a gap
+    unsigned long long first_seq;
+    int wakers[CHANGES_MAX_WAKERS];
+    int wakers_count;
+    // Journal shared with other processes, -1 when the log only lives in memory
+    int journal_fd;
+    int journal_opened;
+    char* journal_path;
+    // Bytes of the journal already in the ring
+    off_t journal_read;
+} changes = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .first_seq = 1,
+    .journal_fd = -1,
+};
+
+static char* dup_name(const char* name, int* failed)
+{
+    if (!name) {
+        return NULL;
+    }
+    char* copy = strdup(name);
+    if (!copy) {
+        *failed = 1;
+    }
+    return copy;
+}
+
+static void change_clear(Change* c)
+{
+    free(c->book);
+    free(c->note);
+    free(c->from_book);
+    free(c->from_note);
+    memset(c, 0, sizeof(*c));
+}
+
+static void wake_all(void)
+{
+    for (int i = 0; i < changes.wakers_count; i++) {
+        char byte = 1;
+        // A full pipe means a wakeup is pending already
+        if (write(changes.wakers[i], &byte, 1) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("write");
+        }
+    }
+}
+
+// Oldest change still in the ring
+static unsigned long long oldest_seq(void)
+{
+    unsigned long long oldest = changes.last_seq > CHANGES_CAPACITY ? changes.last_seq - CHANGES_CAPACITY + 1 : 1;
+    return oldest > changes.first_seq ? oldest : changes.first_seq;
+}
+
+// Takes ownership of the names; a gap in the numbers forgets everything before it
+static void store_change(Change* c, pid_t pid)
+{
+    if (c->seq != changes.last_seq + 1) {
+        changes.first_seq = c->seq;
+    }
+    size_t slot = (c->seq - 1) % CHANGES_CAPACITY;
+    change_clear(&changes.ring[slot]);
+    changes.ring[slot] = *c;
+    changes.pids[slot] = pid;
+    changes.last_seq = c->seq;
+}
+
+static int journal_reopen(void)
+{
+    if (changes.journal_fd >= 0) {
+        close(changes.journal_fd);
+    }
+    changes.journal_read = 0;
+    changes.journal_fd = open(changes.journal_path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (changes.journal_fd < 0) {
+        perror("open");
+        return -1;
+    }
+    return 0;
+}
+
+// Locks the journal, following it to the new file if another process compacted it meanwhile
+static int journal_lock(int op)
+{
+    for (;;) {
+        if (flock(changes.journal_fd, op) != 0) {
+            perror("flock");
+            return -1;
+        }
+        struct stat path_st, fd_st;
+        if (stat(changes.journal_path, &path_st) == 0 && fstat(changes.journal_fd, &fd_st) == 0 &&
+            path_st.st_dev == fd_st.st_dev && path_st.st_ino == fd_st.st_ino) {
+            return 0;
+        }
+        flock(changes.journal_fd, LOCK_UN);
+        if (journal_reopen() != 0) {
+            return -1;
+        }
+    }
+}
+
+// Returns 1 if the line was a change this process did not have yet
+static int journal_load_line(const char* line, size_t len)
+{
+    json_error_t error;
+    json_t* root = json_loadb(line, len, 0, &error);
+    if (!root) {
+        return 0;
+    }
+    json_t* seq = json_object_get(root, "seq");
+    json_t* type = json_object_get(root, "type");
+    if (!json_is_integer(seq) || !json_is_integer(type) ||
+        (unsigned long long)json_integer_value(seq) <= changes.last_seq) {
+        json_decref(root);
+        return 0;
+    }
+    int failed = 0;
+    Change c = {
+        .seq = (unsigned long long)json_integer_value(seq),
+        .type = (int)json_integer_value(type),
+        .time = (time_t)json_integer_value(json_object_get(root, "time")),
+        .book = dup_name(json_string_value(json_object_get(root, "book")), &failed),
+        .note = dup_name(json_string_value(json_object_get(root, "note")), &failed),
+        .from_book = dup_name(json_string_value(json_object_get(root, "from_book")), &failed),
+        .from_note = dup_name(json_string_value(json_object_get(root, "from_note")), &failed),
+    };
+    pid_t pid = (pid_t)json_integer_value(json_object_get(root, "pid"));
+    json_decref(root);
+    if (failed) {
+        // Kept as a gap, clients resync over it
+        perror("strdup");
+        change_clear(&c);
+        return 0;
+    }
+    store_change(&c, pid);
+    return 1;
+}
+
+// Reads what other processes appended since the last load, with the journal locked
+static void journal_load(void)
+{
+    struct stat st;
+    if (fstat(changes.journal_fd, &st) != 0 || st.st_size <= changes.journal_read) {
+        return;
+    }
+    size_t size = st.st_size - changes.journal_read;
+    char* buf = malloc(size);
+    if (!buf) {
+        perror("malloc");
+        return;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(changes.journal_fd, buf + done, size - done, changes.journal_read + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+
+    // A line without its newline is still being cut short by a crash, it is left for later
+    size_t start = 0;
+    int loaded = 0;
+    for (size_t i = 0; i < done; i++) {
+        if (buf[i] == '\n') {
+            loaded |= journal_load_line(buf + start, i - start);
+            start = i + 1;
+        }
+    }
+    changes.journal_read += start;
+    free(buf);
+    if (loaded) {
+        wake_all();
+    }
+}
+
+static char* journal_line(const Change* c, pid_t pid)
+{
+    json_t* line = json_object();
+    if (!line) {
+        return NULL;
+    }
+    json_object_set_new(line, "seq", json_integer((json_int_t)c->seq));
+    json_object_set_new(line, "type", json_integer(c->type));
+    json_object_set_new(line, "time", json_integer((json_int_t)c->time));
+    json_object_set_new(line, "pid", json_integer(pid));
+    if (c->book) {
+        json_object_set_new(line, "book", json_string(c->book));
+    }
+    if (c->note) {
+        json_object_set_new(line, "note", json_string(c->note));
+    }
+    if (c->from_book) {
+        json_object_set_new(line, "from_book", json_string(c->from_book));
+    }
+    if (c->from_note) {
+        json_object_set_new(line, "from_note", json_string(c->from_note));
+    }
+    char* text = json_dumps(line, JSON_COMPACT);
+    json_decref(line);
+    return text;
+}
+
+// Appends changes in one write, with the journal locked exclusively and fully loaded
+static void journal_append(const Change* list, size_t count, pid_t pid)
+{
+    // One byte to end a line a crashed process left unfinished, so this one parses
+    size_t len = 1;
+    char** texts = calloc(count, sizeof(char*));
+    if (!texts) {
+        perror("calloc");
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        texts[i] = journal_line(&list[i], pid);
+        if (!texts[i]) {
+            perror("json_dumps");
+            len = 0;
+            break;
+        }
+        len += strlen(texts[i]) + 1;
+    }
+    char* line = len ? malloc(len) : NULL;
+    if (len && !line) {
+        perror("malloc");
+    }
+    if (line) {
+        struct stat st;
+        off_t end = changes.journal_read;
+        if (fstat(changes.journal_fd, &st) == 0) {
+            end = st.st_size;
+        }
+        size_t at = 0;
+        if (end > changes.journal_read) {
+            line[at++] = '\n';
+        }
+        for (size_t i = 0; i < count; i++) {
+            size_t text_len = strlen(texts[i]);
+            memcpy(line + at, texts[i], text_len);
+            at += text_len;
+            line[at++] = '\n';
+        }
+
+        ssize_t n = write(changes.journal_fd, line, at);
+        if (n == (ssize_t)at) {
+            changes.journal_read = end + n;
+        } else {
+            perror("write");
+        }
+    }
+    free(line);
+    for (size_t i = 0; i < count; i++) {
+        free(texts[i]);
+    }
+    free(texts);
+}
+
+// Rewrites the journal with just the changes in the ring, with it locked exclusively
+static void journal_compact(void)
+{
+    size_t len = strlen(changes.journal_path) + sizeof(".tmp");
+    char* tmp_path = malloc(len);
+    if (!tmp_path) {
+        perror("malloc");
+        return;
+    }
+    snprintf(tmp_path, len, "%s.tmp", changes.journal_path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open");
+        free(tmp_path);
+        return;
+    }
+    off_t written = 0;
+    int failed = 0;
+    for (unsigned long long seq = oldest_seq(); !failed && seq <= changes.last_seq; seq++) {
+        size_t slot = (seq - 1) % CHANGES_CAPACITY;
+        char* text = journal_line(&changes.ring[slot], changes.pids[slot]);
+        failed = !text || dprintf(fd, "%s\n", text) < 0;
+        if (text) {
+            written += strlen(text) + 1;
+        }
+        free(text);
+    }
+    if (close(fd) != 0 || failed || rename(tmp_path, changes.journal_path) != 0) {
+        perror("journal_compact");
+        unlink(tmp_path);
+        free(tmp_path);
+        return;
+    }
+    free(tmp_path);
+    // Processes waiting on the old file find it replaced once they get the lock
+    if (journal_reopen() == 0) {
+        changes.journal_read = written;
+    }
+}
+
+// Opens the journal on first use and loads the changes recorded before this process started
+static void journal_open(void)
+{
+    if (changes.journal_opened) {
+        return;
+    }
+    changes.journal_opened = 1;
+    char* root = get_default_books_path("/books");
+    struct stat st;
+    // Without a books directory there is nothing to journal
+    if (!root || root[0] == '\0' || stat(root, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        if (root && root[0] != '\0') {
+            free(root);
+        }
+        return;
+    }
+    size_t len = strlen(root) + sizeof(CHANGES_JOURNAL_FILE) + 1;
+    changes.journal_path = malloc(len);
+    if (!changes.journal_path) {
+        perror("malloc");
+        free(root);
+        return;
+    }
+    snprintf(changes.journal_path, len, "%s/%s", root, CHANGES_JOURNAL_FILE);
+    free(root);
+    if (journal_reopen() == 0 && journal_lock(LOCK_SH) == 0) {
+        journal_load();
+        flock(changes.journal_fd, LOCK_UN);
+    }
+}
+
+// Picks up what other processes journaled; costs one fstat() when there is nothing new
+static void journal_sync(void)
+{
+    journal_open();
+    if (changes.journal_fd < 0) {
+        return;
+    }
+    struct stat st;
+    // A journal another process compacted is unlinked, st_nlink drops to 0
+    if (fstat(changes.journal_fd, &st) == 0 && st.st_nlink > 0 && st.st_size == changes.journal_read) {
+        return;
+    }
+    if (journal_lock(LOCK_SH) == 0) {
+        journal_load();
+        flock(changes.journal_fd, LOCK_UN);
+    }
+}
+
+static int same_name(const char* a, const char* b)
+{
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+// The catalog sees every change another process makes and journals itself, seq of that entry if so
+static unsigned long long find_echo(const Change* c, pid_t pid, size_t window)
+{
+    unsigned long long oldest = oldest_seq();
+    for (unsigned long long seq = changes.last_seq, n = 0;
+         seq >= oldest && seq > 0 && n < window; seq--, n++) {
+        size_t slot = (seq - 1) % CHANGES_CAPACITY;
+        const Change* other = &changes.ring[slot];
+        if (changes.pids[slot] != pid && other->type == c->type &&
+            difftime(c->time, other->time) <= CHANGES_ECHO_SECONDS &&
+            same_name(other->book, c->book) && same_name(other->note, c->note) &&
+            same_name(other->from_book, c->from_book) && same_name(other->from_note, c->from_note)) {
+            return seq;
+        }
+    }
+    return 0;
+}
+
+unsigned long long changes_record(int type, const char* book, const char* note,
+                                  const char* from_book, const char* from_note)
+{
+    // Copied outside the lock, the watcher thread should not hold up readers
+    int failed = 0;
+    Change c = {
+        .type = type,
+        .time = time(NULL),
+        .book = dup_name(book, &failed),
+        .note = dup_name(note, &failed),
+        .from_book = dup_name(from_book, &failed),
+        .from_note = dup_name(from_note, &failed),
+    };
+    if (failed) {
+        perror("strdup");
+        change_clear(&c);
+        return 0;
+    }
+    pid_t pid = getpid();
+
+    pthread_mutex_lock(&changes.lock);
+    journal_open();
+    // The lock orders the numbers of all processes sharing the journal
+    int journaled = changes.journal_fd >= 0 && journal_lock(LOCK_EX) == 0;
+    if (journaled) {
+        journal_load();
+        unsigned long long echo = find_echo(&c, pid, CHANGES_ECHO_WINDOW);
+        if (echo) {
+            flock(changes.journal_fd, LOCK_UN);
+            pthread_mutex_unlock(&changes.lock);
+            change_clear(&c);
+            return echo;
+        }
+    }
+    c.seq = changes.last_seq + 1;
+    if (journaled) {
+        journal_append(&c, 1, pid);
+    }
+    store_change(&c, pid);
+    if (journaled) {
+        if (changes.journal_read > CHANGES_JOURNAL_MAX_BYTES) {
+            journal_compact();
+        }
+        flock(changes.journal_fd, LOCK_UN);
+    }
+    unsigned long long seq = changes.last_seq;
+    wake_all();
+    pthread_mutex_unlock(&changes.lock);
+    return seq;
+}
+
+unsigned long long changes_record_many(const Change* list, size_t count)
+{
+    Change* copies = calloc(count ? count : 1, sizeof(Change));
+    if (!copies) {
+        perror("calloc");
+        return 0;
+    }
+    int failed = 0;
+    time_t now = time(NULL);
+    for (size_t i = 0; i < count; i++) {
+        copies[i] = (Change){
+            .type = list[i].type,
+            .time = now,
+            .book = dup_name(list[i].book, &failed),
+            .note = dup_name(list[i].note, &failed),
+            .from_book = dup_name(list[i].from_book, &failed),
+            .from_note = dup_name(list[i].from_note, &failed),
+        };
+    }
+    if (failed) {
+        perror("strdup");
+        for (size_t i = 0; i < count; i++) {
+            change_clear(&copies[i]);
+        }
+        free(copies);
+        return 0;
+    }
+    pid_t pid = getpid();
+
+    pthread_mutex_lock(&changes.lock);
+    journal_open();
+    int journaled = changes.journal_fd >= 0 && journal_lock(LOCK_EX) == 0;
+    size_t kept = 0;
+    if (journaled) {
+        journal_load();
+    }
+    for (size_t i = 0; i < count; i++) {
+        // The catalog of a running server may have seen any of them already
+        if (journaled && find_echo(&copies[i], pid, count + CHANGES_ECHO_WINDOW)) {
+            change_clear(&copies[i]);
+            continue;
+        }
+        copies[kept] = copies[i];
+        copies[kept].seq = changes.last_seq + 1 + kept;
+        kept++;
+    }
+    if (journaled && kept > 0) {
+        journal_append(copies, kept, pid);
+    }
+    // Stored last, a batch longer than the log overwrites its own first changes
+    for (size_t i = 0; i < kept; i++) {
+        store_change(&copies[i], pid);
+    }
+    if (journaled) {
+        if (changes.journal_read > CHANGES_JOURNAL_MAX_BYTES) {
+            journal_compact();
+        }
+        flock(changes.journal_fd, LOCK_UN);
+    }
+    unsigned long long seq = changes.last_seq;
+    if (kept > 0) {
+        wake_all();
+    }
+    pthread_mutex_unlock(&changes.lock);
+    free(copies);
+    return seq;
+}
+
+unsigned long long changes_last_seq(void)
+{
+    pthread_mutex_lock(&changes.lock);
+    journal_sync();
+    unsigned long long seq = changes.last_seq;
+    pthread_mutex_unlock(&changes.lock);
+    return seq;
+}
+
+unsigned long long changes_visit(unsigned long long since, size_t max, ChangeVisitor visit, void* ctx)
+{
+    pthread_mutex_lock(&changes.lock);
+    journal_sync();
+    unsigned long long last = changes.last_seq;
+    // A client of a journal that was since deleted may be ahead of us
+    if (since > last) {
+        since = 0;
+    }
+    unsigned long long oldest = oldest_seq();
+    size_t visited = 0;
+    if (since + 1 < oldest) {
+        Change resync = { .seq = oldest - 1, .type = CHANGE_RESYNC, .time = time(NULL) };
+        since = oldest - 1;
+        visited++;
+        if (visit(&resync, ctx) != 0) {
+            pthread_mutex_unlock(&changes.lock);
+            return since;
+        }
+    }
+    while (since < last && (max == 0 || visited < max)) {
+        since++;
+        visited++;
+        if (visit(&changes.ring[(since - 1) % CHANGES_CAPACITY], ctx) != 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&changes.lock);
+    return since;
+}
+
+int changes_add_waker(int fd)
+{
+    pthread_mutex_lock(&changes.lock);
+    if (changes.wakers_count == CHANGES_MAX_WAKERS) {
+        pthread_mutex_unlock(&changes.lock);
+        return -1;
+    }
+    changes.wakers[changes.wakers_count++] = fd;
+    pthread_mutex_unlock(&changes.lock);
+    return 0;
+}
+
+const char* changes_type_name(int type)
+{
+    switch (type) {
+    case CHANGE_BOOK_CREATED:  return "book_created";
+    case CHANGE_BOOK_DELETED:  return "book_deleted";
+    case CHANGE_BOOK_RENAMED:  return "book_renamed";
+    case CHANGE_NOTE_CREATED:  return "note_created";
+    case CHANGE_NOTE_MODIFIED: return "note_modified";
+    case CHANGE_NOTE_DELETED:  return "note_deleted";
+    case CHANGE_NOTE_RENAMED:  return "note_renamed";
+    default:                   return "resync";
+    }
+}
@@ -0,0 +1,253 @@
+/*=================================================================================================
+ *
+ * 	@FILENAME:	      bsdchanges.h
+ * 	@BRIEF:    	      Log of changes to books and notes.
+ * 	@DESCRIPTION:	  Numbers every create, edit, delete and rename the catalog sees and keeps the
+ * 	                  latest ones in a ring, so clients can ask for what happened since the last
+ * 	                  change they know of. Registered descriptors are written to on every change,
+ * 	                  which is how the server's event loops learn there is something to push.
+ * 	                  Changes are also appended to $HOME/books/.bsdchanges, which numbers them
+ * 	                  across every process and restart, so the CLI and the server share one log.
+ * 	@AUTHOR		      Daniil (TwelveFacedJanus) Ermolaev.
+ * 	   | CONTACT:	  twofaced-janus@yandex.ru
+ *	@CREATED AT:	  10.16.26
+ *	@UPDATED_AT:	  10.16.26
+ *
+ *==================================================================================================*/
+
+#ifndef BSDCHANGES_H_
+#define BSDCHANGES_H_
+
+#include <stddef.h>
+#include <time.h>
+
+// Changes kept; a client further behind is told to resync
+#define CHANGES_CAPACITY 4096
+#define CHANGES_MAX_WAKERS 256
+
+#define CHANGES_JOURNAL_FILE ".bsdchanges"
+// Past this size the journal is rewritten with only the changes still kept
+#define CHANGES_JOURNAL_MAX_BYTES (4 * 1024 * 1024)
+// A change another process journaled this recently is not journaled again when the catalog sees it
+#define CHANGES_ECHO_SECONDS 2
+#define CHANGES_ECHO_WINDOW 8
+
+#define CHANGE_RESYNC        0
+#define CHANGE_BOOK_CREATED  1
+#define CHANGE_BOOK_DELETED  2
+#define CHANGE_BOOK_RENAMED  3
+#define CHANGE_NOTE_CREATED  4
+#define CHANGE_NOTE_MODIFIED 5
+#define CHANGE_NOTE_DELETED  6
+#define CHANGE_NOTE_RENAMED  7
+
+
+/*===============================================================================================
+ *
+ * 	@BRIEF:
+ * 		One change.
+ * 	@DESCRIPTION:
+ * 		Names are those after the change, a rename also has the names before it.
+ * 	@PARAMETERS:
+ * 		Change.seq       - unsigned long long, number of the change, starting at 1;
+ * 		Change.type      - int, CHANGE_*;
+ * 		Change.time      - time_t, when it was recorded;
+ * 		Change.book      - char*, book, NULL for CHANGE_RESYNC;
+ * 		Change.note      - char*, note without .bdsb, NULL for book changes;
+ * 		Change.from_book - char*, book before a rename, NULL otherwise;
+ * 		Change.from_note - char*, note before a note rename, NULL otherwise.
+ * 	@RETURN:
+ * 		None.
+ * 	@NOTES:
+ * 		CHANGE_RESYNC means changes were lost and everything should be fetched again.
+ * 	@EXAMPLE:
+ * 		None.
+ * 	@UPDATES:
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *	 	      Struct has been created.
+ *
+ * =============================================================================================*/
+typedef struct Change
+{
+	unsigned long long seq;
+	int type;
+	time_t time;
+	char* book;
+	char* note;
+	char* from_book;
+	char* from_note;
+} Change;
+
+// Called for each change in order, return non-zero to stop
+typedef int (*ChangeVisitor)(const Change* change, void* ctx);
+
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Records a change.
+ *     @DESCRIPTION:
+ *          Gives it the next number, keeps it in place of the oldest one once the log is full,
+ *          appends it to the journal and writes a byte to every registered descriptor. When
+ *          another process journaled the same change a moment ago, as when the catalog sees a
+ *          note the CLI created, that change is not recorded twice.
+ *     @PARAMETERS:
+ *          - int type: CHANGE_*
+ *          - const char* book: Book, NULL for CHANGE_RESYNC
+ *          - const char* note: Note without .bdsb, NULL for book changes
+ *          - const char* from_book: Book before a rename, NULL otherwise
+ *          - const char* from_note: Note before a note rename, NULL otherwise
+ *     @RETURN:
+ *          - unsigned long long: Number of the change, 0 if out of memory
+ *     @NOTES:
+ *          - Thread-safe, and safe across processes sharing the books directory
+ *          - Without a books directory the log only lives in memory
+ *     @EXAMPLE:
+ *          ```c
+ *          changes_record(CHANGE_NOTE_RENAMED, "Programming", "C_Tips", "Programming", "Tips");
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *               Changes are journaled to $HOME/books/.bsdchanges.
+ *
+ =========================================================================================*/
+unsigned long long changes_record(int type, const char* book, const char* note,
+                                  const char* from_book, const char* from_note);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Records many changes as one run.
+ *     @DESCRIPTION:
+ *          Like changes_record() for each of them, but the journal is locked and appended to
+ *          once, so the changes get consecutive numbers and no other process's change falls
+ *          between them.
+ *     @PARAMETERS:
+ *          - const Change* list: Changes, seq and time are ignored
+ *          - size_t count: Number of changes
+ *     @RETURN:
+ *          - unsigned long long: Number of the last change, 0 if out of memory
+ *     @NOTES:
+ *          - A run longer than CHANGES_CAPACITY leaves readers a CHANGE_RESYNC
+ *          - Thread-safe, and safe across processes sharing the books directory
+ *     @EXAMPLE:
+ *          ```c
+ *          Change moved[2] = {
+ *              { .type = CHANGE_NOTE_RENAMED, .book = "Archive", .note = "a", .from_book = "Inbox", .from_note = "a" },
+ *              { .type = CHANGE_BOOK_DELETED, .book = "Inbox" },
+ *          };
+ *          changes_record_many(moved, 2);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+unsigned long long changes_record_many(const Change* list, size_t count);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Returns the number of the latest change.
+ *     @DESCRIPTION:
+ *          0 before the first change. Includes changes other processes journaled.
+ *     @PARAMETERS:
+ *          - None
+ *     @RETURN:
+ *          - unsigned long long: Latest change number
+ *     @NOTES:
+ *          - Thread-safe
+ *     @EXAMPLE:
+ *          ```c
+ *          unsigned long long seq = changes_last_seq();
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *               Reads changes other processes journaled.
+ *
+ =========================================================================================*/
+unsigned long long changes_last_seq(void);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Visits the changes made after a given one.
+ *     @DESCRIPTION:
+ *          Calls visit for each change numbered above since, oldest first. When some of them
+ *          are no longer kept, a single CHANGE_RESYNC stands for all that were dropped. Changes
+ *          other processes journaled since the last call are loaded first.
+ *     @PARAMETERS:
+ *          - unsigned long long since: Latest change the caller knows of, 0 for none
+ *          - size_t max: Most changes to visit, 0 for no limit
+ *          - ChangeVisitor visit: Called for each change
+ *          - void* ctx: Passed to visit
+ *     @RETURN:
+ *          - unsigned long long: Number of the last change visited, since if there was none
+ *     @NOTES:
+ *          - visit runs under the log's lock and must not record changes
+ *          - Thread-safe
+ *     @EXAMPLE:
+ *          ```c
+ *          seq = changes_visit(seq, 0, print_change, NULL);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *               Reads changes other processes journaled.
+ *
+ =========================================================================================*/
+unsigned long long changes_visit(unsigned long long since, size_t max, ChangeVisitor visit, void* ctx);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Asks for a byte on a descriptor after every change.
+ *     @DESCRIPTION:
+ *          The byte carries no data, it only wakes whoever polls the other end. Writes that
+ *          would block are skipped, the reader has a wakeup pending already.
+ *     @PARAMETERS:
+ *          - int fd: Non-blocking write end of a pipe
+ *     @RETURN:
+ *          - 0 on success, -1 if CHANGES_MAX_WAKERS descriptors are registered
+ *     @NOTES:
+ *          - Thread-safe
+ *     @EXAMPLE:
+ *          ```c
+ *          changes_add_waker(wake_pipe[1]);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int changes_add_waker(int fd);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Returns the name of a change type.
+ *     @DESCRIPTION:
+ *          "note_modified", "book_renamed", ..., as sent to clients.
+ *     @PARAMETERS:
+ *          - int type: CHANGE_*
+ *     @RETURN:
+ *          - const char*: Type name, "resync" for unknown types
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          printf("%s\n", changes_type_name(change->type));
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+const char* changes_type_name(int type);
+
+#endif
@@ -0,0 +1,326 @@
+#include "./bsdcore.h"
+
+#include <pthread.h>
+#include <strings.h>
+#include <zlib.h>
+
+#if defined(BSD_WITH_BROTLI)
+#include <brotli/encode.h>
+#endif
+
+#define CACHE_BUCKETS 1024
+#define GZIP_LEVEL 6
+#define BROTLI_QUALITY 6
+
+typedef struct CacheEntry
+{
+    char* key;
+    uint32_t hash;
+    CompressedBody* body;
+    struct CacheEntry* bucket_next;
+    // Most recently used first
+    struct CacheEntry* lru_prev;
+    struct CacheEntry* lru_next;
+} CacheEntry;
+
+static struct
+{
+    pthread_mutex_t lock;
+    CacheEntry* buckets[CACHE_BUCKETS];
+    CacheEntry* lru_head;
+    CacheEntry* lru_tail;
+    size_t bytes;
+} cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// q-value as thousandths, -1 if malformed
+static int parse_qvalue(const char* p, const char* end)
+{
+    if (p == end || (*p != '0' && *p != '1')) {
+        return -1;
+    }
+    int q = (*p++ - '0') * 1000;
+    if (p < end && *p == '.') {
+        p++;
+        for (int scale = 100; p < end && *p >= '0' && *p <= '9' && scale > 0; scale /= 10) {
+            q += (*p++ - '0') * scale;
+        }
+    }
+    return p == end && q <= 1000 ? q : -1;
+}
+
+int compress_negotiate(const HttpRequest* req)
+{
+    const HttpHeader* h = req ? http_find_header(req, "Accept-Encoding") : NULL;
+    if (!h) {
+        return COMPRESS_IDENTITY;
+    }
+
+    // Codings that are not listed are not acceptable, unless "*" is
+    int gzip_q = -1;
+    int br_q = -1;
+    int star_q = -1;
+    const char* p = h->value;
+    const char* end = h->value + h->value_len;
+    while (p < end) {
+        const char* item_end = memchr(p, ',', end - p);
+        if (!item_end) {
+            item_end = end;
+        }
+        while (p < item_end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        const char* token = p;
+        while (p < item_end && *p != ';' && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        size_t token_len = p - token;
+
+        int q = 1000;
+        while (p < item_end) {
+            const char* param = memchr(p, ';', item_end - p);
+            if (!param) {
+                break;
+            }
+            p = param + 1;
+            while (p < item_end && (*p == ' ' || *p == '\t')) {
+                p++;
+            }
+            const char* param_end = p;
+            while (param_end < item_end && *param_end != ';') {
+                param_end++;
+            }
+            const char* value_end = param_end;
+            while (value_end > p && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+                value_end--;
+            }
+            if (value_end - p >= 2 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+                q = parse_qvalue(p + 2, value_end);
+                if (q < 0) {
+                    q = 0;
+                }
+            }
+            p = param_end;
+        }
+
+        if ((token_len == 4 && strncasecmp(token, "gzip", 4) == 0) ||
+            (token_len == 6 && strncasecmp(token, "x-gzip", 6) == 0)) {
+            gzip_q = q;
+        } else if (token_len == 2 && strncasecmp(token, "br", 2) == 0) {
+            br_q = q;
+        } else if (token_len == 1 && token[0] == '*') {
+            star_q = q;
+        }
+        p = item_end + (item_end < end);
+    }
+
+    if (gzip_q < 0) {
+        gzip_q = star_q;
+    }
+#if defined(BSD_WITH_BROTLI)
+    if (br_q < 0) {
+        br_q = star_q;
+    }
+#else
+    br_q = -1;
+#endif
+    if (br_q > 0 && br_q >= gzip_q) {
+        return COMPRESS_BR;
+    }
+    return gzip_q > 0 ? COMPRESS_GZIP : COMPRESS_IDENTITY;
+}
+
+const char* compress_encoding_name(int encoding)
+{
+    switch (encoding) {
+    case COMPRESS_GZIP: return "gzip";
+    case COMPRESS_BR:   return "br";
+    default:            return "identity";
+    }
+}
+
+static CompressedBody* body_alloc(size_t cap)
+{
+    CompressedBody* body = malloc(sizeof(CompressedBody) + cap);
+    if (!body) {
+        perror("malloc");
+        return NULL;
+    }
+    body->refs = 1;
+    body->len = 0;
+    return body;
+}
+
+static CompressedBody* gzip_data(const void* src, size_t len)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // 16 + window bits asks zlib for a gzip header and trailer
+    if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+    size_t cap = deflateBound(&zs, len);
+    CompressedBody* body = body_alloc(cap);
+    if (!body) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+    zs.next_in = (Bytef*)src;
+    zs.avail_in = len;
+    zs.next_out = (Bytef*)body->data;
+    zs.avail_out = cap;
+    int rc = deflate(&zs, Z_FINISH);
+    body->len = zs.total_out;
+    deflateEnd(&zs);
+    if (rc != Z_STREAM_END) {
+        free(body);
+        return NULL;
+    }
+    return body;
+}
+
+#if defined(BSD_WITH_BROTLI)
+static CompressedBody* brotli_data(const void* src, size_t len)
+{
+    size_t cap = BrotliEncoderMaxCompressedSize(len);
+    CompressedBody* body = cap ? body_alloc(cap) : NULL;
+    if (!body) {
+        return NULL;
+    }
+    body->len = cap;
+    if (!BrotliEncoderCompress(BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                               len, src, &body->len, (uint8_t*)body->data)) {
+        free(body);
+        return NULL;
+    }
+    return body;
+}
+#endif
+
+CompressedBody* compress_data(int encoding, const void* src, size_t len)
+{
+    switch (encoding) {
+    case COMPRESS_GZIP:
+        return gzip_data(src, len);
+#if defined(BSD_WITH_BROTLI)
+    case COMPRESS_BR:
+        return brotli_data(src, len);
+#endif
+    default:
+        return NULL;
+    }
+}
+
+static uint32_t hash_key(const char* key)
+{
+    uint32_t h = 2166136261u;
+    for (; *key; key++) {
+        h = (h ^ (unsigned char)*key) * 16777619u;
+    }
+    return h;
+}
+
+static void lru_unlink(CacheEntry* e)
+{
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else cache.lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else cache.lru_tail = e->lru_prev;
+}
+
+static void lru_push_front(CacheEntry* e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = cache.lru_head;
+    if (cache.lru_head) cache.lru_head->lru_prev = e;
+    else cache.lru_tail = e;
+    cache.lru_head = e;
+}
+
+// Returns the link pointing at the entry of key, or at the end of its bucket
+static CacheEntry** find_entry(const char* key, uint32_t hash)
+{
+    CacheEntry** link = &cache.buckets[hash % CACHE_BUCKETS];
+    while (*link && ((*link)->hash != hash || strcmp((*link)->key, key) != 0)) {
+        link = &(*link)->bucket_next;
+    }
+    return link;
+}
+
+// Unlinks and frees an entry, the body lives on while responses hold it; cache lock held
+static void remove_entry(CacheEntry* e)
+{
+    CacheEntry** link = find_entry(e->key, e->hash);
+    *link = e->bucket_next;
+    lru_unlink(e);
+    cache.bytes -= e->body->len;
+    if (--e->body->refs == 0) {
+        free(e->body);
+    }
+    free(e->key);
+    free(e);
+}
+
+CompressedBody* compress_cache_get(const char* key)
+{
+    uint32_t hash = hash_key(key);
+    pthread_mutex_lock(&cache.lock);
+    CacheEntry* e = *find_entry(key, hash);
+    CompressedBody* body = NULL;
+    if (e) {
+        lru_unlink(e);
+        lru_push_front(e);
+        body = e->body;
+        body->refs++;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return body;
+}
+
+void compress_cache_put(const char* key, CompressedBody* body)
+{
+    if (body->len > COMPRESS_CACHE_MAX_ENTRY) {
+        return;
+    }
+    CacheEntry* e = malloc(sizeof(CacheEntry));
+    char* key_copy = strdup(key);
+    if (!e || !key_copy) {
+        perror("malloc");
+        free(e);
+        free(key_copy);
+        return;
+    }
+    e->key = key_copy;
+    e->hash = hash_key(key);
+    e->body = body;
+
+    pthread_mutex_lock(&cache.lock);
+    CacheEntry* old = *find_entry(key, e->hash);
+    if (old) {
+        remove_entry(old);
+    }
+    while (cache.lru_tail && cache.bytes + body->len > COMPRESS_CACHE_BYTES) {
+        remove_entry(cache.lru_tail);
+    }
+    CacheEntry** link = find_entry(key, e->hash);
+    e->bucket_next = NULL;
+    *link = e;
+    lru_push_front(e);
+    cache.bytes += body->len;
+    body->refs++;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void compress_body_release(CompressedBody* body)
+{
+    if (!body) {
+        return;
+    }
+    pthread_mutex_lock(&cache.lock);
+    int refs = --body->refs;
+    pthread_mutex_unlock(&cache.lock);
+    if (refs == 0) {
+        free(body);
+    }
+}
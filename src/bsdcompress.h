@@ -0,0 +1,223 @@
+/*=================================================================================================
+ *
+ * 	@FILENAME:	      bsdcompress.h
+ * 	@BRIEF:    	      Content-coding negotiation and a cache of compressed response bodies.
+ * 	@DESCRIPTION:	  Picks gzip or, when the server is built with it, brotli from the client's
+ * 	                  Accept-Encoding, compresses bodies in one pass and keeps the results in
+ * 	                  an LRU cache bounded in bytes. Entries are keyed by the entity tag of the
+ * 	                  compressed representation, so a changed note or listing gets a new key
+ * 	                  and stale entries simply age out.
+ * 	@AUTHOR		      Daniil (TwelveFacedJanus) Ermolaev.
+ * 	   | CONTACT:	  twofaced-janus@yandex.ru
+ *	@CREATED AT:	  10.16.26
+ *	@UPDATED_AT:	  10.16.26
+ *
+ *==================================================================================================*/
+
+#ifndef BSDCOMPRESS_H_
+#define BSDCOMPRESS_H_
+
+#include <stddef.h>
+
+#include "bsdhttp.h"
+
+#define COMPRESS_IDENTITY 0
+#define COMPRESS_GZIP 1
+#define COMPRESS_BR 2
+
+// Notes outside these sizes are sent as they are
+#define COMPRESS_MIN_SIZE 256
+#define COMPRESS_MAX_SIZE (16 * 1024 * 1024)
+
+#define COMPRESS_CACHE_BYTES (32 * 1024 * 1024)
+// Bodies larger than this share of the budget are compressed but not kept
+#define COMPRESS_CACHE_MAX_ENTRY (COMPRESS_CACHE_BYTES / 8)
+
+
+/*===============================================================================================
+ *
+ * 	@BRIEF:
+ * 		Compressed body shared between the cache and the responses using it.
+ * 	@DESCRIPTION:
+ * 		Reference counted, the cache holds one reference while the body is cached and every
+ * 		caller of compress_cache_get() or compress_cache_put() holds another one.
+ * 	@PARAMETERS:
+ * 		CompressedBody.refs - int, references, changed under the cache lock;
+ * 		CompressedBody.len  - size_t, length of data;
+ * 		CompressedBody.data - char[], compressed bytes.
+ * 	@RETURN:
+ * 		None.
+ * 	@NOTES:
+ * 		Read only once published, release it with compress_body_release().
+ * 	@EXAMPLE:
+ * 		```c
+ * 		CompressedBody* body = compress_cache_get(key);
+ * 		if (body) {
+ * 		    outbuf_append(out, body->data, body->len);
+ * 		    compress_body_release(body);
+ * 		}
+ * 		```
+ * 	@UPDATES:
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *	 	      Struct has been created.
+ *
+ * =============================================================================================*/
+typedef struct CompressedBody
+{
+	int refs;
+	size_t len;
+	char data[];
+} CompressedBody;
+
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Chooses the content coding of a response.
+ *     @DESCRIPTION:
+ *          Reads the Accept-Encoding header with its q-values and returns the supported coding
+ *          the client ranks highest, brotli before gzip when they tie. "*" stands for the codings
+ *          not listed, "x-gzip" is taken as gzip.
+ *     @PARAMETERS:
+ *          - const HttpRequest* req: Parsed request, NULL for none
+ *     @RETURN:
+ *          - COMPRESS_IDENTITY, COMPRESS_GZIP or COMPRESS_BR
+ *     @NOTES:
+ *          - COMPRESS_BR is only returned when the server is built with BSD_WITH_BROTLI
+ *     @EXAMPLE:
+ *          ```c
+ *          int encoding = compress_negotiate(req);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int compress_negotiate(const HttpRequest* req);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Returns the Content-Encoding name of a coding.
+ *     @DESCRIPTION:
+ *          "gzip" or "br", also used to tell the entity tags of the representations apart.
+ *     @PARAMETERS:
+ *          - int encoding: COMPRESS_GZIP or COMPRESS_BR
+ *     @RETURN:
+ *          - const char*: Coding name, "identity" for anything else
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          outbuf_printf(out, "Content-Encoding: %s\r\n", compress_encoding_name(encoding));
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+const char* compress_encoding_name(int encoding);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Compresses a buffer.
+ *     @DESCRIPTION:
+ *          Writes a complete gzip member or brotli stream, at a level meant for bodies that are
+ *          compressed once and then served from the cache.
+ *     @PARAMETERS:
+ *          - int encoding: COMPRESS_GZIP or COMPRESS_BR
+ *          - const void* src: Data to compress
+ *          - size_t len: Length of src
+ *     @RETURN:
+ *          - CompressedBody*: New body holding one reference, not cached
+ *          - NULL if out of memory or the coding is not supported
+ *     @NOTES:
+ *          - Pass the body to compress_cache_put() or release it
+ *     @EXAMPLE:
+ *          ```c
+ *          CompressedBody* body = compress_data(COMPRESS_GZIP, text, text_len);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+CompressedBody* compress_data(int encoding, const void* src, size_t len);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Looks up a compressed body.
+ *     @DESCRIPTION:
+ *          A hit moves the entry to the front of the LRU list.
+ *     @PARAMETERS:
+ *          - const char* key: Entity tag of the compressed representation, plus anything else
+ *            that tells the responses sharing that tag apart
+ *     @RETURN:
+ *          - CompressedBody*: Cached body with a new reference
+ *          - NULL on a miss
+ *     @NOTES:
+ *          - Thread-safe
+ *     @EXAMPLE:
+ *          ```c
+ *          CompressedBody* body = compress_cache_get("\"d46004-3d-6ad214fc.14aa6461-gzip\"");
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+CompressedBody* compress_cache_get(const char* key);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Adds a compressed body to the cache.
+ *     @DESCRIPTION:
+ *          Least recently used entries are evicted until the cache fits COMPRESS_CACHE_BYTES.
+ *          An existing entry with the same key is replaced. Bodies over COMPRESS_CACHE_MAX_ENTRY
+ *          are not kept.
+ *     @PARAMETERS:
+ *          - const char* key: Cache key, see compress_cache_get()
+ *          - CompressedBody* body: Body from compress_data()
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - The caller keeps its reference to body
+ *          - Thread-safe
+ *     @EXAMPLE:
+ *          ```c
+ *          compress_cache_put(key, body);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void compress_cache_put(const char* key, CompressedBody* body);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Drops a reference to a compressed body.
+ *     @DESCRIPTION:
+ *          The body is freed with its last reference. Accepts NULL.
+ *     @PARAMETERS:
+ *          - CompressedBody* body: Body to release
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - Thread-safe
+ *     @EXAMPLE:
+ *          ```c
+ *          compress_body_release(body);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void compress_body_release(CompressedBody* body);
+
+#endif
@@ -1,5 +1,7 @@
 #include "./bsdcore.h"
 
+#include <pthread.h>
+
 typedef struct Note
 {
 	char* name;
@@ -13,6 +15,32 @@ typedef struct Book
     int32_t notes_count;
 } Book;
 
+// The index mapping is process-wide and server workers may list concurrently
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Lines returned by /grep unless ?limit= asks for another count
+#define GREP_DEFAULT_LIMIT 1000
+#define GREP_MAX_LIMIT 100000
+#define SEARCH_DEFAULT_LIMIT 20
+#define SEARCH_MAX_LIMIT 1000
+// Notes per page of /books/{book} when only a cursor or order is given
+#define PAGE_DEFAULT_LIMIT 100
+#define PAGE_MAX_LIMIT 1000
+// Changes per page of /changes
+#define CHANGES_DEFAULT_LIMIT 1000
+#define CHANGES_MAX_LIMIT CHANGES_CAPACITY
+// Edits one PATCH may carry
+#define PATCH_MAX_EDITS 4096
+// ETag, Last-Modified and Cache-Control lines of a response
+#define VALIDATORS_SIZE 256
+
+// Name index of the catalog, rebuilt when notes are created, removed or renamed
+static pthread_rwlock_t find_lock = PTHREAD_RWLOCK_INITIALIZER;
+static FindIndex* find_index;
+static unsigned long long find_generation;
+// Held while the name index is checked and rebuilt, so one rebuild runs at a time
+static pthread_mutex_t find_build_lock = PTHREAD_MUTEX_INITIALIZER;
+
 char* get_default_books_path(const char* path)
 {
     char* home_dir = getenv("HOME");
@@ -20,7 +48,8 @@ char* get_default_books_path(const char* path)
         perror("Unable to get HOME directory");
         return "";
     }
-    char* default_books_path = malloc(strlen(home_dir) + strlen(path) + 1);
+    // home + "/" + path + NUL
+    char* default_books_path = malloc(strlen(home_dir) + strlen(path) + 2);
     if (default_books_path == NULL) {
 	free(default_books_path);
         perror("Unable to allocate memory");
@@ -62,43 +91,151 @@ int create_note(const char* bookname, const char* notename)
         return -1;
     }
     fclose(fp);
+    changes_record(CHANGE_NOTE_CREATED, bookname, notename, NULL, NULL);
     printf("Note has been created!\n");
     return 0;
 }
 
 char* get_note_content(const char* book_name, const char* note_name) {
-    char* default_books_path = get_default_books_path("/books");
-    char note_path[1024];
-    snprintf(note_path, sizeof(note_path), "%s/%s/%s.bdsb", default_books_path, book_name, note_name);
-
-    FILE* file = fopen(note_path, "r");
-    if (!file) {
-        free(default_books_path);
-        return NULL;
+    // Served from the note cache when the server runs one
+    unsigned long long ticket;
+    NoteBody* body = notecache_get(book_name, note_name, &ticket);
+    struct stat st;
+    int fd = -1;
+    if (!body) {
+        fd = open_note(book_name, note_name, &st);
+        if (fd < 0) {
+            return NULL;
+        }
+        body = notecache_fill(book_name, note_name, fd, &st, ticket);
+    }
+    if (body) {
+        char* content = malloc(body->len + 1);
+        if (content) {
+            memcpy(content, body->data, body->len + 1);
+        }
+        notecache_release(body);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return content;
     }
-
-    // Get file size
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
 
     // Allocate buffer for content
-    char* content = malloc(file_size + 1);
+    char* content = malloc(st.st_size + 1);
     if (!content) {
-        fclose(file);
-        free(default_books_path);
+        close(fd);
         return NULL;
     }
 
     // Read file content
-    size_t bytes_read = fread(content, 1, file_size, file);
+    size_t bytes_read = 0;
+    while (bytes_read < (size_t)st.st_size) {
+        ssize_t n = read(fd, content + bytes_read, st.st_size - bytes_read);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        bytes_read += n;
+    }
     content[bytes_read] = '\0';
 
-    fclose(file);
-    free(default_books_path);
+    close(fd);
     return content;
 }
 
+int is_valid_name(const char* name)
+{
+    if (!name || name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return 0;
+    }
+    for (const unsigned char* c = (const unsigned char*)name; *c; c++) {
+        if (*c == '/' || *c < 0x20 || *c == 0x7f) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Splits a decoded "/book/{book}[/{note}]" at its first '/', the note is the rest of the path
+// as a whole. Returns -1 when a name is empty, too long or not a single path component
+static int split_book_path(const char* path, char* book_name, char* note_name, size_t size)
+{
+    const char* book = path + 6;
+    const char* slash = strchr(book, '/');
+    size_t book_len = slash ? (size_t)(slash - book) : strlen(book);
+    if (book_len == 0 || book_len >= size) {
+        return -1;
+    }
+    memcpy(book_name, book, book_len);
+    book_name[book_len] = '\0';
+    note_name[0] = '\0';
+    if (slash) {
+        // "/book/B/" names no note, it must not fall through to the whole book
+        size_t note_len = strlen(slash + 1);
+        if (note_len == 0 || note_len >= size) {
+            return -1;
+        }
+        memcpy(note_name, slash + 1, note_len + 1);
+    }
+    if (!is_valid_name(book_name) || (slash && !is_valid_name(note_name))) {
+        return -1;
+    }
+    return 0;
+}
+
+int open_note(const char* book_name, const char* note_name, struct stat* st)
+{
+    if (!is_valid_name(book_name) || !is_valid_name(note_name)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char* default_books_path = get_default_books_path("/books");
+    char note_path[1024];
+    snprintf(note_path, sizeof(note_path), "%s/%s/%s.bdsb", default_books_path, book_name, note_name);
+    free(default_books_path);
+
+    int fd = open(note_path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, st) != 0 || !S_ISREG(st->st_mode)) {
+        close(fd);
+        errno = ENOENT;
+        return -1;
+    }
+    return fd;
+}
+
+ssize_t read_note_range(const char* book_name, const char* note_name, off_t offset, char* buf, size_t size)
+{
+    struct stat st;
+    int fd = open_note(book_name, note_name, &st);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, buf + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            close(fd);
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+    return done;
+}
+
 int create_book(const char* bookname)
 {
     char* default_books_path = get_default_books_path("/books");
@@ -109,6 +246,7 @@ int create_book(const char* bookname)
 
     if (mkdir(book_path, 0755) == 0)
     {
+        changes_record(CHANGE_BOOK_CREATED, bookname, NULL, NULL, NULL);
         printf("Book has been created!\n");
         return 0;
     }
@@ -118,6 +256,15 @@ int create_book(const char* bookname)
 
 void get_books()
 {
+    int indexed_count = 0;
+    const IndexBook* indexed = index_books(&indexed_count);
+    if (indexed) {
+        for (int i = 0; i < indexed_count; i++) {
+            printf("%s\n", index_name(indexed[i].name));
+        }
+        return;
+    }
+
     char* default_books_path = get_default_books_path("/books");
     DIR* dir;
     struct dirent* entry;
@@ -145,63 +292,114 @@ void get_books()
     free(default_books_path);
 }
 
+/*
+ * Tells whether a directory entry is of the wanted type (S_IFDIR, S_IFREG). d_type answers
+ * without a syscall; entries the filesystem leaves as DT_UNKNOWN, and symlinks, which stat()
+ * used to follow, are resolved with fstatat() relative to the open directory.
+ */
+static int dirent_is(int dfd, const struct dirent* entry, mode_t type)
+{
+#ifdef DT_UNKNOWN
+    switch (entry->d_type) {
+    case DT_DIR:
+        return type == S_IFDIR;
+    case DT_REG:
+        return type == S_IFREG;
+    case DT_UNKNOWN:
+    case DT_LNK:
+        break;
+    default:
+        return 0;
+    }
+#endif
+    struct stat statbuf;
+    return fstatat(dfd, entry->d_name, &statbuf, 0) == 0 && (statbuf.st_mode & S_IFMT) == type;
+}
+
+// Doubles *cap when *count reached it, returns 0 on success
+static int grow_array(void** array, int count, int* cap, size_t item_size)
+{
+    if (count < *cap) {
+        return 0;
+    }
+    int new_cap = *cap ? *cap * 2 : 16;
+    void* grown = realloc(*array, (size_t)new_cap * item_size);
+    if (!grown) {
+        perror("realloc");
+        return -1;
+    }
+    *array = grown;
+    *cap = new_cap;
+    return 0;
+}
+
 Book* get_books_st(int* count)
 {
-    char *default_books_path = get_default_books_path("/books");
+    char *default_books_path;
     DIR *dir;
     struct dirent *entry;
-    struct stat statbuf;
     Book* books = NULL;
     int book_count = 0;
+    int book_cap = 0;
+
+    *count = 0;
+    int indexed_count = 0;
+    pthread_mutex_lock(&index_lock);
+    const IndexBook* indexed = index_books(&indexed_count);
+    if (indexed) {
+        books = malloc((indexed_count ? indexed_count : 1) * sizeof(Book));
+        if (!books) {
+            perror("malloc");
+            pthread_mutex_unlock(&index_lock);
+            return NULL;
+        }
+        for (int i = 0; i < indexed_count; i++) {
+            books[book_count].name = strdup(index_name(indexed[i].name));
+            books[book_count].notes = NULL;
+            books[book_count].notes_count = 0;
+            if (books[book_count].name) {
+                book_count++;
+            }
+        }
+        pthread_mutex_unlock(&index_lock);
+        *count = book_count;
+        return books;
+    }
+    pthread_mutex_unlock(&index_lock);
 
+    // No usable index (read-only directory, ...), read the directory
+    default_books_path = get_default_books_path("/books");
     dir = opendir(default_books_path);
+    free(default_books_path);
     if (!dir) {
         perror("opendir");
-        free(default_books_path);
-        *count = 0;
         return NULL;
     }
 
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-        char fullpath[1024];
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", default_books_path, entry->d_name);
-
-        if (stat(fullpath, &statbuf) == 0 && S_ISDIR(statbuf.st_mode)) {
-            book_count++;
-        }
-    }
-
-    books = (Book*)malloc(book_count * sizeof(Book));
-    if (!books) {
-        perror("malloc");
+    // Single pass, so entries created or removed meanwhile cannot desync a count
+    if (grow_array((void**)&books, 0, &book_cap, sizeof(Book)) != 0) {
         closedir(dir);
-        free(default_books_path);
-        *count = 0;
         return NULL;
     }
-
-    rewinddir(dir);
-    int i = 0;
-    while ((entry = readdir(dir)) != NULL && i < book_count) {
+    while ((entry = readdir(dir)) != NULL) {
         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
             continue;
         }
-        char fullpath[1024];
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", default_books_path, entry->d_name);
-
-        if (stat(fullpath, &statbuf) == 0 && S_ISDIR(statbuf.st_mode)) {
-            books[i].name = strdup(entry->d_name);
-            books[i].notes = NULL;
-            books[i].notes_count = 0;
-            i++;
+        if (!dirent_is(dirfd(dir), entry, S_IFDIR)) {
+            continue;
+        }
+        if (grow_array((void**)&books, book_count, &book_cap, sizeof(Book)) != 0) {
+            break;
+        }
+        books[book_count].name = strdup(entry->d_name);
+        books[book_count].notes = NULL;
+        books[book_count].notes_count = 0;
+        if (books[book_count].name) {
+            book_count++;
         }
     }
 
     closedir(dir);
-    free(default_books_path);
     *count = book_count;
     return books;
 }
@@ -211,73 +409,67 @@ Note* get_notes_st(const char* bookname, int* count)
     char* default_books_path = get_default_books_path("/books");
     char book_path[1024];
     snprintf(book_path, sizeof(book_path), "%s/%s", default_books_path, bookname);
+    free(default_books_path);
 
     DIR* dir;
     struct dirent* entry;
-    struct stat statbuf;
     Note* notes = NULL;
     int note_count = 0;
+    int note_cap = 0;
+
+    *count = 0;
+    int indexed_count = 0;
+    pthread_mutex_lock(&index_lock);
+    const IndexNote* indexed = index_notes(bookname, &indexed_count);
+    if (indexed) {
+        notes = malloc((indexed_count ? indexed_count : 1) * sizeof(Note));
+        if (!notes) {
+            perror("malloc");
+            pthread_mutex_unlock(&index_lock);
+            return NULL;
+        }
+        for (int i = 0; i < indexed_count; i++) {
+            notes[note_count].name = strdup(index_name(indexed[i].name));
+            if (notes[note_count].name) {
+                note_count++;
+            }
+        }
+        pthread_mutex_unlock(&index_lock);
+        *count = note_count;
+        return notes;
+    }
+    pthread_mutex_unlock(&index_lock);
 
-    // First pass - count .bdsb files
     dir = opendir(book_path);
     if (!dir) {
         perror("opendir");
-        free(default_books_path);
-        *count = 0;
         return NULL;
     }
 
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-
-        char fullpath[1024];
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", book_path, entry->d_name);
-
-        if (stat(fullpath, &statbuf) == 0 && S_ISREG(statbuf.st_mode)) {
-            // Check if file has .bdsb extension
-            char* ext = strrchr(entry->d_name, '.');
-            if (ext && strcmp(ext, ".bdsb") == 0) {
-                note_count++;
-            }
-        }
-    }
-
-    // Allocate memory for notes array
-    notes = (Note*)malloc(note_count * sizeof(Note));
-    if (!notes) {
-        perror("malloc");
+    if (grow_array((void**)&notes, 0, &note_cap, sizeof(Note)) != 0) {
         closedir(dir);
-        free(default_books_path);
-        *count = 0;
         return NULL;
     }
-
-    // Second pass - fill the array
-    rewinddir(dir);
-    int i = 0;
-    while ((entry = readdir(dir)) != NULL && i < note_count) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+    while ((entry = readdir(dir)) != NULL) {
+        // Check the name first, it costs nothing compared to a stat
+        char* ext = strrchr(entry->d_name, '.');
+        if (!ext || ext == entry->d_name || strcmp(ext, ".bdsb") != 0) {
             continue;
         }
-
-        char fullpath[1024];
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", book_path, entry->d_name);
-
-        if (stat(fullpath, &statbuf) == 0 && S_ISREG(statbuf.st_mode)) {
-            char* ext = strrchr(entry->d_name, '.');
-            if (ext && strcmp(ext, ".bdsb") == 0) {
-                // Remove .bdsb extension for the note name
-                *ext = '\0';
-                notes[i].name = strdup(entry->d_name);
-                i++;
-            }
+        if (!dirent_is(dirfd(dir), entry, S_IFREG)) {
+            continue;
+        }
+        if (grow_array((void**)&notes, note_count, &note_cap, sizeof(Note)) != 0) {
+            break;
+        }
+        // Note name is the file name without .bdsb extension
+        notes[note_count].name = strndup(entry->d_name, ext - entry->d_name);
+        if (notes[note_count].name) {
+            note_count++;
         }
     }
 
     closedir(dir);
-    free(default_books_path);
     *count = note_count;
     return notes;
 }
@@ -305,11 +497,14 @@ void show_welcome_and_help()
     printf("  ./bsdnotes create note <book_name> <note_name> - Create a new note in a book\n");
     printf("  ./bsdnotes delete book <book_name>  - Delete a book\n");
     printf("  ./bsdnotes delete note <book_name> <note_name> - Delete a note from a book\n");
+    printf("  ./bsdnotes bulk [file]              - Apply create, delete and 'move note <book> <note> <to_book> <to_note>' lines as one change\n");
     printf("  ./bsdnotes show <book_name>         - Show all notes in a book\n");
     printf("  ./bsdnotes books                    - List all books\n");
     printf("  ./bsdnotes edit <book_name> <note_name> - Edit a note in a book using NeoVim\n");
     printf("  ./bsdnotes show todos               - Show all lines with #todo tag from all notes\n");
+    printf("  ./bsdnotes find <fragment>          - Find notes by part of their book/note name\n");
     printf("  ./bsdnotes --tui                    - Open BSDNotes in TUI mode\n");
+    printf("  ./bsdnotes --server [--workers N] [--port P] [--idle-timeout SEC] [--note-cache MB] [--commit-window USEC] - Run HTTP server\n");
 }
 int is_directory(const char *path)
 {
@@ -327,59 +522,33 @@ int is_regular_file(const char *path)
     return S_ISREG(statbuf.st_mode);
 }
 
-void find_by_tag(const char* tag)
+static void print_tag_hit(const char* book_name, const char* note_name, uint32_t line, const char* text, void* ctx)
 {
-    char* default_books_path = get_default_books_path("/books");
-    DIR *books_dir = opendir(default_books_path);
-    if (!books_dir) {
-        perror("Unable to open 'books' directory");
-        free(default_books_path);
-        return;
-    }
-
-    struct dirent *book_entry;
-    while ((book_entry = readdir(books_dir))) {
-        char book_path[1024];
-        snprintf(book_path, sizeof(book_path), "%s/%s", default_books_path, book_entry->d_name);
-
-        if (is_directory(book_path) && strcmp(book_entry->d_name, ".") != 0 && strcmp(book_entry->d_name, "..") != 0) {
-            DIR *notes_dir = opendir(book_path);
-            if (!notes_dir) {
-                perror("Unable to open book directory");
-                continue;
-            }
+    (void)ctx;
+    printf("[Book: %s, Note: %s.bdsb, Line %u] %s\n", book_name, note_name, line, text);
+}
 
-            struct dirent *note_entry;
-            while ((note_entry = readdir(notes_dir))) {
-                char note_path[1024];
-                snprintf(note_path, sizeof(note_path), "%s/%s", book_path, note_entry->d_name);
-
-                if (is_regular_file(note_path)) {
-                    FILE *note_file = fopen(note_path, "r");
-                    if (!note_file) {
-                        perror("Unable to open note file");
-                        continue;
-                    }
-
-                    char line[1024];
-                    int line_number = 1;
-                    while (fgets(line, sizeof(line), note_file)) {
-                        if (strstr(line, tag)) {
-                            printf("[Book: %s, Note: %s, Line %d] %s", book_entry->d_name, note_entry->d_name, line_number, line);
-                        }
-                        line_number++;
-                    }
-
-                    fclose(note_file);
-                }
-            }
+static int print_search_hit(const char* book_name, const char* note_name, uint32_t line,
+                            const char* text, size_t len, uint32_t patterns, void* ctx)
+{
+    (void)patterns;
+    (void)ctx;
+    printf("[Book: %s, Note: %s, Line %u] %.*s\n", book_name, note_name, line, (int)len, text);
+    return 0;
+}
 
-            closedir(notes_dir);
-        }
+void find_by_tag(const char* tag)
+{
+    // Tags are answered from the postings in .bsdindex, other strings need the full scan
+    pthread_mutex_lock(&index_lock);
+    int found = index_find_tag(tag, print_tag_hit, NULL);
+    pthread_mutex_unlock(&index_lock);
+    if (found >= 0) {
+        return;
     }
 
-    closedir(books_dir);
-    free(default_books_path);
+    // Other strings, or no index: scan every note on all cores
+    search_notes(&tag, 1, 0, 0, print_search_hit, NULL);
 }
 
 void show_todos()
@@ -392,8 +561,46 @@ void show_links()
     find_by_tag("#link");
 }
 
+static void print_find_match(const char* book_name, const char* note_name, double score, void* ctx)
+{
+    (void)score;
+    (void)ctx;
+    printf("%s/%s\n", book_name, note_name);
+}
+
+void find_notes(const char* fragment)
+{
+    pthread_mutex_lock(&index_lock);
+    FindIndex* index = find_index_from_books();
+    pthread_mutex_unlock(&index_lock);
+    if (!index) {
+        fprintf(stderr, "Unable to list the notes\n");
+        return;
+    }
+    if (find_index_query(index, fragment, FIND_DEFAULT_LIMIT, print_find_match, NULL) == 0) {
+        printf("No notes match '%s'\n", fragment);
+    }
+    find_index_free(index);
+}
+
 void print_notes_from_book(const char *book_name)
 {
+    int indexed_count = 0;
+    const IndexNote* indexed = index_notes(book_name, &indexed_count);
+    if (indexed) {
+        printf("Notes in book '%s':\n", book_name);
+        // localtime() rereads the zone file on every call, localtime_r() after tzset() does not
+        tzset();
+        for (int i = 0; i < indexed_count; i++) {
+            char time_buf[80];
+            struct tm tm_buf;
+            time_t mtime = indexed[i].mtime_sec;
+            strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", localtime_r(&mtime, &tm_buf));
+            printf("- %s.bdsb (Last Edited: %s)\n", index_name(indexed[i].name), time_buf);
+        }
+        return;
+    }
+
     char* default_books_path = get_default_books_path("/books");
     char book_path[1024];
     snprintf(book_path, sizeof(book_path), "%s/%s", default_books_path, book_name);
@@ -473,254 +680,1692 @@ json_t* notes_to_json(Note* notes, int count) {
     return root;
 }
 
-int handle_note_content_request(int client_socket, const char* path) {
-    char book_name[256] = {0};
-    char note_name[256] = {0};
-    
-    // Parse book and note names from path
-    if (sscanf(path, "/book/%255[^/]/%255s", book_name, note_name) != 2) {
-        const char* bad_request = "HTTP/1.1 400 Bad Request\r\n"
-                                 "Content-Type: text/plain\r\n"
-                                 "\r\n"
-                                 "400 Bad Request - Invalid path format\r\n";
-        write(client_socket, bad_request, strlen(bad_request));
-        return -1;
+// 1 when the client's copy is current; If-Modified-Since only counts without If-None-Match
+static int not_modified(const HttpRequest* req, const char* etag, time_t mtime)
+{
+    if (!req) {
+        return 0;
     }
-
-    // Get note content
-    char* content = get_note_content(book_name, note_name);
-    if (!content) {
-        const char* not_found = "HTTP/1.1 404 Not Found\r\n"
-                               "Content-Type: text/plain\r\n"
-                               "\r\n"
-                               "404 Note Not Found\r\n";
-        write(client_socket, not_found, strlen(not_found));
-        return -1;
+    const HttpHeader* h = http_find_header(req, "If-None-Match");
+    if (h) {
+        return http_etag_match(h, etag);
     }
+    h = http_find_header(req, "If-Modified-Since");
+    time_t since;
+    return h && mtime != (time_t)-1 && http_parse_date(h->value, h->value_len, &since) == 0 &&
+           mtime <= since;
+}
 
-    // Build response
-    char response_header[512];
-    snprintf(response_header, sizeof(response_header),
+// 304 repeats the validators of the 200 it stands for, and has no body
+static int not_modified_response(OutBuffer* out, const char* validators)
+{
+    outbuf_printf(out, "HTTP/1.1 304 Not Modified\r\n%s\r\n", validators);
+    return 0;
+}
+
+// 200 with a compressed body, the content coding is part of the entity tag in validators
+static void compressed_response(OutBuffer* out, const char* type, const char* validators,
+                                int encoding, const CompressedBody* body)
+{
+    outbuf_printf(out,
             "HTTP/1.1 200 OK\r\n"
-            "Content-Type: text/plain\r\n"
+            "Content-Type: %s\r\n"
+            "%s"
+            "Content-Encoding: %s\r\n"
             "Content-Length: %zu\r\n"
             "\r\n",
-            strlen(content));
+            type, validators, compress_encoding_name(encoding), body->len);
+    outbuf_append(out, body->data, body->len);
+}
+
+// Entity tag of a representation: "tag" for identity, "tag-gzip" for a compressed one
+static void representation_etag(char* etag, size_t size, const char* base, int encoding)
+{
+    size_t base_len = strlen(base);
+    if (encoding == COMPRESS_IDENTITY || base_len < 2) {
+        snprintf(etag, size, "%s", base);
+    } else {
+        snprintf(etag, size, "%.*s-%s\"", (int)(base_len - 1), base, compress_encoding_name(encoding));
+    }
+}
+
+// Cache key of a compressed body, empty when the request target does not fit
+static void compressed_key(char* key, size_t size, const char* etag, const HttpRequest* req)
+{
+    int n = snprintf(key, size, "%s %.*s?%.*s", etag, (int)req->path_len, req->path,
+                     (int)req->query_len, req->query ? req->query : "");
+    if (n < 0 || (size_t)n >= size) {
+        key[0] = '\0';
+    }
+}
 
-    // Send header and content
-    write(client_socket, response_header, strlen(response_header));
-    write(client_socket, content, strlen(content));
+// A catalog listing being answered: validators, content coding and compressed-body key
+typedef struct Listing
+{
+    int encoding;
+    char validators[VALIDATORS_SIZE];
+    char key[CATALOG_ETAG_SIZE + 2 * HTTP_MAX_PATH];
+} Listing;
+
+/*
+ * Listings served from the catalog are tagged with its generation. Returns 1 when the
+ * response is complete already: a 304, or a compressed body found in the cache.
+ */
+static int listing_begin(OutBuffer* out, const HttpRequest* req, JsonWriter* w,
+                         const char* book_name, Listing* l)
+{
+    l->encoding = compress_negotiate(req);
+    l->validators[0] = '\0';
+    l->key[0] = '\0';
+    jsonw_init(w, out);
+
+    char base[CATALOG_ETAG_SIZE];
+    char etag[CATALOG_ETAG_SIZE + 8];
+    if (catalog_etag(book_name, base, sizeof(base)) < 0) {
+        return 0;
+    }
+    representation_etag(etag, sizeof(etag), base, l->encoding);
+    snprintf(l->validators, sizeof(l->validators),
+             "ETag: %s\r\nVary: Accept-Encoding\r\nCache-Control: no-cache\r\n", etag);
+    if (not_modified(req, etag, (time_t)-1)) {
+        not_modified_response(out, l->validators);
+        return 1;
+    }
+    if (l->encoding == COMPRESS_IDENTITY) {
+        jsonw_headers(w, l->validators);
+        return 0;
+    }
 
-    free(content);
+    compressed_key(l->key, sizeof(l->key), etag, req);
+    CompressedBody* body = l->key[0] ? compress_cache_get(l->key) : NULL;
+    if (body) {
+        compressed_response(out, "application/json", l->validators, l->encoding, body);
+        compress_body_release(body);
+        return 1;
+    }
     return 0;
 }
 
-int handle_http_request(int client_socket, const char* request)
+// Completes a listing started with listing_begin(), compressing and caching it if asked for
+static int listing_finish(JsonWriter* w, Listing* l)
 {
-    char path[256] = {0};
-    if (sscanf(request, "GET %255s HTTP/1.1", path) != 1) {
-        const char* bad_request = "HTTP/1.1 400 Bad Request\r\n"
-                                 "Content-Type: text/plain\r\n"
-                                 "\r\n"
-                                 "400 Bad Request\r\n";
-        write(client_socket, bad_request, strlen(bad_request));
-        return -1;
+    int rc = jsonw_finish(w);
+    if (rc != 0 || l->encoding == COMPRESS_IDENTITY) {
+        return rc;
     }
 
-    if (strcmp(path, "/books") == 0) {
-        // Handle books listing
-        int book_count = 0;
-        Book* books = get_books_st(&book_count);
-        if (!books) {
-            const char* not_found = "HTTP/1.1 404 Not Found\r\n"
-                                   "Content-Type: text/plain\r\n"
-                                   "\r\n"
-                                   "404 No Books Found\r\n";
-            write(client_socket, not_found, strlen(not_found));
-            return -1;
-        }
+    OutBuffer* out = w->out;
+    char* head_end = memmem(out->data + w->start, out->len - w->start, "\r\n\r\n", 4);
+    const char* data = head_end + 4;
+    CompressedBody* body = compress_data(l->encoding, data, out->data + out->len - data);
+    if (!body) {
+        // Out of memory: the plain body goes out without the compressed entity tag
+        return 0;
+    }
+    if (l->key[0]) {
+        compress_cache_put(l->key, body);
+    }
+    out->len = w->start;
+    compressed_response(out, "application/json", l->validators, l->encoding, body);
+    compress_body_release(body);
+    return 0;
+}
 
-        json_t* books_json = books_to_json(books, book_count);
-        if (!books_json) {
-            const char* server_error = "HTTP/1.1 500 Internal Server Error\r\n"
-                                     "Content-Type: text/plain\r\n"
-                                     "\r\n"
-                                     "500 JSON Conversion Failed\r\n";
-            write(client_socket, server_error, strlen(server_error));
-            
-            // Free books array
-            for (int i = 0; i < book_count; i++) {
-                free(books[i].name);
+// Reads a whole note and compresses it, NULL on a short read
+static CompressedBody* compress_note(int fd, size_t size, int encoding)
+{
+    char* text = malloc(size ? size : 1);
+    if (!text) {
+        perror("malloc");
+        return NULL;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, text + done, size - done, done);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
             }
-            free(books);
-            return -1;
+            free(text);
+            return NULL;
         }
+        done += n;
+    }
+    CompressedBody* body = compress_data(encoding, text, size);
+    free(text);
+    return body;
+}
 
-        char* json_str = json_dumps(books_json, JSON_INDENT(2));
-        json_decref(books_json);
-        
-        // Free books array
-        for (int i = 0; i < book_count; i++) {
-            free(books[i].name);
-        }
-        free(books);
+// ETag, Last-Modified and caching headers of one representation of a note
+static void note_validators(const struct stat* st, int encoding, char* etag, size_t etag_size,
+                            char* validators, size_t size)
+{
+    // Strong tag: any write moves the size or the mtime, a replacing rename the inode
+    char base[96];
+    snprintf(base, sizeof(base), "\"%llx-%llx-%llx.%lx\"",
+             (unsigned long long)st->st_ino, (unsigned long long)st->st_size,
+             (unsigned long long)st->st_mtime, (long)NOTE_MTIME_NSEC(st));
+    representation_etag(etag, etag_size, base, encoding);
+
+    char date[HTTP_DATE_SIZE];
+    if (http_format_date(st->st_mtime, date, sizeof(date)) > 0) {
+        snprintf(validators, size,
+                 "ETag: %s\r\nLast-Modified: %s\r\nVary: Accept-Encoding\r\nCache-Control: no-cache\r\n",
+                 etag, date);
+    } else {
+        snprintf(validators, size, "ETag: %s\r\nVary: Accept-Encoding\r\nCache-Control: no-cache\r\n",
+                 etag);
+    }
+}
 
-        if (!json_str) {
-            const char* server_error = "HTTP/1.1 500 Internal Server Error\r\n"
-                                     "Content-Type: text/plain\r\n"
-                                     "\r\n"
-                                     "500 JSON Serialization Failed\r\n";
-            write(client_socket, server_error, strlen(server_error));
-            return -1;
-        }
+// If-Range: a range only applies to the representation the client already has part of
+static int if_range_holds(const HttpRequest* req, const char* etag, time_t mtime)
+{
+    const HttpHeader* h = http_find_header(req, "If-Range");
+    if (!h) {
+        return 1;
+    }
+    // Compared strongly, a weak tag never validates a range
+    if (h->value_len > 0 && h->value[0] == '"') {
+        return h->value_len == strlen(etag) && memcmp(h->value, etag, h->value_len) == 0;
+    }
+    time_t date;
+    return http_parse_date(h->value, h->value_len, &date) == 0 && date == mtime;
+}
 
-        char response_header[512];
-        snprintf(response_header, sizeof(response_header),
-                "HTTP/1.1 200 OK\r\n"
-                "Content-Type: application/json\r\n"
+// 206 with one range of a note, or 416 when it starts past the end; takes cached and fd
+static int range_response(OutBuffer* out, const char* validators, long long size,
+                          NoteBody* cached, int fd, int rc, long long first, long long last)
+{
+    if (rc < 0) {
+        notecache_release(cached);
+        if (fd >= 0) {
+            close(fd);
+        }
+        const char* body = "416 Range Not Satisfiable\r\n";
+        outbuf_printf(out,
+                "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                "Content-Range: bytes */%lld\r\n"
+                "Content-Type: text/plain\r\n"
                 "Content-Length: %zu\r\n"
-                "\r\n",
-                strlen(json_str));
+                "\r\n"
+                "%s",
+                size, strlen(body), body);
+        return -1;
+    }
 
-        write(client_socket, response_header, strlen(response_header));
-        write(client_socket, json_str, strlen(json_str));
-        free(json_str);
+    outbuf_printf(out,
+            "HTTP/1.1 206 Partial Content\r\n"
+            "Content-Type: text/plain\r\n"
+            "%s"
+            "Content-Range: bytes %lld-%lld/%lld\r\n"
+            "Content-Length: %lld\r\n"
+            "\r\n",
+            validators, first, last, size, last - first + 1);
+    if (cached) {
+        outbuf_append(out, cached->data + first, last - first + 1);
+        notecache_release(cached);
+    } else {
+        // Straight from the file at any offset, the range never passes through memory
+        outbuf_attach_file(out, fd, first, last - first + 1);
+    }
+    return 0;
+}
+
+int handle_note_content_request_buf(OutBuffer* out, const HttpRequest* req, const char* path) {
+    char book_name[256] = {0};
+    char note_name[256] = {0};
+    
+    // Parse book and note names from path
+    if (split_book_path(path, book_name, note_name, sizeof(book_name)) != 0 || !note_name[0]) {
+        http_text_response(out, "400 Bad Request", "400 Bad Request - Invalid path format\r\n");
+        return -1;
+    }
+
+    // Hot notes come from memory, the rest is sent straight from the descriptor
+    struct stat note_stat;
+    int fd = -1;
+    unsigned long long ticket;
+    NoteBody* cached = notecache_get(book_name, note_name, &ticket);
+    if (cached) {
+        note_stat = cached->st;
+    } else {
+        fd = open_note(book_name, note_name, &note_stat);
+        if (fd < 0) {
+            http_text_response(out, "404 Not Found", "404 Note Not Found\r\n");
+            return -1;
+        }
+        cached = notecache_fill(book_name, note_name, fd, &note_stat, ticket);
+        if (cached) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    // Tiny notes gain nothing from compression, huge ones are not read into memory; ranges
+    // are always of the plain representation
+    const HttpHeader* range = req ? http_find_header(req, "Range") : NULL;
+    int encoding = COMPRESS_IDENTITY;
+    if (!range && note_stat.st_size >= COMPRESS_MIN_SIZE && note_stat.st_size <= COMPRESS_MAX_SIZE) {
+        encoding = compress_negotiate(req);
+    }
+    char etag[112];
+    char validators[VALIDATORS_SIZE];
+    note_validators(&note_stat, encoding, etag, sizeof(etag), validators, sizeof(validators));
+
+    if (not_modified(req, etag, note_stat.st_mtime)) {
+        notecache_release(cached);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return not_modified_response(out, validators);
+    }
+
+    if (range && if_range_holds(req, etag, note_stat.st_mtime)) {
+        long long first = 0;
+        long long last = 0;
+        int rc = http_parse_range(range, note_stat.st_size, &first, &last);
+        if (rc != 0) {
+            return range_response(out, validators, note_stat.st_size, cached, fd, rc, first, last);
+        }
+    }
+
+    if (encoding != COMPRESS_IDENTITY) {
+        char key[sizeof(etag) + 2 * HTTP_MAX_PATH];
+        compressed_key(key, sizeof(key), etag, req);
+        CompressedBody* body = key[0] ? compress_cache_get(key) : NULL;
+        if (!body) {
+            body = cached ? compress_data(encoding, cached->data, cached->len)
+                          : compress_note(fd, note_stat.st_size, encoding);
+            if (body && key[0]) {
+                compress_cache_put(key, body);
+            }
+        }
+        if (body) {
+            notecache_release(cached);
+            if (fd >= 0) {
+                close(fd);
+            }
+            compressed_response(out, "text/plain", validators, encoding, body);
+            compress_body_release(body);
+            return 0;
+        }
+        // Could not compress, send the plain representation
+        encoding = COMPRESS_IDENTITY;
+        note_validators(&note_stat, encoding, etag, sizeof(etag), validators, sizeof(validators));
+    }
+
+    // Build response
+    outbuf_printf(out,
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/plain\r\n"
+            "%s"
+            "Accept-Ranges: bytes\r\n"
+            "Content-Length: %lld\r\n"
+            "\r\n",
+            validators, (long long)note_stat.st_size);
+    if (cached) {
+        outbuf_append(out, cached->data, cached->len);
+        notecache_release(cached);
+    } else {
+        outbuf_attach_file(out, fd, 0, note_stat.st_size);
+    }
+    return 0;
+}
+
+static int append_grep_hit(const char* book_name, const char* note_name, uint32_t line,
+                           const char* text, size_t len, uint32_t patterns, void* ctx)
+{
+    JsonWriter* w = ctx;
+    (void)patterns;
+
+    // Notes are named without their extension everywhere else in the API
+    size_t note_len = strlen(note_name);
+    if (note_len > 5 && strcmp(note_name + note_len - 5, ".bdsb") == 0) {
+        note_len -= 5;
+    }
+
+    jsonw_object_begin(w);
+    jsonw_key(w, "book");
+    jsonw_string(w, book_name);
+    jsonw_key(w, "note");
+    jsonw_string_len(w, note_name, note_len);
+    jsonw_key(w, "line");
+    jsonw_integer(w, line);
+    // Bytes that are not UTF-8 come out as U+FFFD
+    jsonw_key(w, "text");
+    jsonw_string_len(w, text, len);
+    jsonw_object_end(w);
+    return 0;
+}
+
+// GET /grep?q=text[&q=other...][&limit=N]: lines containing any q, in book/note/line order
+static int handle_grep_request(OutBuffer* out, const HttpRequest* req)
+{
+    char queries[SCAN_MAX_PATTERNS][256];
+    const char* patterns[SCAN_MAX_PATTERNS];
+    int count = 0;
+    int rc;
+    while (count < SCAN_MAX_PATTERNS &&
+           (rc = http_query_get(req->query, req->query_len, "q", count, queries[count], sizeof(queries[count]))) != -1) {
+        if (rc <= 0) {
+            http_text_response(out, "400 Bad Request", "400 Bad Request - Invalid q\r\n");
+            return -1;
+        }
+        patterns[count] = queries[count];
+        count++;
+    }
+    char extra[1];
+    if (count == 0 || http_query_get(req->query, req->query_len, "q", count, extra, sizeof(extra)) != -1) {
+        http_text_response(out, "400 Bad Request", "400 Bad Request - Expected 1 to 32 q\r\n");
+        return -1;
+    }
+
+    long limit = GREP_DEFAULT_LIMIT;
+    char limit_str[32];
+    if (http_query_get(req->query, req->query_len, "limit", 0, limit_str, sizeof(limit_str)) != -1) {
+        char* end;
+        limit = strtol(limit_str, &end, 10);
+        if (end == limit_str || *end != '\0' || limit < 1 || limit > GREP_MAX_LIMIT) {
+            http_text_response(out, "400 Bad Request", "400 Bad Request - Invalid limit\r\n");
+            return -1;
+        }
+    }
+
+    JsonWriter w;
+    jsonw_init(&w, out);
+    jsonw_array_begin(&w);
+    if (search_notes(patterns, count, 0, (size_t)limit, append_grep_hit, &w) < 0) {
+        jsonw_abort(&w);
+        http_text_response(out, "500 Internal Server Error", "500 Search Failed\r\n");
+        return -1;
+    }
+    jsonw_array_end(&w);
+    return jsonw_finish(&w);
+}
+
+static void append_search_hit(const char* book_name, const char* note_name, double score,
+                              uint32_t line, void* ctx)
+{
+    JsonWriter* w = ctx;
+    jsonw_object_begin(w);
+    jsonw_key(w, "book");
+    jsonw_string(w, book_name);
+    jsonw_key(w, "note");
+    jsonw_string(w, note_name);
+    jsonw_key(w, "score");
+    jsonw_real(w, score);
+    jsonw_key(w, "line");
+    jsonw_integer(w, line);
+    jsonw_object_end(w);
+}
+
+// GET /search?q=query[&limit=N]: best notes for a word query, see terms_search()
+static int handle_search_request(OutBuffer* out, const HttpRequest* req)
+{
+    char query[1024];
+    if (http_query_get(req->query, req->query_len, "q", 0, query, sizeof(query)) < 0) {
+        http_text_response(out, "400 Bad Request", "400 Bad Request - Missing q\r\n");
+        return -1;
+    }
+
+    long limit = SEARCH_DEFAULT_LIMIT;
+    char limit_str[32];
+    if (http_query_get(req->query, req->query_len, "limit", 0, limit_str, sizeof(limit_str)) != -1) {
+        char* end;
+        limit = strtol(limit_str, &end, 10);
+        if (end == limit_str || *end != '\0' || limit < 1 || limit > SEARCH_MAX_LIMIT) {
+            http_text_response(out, "400 Bad Request", "400 Bad Request - Invalid limit\r\n");
+            return -1;
+        }
+    }
+
+    // Hits are written as they are ranked, total is only known afterwards
+    JsonWriter w;
+    jsonw_init(&w, out);
+    jsonw_object_begin(&w);
+    jsonw_key(&w, "query");
+    jsonw_string(&w, query);
+    jsonw_key(&w, "hits");
+    jsonw_array_begin(&w);
+
+    // The refresher thread of terms_start() keeps the index current, queries never build it
+    long total = terms_search(query, 0, (size_t)limit, append_search_hit, &w);
+
+    if (total == TERMS_BAD_QUERY) {
+        jsonw_abort(&w);
+        http_text_response(out, "400 Bad Request", "400 Bad Request - Invalid query\r\n");
+        return -1;
+    }
+    if (total == TERMS_NOT_READY) {
+        jsonw_abort(&w);
+        http_text_response(out, "503 Service Unavailable", "503 Search Index Is Being Built\r\n");
+        return -1;
+    }
+    if (total < 0) {
+        jsonw_abort(&w);
+        http_text_response(out, "500 Internal Server Error", "500 Search Index Unavailable\r\n");
+        return -1;
+    }
+
+    jsonw_array_end(&w);
+    jsonw_key(&w, "total");
+    jsonw_integer(&w, total);
+    jsonw_object_end(&w);
+    return jsonw_finish(&w);
+}
+
+typedef struct FindBuild
+{
+    FindIndex* index;
+    int failed;
+} FindBuild;
+
+static void add_find_note(const char* book_name, const char* note_name, void* ctx)
+{
+    FindBuild* build = ctx;
+    if (build->failed) {
+        return;
+    }
+    // Created on the first note, a current index costs no allocation
+    if (!build->index) {
+        build->index = find_index_create();
+    }
+    if (!build->index || find_index_add(build->index, book_name, note_name) != 0) {
+        build->failed = 1;
+    }
+}
+
+// Swaps in a name index of the current catalog unless the one held is still current
+static int refresh_find_index(void)
+{
+    // Requests arriving during a rebuild wait for it instead of building the same index
+    pthread_mutex_lock(&find_build_lock);
+    FindBuild build = { NULL, 0 };
+    unsigned long long known = __atomic_load_n(&find_generation, __ATOMIC_ACQUIRE);
+    unsigned long long generation = catalog_visit_notes(known, add_find_note, &build);
+    // Names generations start at 1, known only matches once an index was swapped in
+    if (generation == known) {
+        pthread_mutex_unlock(&find_build_lock);
+        return 0;
+    }
+    // A catalog without notes gets an empty index
+    if (!build.failed && !build.index) {
+        build.index = find_index_create();
+        build.failed = !build.index;
+    }
+    if (build.failed || find_index_finish(build.index) != 0) {
+        pthread_mutex_unlock(&find_build_lock);
+        find_index_free(build.index);
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&find_lock);
+    find_index_free(find_index);
+    find_index = build.index;
+    __atomic_store_n(&find_generation, generation, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&find_lock);
+    pthread_mutex_unlock(&find_build_lock);
+    return 0;
+}
+
+static void append_find_match(const char* book_name, const char* note_name, double score, void* ctx)
+{
+    JsonWriter* w = ctx;
+    jsonw_object_begin(w);
+    jsonw_key(w, "book");
+    jsonw_string(w, book_name);
+    jsonw_key(w, "note");
+    jsonw_string(w, note_name);
+    jsonw_key(w, "score");
+    jsonw_real(w, score);
+    jsonw_object_end(w);
+}
+
+// GET /find?name=fragment[&limit=N]: notes whose "book/note" name best matches the fragment
+static int handle_find_request(OutBuffer* out, const HttpRequest* req)
+{
+    char name[FIND_MAX_FRAGMENT + 1];
+    if (http_query_get(req->query, req->query_len, "name", 0, name, sizeof(name)) <= 0) {
+        http_text_response(out, "400 Bad Request", "400 Bad Request - Invalid name\r\n");
+        return -1;
+    }
+
+    long limit = FIND_DEFAULT_LIMIT;
+    char limit_str[32];
+    if (http_query_get(req->query, req->query_len, "limit", 0, limit_str, sizeof(limit_str)) != -1) {
+        char* end;
+        limit = strtol(limit_str, &end, 10);
+        if (end == limit_str || *end != '\0' || limit < 1 || limit > FIND_MAX_LIMIT) {
+            http_text_response(out, "400 Bad Request", "400 Bad Request - Invalid limit\r\n");
+            return -1;
+        }
+    }
+
+    JsonWriter w;
+    jsonw_init(&w, out);
+    jsonw_object_begin(&w);
+    jsonw_key(&w, "name");
+    jsonw_string(&w, name);
+    jsonw_key(&w, "matches");
+    jsonw_array_begin(&w);
+
+    long total = -1;
+    if (catalog_ready()) {
+        if (refresh_find_index() == 0) {
+            pthread_rwlock_rdlock(&find_lock);
+            total = find_index_query(find_index, name, (size_t)limit, append_find_match, &w);
+            pthread_rwlock_unlock(&find_lock);
+        }
+    } else {
+        pthread_mutex_lock(&index_lock);
+        FindIndex* index = find_index_from_books();
+        pthread_mutex_unlock(&index_lock);
+        if (index) {
+            total = find_index_query(index, name, (size_t)limit, append_find_match, &w);
+            find_index_free(index);
+        }
+    }
+
+    if (total == FIND_BAD_FRAGMENT) {
+        jsonw_abort(&w);
+        http_text_response(out, "400 Bad Request", "400 Bad Request - Invalid name\r\n");
+        return -1;
+    }
+    if (total < 0) {
+        jsonw_abort(&w);
+        http_text_response(out, "500 Internal Server Error", "500 Name Index Unavailable\r\n");
+        return -1;
+    }
+
+    jsonw_array_end(&w);
+    jsonw_key(&w, "total");
+    jsonw_integer(&w, total);
+    jsonw_object_end(&w);
+    return jsonw_finish(&w);
+}
+
+// GET /books/{book}?limit=N[&cursor=C][&order=name|mtime]: one page of a book's notes
+static int handle_notes_page_request(OutBuffer* out, const HttpRequest* req, const char* book_name)
+{
+    long limit = PAGE_DEFAULT_LIMIT;
+    char limit_str[32];
+    if (http_query_get(req->query, req->query_len, "limit", 0, limit_str, sizeof(limit_str)) != -1) {
+        char* end;
+        limit = strtol(limit_str, &end, 10);
+        if (end == limit_str || *end != '\0' || limit < 1 || limit > PAGE_MAX_LIMIT) {
+            http_text_response(out, "400 Bad Request", "400 Bad Request - Invalid limit\r\n");
+            return -1;
+        }
+    }
+
+    int order = CATALOG_ORDER_NAME;
+    char order_str[16];
+    int rc = http_query_get(req->query, req->query_len, "order", 0, order_str, sizeof(order_str));
+    if (rc != -1) {
+        if (rc > 0 && strcmp(order_str, "mtime") == 0) {
+            order = CATALOG_ORDER_MTIME;
+        } else if (rc <= 0 || strcmp(order_str, "name") != 0) {
+            http_text_response(out, "400 Bad Request", "400 Bad Request - Invalid order\r\n");
+            return -1;
+        }
+    }
+
+    char cursor[512];
+    rc = http_query_get(req->query, req->query_len, "cursor", 0, cursor, sizeof(cursor));
+    if (rc == -2 || rc == 0) {
+        http_text_response(out, "400 Bad Request", "400 Bad Request - Invalid cursor\r\n");
+        return -1;
+    }
+
+    // Pages come from the sorted catalog, without it only full listings are served
+    if (!catalog_ready()) {
+        http_text_response(out, "500 Internal Server Error", "500 Catalog Unavailable\r\n");
+        return -1;
+    }
+
+    JsonWriter w;
+    Listing listing;
+    if (listing_begin(out, req, &w, book_name, &listing)) {
+        return 0;
+    }
+    rc = catalog_write_notes_page(&w, book_name, order, rc > 0 ? cursor : NULL, (size_t)limit);
+    if (rc == -1) {
+        http_text_response(out, "404 Not Found", "404 No Notes Found\r\n");
+        return -1;
+    }
+    if (rc == -2) {
+        http_text_response(out, "400 Bad Request", "400 Bad Request - Invalid cursor\r\n");
+        return -1;
+    }
+    return listing_finish(&w, &listing);
+}
+
+static int compare_note_names(const void* a, const void* b)
+{
+    return strcmp(((const Note*)a)->name, ((const Note*)b)->name);
+}
+
+static void free_notes(Note* notes, int count)
+{
+    for (int i = 0; i < count; i++) {
+        free(notes[i].name);
+    }
+    free(notes);
+}
+
+// 0 when the book exists, else a 400 or 404 is written
+static int check_book(OutBuffer* out, const char* book_name)
+{
+    if (!is_valid_name(book_name)) {
+        http_text_response(out, "400 Bad Request", "400 Bad Request - Invalid book name\r\n");
+        return -1;
+    }
+    char* default_books_path = get_default_books_path("/books");
+    char book_path[1024];
+    snprintf(book_path, sizeof(book_path), "%s/%s", default_books_path ? default_books_path : "", book_name);
+    free(default_books_path);
+    if (!is_directory(book_path)) {
+        http_text_response(out, "404 Not Found", "404 Book Not Found\r\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Adds a note to a batch, 400 or 500 written on failure
+static int add_batch_note(OutBuffer* out, Note** notes, int* count, int* cap, const char* note_name)
+{
+    if (!is_valid_name(note_name)) {
+        http_text_response(out, "400 Bad Request", "400 Bad Request - Invalid note\r\n");
+        return -1;
+    }
+    if (grow_array((void**)notes, *count, cap, sizeof(Note)) != 0 ||
+        !((*notes)[*count].name = strdup(note_name))) {
+        http_text_response(out, "500 Internal Server Error", "500 Out Of Memory\r\n");
+        return -1;
+    }
+    (*count)++;
+    return 0;
+}
+
+/*
+ * Answers a batch: [{"name": ..., "content": ...}], content null for notes that do not exist.
+ * No notes means the whole book. Takes notes. With tagged, the response gets the catalog's
+ * entity tag and may be compressed, which only GET can use as its target names the notes.
+ */
+static int write_batch(OutBuffer* out, const HttpRequest* req, const char* book_name,
+                       Note* notes, int count, int tagged)
+{
+    if (count == 0) {
+        // The whole book, in the order of the listing
+        free(notes);
+        notes = get_notes_st(book_name, &count);
+        if (!notes) {
+            http_text_response(out, "404 Not Found", "404 No Notes Found\r\n");
+            return -1;
+        }
+        qsort(notes, count, sizeof(Note), compare_note_names);
+    }
+
+    // Only inotify moves the catalog's tag on in-place edits, elsewhere the batch goes out untagged
+#if defined(__linux__)
+    tagged = tagged && catalog_ready();
+#else
+    tagged = 0;
+#endif
+    JsonWriter w;
+    Listing listing;
+    if (tagged && listing_begin(out, req, &w, book_name, &listing)) {
+        free_notes(notes, count);
+        return 0;
+    }
+    if (!tagged) {
+        jsonw_init(&w, out);
+    }
+
+    const char** names = malloc((count ? count : 1) * sizeof(*names));
+    NoteBody** bodies = malloc((count ? count : 1) * sizeof(*bodies));
+    long found = -1;
+    if (names && bodies) {
+        for (int i = 0; i < count; i++) {
+            names[i] = notes[i].name;
+        }
+        found = batch_read_notes(book_name, names, count, 0, BATCH_MAX_BYTES, bodies);
+    }
+    if (found < 0) {
+        free(names);
+        free(bodies);
+        free_notes(notes, count);
+        if (found == -2) {
+            http_text_response(out, "413 Content Too Large", "413 Content Too Large - Ask for fewer notes\r\n");
+        } else {
+            http_text_response(out, "500 Internal Server Error", "500 Out Of Memory\r\n");
+        }
+        return -1;
+    }
+
+    jsonw_array_begin(&w);
+    for (int i = 0; i < count; i++) {
+        jsonw_object_begin(&w);
+        jsonw_key(&w, "name");
+        jsonw_string(&w, notes[i].name);
+        jsonw_key(&w, "content");
+        if (bodies[i]) {
+            jsonw_string_len(&w, bodies[i]->data, bodies[i]->len);
+            notecache_release(bodies[i]);
+        } else {
+            jsonw_null(&w);
+        }
+        jsonw_object_end(&w);
+    }
+    jsonw_array_end(&w);
+    free(names);
+    free(bodies);
+    free_notes(notes, count);
+    return tagged ? listing_finish(&w, &listing) : jsonw_finish(&w);
+}
+
+// GET /book/{book}?include=content[&note=N...]: the named notes, or all of them, with their text
+static int handle_book_content_request(OutBuffer* out, const HttpRequest* req, const char* book_name)
+{
+    if (check_book(out, book_name) != 0) {
+        return -1;
+    }
+    Note* notes = NULL;
+    int count = 0;
+    int cap = 0;
+    char note_name[256];
+    int rc;
+    while ((rc = http_query_get(req->query, req->query_len, "note", count, note_name, sizeof(note_name))) != -1) {
+        if (add_batch_note(out, &notes, &count, &cap, rc > 0 ? note_name : "") != 0) {
+            free_notes(notes, count);
+            return -1;
+        }
+    }
+    return write_batch(out, req, book_name, notes, count, 1);
+}
+
+// POST /batch {"book": B, "notes": [N, ...]}: the same for lists too long for a request target
+static int handle_batch_request(OutBuffer* out, const HttpRequest* req)
+{
+    json_error_t error;
+    json_t* root = json_loadb(req->body ? req->body : "", req->body_len, 0, &error);
+    json_t* book = json_object_get(root, "book");
+    json_t* names = json_object_get(root, "notes");
+    if (!json_is_string(book) || (names && !json_is_array(names))) {
+        json_decref(root);
+        http_text_response(out, "400 Bad Request", "400 Bad Request - Expected {\"book\": ..., \"notes\": [...]}\r\n");
+        return -1;
+    }
+    if (check_book(out, json_string_value(book)) != 0) {
+        json_decref(root);
+        return -1;
+    }
+
+    Note* notes = NULL;
+    int count = 0;
+    int cap = 0;
+    for (size_t i = 0; i < json_array_size(names); i++) {
+        json_t* name = json_array_get(names, i);
+        if (add_batch_note(out, &notes, &count, &cap, json_is_string(name) ? json_string_value(name) : "") != 0) {
+            free_notes(notes, count);
+            json_decref(root);
+            return -1;
+        }
+    }
+    // An empty list asks for nothing, not for the whole book
+    if (names && count == 0) {
+        json_decref(root);
+        JsonWriter w;
+        jsonw_init(&w, out);
+        jsonw_array_begin(&w);
+        jsonw_array_end(&w);
+        return jsonw_finish(&w);
+    }
+    int rc = write_batch(out, req, json_string_value(book), notes, count, 0);
+    json_decref(root);
+    return rc;
+}
+
+// One server-sent event per change, the id is what a reconnecting client sends back
+static int append_change_event(const Change* change, void* ctx)
+{
+    OutBuffer* out = ctx;
+    json_t* data = json_object();
+    if (!data) {
+        return 1;
+    }
+    json_object_set_new(data, "seq", json_integer((json_int_t)change->seq));
+    json_object_set_new(data, "type", json_string(changes_type_name(change->type)));
+    json_object_set_new(data, "time", json_integer((json_int_t)change->time));
+    if (change->book) {
+        json_object_set_new(data, "book", json_string(change->book));
+    }
+    if (change->note) {
+        json_object_set_new(data, "note", json_string(change->note));
+    }
+    if (change->from_book) {
+        json_object_set_new(data, "from_book", json_string(change->from_book));
+    }
+    if (change->from_note) {
+        json_object_set_new(data, "from_note", json_string(change->from_note));
+    }
+    // Compact JSON has no newlines, so it always fits one data line
+    char* text = json_dumps(data, JSON_COMPACT);
+    json_decref(data);
+    if (!text) {
+        return 1;
+    }
+    outbuf_printf(out, "id: %llu\nevent: %s\ndata: %s\n\n", change->seq, changes_type_name(change->type), text);
+    free(text);
+    return 0;
+}
+
+void write_change_events(OutBuffer* out, unsigned long long* seq)
+{
+    *seq = changes_visit(*seq, 0, append_change_event, out);
+}
+
+static int append_change_json(const Change* change, void* ctx)
+{
+    JsonWriter* w = ctx;
+    jsonw_object_begin(w);
+    jsonw_key(w, "seq");
+    jsonw_integer(w, (long long)change->seq);
+    jsonw_key(w, "type");
+    jsonw_string(w, changes_type_name(change->type));
+    jsonw_key(w, "time");
+    jsonw_integer(w, (long long)change->time);
+    if (change->book) {
+        jsonw_key(w, "book");
+        jsonw_string(w, change->book);
+    }
+    if (change->note) {
+        jsonw_key(w, "note");
+        jsonw_string(w, change->note);
+    }
+    if (change->from_book) {
+        jsonw_key(w, "from_book");
+        jsonw_string(w, change->from_book);
+    }
+    if (change->from_note) {
+        jsonw_key(w, "from_note");
+        jsonw_string(w, change->from_note);
+    }
+    jsonw_object_end(w);
+    return 0;
+}
+
+// GET /changes?since=N[&limit=N]: changes after since, oldest first; "next" is the since of the next call
+static int handle_changes_request(OutBuffer* out, const HttpRequest* req)
+{
+    unsigned long long since = 0;
+    char since_str[32];
+    int rc = http_query_get(req->query, req->query_len, "since", 0, since_str, sizeof(since_str));
+    if (rc != -1) {
+        char* end;
+        errno = 0;
+        since = strtoull(since_str, &end, 10);
+        if (rc <= 0 || end == since_str || *end != '\0' || since_str[0] == '-' || errno != 0) {
+            http_text_response(out, "400 Bad Request", "400 Bad Request - Invalid since\r\n");
+            return -1;
+        }
+    }
+
+    long limit = CHANGES_DEFAULT_LIMIT;
+    char limit_str[32];
+    if (http_query_get(req->query, req->query_len, "limit", 0, limit_str, sizeof(limit_str)) != -1) {
+        char* end;
+        limit = strtol(limit_str, &end, 10);
+        if (end == limit_str || *end != '\0' || limit < 1 || limit > CHANGES_MAX_LIMIT) {
+            http_text_response(out, "400 Bad Request", "400 Bad Request - Invalid limit\r\n");
+            return -1;
+        }
+    }
+
+    JsonWriter w;
+    jsonw_init(&w, out);
+    jsonw_headers(&w, "Cache-Control: no-cache\r\n");
+    jsonw_object_begin(&w);
+    jsonw_key(&w, "changes");
+    jsonw_array_begin(&w);
+    unsigned long long next = changes_visit(since, (size_t)limit, append_change_json, &w);
+    jsonw_array_end(&w);
+    jsonw_key(&w, "next");
+    jsonw_integer(&w, (long long)next);
+    jsonw_key(&w, "last");
+    jsonw_integer(&w, (long long)changes_last_seq());
+    jsonw_object_end(&w);
+    return jsonw_finish(&w);
+}
+
+// GET /events: a server-sent event for every change after Last-Event-ID or ?since=, else from now on
+static int handle_events_request(OutBuffer* out, const HttpRequest* req)
+{
+    // Changes are fed by the catalog's watcher
+    if (!catalog_ready()) {
+        http_text_response(out, "500 Internal Server Error", "500 Catalog Unavailable\r\n");
+        return -1;
+    }
+
+    unsigned long long seq = changes_last_seq();
+    char since[32] = {0};
+    const HttpHeader* h = http_find_header(req, "Last-Event-ID");
+    int rc = -1;
+    if (h && h->value_len < sizeof(since)) {
+        memcpy(since, h->value, h->value_len);
+        rc = (int)h->value_len;
+    } else if (!h) {
+        rc = http_query_get(req->query, req->query_len, "since", 0, since, sizeof(since));
+    }
+    if (h || rc != -1) {
+        char* end;
+        errno = 0;
+        unsigned long long v = strtoull(since, &end, 10);
+        if (rc <= 0 || end == since || *end != '\0' || since[0] == '-' || errno != 0) {
+            http_text_response(out, "400 Bad Request", "400 Bad Request - Invalid event id\r\n");
+            return -1;
+        }
+        seq = v;
+    }
+
+    outbuf_printf(out,
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/event-stream\r\n"
+            "Cache-Control: no-cache\r\n"
+            "Connection: close\r\n"
+            "\r\n"
+            "retry: 3000\n\n");
+    // What the client missed goes out with the headers, the server loop pushes the rest
+    write_change_events(out, &seq);
+    out->stream = 1;
+    out->stream_seq = seq;
+    return 0;
+}
+
+static int handle_get_request(OutBuffer* out, const HttpRequest* req, const char* path)
+{
+    if (strcmp(path, "/books") == 0) {
+        JsonWriter w;
+
+        // Served from memory when the catalog is running
+        if (catalog_ready()) {
+            Listing listing;
+            if (listing_begin(out, req, &w, NULL, &listing)) {
+                return 0;
+            }
+            catalog_write_books(&w);
+            return listing_finish(&w, &listing);
+        }
+        jsonw_init(&w, out);
+
+        // Handle books listing
+        int book_count = 0;
+        Book* books = get_books_st(&book_count);
+        if (!books) {
+            http_text_response(out, "404 Not Found", "404 No Books Found\r\n");
+            return -1;
+        }
+
+        jsonw_array_begin(&w);
+        for (int i = 0; i < book_count; i++) {
+            jsonw_object_begin(&w);
+            jsonw_key(&w, "name");
+            jsonw_string(&w, books[i].name);
+            jsonw_key(&w, "notes_count");
+            jsonw_integer(&w, books[i].notes_count);
+            jsonw_object_end(&w);
+        }
+        jsonw_array_end(&w);
+
+        // Free books array
+        for (int i = 0; i < book_count; i++) {
+            free(books[i].name);
+        }
+        free(books);
+        return jsonw_finish(&w);
     }
     else if (strncmp(path, "/books/", 7) == 0) {
         // Handle notes listing for a book
         char book_name[256] = {0};
         strncpy(book_name, path + 7, sizeof(book_name) - 1);
+        if (!is_valid_name(book_name)) {
+            http_text_response(out, "400 Bad Request", "400 Bad Request - Invalid book name\r\n");
+            return -1;
+        }
+
+        char param[1];
+        if (http_query_get(req->query, req->query_len, "limit", 0, param, sizeof(param)) != -1 ||
+            http_query_get(req->query, req->query_len, "cursor", 0, param, sizeof(param)) != -1 ||
+            http_query_get(req->query, req->query_len, "order", 0, param, sizeof(param)) != -1) {
+            return handle_notes_page_request(out, req, book_name);
+        }
+
+        JsonWriter w;
+
+        if (catalog_ready()) {
+            Listing listing;
+            if (listing_begin(out, req, &w, book_name, &listing)) {
+                return 0;
+            }
+            if (catalog_write_notes(&w, book_name) != 0) {
+                http_text_response(out, "404 Not Found", "404 No Notes Found\r\n");
+                return -1;
+            }
+            return listing_finish(&w, &listing);
+        }
+        jsonw_init(&w, out);
 
         int note_count = 0;
         Note* notes = get_notes_st(book_name, &note_count);
         if (!notes) {
-            const char* not_found = "HTTP/1.1 404 Not Found\r\n"
-                                   "Content-Type: text/plain\r\n"
-                                   "\r\n"
-                                   "404 No Notes Found\r\n";
-            write(client_socket, not_found, strlen(not_found));
+            http_text_response(out, "404 Not Found", "404 No Notes Found\r\n");
             return -1;
         }
 
-        json_t* notes_json = notes_to_json(notes, note_count);
-        if (!notes_json) {
-            const char* server_error = "HTTP/1.1 500 Internal Server Error\r\n"
-                                     "Content-Type: text/plain\r\n"
-                                     "\r\n"
-                                     "500 JSON Conversion Failed\r\n";
-            write(client_socket, server_error, strlen(server_error));
-            
-            // Free notes array
-            for (int i = 0; i < note_count; i++) {
-                free(notes[i].name);
-            }
-            free(notes);
-            return -1;
+        jsonw_array_begin(&w);
+        for (int i = 0; i < note_count; i++) {
+            jsonw_object_begin(&w);
+            jsonw_key(&w, "name");
+            jsonw_string(&w, notes[i].name);
+            jsonw_object_end(&w);
         }
+        jsonw_array_end(&w);
 
-        char* json_str = json_dumps(notes_json, JSON_INDENT(2));
-        json_decref(notes_json);
-        
         // Free notes array
         for (int i = 0; i < note_count; i++) {
             free(notes[i].name);
         }
         free(notes);
+        return jsonw_finish(&w);
+    }
+    else if (strcmp(path, "/stats") == 0) {
+        // Per-worker counters, used to check that the load is balanced
+        json_t* stats_json = server_stats_to_json();
+        char* json_str = stats_json ? json_dumps(stats_json, JSON_INDENT(2)) : NULL;
+        json_decref(stats_json);
 
         if (!json_str) {
-            const char* server_error = "HTTP/1.1 500 Internal Server Error\r\n"
-                                     "Content-Type: text/plain\r\n"
-                                     "\r\n"
-                                     "500 JSON Serialization Failed\r\n";
-            write(client_socket, server_error, strlen(server_error));
+            http_text_response(out, "500 Internal Server Error", "500 JSON Serialization Failed\r\n");
             return -1;
         }
 
-        char response_header[512];
-        snprintf(response_header, sizeof(response_header),
+        outbuf_printf(out,
                 "HTTP/1.1 200 OK\r\n"
                 "Content-Type: application/json\r\n"
                 "Content-Length: %zu\r\n"
                 "\r\n",
                 strlen(json_str));
-
-        write(client_socket, response_header, strlen(response_header));
-        write(client_socket, json_str, strlen(json_str));
+        outbuf_append(out, json_str, strlen(json_str));
         free(json_str);
     }
+    else if (strcmp(path, "/stats/cache") == 0) {
+        NoteCacheStats st;
+        notecache_stats(&st);
+
+        JsonWriter w;
+        jsonw_init(&w, out);
+        jsonw_object_begin(&w);
+        jsonw_key(&w, "budget_bytes");
+        jsonw_integer(&w, (long long)st.budget);
+        jsonw_key(&w, "bytes");
+        jsonw_integer(&w, (long long)st.bytes);
+        jsonw_key(&w, "entries");
+        jsonw_integer(&w, (long long)st.entries);
+        jsonw_key(&w, "hits");
+        jsonw_integer(&w, (long long)st.hits);
+        jsonw_key(&w, "misses");
+        jsonw_integer(&w, (long long)st.misses);
+        jsonw_key(&w, "evictions");
+        jsonw_integer(&w, (long long)st.evictions);
+        jsonw_key(&w, "invalidations");
+        jsonw_integer(&w, (long long)st.invalidations);
+        jsonw_object_end(&w);
+        return jsonw_finish(&w);
+    }
+    else if (strcmp(path, "/stats/writes") == 0) {
+        WriteStats st;
+        write_stats(&st);
+
+        JsonWriter w;
+        jsonw_init(&w, out);
+        jsonw_object_begin(&w);
+        jsonw_key(&w, "window_us");
+        jsonw_integer(&w, st.window_us);
+        jsonw_key(&w, "writes");
+        jsonw_integer(&w, (long long)st.writes);
+        jsonw_key(&w, "groups");
+        jsonw_integer(&w, (long long)st.groups);
+        jsonw_key(&w, "syncs");
+        jsonw_integer(&w, (long long)st.syncs);
+        jsonw_object_end(&w);
+        return jsonw_finish(&w);
+    }
+    else if (strcmp(path, "/events") == 0) {
+        return handle_events_request(out, req);
+    }
+    else if (strcmp(path, "/changes") == 0) {
+        return handle_changes_request(out, req);
+    }
+    else if (strcmp(path, "/find") == 0) {
+        // The server runs it off its event loop, see http_request_blocks()
+        return handle_find_request(out, req);
+    }
+    else if (strcmp(path, "/search") == 0) {
+        return handle_search_request(out, req);
+    }
+    else if (strcmp(path, "/grep") == 0) {
+        // The server runs it off its event loop, see http_request_blocks()
+        return handle_grep_request(out, req);
+    }
     else if (strncmp(path, "/book/", 6) == 0) {
+        // A book with ?include=content is a batch of its notes, run off the event loop
+        char include[16];
+        if (!strchr(path + 6, '/') &&
+            http_query_get(req->query, req->query_len, "include", 0, include, sizeof(include)) > 0 &&
+            strcmp(include, "content") == 0) {
+            return handle_book_content_request(out, req, path + 6);
+        }
         // Handle note content request
-        return handle_note_content_request(client_socket, path);
+        return handle_note_content_request_buf(out, req, path);
     }
     else {
-        const char* not_found = "HTTP/1.1 404 Not Found\r\n"
-                               "Content-Type: text/plain\r\n"
-                               "\r\n"
-                               "404 Not Found\r\n";
-        write(client_socket, not_found, strlen(not_found));
+        http_text_response(out, "404 Not Found", "404 Not Found\r\n");
         return -1;
     }
 
     return 0;
 }
 
-int run_http_server()
+int handle_note_content_request(int client_socket, const char* path)
+{
+    OutBuffer out = {0};
+    int rc = handle_note_content_request_buf(&out, NULL, path);
+    outbuf_write_all(client_socket, &out);
+    outbuf_free(&out);
+    return rc;
+}
+
+// 201 or 204 once a write is durable, with the validators of the note written if there is one
+static int written_response(OutBuffer* out, int created, const struct stat* st)
+{
+    char etag[112];
+    char validators[VALIDATORS_SIZE] = "";
+    if (st) {
+        note_validators(st, COMPRESS_IDENTITY, etag, sizeof(etag), validators, sizeof(validators));
+    }
+    if (created) {
+        outbuf_printf(out, "HTTP/1.1 201 Created\r\n%sContent-Length: 0\r\n\r\n", validators);
+    } else {
+        outbuf_printf(out, "HTTP/1.1 204 No Content\r\n%s\r\n", validators);
+    }
+    return 0;
+}
+
+static int write_failed(OutBuffer* out, int err, const char* not_found)
 {
-    int server_fd, client_socket;
-    struct sockaddr_in address;
-    int opt = 1;
-    int addrlen = sizeof(address);
+    if (err == EINVAL || err == ENAMETOOLONG) {
+        http_text_response(out, "400 Bad Request", "400 Bad Request - Invalid name\r\n");
+    } else if (err == ENOENT || err == ENOTDIR) {
+        http_text_response(out, "404 Not Found", not_found);
+    } else if (err == EBUSY) {
+        http_text_response(out, "503 Service Unavailable", "503 Service Unavailable - Unfinished bulk change\r\n");
+    } else {
+        http_text_response(out, "500 Internal Server Error", "500 Internal Server Error - Write failed\r\n");
+    }
+    return -1;
+}
 
-    // Create socket
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("socket failed");
+// POST /bulk {"ops": [{"op": "move_note", "book": B, "note": N, "to_book": B2, "to_note": N2}, ...]}
+static int handle_bulk_request(OutBuffer* out, const HttpRequest* req)
+{
+    static const struct { const char* name; int type; } op_names[] = {
+        { "create_book", BULK_CREATE_BOOK },
+        { "delete_book", BULK_DELETE_BOOK },
+        { "create_note", BULK_CREATE_NOTE },
+        { "delete_note", BULK_DELETE_NOTE },
+        { "move_note", BULK_MOVE_NOTE },
+    };
+    json_error_t error;
+    json_t* root = json_loadb(req->body ? req->body : "", req->body_len, 0, &error);
+    json_t* list = json_object_get(root, "ops");
+    size_t count = json_array_size(list);
+    BulkOp* ops = calloc(count ? count : 1, sizeof(BulkOp));
+    if (!json_is_array(list) || !ops) {
+        free(ops);
+        json_decref(root);
+        http_text_response(out, "400 Bad Request", "400 Bad Request - Expected {\"ops\": [...]}\r\n");
         return -1;
     }
+    for (size_t i = 0; i < count; i++) {
+        json_t* item = json_array_get(list, i);
+        const char* name = json_string_value(json_object_get(item, "op"));
+        for (size_t k = 0; name && k < sizeof(op_names) / sizeof(op_names[0]); k++) {
+            if (strcmp(name, op_names[k].name) == 0) {
+                ops[i].type = op_names[k].type;
+            }
+        }
+        // Missing names are caught by bulk_apply() with the operation's index
+        ops[i].book = json_string_value(json_object_get(item, "book"));
+        ops[i].note = json_string_value(json_object_get(item, "note"));
+        ops[i].to_book = json_string_value(json_object_get(item, "to_book"));
+        ops[i].to_note = json_string_value(json_object_get(item, "to_note"));
+        ops[i].text = json_string_value(json_object_get(item, "text"));
+        ops[i].text_len = ops[i].text ? strlen(ops[i].text) : 0;
+    }
 
-    // Set socket options
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-        perror("setsockopt");
+    size_t failed;
+    size_t applied;
+    int rc = bulk_apply(ops, count, &failed, &applied);
+    int err = errno;
+    free(ops);
+    json_decref(root);
+    if (rc != 0) {
+        const char* status = err == EINVAL || err == ENAMETOOLONG ? "400 Bad Request"
+                           : err == ENOENT || err == ENOTDIR      ? "404 Not Found"
+                           : err == EEXIST                         ? "409 Conflict"
+                           : err == EBUSY                          ? "503 Service Unavailable"
+                                                                   : "500 Internal Server Error";
+        char body[256];
+        // Past the check the rest is replayed from the intent, its books refuse writes until then
+        snprintf(body, sizeof(body), "%s - Operation %zu: %s, %zu of %zu applied%s\r\n",
+                 status, failed, strerror(err), applied, count,
+                 applied > 0 ? ", the books it names refuse writes until the rest is done" : "");
+        http_text_response(out, status, body);
         return -1;
     }
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+    JsonWriter w;
+    jsonw_init(&w, out);
+    jsonw_object_begin(&w);
+    jsonw_key(&w, "applied");
+    jsonw_integer(&w, (long long)applied);
+    jsonw_object_end(&w);
+    return jsonw_finish(&w);
+}
 
-    // Bind socket
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("bind failed");
+// 405 naming the methods the target does allow
+static int method_not_allowed(OutBuffer* out, const char* allow)
+{
+    outbuf_printf(out,
+            "HTTP/1.1 405 Method Not Allowed\r\n"
+            "Allow: %s\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: 24\r\n"
+            "\r\n"
+            "405 Method Not Allowed\r\n",
+            allow);
+    return -1;
+}
+
+// 412 with the validators of the note as it is, so the client can fetch it and retry
+static int precondition_failed(OutBuffer* out, const char* validators)
+{
+    const char* body = "412 Precondition Failed\r\n";
+    outbuf_printf(out,
+            "HTTP/1.1 412 Precondition Failed\r\n"
+            "%s"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: %zu\r\n"
+            "\r\n"
+            "%s",
+            validators, strlen(body), body);
+    return -1;
+}
+
+// If-Match and If-None-Match of a write against the note open on fd, or no note for -1
+static int write_preconditions(OutBuffer* out, const HttpRequest* req, int fd, const struct stat* st)
+{
+    char etag[112] = "";
+    char validators[VALIDATORS_SIZE] = "";
+    if (fd >= 0) {
+        note_validators(st, COMPRESS_IDENTITY, etag, sizeof(etag), validators, sizeof(validators));
+    }
+    const HttpHeader* match = http_find_header(req, "If-Match");
+    const HttpHeader* none_match = http_find_header(req, "If-None-Match");
+    // If-Match compares strongly, a weak tag never allows a write
+    if (match && (fd < 0 || !http_etag_match_strong(match, etag))) {
+        return precondition_failed(out, validators);
+    }
+    if (none_match && fd >= 0 && http_etag_match(none_match, etag)) {
+        return precondition_failed(out, validators);
+    }
+    return 0;
+}
+
+// One edit of a PATCH body as sent, before its lines are turned into bytes
+typedef struct PatchEdit
+{
+    int by_line;
+    long long first;
+    long long count;
+    NoteEdit edit;
+    // Position in the body, edits at one offset apply in this order
+    size_t order;
+} PatchEdit;
+
+static int compare_patch_edits(const void* a, const void* b)
+{
+    const PatchEdit* x = a;
+    const PatchEdit* y = b;
+    if (x->edit.offset != y->edit.offset) {
+        return x->edit.offset < y->edit.offset ? -1 : 1;
+    }
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+// Reads {"edits": [{"line": L, "count": C, "text": T} or {"offset": O, "length": N, "text": T}, ...]}
+static PatchEdit* parse_patch(const json_t* root, size_t* count)
+{
+    json_t* list = json_object_get(root, "edits");
+    size_t n = json_array_size(list);
+    if (!json_is_array(list) || n == 0 || n > PATCH_MAX_EDITS) {
+        return NULL;
+    }
+    PatchEdit* edits = calloc(n, sizeof(PatchEdit));
+    if (!edits) {
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++) {
+        json_t* item = json_array_get(list, i);
+        json_t* text = json_object_get(item, "text");
+        json_t* line = json_object_get(item, "line");
+        json_t* offset = json_object_get(item, "offset");
+        // Line edits replace one line unless told otherwise, byte edits insert
+        json_t* count_field = json_object_get(item, line ? "count" : "length");
+        if (!json_is_string(text) || !line == !offset || !json_is_integer(line ? line : offset) ||
+            (count_field && !json_is_integer(count_field))) {
+            free(edits);
+            return NULL;
+        }
+        PatchEdit* e = &edits[i];
+        e->by_line = line != NULL;
+        e->first = json_integer_value(line ? line : offset);
+        e->count = count_field ? json_integer_value(count_field) : e->by_line;
+        e->edit.text = json_string_value(text);
+        e->edit.text_len = strlen(e->edit.text);
+        e->order = i;
+        if (e->first < 0 || e->count < 0) {
+            free(edits);
+            return NULL;
+        }
+    }
+    *count = n;
+    return edits;
+}
+
+// Turns the edits into sorted byte ranges of the note idx describes, 0 or -1 if one is out of range
+static int locate_edits(PatchEdit* edits, size_t count, const LineIndex* idx)
+{
+    off_t size = idx->st.st_size;
+    for (size_t i = 0; i < count; i++) {
+        PatchEdit* e = &edits[i];
+        if (e->by_line) {
+            // Line lines + 1 is the end of the note, where a count of 0 appends
+            if (e->first < 1 || (unsigned long long)e->first > idx->lines + 1 ||
+                e->count > (long long)(idx->lines + 1 - e->first)) {
+                return -1;
+            }
+            e->edit.offset = lines_offset(idx, e->first);
+            e->edit.length = lines_offset(idx, e->first + e->count) - e->edit.offset;
+        } else {
+            if (e->first > size || e->count > size - e->first) {
+                return -1;
+            }
+            e->edit.offset = e->first;
+            e->edit.length = e->count;
+        }
+    }
+    qsort(edits, count, sizeof(PatchEdit), compare_patch_edits);
+    for (size_t i = 1; i < count; i++) {
+        if (edits[i].edit.offset < edits[i - 1].edit.offset + edits[i - 1].edit.length) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// PATCH /book/{book}/{note}: edits by line or byte range of the version named by If-Match
+static int handle_patch_request(OutBuffer* out, const HttpRequest* req, const char* book_name,
+                                const char* note_name)
+{
+    // Without a version to apply them to, positions in the note mean nothing
+    if (!http_find_header(req, "If-Match")) {
+        http_text_response(out, "428 Precondition Required", "428 Precondition Required - Send If-Match\r\n");
+        return -1;
+    }
+    json_error_t error;
+    json_t* root = json_loadb(req->body ? req->body : "", req->body_len, 0, &error);
+    size_t count = 0;
+    PatchEdit* edits = parse_patch(root, &count);
+    if (!edits) {
+        json_decref(root);
+        http_text_response(out, "400 Bad Request", "400 Bad Request - Expected {\"edits\": [...]}\r\n");
         return -1;
     }
 
-    // Listen for connections
-    if (listen(server_fd, 3) < 0) {
-        perror("listen");
+    // Nothing else in this server writes the note between the check and the rename
+    write_lock_note(book_name, note_name);
+    struct stat st;
+    int fd = open_note(book_name, note_name, &st);
+    int rc = -1;
+    LineIndex* idx = NULL;
+    NoteEdit* byte_edits = NULL;
+    if (fd < 0) {
+        write_failed(out, errno, "404 Note Not Found\r\n");
+    } else if (write_preconditions(out, req, fd, &st) != 0) {
+        // 412 written
+    } else if (!(idx = lines_get(book_name, note_name, fd, &st)) ||
+               !(byte_edits = malloc(count * sizeof(NoteEdit)))) {
+        http_text_response(out, "500 Internal Server Error", "500 Internal Server Error - Out of memory\r\n");
+    } else if (locate_edits(edits, count, idx) != 0) {
+        http_text_response(out, "400 Bad Request", "400 Bad Request - Edit out of range or overlapping\r\n");
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            byte_edits[i] = edits[i].edit;
+        }
+        struct stat new_st;
+        rc = patch_note_durable(book_name, note_name, fd, byte_edits, count, &new_st);
+        if (rc < 0) {
+            write_failed(out, errno, "404 Note Not Found\r\n");
+        } else {
+            // The next PATCH finds its lines in the shifted index instead of reading the note
+            lines_release(lines_apply(book_name, note_name, idx, byte_edits, count, &new_st));
+            written_response(out, rc, &new_st);
+        }
+    }
+    write_unlock_note(book_name, note_name);
+
+    lines_release(idx);
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(byte_edits);
+    free(edits);
+    json_decref(root);
+    return rc < 0 ? -1 : 0;
+}
+
+// PUT, PATCH and DELETE of /book/{book} and /book/{book}/{note}, answered once the change is durable
+static int handle_write_request(OutBuffer* out, const HttpRequest* req, const char* path)
+{
+    char book_name[256] = {0};
+    char note_name[256] = {0};
+    if (split_book_path(path, book_name, note_name, sizeof(book_name)) != 0) {
+        http_text_response(out, "400 Bad Request", "400 Bad Request - Invalid path format\r\n");
         return -1;
     }
+    int put = http_method_is(req, "PUT");
+    // A bulk change left part way is finished before its books take other writes
+    if (bulk_finish(book_name) != 0) {
+        return write_failed(out, errno, "404 Book Not Found\r\n");
+    }
 
-    printf("BSDBook HTTP server running on port %d\n", PORT);
+    if (http_method_is(req, "PATCH")) {
+        if (!note_name[0]) {
+            return method_not_allowed(out, "GET, HEAD, PUT, DELETE");
+        }
+        return handle_patch_request(out, req, book_name, note_name);
+    }
+    if (note_name[0]) {
+        // Conditional writes check the version and replace it under one lock
+        int conditional = http_find_header(req, "If-Match") || http_find_header(req, "If-None-Match");
+        write_lock_note(book_name, note_name);
+        int rc = 0;
+        if (conditional) {
+            struct stat st;
+            int fd = open_note(book_name, note_name, &st);
+            rc = write_preconditions(out, req, fd, &st);
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        if (rc == 0 && put) {
+            struct stat st;
+            rc = write_note_durable(book_name, note_name, req->body, req->body_len, &st);
+            rc = rc < 0 ? write_failed(out, errno, "404 Book Not Found\r\n") : written_response(out, rc, &st);
+        } else if (rc == 0) {
+            rc = delete_note_durable(book_name, note_name) != 0 ? write_failed(out, errno, "404 Note Not Found\r\n")
+                                                                 : written_response(out, 0, NULL);
+        }
+        write_unlock_note(book_name, note_name);
+        return rc;
+    }
+    if (put) {
+        // PUT is idempotent, an existing book is left as it is
+        if (create_book_durable(book_name) == 0) {
+            return written_response(out, 1, NULL);
+        }
+        if (errno == EEXIST) {
+            return written_response(out, 0, NULL);
+        }
+        return write_failed(out, errno, "404 Books Directory Not Found\r\n");
+    }
+    if (delete_book_durable(book_name) != 0) {
+        return write_failed(out, errno, "404 Book Not Found\r\n");
+    }
+    return written_response(out, 0, NULL);
+}
 
-    while (1) {
-        // Accept connection
-        if ((client_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
-            perror("accept");
-            continue;
+int handle_http_request_parsed(OutBuffer* out, const HttpRequest* req)
+{
+    size_t start = out->len;
+    char path[HTTP_MAX_PATH];
+    if (http_url_decode(req->path, req->path_len, path, sizeof(path), 0) < 0) {
+        http_text_response(out, "400 Bad Request", "400 Bad Request\r\n");
+        return -1;
+    }
+
+    // POST /batch takes its list of notes in the body; the server runs it off its event loop
+    if (strcmp(path, "/batch") == 0) {
+        if (!http_method_is(req, "POST")) {
+            return method_not_allowed(out, "POST");
         }
+        return handle_batch_request(out, req);
+    }
 
-        // Read request
-        char buffer[BUFFER_SIZE] = {0};
-        ssize_t bytes_read = read(client_socket, buffer, BUFFER_SIZE - 1);
-        if (bytes_read < 0) {
-            perror("read");
-            close(client_socket);
-            continue;
+    // Applies many writes at once; the server runs it off its event loop like the single ones below
+    if (strcmp(path, "/bulk") == 0) {
+        if (!http_method_is(req, "POST")) {
+            return method_not_allowed(out, "POST");
         }
+        return handle_bulk_request(out, req);
+    }
 
-        // Handle request
-        handle_http_request(client_socket, buffer);
-        close(client_socket);
+    // Waits until the write is synced; the server runs it off its event loop, see http_request_blocks()
+    int book_target = strncmp(path, "/book/", 6) == 0;
+    if (book_target && (http_method_is(req, "PUT") || http_method_is(req, "PATCH") || http_method_is(req, "DELETE"))) {
+        return handle_write_request(out, req, path);
     }
 
-    return 0;
-}
\ No newline at end of file
+    int head = http_method_is(req, "HEAD");
+    if (!head && !http_method_is(req, "GET")) {
+        return method_not_allowed(out, book_target ? "GET, HEAD, PUT, PATCH, DELETE" : "GET, HEAD");
+    }
+
+    int rc = handle_get_request(out, req, path);
+    // HEAD gets the same headers as GET, without the body, and never turns into a stream
+    if (head) {
+        outbuf_drop_body(out, start);
+        out->stream = 0;
+    }
+    return rc;
+}
+
+int http_request_blocks(const HttpRequest* req)
+{
+    char path[HTTP_MAX_PATH];
+    if (http_url_decode(req->path, req->path_len, path, sizeof(path), 0) < 0) {
+        return 0;
+    }
+    // Writes wait for their group's syncs, and only writes waiting together share a group
+    if (strncmp(path, "/book/", 6) == 0 &&
+        (http_method_is(req, "PUT") || http_method_is(req, "PATCH") || http_method_is(req, "DELETE"))) {
+        return 1;
+    }
+    // A bulk change may run thousands of operations, a batch read up to BATCH_MAX_BYTES
+    if ((strcmp(path, "/bulk") == 0 || strcmp(path, "/batch") == 0) && http_method_is(req, "POST")) {
+        return 1;
+    }
+    if (!http_method_is(req, "GET") && !http_method_is(req, "HEAD")) {
+        return 0;
+    }
+    char include[16];
+    if (strncmp(path, "/book/", 6) == 0 && !strchr(path + 6, '/') &&
+        http_query_get(req->query, req->query_len, "include", 0, include, sizeof(include)) > 0 &&
+        strcmp(include, "content") == 0) {
+        return 1;
+    }
+    // /grep reads every note, /find may rebuild the name index and ranks every name
+    return strcmp(path, "/grep") == 0 || strcmp(path, "/find") == 0;
+}
+
+int handle_http_request_buf(OutBuffer* out, const char* request)
+{
+    // The parser decodes chunked bodies in place, work on a private copy
+    size_t len = strlen(request);
+    char* buf = malloc(len + 5);
+    if (!buf) {
+        http_text_response(out, "500 Internal Server Error", "500 Out Of Memory\r\n");
+        return -1;
+    }
+    memcpy(buf, request, len + 1);
+
+    // Accept a bare request line, as older callers pass "GET /books HTTP/1.1"
+    if (!strstr(buf, "\r\n\r\n")) {
+        while (len > 0 && (buf[len - 1] == '\r' || buf[len - 1] == '\n')) {
+            len--;
+        }
+        memcpy(buf + len, "\r\n\r\n", 5);
+        len += 4;
+    }
+
+    HttpParser parser;
+    HttpRequest req;
+    http_parser_init(&parser, 0, 0);
+    int rc = http_parse(&parser, buf, len, &req);
+    if (rc != HTTP_PARSE_DONE) {
+        int status = rc < 0 ? -rc : 400;
+        http_text_response(out, http_status_line(status), "Malformed or incomplete request\r\n");
+        free(buf);
+        return -1;
+    }
+
+    rc = handle_http_request_parsed(out, &req);
+    free(buf);
+    return rc;
+}
+
+int handle_http_request(int client_socket, const char* request)
+{
+    OutBuffer out = {0};
+    int rc = handle_http_request_buf(&out, request);
+    outbuf_write_all(client_socket, &out);
+    outbuf_free(&out);
+    return rc;
+}
+
+int run_http_server()
+{
+    return run_http_server_cfg(NULL);
+}
@@ -6,7 +6,7 @@
  * 	@AUTHOR		      Daniil (TwelveFacedJanus) Ermolaev.
  * 	   | CONTACT:	  twofaced-janus@yandex.ru
  *	@CREATED AT:	  03.30.25
- *	@UPDATED_AT:	  04.03.25
+ *	@UPDATED_AT:	  10.16.26
  *
  *==================================================================================================*/
 
@@ -14,7 +14,11 @@
 #define BSDCORE_H_
 
 
-#define _XOPEN_SOURCE 500
+// glibc hides SO_REUSEPORT, d_type constants and friends under strict X/Open mode,
+// the BSDs expose everything by default.
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
 #define BSDBOOKSERVER_
 #define DEFAULT_BOOKS_PATH "$HOME/books"
 
@@ -23,6 +27,13 @@
 #define BUFFER_SIZE 4096
 #endif // defined(BSDBOOKSERVER_)
 
+// Nanoseconds of a note's mtime, used to tell apart writes within one second
+#if defined(__APPLE__)
+#define NOTE_MTIME_NSEC(st) ((st)->st_mtimespec.tv_nsec)
+#else
+#define NOTE_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#endif
+
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,6 +44,7 @@
 #include <string.h>
 #include <ftw.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <time.h>
 #include <ncurses.h>
 
@@ -40,6 +52,21 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <jansson.h>
+#include "bsdserver.h"
+#include "bsdhttp.h"
+#include "bsdjson.h"
+#include "bsdcatalog.h"
+#include "bsdindex.h"
+#include "bsdscan.h"
+#include "bsdsearch.h"
+#include "bsdterms.h"
+#include "bsdfind.h"
+#include "bsdcompress.h"
+#include "bsdnotecache.h"
+#include "bsdbatch.h"
+#include "bsdchanges.h"
+#include "bsdwrite.h"
+#include "bsdlines.h"
 
 
 /*===============================================================================================
@@ -158,6 +185,7 @@ int create_note(const char* bookname, const char* notename);
  *          - NULL if error occurs
  *     @NOTES:
  *          - Allocates memory for the returned content
+ *          - Holds the whole note in memory, read_note_range() pages through large ones
  *     @EXAMPLE:
  *          ```c
  *          char* content = get_note_content("Programming", "C_Tips");
@@ -169,10 +197,103 @@ int create_note(const char* bookname, const char* notename);
  *     @UPDATES:
  *       04.03.25 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
  *                Implementation of this function moved to bsdcode.c file.
+ *       10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *                Served from the note cache when it is on, names are checked by open_note().
  *
  =========================================================================================*/
 char* get_note_content(const char* book_name, const char* note_name);
 
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Checks that a book or note name is a single path component.
+ *     @DESCRIPTION:
+ *          Rejects empty names, "." and "..", and names containing '/' or control bytes.
+ *     @PARAMETERS:
+ *          - const char* name: Name to check
+ *     @RETURN:
+ *          - 1 if name is safe to join to the books path, 0 otherwise
+ *     @NOTES:
+ *          - Used for names taken from HTTP requests
+ *     @EXAMPLE:
+ *          ```c
+ *          if (!is_valid_name(book_name)) {
+ *              return -1;
+ *          }
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FIX]:
+ *               Control bytes are refused, they would break listings and the journal.
+ *
+ =========================================================================================*/
+int is_valid_name(const char* name);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Opens a note for reading.
+ *     @DESCRIPTION:
+ *          Opens $HOME/books/{book}/{note}.bdsb read-only and fstat()s it.
+ *     @PARAMETERS:
+ *          - const char* book_name: Name of the book
+ *          - const char* note_name: Name of the note (without .bdsb extension)
+ *          - struct stat* st: Filled with the note metadata
+ *     @RETURN:
+ *          - File descriptor (must be closed by caller)
+ *          - -1 if the note does not exist, is not a regular file or a name is invalid
+ *     @NOTES:
+ *          - Lets callers serve the note with sendfile() instead of get_note_content()
+ *     @EXAMPLE:
+ *          ```c
+ *          struct stat st;
+ *          int fd = open_note("Programming", "C_Tips", &st);
+ *          if (fd >= 0) {
+ *              printf("%lld bytes\n", (long long)st.st_size);
+ *              close(fd);
+ *          }
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int open_note(const char* book_name, const char* note_name, struct stat* st);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Reads part of a note.
+ *     @DESCRIPTION:
+ *          Copies up to size bytes starting at offset into buf. Memory stays bounded by buf
+ *          whatever the size of the note, so callers can page through huge ones.
+ *     @PARAMETERS:
+ *          - const char* book_name: Name of the book
+ *          - const char* note_name: Name of the note (without .bdsb extension)
+ *          - off_t offset: First byte to read
+ *          - char* buf: Destination
+ *          - size_t size: Size of buf
+ *     @RETURN:
+ *          - ssize_t: Bytes read, less than size only at the end of the note, 0 past it
+ *          - -1 if the note cannot be opened or read
+ *     @NOTES:
+ *          - buf is not NUL-terminated
+ *     @EXAMPLE:
+ *          ```c
+ *          char buf[65536];
+ *          ssize_t n;
+ *          for (off_t off = 0; (n = read_note_range("Logs", "Crash", off, buf, sizeof(buf))) > 0; off += n) {
+ *              fwrite(buf, 1, n, stdout);
+ *          }
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+ssize_t read_note_range(const char* book_name, const char* note_name, off_t offset, char* buf, size_t size);
+
 
 /* =======================================================================================
  * 
@@ -223,6 +344,8 @@ int create_book(const char* bookname);
  *    		Documentation of this function has been created.
  *      04.03.25 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
  *          Implementation of this function moved to bsdcode.c file.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *          Reads book names from the .bsdindex file, see bsdindex.h.
  *
  *==============================================================================================*/
 void get_books();
@@ -261,6 +384,10 @@ void get_books();
  *    		Documentation for this function has been created.
  *      04.03.25 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
  *          Implementation of this function moved to bsdcode.c file.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *          Single directory pass, entry types come from d_type (fstatat() fallback).
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *          Answered from the .bsdindex file; the directory is read only without an index.
  *
  *==============================================================================================*/
 Book* get_books_st(int* count);
@@ -298,6 +425,11 @@ Book* get_books_st(int* count);
  *               Function created.
  *      04.03.25 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
  *               Implementation of this function moved to bsdcode.c file.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *               Single directory pass, entry types come from d_type (fstatat() fallback).
+ *               An empty book returns an empty array, not NULL.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *               Answered from the .bsdindex file; the directory is read only without an index.
  *
  * =======================================================================================*/
 Note* get_notes_st(const char* bookname, int* count);
@@ -440,7 +572,10 @@ int is_regular_file(const char *path);
  *          - None
  *     @NOTES:
  *          - Uses get_default_books_path() to locate books directory
- *          - Prints results to stdout
+ *          - Tags ('#' followed by tag characters) are looked up in .bsdindex, only notes
+ *            changed since the last run are read; other strings, or tags when the index is
+ *            unavailable, are searched in every note with search_notes() on all CPUs
+ *          - Prints results to stdout, ordered by book, note and line
  *     @EXAMPLE:
  *          ```c
  *          find_by_tag("#important");
@@ -448,6 +583,10 @@ int is_regular_file(const char *path);
  *     @UPDATES:
  *      04.03.25 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
  *               Implementation of this function moved to bsdcode.c file.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *               Answered from the tag postings of .bsdindex (see index_find_tag()).
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *               Full scans run in parallel (see search_notes()).
  *
  =========================================================================================*/
 void find_by_tag(const char* tag);
@@ -498,6 +637,30 @@ void show_todos();
  =========================================================================================*/
 void show_links();
 
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Prints the notes whose "book/note" name best matches a fragment.
+ *     @DESCRIPTION:
+ *          Builds the trigram name index from .bsdindex and prints the FIND_DEFAULT_LIMIT best
+ *          matches, best first, as "book/note". Substring matches rank above fuzzy ones.
+ *     @PARAMETERS:
+ *          - const char* fragment: Part of a book or note name
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - See find_index_query() for the ranking
+ *     @EXAMPLE:
+ *          ```c
+ *          find_notes("pointr");
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void find_notes(const char* fragment);
+
 /* ==============================================================================================
  *
  *     @BRIEF:
@@ -509,7 +672,8 @@ void show_links();
  *     @RETURN:
  *          - None
  *     @NOTES:
- *          - Uses stat() to get file modification time
+ *          - Modification times come from the .bsdindex file (stat() without an index)
+ *          - Only .bdsb notes are listed when the index is used
  *          - Prints to stdout
  *     @EXAMPLE:
  *          ```c
@@ -518,6 +682,8 @@ void show_links();
  *     @UPDATES:
  *      04.03.25 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
  *               Implementation of this function moved to bsdcode.c file.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *               Reads note names and mtimes from the .bsdindex file.
  *
  =========================================================================================*/
 void print_notes_from_book(const char *book_name);
@@ -598,6 +764,7 @@ json_t* notes_to_json(Note* notes, int count);
  *          - 0 on success, -1 on error
  *     @NOTES:
  *          - Returns note content as plain text
+ *          - The body is sent with sendfile(), Content-Length comes from fstat()
  *     @EXAMPLE:
  *          ```c
  *          handle_note_content_request(client_sock, "/book/Programming/C_Tips");
@@ -609,6 +776,38 @@ json_t* notes_to_json(Note* notes, int count);
  =========================================================================================*/
 int handle_note_content_request(int client_socket, const char* path);
 
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Builds the response for a note content request into a buffer.
+ *     @DESCRIPTION:
+ *          Same as handle_note_content_request(), but the response is appended to an
+ *          OutBuffer instead of being written to a socket. The note is tagged with a strong
+ *          ETag made of its inode, size and mtime, and with its Last-Modified date. A request
+ *          whose If-None-Match (or, without it, If-Modified-Since) shows the client's copy is
+ *          current gets a 304 without a body.
+ *     @PARAMETERS:
+ *          - OutBuffer* out: Response buffer
+ *          - const HttpRequest* req: Parsed request, NULL to always send the note
+ *          - const char* path: Request path
+ *     @RETURN:
+ *          - 0 on success, -1 on error
+ *     @NOTES:
+ *          - Used by the event loop in bsdserver.c
+ *     @EXAMPLE:
+ *          ```c
+ *          OutBuffer out = {0};
+ *          handle_note_content_request_buf(&out, req, "/book/Programming/C_Tips");
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *               Conditional requests with ETag and Last-Modified.
+ *
+ =========================================================================================*/
+int handle_note_content_request_buf(OutBuffer* out, const HttpRequest* req, const char* path);
+
 /* ==============================================================================================
  *
  *     @BRIEF:
@@ -621,7 +820,7 @@ int handle_note_content_request(int client_socket, const char* path);
  *     @RETURN:
  *          - 0 on success, -1 on error
  *     @NOTES:
- *          - Now supports /books, /books/{book}, and /book/{book}/{note}
+ *          - Now supports /books, /books/{book}, /book/{book}/{note} and /stats
  *     @EXAMPLE:
  *          ```c
  *          handle_http_request(client_sock, "GET /book/Programming/C_Tips HTTP/1.1");
@@ -633,6 +832,118 @@ int handle_note_content_request(int client_socket, const char* path);
  =========================================================================================*/
 int handle_http_request(int client_socket, const char* request);
 
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Builds the response for an HTTP request into a buffer.
+ *     @DESCRIPTION:
+ *          Routes the request like handle_http_request(), but appends the response to an
+ *          OutBuffer so that it can be sent by a non-blocking event loop.
+ *     @PARAMETERS:
+ *          - OutBuffer* out: Response buffer
+ *          - const char* request: HTTP request string
+ *     @RETURN:
+ *          - 0 on success, -1 on error
+ *     @NOTES:
+ *          - The response is complete even when -1 is returned (error status)
+ *          - The request must be complete, see http_parse() for partial input
+ *     @EXAMPLE:
+ *          ```c
+ *          OutBuffer out = {0};
+ *          handle_http_request_buf(&out, "GET /books HTTP/1.1\r\n\r\n");
+ *          write_all(client_sock, out.data, out.len);
+ *          outbuf_free(&out);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int handle_http_request_buf(OutBuffer* out, const char* request);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Builds the response for an already parsed HTTP request.
+ *     @DESCRIPTION:
+ *          Routes GET and HEAD requests; other methods get 405. The path is percent-decoded
+ *          before routing.
+ *     @PARAMETERS:
+ *          - OutBuffer* out: Response buffer
+ *          - const HttpRequest* req: Request filled by http_parse()
+ *     @RETURN:
+ *          - 0 on success, -1 on error
+ *     @NOTES:
+ *          - Used by the event loop in bsdserver.c
+ *     @EXAMPLE:
+ *          ```c
+ *          if (http_parse(&parser, buf, len, &req) == HTTP_PARSE_DONE) {
+ *              handle_http_request_parsed(&out, &req);
+ *          }
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int handle_http_request_parsed(OutBuffer* out, const HttpRequest* req);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Tells whether a request may take long to answer.
+ *     @DESCRIPTION:
+ *          True for requests that scan every note or name, GET /grep and GET /find, and for
+ *          PUT, PATCH and DELETE on /book/... and POST /bulk, which wait for their group commit,
+ *          and for POST /batch and GET /book/{book}?include=content, which read many notes.
+ *          The server hands them to its slow-request threads instead of answering them on the
+ *          event loop.
+ *     @PARAMETERS:
+ *          - const HttpRequest* req: Request filled by http_parse()
+ *     @RETURN:
+ *          - 1 if handle_http_request_parsed() may block for long, 0 otherwise
+ *     @NOTES:
+ *          - Thread-safe
+ *     @EXAMPLE:
+ *          ```c
+ *          if (!http_request_blocks(&req)) {
+ *              handle_http_request_parsed(&conn->out, &req);
+ *          }
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FIX]:
+ *               Batch reads are run off the event loop too.
+ *
+ =========================================================================================*/
+int http_request_blocks(const HttpRequest* req);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Appends the changes a client has not seen as server-sent events.
+ *     @DESCRIPTION:
+ *          Writes an "id", "event" and JSON "data" line for each change after *seq and moves
+ *          *seq to the last one written. Used by the server loop for GET /events streams.
+ *     @PARAMETERS:
+ *          - OutBuffer* out: Stream output
+ *          - unsigned long long* seq: Last change the client has
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - Nothing is appended when there is nothing new
+ *     @EXAMPLE:
+ *          ```c
+ *          write_change_events(&conn->out, &conn->event_seq);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void write_change_events(OutBuffer* out, unsigned long long* seq);
+
 /* ==============================================================================================
  *
  *     @BRIEF:
@@ -645,7 +956,7 @@ int handle_http_request(int client_socket, const char* request);
  *          - 0 on success, -1 on error
  *     @NOTES:
  *          - Listens on port 8080 by default
- *          - Uses handle_http_request() to process each request
+ *          - Runs the non-blocking event loop, see run_http_server_cfg()
  *     @EXAMPLE:
  *          ```c
  *          int main() {
@@ -655,6 +966,8 @@ int handle_http_request(int client_socket, const char* request);
  *     @UPDATES:
  *      04.03.25 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
  *               Implementation of this function moved to bsdcode.c file.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *               Blocking accept/read/write loop replaced with the epoll/kqueue event loop.
  *
  =========================================================================================*/
 int run_http_server();
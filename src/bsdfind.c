@@ -0,0 +1,467 @@
+#include "./bsdcore.h"
+
+#define TRIGRAM(a, b, c) (((uint32_t)(a) << 16) | ((uint32_t)(b) << 8) | (uint32_t)(c))
+#define RADIX_BITS 12
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+/*
+ * The pool holds, for every note, the lowercased "book/note" name followed by the original
+ * "book\0note\0", so matching never folds case and visitors get the names as they are.
+ * Trigram keys are sorted, the notes of keys[i] are ids[starts[i]] to ids[starts[i + 1]].
+ */
+typedef struct FindEntry
+{
+    uint32_t name;
+    uint16_t len;
+    uint16_t slash;
+    uint32_t grams;
+} FindEntry;
+
+struct FindIndex
+{
+    char* pool;
+    size_t pool_len;
+    size_t pool_cap;
+    FindEntry* entries;
+    uint32_t entries_count;
+    uint32_t entries_cap;
+    uint32_t* keys;
+    uint32_t* starts;
+    uint32_t keys_count;
+    uint32_t* ids;
+};
+
+typedef struct Ranked
+{
+    double score;
+    uint32_t entry;
+} Ranked;
+
+static char lower_byte(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+}
+
+static int is_word_byte(unsigned char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+static int compare_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Sorted distinct trigrams of text into grams, returns their count
+static size_t distinct_trigrams(const char* text, size_t len, uint32_t* grams)
+{
+    if (len < 3) {
+        return 0;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i + 2 < len; i++) {
+        grams[n++] = TRIGRAM((unsigned char)text[i], (unsigned char)text[i + 1],
+                             (unsigned char)text[i + 2]);
+    }
+    if (n > 64) {
+        qsort(grams, n, sizeof(uint32_t), compare_u32);
+    } else {
+        // Names are short, insertion sort beats qsort() and its callback
+        for (size_t i = 1; i < n; i++) {
+            uint32_t g = grams[i];
+            size_t j = i;
+            while (j > 0 && grams[j - 1] > g) {
+                grams[j] = grams[j - 1];
+                j--;
+            }
+            grams[j] = g;
+        }
+    }
+    size_t distinct = 1;
+    for (size_t i = 1; i < n; i++) {
+        if (grams[i] != grams[distinct - 1]) {
+            grams[distinct++] = grams[i];
+        }
+    }
+    return distinct;
+}
+
+FindIndex* find_index_create(void)
+{
+    FindIndex* index = calloc(1, sizeof(FindIndex));
+    if (!index) {
+        perror("calloc");
+    }
+    return index;
+}
+
+int find_index_add(FindIndex* index, const char* book_name, const char* note_name)
+{
+    size_t book_len = strlen(book_name);
+    size_t note_len = strlen(note_name);
+    size_t len = book_len + 1 + note_len;
+    size_t need = index->pool_len + 2 * (len + 1);
+    if (len > UINT16_MAX || need > UINT32_MAX || index->entries_count == UINT32_MAX) {
+        return -1;
+    }
+    if (need > index->pool_cap) {
+        size_t cap = index->pool_cap ? index->pool_cap : 4096;
+        while (cap < need) cap *= 2;
+        char* pool = realloc(index->pool, cap);
+        if (!pool) {
+            perror("realloc");
+            return -1;
+        }
+        index->pool = pool;
+        index->pool_cap = cap;
+    }
+    if (index->entries_count == index->entries_cap) {
+        uint32_t cap = index->entries_cap ? index->entries_cap * 2 : 1024;
+        FindEntry* entries = realloc(index->entries, cap * sizeof(FindEntry));
+        if (!entries) {
+            perror("realloc");
+            return -1;
+        }
+        index->entries = entries;
+        index->entries_cap = cap;
+    }
+
+    char* lowered = index->pool + index->pool_len;
+    char* original = lowered + len + 1;
+    memcpy(original, book_name, book_len + 1);
+    memcpy(original + book_len + 1, note_name, note_len + 1);
+    for (size_t i = 0; i < len; i++) {
+        lowered[i] = i == book_len ? '/' : lower_byte(original[i]);
+    }
+    lowered[len] = '\0';
+
+    index->entries[index->entries_count++] = (FindEntry){
+        .name = (uint32_t)index->pool_len,
+        .len = (uint16_t)len,
+        .slash = (uint16_t)book_len,
+    };
+    index->pool_len = need;
+    return 0;
+}
+
+int find_index_finish(FindIndex* index)
+{
+    size_t pairs_cap = 0;
+    for (uint32_t e = 0; e < index->entries_count; e++) {
+        if (index->entries[e].len >= 3) {
+            pairs_cap += index->entries[e].len - 2;
+        }
+    }
+
+    // (trigram << 32 | entry), appended in entry order so a stable sort by trigram is enough
+    uint64_t* pairs = malloc((pairs_cap ? pairs_cap : 1) * sizeof(uint64_t));
+    uint64_t* sorted = malloc((pairs_cap ? pairs_cap : 1) * sizeof(uint64_t));
+    uint32_t* grams = malloc(UINT16_MAX * sizeof(uint32_t));
+    if (!pairs || !sorted || !grams) {
+        perror("malloc");
+        free(pairs);
+        free(sorted);
+        free(grams);
+        return -1;
+    }
+
+    size_t pairs_count = 0;
+    for (uint32_t e = 0; e < index->entries_count; e++) {
+        FindEntry* entry = &index->entries[e];
+        size_t n = distinct_trigrams(index->pool + entry->name, entry->len, grams);
+        entry->grams = (uint32_t)n;
+        for (size_t i = 0; i < n; i++) {
+            pairs[pairs_count++] = ((uint64_t)grams[i] << 32) | e;
+        }
+    }
+    free(grams);
+
+    // LSD radix sort on the 24 trigram bits, two passes
+    for (int shift = 32; shift < 56; shift += RADIX_BITS) {
+        size_t counts[RADIX_BUCKETS] = {0};
+        for (size_t i = 0; i < pairs_count; i++) {
+            counts[(pairs[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+        }
+        size_t offset = 0;
+        for (int b = 0; b < RADIX_BUCKETS; b++) {
+            size_t c = counts[b];
+            counts[b] = offset;
+            offset += c;
+        }
+        for (size_t i = 0; i < pairs_count; i++) {
+            sorted[counts[(pairs[i] >> shift) & (RADIX_BUCKETS - 1)]++] = pairs[i];
+        }
+        uint64_t* tmp = pairs;
+        pairs = sorted;
+        sorted = tmp;
+    }
+    free(sorted);
+
+    size_t keys_count = 0;
+    for (size_t i = 0; i < pairs_count; i++) {
+        if (i == 0 || (pairs[i] >> 32) != (pairs[i - 1] >> 32)) {
+            keys_count++;
+        }
+    }
+    index->keys = malloc((keys_count ? keys_count : 1) * sizeof(uint32_t));
+    index->starts = malloc((keys_count + 1) * sizeof(uint32_t));
+    index->ids = malloc((pairs_count ? pairs_count : 1) * sizeof(uint32_t));
+    if (!index->keys || !index->starts || !index->ids) {
+        perror("malloc");
+        free(pairs);
+        return -1;
+    }
+
+    size_t k = 0;
+    for (size_t i = 0; i < pairs_count; i++) {
+        uint32_t key = (uint32_t)(pairs[i] >> 32);
+        if (i == 0 || key != index->keys[k - 1]) {
+            index->keys[k] = key;
+            index->starts[k] = (uint32_t)i;
+            k++;
+        }
+        index->ids[i] = (uint32_t)pairs[i];
+    }
+    index->starts[keys_count] = (uint32_t)pairs_count;
+    index->keys_count = (uint32_t)keys_count;
+    free(pairs);
+    return 0;
+}
+
+FindIndex* find_index_from_books(void)
+{
+    int books_count;
+    const IndexBook* books = index_books(&books_count);
+    if (!books) {
+        return NULL;
+    }
+
+    // index_notes() may rewrite the index and move the book table, keep the names
+    char** names = malloc((books_count ? books_count : 1) * sizeof(char*));
+    if (!names) {
+        perror("malloc");
+        return NULL;
+    }
+    for (int i = 0; i < books_count; i++) {
+        names[i] = strdup(index_name(books[i].name));
+    }
+
+    FindIndex* index = find_index_create();
+    for (int i = 0; index && i < books_count; i++) {
+        int notes_count = 0;
+        const IndexNote* notes = names[i] ? index_notes(names[i], &notes_count) : NULL;
+        for (int n = 0; notes && n < notes_count; n++) {
+            if (find_index_add(index, names[i], index_name(notes[n].name)) != 0) {
+                find_index_free(index);
+                index = NULL;
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < books_count; i++) {
+        free(names[i]);
+    }
+    free(names);
+
+    if (index && find_index_finish(index) != 0) {
+        find_index_free(index);
+        index = NULL;
+    }
+    return index;
+}
+
+// Case-folded substring score, 0 when fragment does not occur in the name
+static double substring_score(const FindIndex* index, const FindEntry* entry,
+                              const char* fragment, size_t len)
+{
+    const char* name = index->pool + entry->name;
+    const char* best = NULL;
+    double best_bonus = 0;
+    for (const char* p = strstr(name, fragment); p; p = strstr(p + 1, fragment)) {
+        size_t at = p - name;
+        double bonus = 0;
+        if (at == 0 || !is_word_byte((unsigned char)name[at - 1])) {
+            bonus += 1.0;
+        }
+        if (at > entry->slash) {
+            bonus += 0.5;
+            if (at == (size_t)entry->slash + 1 && at + len == entry->len) {
+                bonus += 1.0;
+            }
+        }
+        if (!best || bonus > best_bonus) {
+            best = p;
+            best_bonus = bonus;
+        }
+    }
+    if (!best) {
+        return 0;
+    }
+    return 2.0 + best_bonus + (double)len / entry->len;
+}
+
+static uint32_t find_key(const FindIndex* index, uint32_t key)
+{
+    uint32_t lo = 0, hi = index->keys_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (index->keys[mid] < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < index->keys_count && index->keys[lo] == key ? lo : UINT32_MAX;
+}
+
+// Ranked order: higher score first, then the order the notes were added
+static int ranked_before(const Ranked* a, const Ranked* b)
+{
+    return a->score > b->score || (a->score == b->score && a->entry < b->entry);
+}
+
+static int compare_ranked(const void* a, const void* b)
+{
+    return ranked_before(a, b) ? -1 : ranked_before(b, a) ? 1 : 0;
+}
+
+// Min-heap of the best matches so far, the worst kept match at the root
+static void heap_push(Ranked* heap, size_t* count, size_t limit, Ranked hit)
+{
+    size_t i;
+    if (*count < limit) {
+        i = (*count)++;
+        while (i > 0 && ranked_before(&heap[(i - 1) / 2], &hit)) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = hit;
+        return;
+    }
+    if (limit == 0 || !ranked_before(&hit, &heap[0])) {
+        return;
+    }
+    i = 0;
+    while (1) {
+        size_t child = 2 * i + 1;
+        if (child >= *count) break;
+        if (child + 1 < *count && ranked_before(&heap[child], &heap[child + 1])) child++;
+        if (!ranked_before(&hit, &heap[child])) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = hit;
+}
+
+long find_index_query(const FindIndex* index, const char* fragment, size_t limit,
+                      FindVisitor visit, void* ctx)
+{
+    size_t len = strlen(fragment);
+    if (len == 0 || len > FIND_MAX_FRAGMENT) {
+        return FIND_BAD_FRAGMENT;
+    }
+    char lowered[FIND_MAX_FRAGMENT + 1];
+    for (size_t i = 0; i <= len; i++) {
+        lowered[i] = lower_byte(fragment[i]);
+    }
+
+    Ranked* heap = malloc((limit ? limit : 1) * sizeof(Ranked));
+    if (!heap) {
+        perror("malloc");
+        return -1;
+    }
+    size_t heap_count = 0;
+    long total = 0;
+
+    uint32_t grams[FIND_MAX_FRAGMENT];
+    size_t grams_count = distinct_trigrams(lowered, len, grams);
+    if (grams_count == 0) {
+        // Nothing to look up, one or two bytes are compared with every name
+        for (uint32_t e = 0; e < index->entries_count; e++) {
+            double score = substring_score(index, &index->entries[e], lowered, len);
+            if (score > 0) {
+                total++;
+                heap_push(heap, &heap_count, limit, (Ranked){ score, e });
+            }
+        }
+    } else {
+        // Shared trigram count per note, fragments have at most 253 distinct trigrams
+        uint8_t* shared = calloc(index->entries_count ? index->entries_count : 1, 1);
+        uint32_t* touched = NULL;
+        size_t touched_count = 0, touched_cap = 0;
+        if (!shared) {
+            perror("calloc");
+            free(heap);
+            return -1;
+        }
+        for (size_t g = 0; g < grams_count; g++) {
+            uint32_t k = find_key(index, grams[g]);
+            if (k == UINT32_MAX) {
+                continue;
+            }
+            for (uint32_t i = index->starts[k]; i < index->starts[k + 1]; i++) {
+                uint32_t e = index->ids[i];
+                if (shared[e]++ != 0) {
+                    continue;
+                }
+                if (touched_count == touched_cap) {
+                    size_t cap = touched_cap ? touched_cap * 2 : 1024;
+                    uint32_t* grown = realloc(touched, cap * sizeof(uint32_t));
+                    if (!grown) {
+                        perror("realloc");
+                        free(touched);
+                        free(shared);
+                        free(heap);
+                        return -1;
+                    }
+                    touched = grown;
+                    touched_cap = cap;
+                }
+                touched[touched_count++] = e;
+            }
+        }
+
+        size_t need = (grams_count + 1) / 2;
+        for (size_t t = 0; t < touched_count; t++) {
+            uint32_t e = touched[t];
+            const FindEntry* entry = &index->entries[e];
+            if (shared[e] < need) {
+                continue;
+            }
+            double score = shared[e] == grams_count ? substring_score(index, entry, lowered, len) : 0;
+            if (score == 0 && grams_count > 1) {
+                // Jaccard similarity of the trigram sets
+                score = (double)shared[e] / (grams_count + entry->grams - shared[e]);
+            }
+            if (score > 0) {
+                total++;
+                heap_push(heap, &heap_count, limit, (Ranked){ score, e });
+            }
+        }
+        free(touched);
+        free(shared);
+    }
+
+    if (heap_count > 1) {
+        qsort(heap, heap_count, sizeof(Ranked), compare_ranked);
+    }
+    for (size_t i = 0; i < heap_count; i++) {
+        const FindEntry* entry = &index->entries[heap[i].entry];
+        const char* book = index->pool + entry->name + entry->len + 1;
+        visit(book, book + entry->slash + 1, heap[i].score, ctx);
+    }
+    free(heap);
+    return total;
+}
+
+void find_index_free(FindIndex* index)
+{
+    if (!index) {
+        return;
+    }
+    free(index->pool);
+    free(index->entries);
+    free(index->keys);
+    free(index->starts);
+    free(index->ids);
+    free(index);
+}
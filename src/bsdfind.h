@@ -0,0 +1,196 @@
+/*=================================================================================================
+ *
+ * 	@FILENAME:	      bsdfind.h
+ * 	@BRIEF:    	      Trigram index for quick-open lookups of notes by name.
+ * 	@DESCRIPTION:	  Every "book/note" name is split into its three-byte substrings. A fragment
+ * 	                  is looked up through the postings of its own trigrams, so only names that
+ * 	                  share some of them are compared, and the matches are ranked: substring
+ * 	                  matches first, then names that share most trigrams (typos, swapped letters).
+ * 	@AUTHOR		      Daniil (TwelveFacedJanus) Ermolaev.
+ * 	   | CONTACT:	  twofaced-janus@yandex.ru
+ *	@CREATED AT:	  10.16.26
+ *	@UPDATED_AT:	  10.16.26
+ *
+ *==================================================================================================*/
+
+#ifndef BSDFIND_H_
+#define BSDFIND_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FIND_MAX_FRAGMENT 255
+#define FIND_DEFAULT_LIMIT 20
+#define FIND_MAX_LIMIT 1000
+
+#define FIND_BAD_FRAGMENT -2
+
+typedef struct FindIndex FindIndex;
+
+/*
+ * Called for each of the best matching notes, best first. note_name is without .bdsb.
+ */
+typedef void (*FindVisitor)(const char* book_name, const char* note_name, double score, void* ctx);
+
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Creates an empty name index.
+ *     @DESCRIPTION:
+ *          Names are added with find_index_add() and the postings are built by
+ *          find_index_finish().
+ *     @PARAMETERS:
+ *          - None
+ *     @RETURN:
+ *          - FindIndex*: New index, NULL if out of memory
+ *     @NOTES:
+ *          - Free it with find_index_free()
+ *     @EXAMPLE:
+ *          ```c
+ *          FindIndex* index = find_index_create();
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+FindIndex* find_index_create(void);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Adds a note to the index.
+ *     @DESCRIPTION:
+ *          The note is indexed as "book_name/note_name". Notes should be added in book and note
+ *          order, equal scores are returned in the order the notes were added.
+ *     @PARAMETERS:
+ *          - FindIndex* index: Index not finished yet
+ *          - const char* book_name: Name of the book
+ *          - const char* note_name: Name of the note without .bdsb
+ *     @RETURN:
+ *          - 0 on success, -1 if out of memory
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          find_index_add(index, "Programming", "C pointers");
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int find_index_add(FindIndex* index, const char* book_name, const char* note_name);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Builds the trigram postings of the added names.
+ *     @DESCRIPTION:
+ *          Trigrams are taken from the ASCII-lowercased names. The (trigram, note) pairs are
+ *          radix sorted, which keeps the notes of a trigram in the order they were added.
+ *     @PARAMETERS:
+ *          - FindIndex* index: Index to finish
+ *     @RETURN:
+ *          - 0 on success, -1 if out of memory
+ *     @NOTES:
+ *          - No name can be added afterwards
+ *     @EXAMPLE:
+ *          ```c
+ *          find_index_finish(index);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int find_index_finish(FindIndex* index);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Builds a finished index of every note from .bsdindex.
+ *     @DESCRIPTION:
+ *          Used by the CLI and by the server when the catalog is not running. Books whose
+ *          directory changed are rescanned by the metadata index first.
+ *     @PARAMETERS:
+ *          - None
+ *     @RETURN:
+ *          - FindIndex*: Finished index, NULL if the books cannot be listed
+ *     @NOTES:
+ *          - Calls the bsdindex functions, callers serialize them
+ *     @EXAMPLE:
+ *          ```c
+ *          FindIndex* index = find_index_from_books();
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+FindIndex* find_index_from_books(void);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Finds the notes whose "book/note" name best matches a fragment.
+ *     @DESCRIPTION:
+ *          Matching ignores ASCII case. A name containing the fragment scores above 2, more
+ *          when the match starts a word, lies in the note name or covers most of the name.
+ *          With a fragment of 4 bytes or more, names that contain at least half of its
+ *          trigrams also match and score their trigram similarity, between 0 and 1. Fragments
+ *          shorter than 3 bytes have no trigram and are compared with every name.
+ *     @PARAMETERS:
+ *          - const FindIndex* index: Finished index
+ *          - const char* fragment: Part of a book or note name, "book/note" narrows to a book
+ *          - size_t limit: Number of best notes passed to visit
+ *          - FindVisitor visit: Called for each of the best notes
+ *          - void* ctx: Passed to visit
+ *     @RETURN:
+ *          - Number of matching notes, which may be more than limit
+ *          - FIND_BAD_FRAGMENT if the fragment is empty or longer than FIND_MAX_FRAGMENT
+ *          - -1 if out of memory
+ *     @NOTES:
+ *          - Read only, any number of threads may query one index
+ *     @EXAMPLE:
+ *          ```c
+ *          static void print_match(const char* book, const char* note, double score, void* ctx)
+ *          {
+ *              printf("%s/%s\n", book, note);
+ *          }
+ *
+ *          find_index_query(index, "pointr", 10, print_match, NULL);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+long find_index_query(const FindIndex* index, const char* fragment, size_t limit,
+                      FindVisitor visit, void* ctx);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Frees a name index.
+ *     @DESCRIPTION:
+ *          Accepts NULL.
+ *     @PARAMETERS:
+ *          - FindIndex* index: Index to free
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          find_index_free(index);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void find_index_free(FindIndex* index);
+
+#endif
@@ -0,0 +1,629 @@
+#include "./bsdcore.h"
+
+#include <limits.h>
+#include <strings.h>
+
+enum
+{
+    HTTP_STATE_HEAD,
+    HTTP_STATE_BODY,
+    HTTP_STATE_CHUNK_SIZE,
+    HTTP_STATE_CHUNK_DATA,
+    HTTP_STATE_CHUNK_CRLF,
+    HTTP_STATE_TRAILER,
+    HTTP_STATE_DONE
+};
+
+static const char* const day_names[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char* const month_names[] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+static int is_tchar(unsigned char c)
+{
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+        return 1;
+    }
+    return c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+static int hex_value(unsigned char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static int value_is(const HttpHeader* h, const char* value)
+{
+    size_t len = strlen(value);
+    return h->value_len == len && strncasecmp(h->value, value, len) == 0;
+}
+
+// Looks for a comma separated token, e.g. "close" in "Connection: keep-alive, close"
+static int value_has_token(const HttpHeader* h, const char* token)
+{
+    size_t len = strlen(token);
+    const char* p = h->value;
+    const char* end = h->value + h->value_len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        const char* start = p;
+        while (p < end && *p != ',') {
+            p++;
+        }
+        const char* stop = p;
+        while (stop > start && (stop[-1] == ' ' || stop[-1] == '\t')) {
+            stop--;
+        }
+        if ((size_t)(stop - start) == len && strncasecmp(start, token, len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void http_parser_init(HttpParser* p, size_t max_header, size_t max_body)
+{
+    memset(p, 0, sizeof(*p));
+    p->state = HTTP_STATE_HEAD;
+    p->max_header = max_header ? max_header : HTTP_MAX_HEADER_SIZE;
+    p->max_body = max_body ? max_body : HTTP_MAX_BODY_SIZE;
+}
+
+/*
+ * Parses request line and headers. The block [buf, buf + head_len) is complete and ends
+ * with an empty line, so every line is guaranteed to be CRLF terminated.
+ */
+static int parse_head(const char* buf, size_t head_len, HttpRequest* req)
+{
+    const char* p = buf;
+    const char* end = buf + head_len;
+
+    memset(req, 0, sizeof(*req));
+    req->content_length = -1;
+
+    // Method
+    req->method = p;
+    while (p < end && is_tchar(*p)) {
+        p++;
+    }
+    req->method_len = p - req->method;
+    if (req->method_len == 0 || *p != ' ') {
+        return HTTP_PARSE_BAD_REQUEST;
+    }
+    p++;
+
+    // Target, split at '?'
+    const char* target = p;
+    while (p < end && (unsigned char)*p > ' ' && *p != 0x7f) {
+        p++;
+    }
+    if (p == target || *p != ' ') {
+        return HTTP_PARSE_BAD_REQUEST;
+    }
+    if ((size_t)(p - target) >= HTTP_MAX_PATH) {
+        return HTTP_PARSE_URI_TOO_LONG;
+    }
+    req->path = target;
+    const char* q = memchr(target, '?', p - target);
+    if (q) {
+        req->path_len = q - target;
+        req->query = q + 1;
+        req->query_len = p - q - 1;
+    } else {
+        req->path_len = p - target;
+    }
+    p++;
+
+    // Version
+    if (end - p < 10 || strncmp(p, "HTTP/", 5) != 0 || p[6] != '.' ||
+        p[5] < '0' || p[5] > '9' || p[7] < '0' || p[7] > '9' || p[8] != '\r' || p[9] != '\n') {
+        return HTTP_PARSE_BAD_REQUEST;
+    }
+    if (p[5] != '1') {
+        return HTTP_PARSE_BAD_VERSION;
+    }
+    req->version_minor = p[7] - '0';
+    p += 10;
+
+    // Headers
+    int te_seen = 0;
+    while (p < end - 2) {
+        if (req->header_count == HTTP_MAX_HEADERS) {
+            return HTTP_PARSE_HEADER_TOO_LARGE;
+        }
+        HttpHeader* h = &req->headers[req->header_count];
+
+        h->name = p;
+        while (is_tchar(*p)) {
+            p++;
+        }
+        h->name_len = p - h->name;
+        // Obsolete line folding and whitespace before the colon are rejected
+        if (h->name_len == 0 || *p != ':') {
+            return HTTP_PARSE_BAD_REQUEST;
+        }
+        p++;
+
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        h->value = p;
+        while (*p != '\r') {
+            if ((unsigned char)*p < ' ' && *p != '\t') {
+                return HTTP_PARSE_BAD_REQUEST;
+            }
+            p++;
+        }
+        const char* value_end = p;
+        while (value_end > h->value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+            value_end--;
+        }
+        h->value_len = value_end - h->value;
+        if (p[1] != '\n') {
+            return HTTP_PARSE_BAD_REQUEST;
+        }
+        p += 2;
+        req->header_count++;
+
+        if (h->name_len == 14 && strncasecmp(h->name, "Content-Length", 14) == 0) {
+            long long value = 0;
+            if (h->value_len == 0 || h->value_len > 18) {
+                return HTTP_PARSE_BAD_REQUEST;
+            }
+            for (size_t i = 0; i < h->value_len; i++) {
+                if (h->value[i] < '0' || h->value[i] > '9') {
+                    return HTTP_PARSE_BAD_REQUEST;
+                }
+                value = value * 10 + (h->value[i] - '0');
+            }
+            if (req->content_length >= 0 && req->content_length != value) {
+                return HTTP_PARSE_BAD_REQUEST;
+            }
+            req->content_length = value;
+        } else if (h->name_len == 17 && strncasecmp(h->name, "Transfer-Encoding", 17) == 0) {
+            if (te_seen || !value_is(h, "chunked")) {
+                return HTTP_PARSE_NOT_IMPLEMENTED;
+            }
+            te_seen = 1;
+            req->chunked = 1;
+        }
+    }
+
+    // Both framings at once is how requests get smuggled past proxies
+    if (req->chunked && req->content_length >= 0) {
+        return HTTP_PARSE_BAD_REQUEST;
+    }
+
+    const HttpHeader* conn = http_find_header(req, "Connection");
+    if (req->version_minor >= 1) {
+        req->keep_alive = !(conn && value_has_token(conn, "close"));
+    } else {
+        req->keep_alive = 0;
+    }
+    return HTTP_PARSE_DONE;
+}
+
+// Decodes as much of a chunked body as is buffered, compacting the data in place
+static int parse_chunked(HttpParser* p, char* buf, size_t len)
+{
+    while (1) {
+        switch (p->state) {
+        case HTTP_STATE_CHUNK_SIZE: {
+            char* line = buf + p->read_pos;
+            size_t avail = len - p->read_pos;
+            char* eol = avail > 1 ? memchr(line, '\r', avail - 1) : NULL;
+            if (!eol) {
+                return avail > HTTP_MAX_CHUNK_LINE ? HTTP_PARSE_BAD_REQUEST : HTTP_PARSE_INCOMPLETE;
+            }
+            if (eol[1] != '\n') {
+                return HTTP_PARSE_BAD_REQUEST;
+            }
+
+            unsigned long long size = 0;
+            char* c = line;
+            int digits = 0;
+            for (; c < eol && hex_value(*c) >= 0; c++, digits++) {
+                if (size > (1ULL << 40)) {
+                    return HTTP_PARSE_BODY_TOO_LARGE;
+                }
+                size = size * 16 + hex_value(*c);
+            }
+            // Chunk extensions are allowed and ignored
+            if (digits == 0 || (c < eol && *c != ';' && *c != ' ' && *c != '\t')) {
+                return HTTP_PARSE_BAD_REQUEST;
+            }
+            p->read_pos = eol + 2 - buf;
+            // Framing is bounded too, or tiny chunks could fill the buffer without a body
+            if (p->read_pos - p->write_pos > HTTP_MAX_CHUNK_FRAMING(p->max_body)) {
+                return HTTP_PARSE_BODY_TOO_LARGE;
+            }
+
+            if (size == 0) {
+                p->state = HTTP_STATE_TRAILER;
+                break;
+            }
+            if (p->write_pos - p->head_len + size > p->max_body) {
+                return HTTP_PARSE_BODY_TOO_LARGE;
+            }
+            p->chunk_left = size;
+            p->state = HTTP_STATE_CHUNK_DATA;
+            break;
+        }
+        case HTTP_STATE_CHUNK_DATA: {
+            size_t avail = len - p->read_pos;
+            size_t n = avail < p->chunk_left ? avail : (size_t)p->chunk_left;
+            if (n == 0) {
+                return HTTP_PARSE_INCOMPLETE;
+            }
+            if (p->write_pos != p->read_pos) {
+                memmove(buf + p->write_pos, buf + p->read_pos, n);
+            }
+            p->write_pos += n;
+            p->read_pos += n;
+            p->chunk_left -= n;
+            if (p->chunk_left == 0) {
+                p->state = HTTP_STATE_CHUNK_CRLF;
+            }
+            break;
+        }
+        case HTTP_STATE_CHUNK_CRLF:
+            if (len - p->read_pos < 2) {
+                return HTTP_PARSE_INCOMPLETE;
+            }
+            if (buf[p->read_pos] != '\r' || buf[p->read_pos + 1] != '\n') {
+                return HTTP_PARSE_BAD_REQUEST;
+            }
+            p->read_pos += 2;
+            p->state = HTTP_STATE_CHUNK_SIZE;
+            break;
+        case HTTP_STATE_TRAILER: {
+            // Trailer fields are skipped up to the terminating empty line
+            size_t avail = len - p->read_pos;
+            char* line = buf + p->read_pos;
+            char* eol = avail > 1 ? memchr(line, '\r', avail - 1) : NULL;
+            if (!eol) {
+                return avail > p->max_header ? HTTP_PARSE_HEADER_TOO_LARGE : HTTP_PARSE_INCOMPLETE;
+            }
+            if (eol[1] != '\n') {
+                return HTTP_PARSE_BAD_REQUEST;
+            }
+            p->read_pos = eol + 2 - buf;
+            if (eol == line) {
+                p->state = HTTP_STATE_DONE;
+                return HTTP_PARSE_DONE;
+            }
+            break;
+        }
+        default:
+            return HTTP_PARSE_BAD_REQUEST;
+        }
+    }
+}
+
+int http_parse(HttpParser* p, char* buf, size_t len, HttpRequest* req)
+{
+    if (p->state == HTTP_STATE_HEAD) {
+        // Resume the terminator search where the previous call stopped
+        size_t from = p->scan;
+        char* end = NULL;
+        for (size_t i = from; i + 3 < len; i++) {
+            if (buf[i] == '\r' && buf[i + 1] == '\n' && buf[i + 2] == '\r' && buf[i + 3] == '\n') {
+                end = buf + i;
+                break;
+            }
+        }
+        if (!end) {
+            p->scan = len > 3 ? len - 3 : 0;
+            return len >= p->max_header ? HTTP_PARSE_HEADER_TOO_LARGE : HTTP_PARSE_INCOMPLETE;
+        }
+
+        p->head_len = end + 4 - buf;
+        if (p->head_len > p->max_header) {
+            return HTTP_PARSE_HEADER_TOO_LARGE;
+        }
+        int rc = parse_head(buf, p->head_len, &p->head);
+        if (rc != HTTP_PARSE_DONE) {
+            return rc;
+        }
+        p->head_base = buf;
+
+        const HttpHeader* expect = http_find_header(&p->head, "Expect");
+        p->expect_continue = expect && value_is(expect, "100-continue");
+
+        p->read_pos = p->write_pos = p->head_len;
+        if (p->head.chunked) {
+            p->state = HTTP_STATE_CHUNK_SIZE;
+        } else {
+            if (p->head.content_length > 0 && (unsigned long long)p->head.content_length > p->max_body) {
+                return HTTP_PARSE_BODY_TOO_LARGE;
+            }
+            p->state = HTTP_STATE_BODY;
+        }
+    }
+
+    if (p->state == HTTP_STATE_BODY) {
+        size_t body_len = p->head.content_length > 0 ? (size_t)p->head.content_length : 0;
+        if (len - p->head_len < body_len) {
+            return HTTP_PARSE_INCOMPLETE;
+        }
+        p->read_pos = p->write_pos = p->head_len + body_len;
+        p->state = HTTP_STATE_DONE;
+    } else if (p->state != HTTP_STATE_DONE) {
+        int rc = parse_chunked(p, buf, len);
+        if (rc != HTTP_PARSE_DONE) {
+            return rc;
+        }
+    }
+
+    // The buffer may have moved while the body was arriving, refresh the header pointers
+    if (p->head_base != buf) {
+        parse_head(buf, p->head_len, &p->head);
+        p->head_base = buf;
+    }
+    *req = p->head;
+    req->body = buf + p->head_len;
+    req->body_len = p->write_pos - p->head_len;
+    req->consumed = p->read_pos;
+    return HTTP_PARSE_DONE;
+}
+
+const HttpHeader* http_find_header(const HttpRequest* req, const char* name)
+{
+    size_t len = strlen(name);
+    for (int i = 0; i < req->header_count; i++) {
+        const HttpHeader* h = &req->headers[i];
+        if (h->name_len == len && strncasecmp(h->name, name, len) == 0) {
+            return h;
+        }
+    }
+    return NULL;
+}
+
+int http_method_is(const HttpRequest* req, const char* method)
+{
+    size_t len = strlen(method);
+    return req->method_len == len && memcmp(req->method, method, len) == 0;
+}
+
+int http_url_decode(const char* src, size_t src_len, char* dst, size_t dst_size, int plus_is_space)
+{
+    size_t out = 0;
+    for (size_t i = 0; i < src_len; i++) {
+        char c = src[i];
+        if (c == '%') {
+            if (i + 2 >= src_len) {
+                return -1;
+            }
+            int hi = hex_value(src[i + 1]);
+            int lo = hex_value(src[i + 2]);
+            if (hi < 0 || lo < 0) {
+                return -1;
+            }
+            c = (char)(hi * 16 + lo);
+            i += 2;
+        } else if (c == '+' && plus_is_space) {
+            c = ' ';
+        }
+        if (c == '\0' || out + 1 >= dst_size) {
+            return -1;
+        }
+        dst[out++] = c;
+    }
+    if (dst_size == 0) {
+        return -1;
+    }
+    dst[out] = '\0';
+    return (int)out;
+}
+
+int http_query_get(const char* query, size_t query_len, const char* name, int nth, char* dst, size_t dst_size)
+{
+    size_t name_len = strlen(name);
+    const char* end = query ? query + query_len : NULL;
+    for (const char* p = query; p && p < end; ) {
+        const char* amp = memchr(p, '&', end - p);
+        const char* field_end = amp ? amp : end;
+        const char* eq = memchr(p, '=', field_end - p);
+        const char* key_end = eq ? eq : field_end;
+
+        if ((size_t)(key_end - p) == name_len && memcmp(p, name, name_len) == 0 && nth-- == 0) {
+            const char* value = eq ? eq + 1 : field_end;
+            int len = http_url_decode(value, field_end - value, dst, dst_size, 1);
+            return len < 0 ? -2 : len;
+        }
+        p = amp ? amp + 1 : end;
+    }
+    return -1;
+}
+
+const char* http_status_line(int status)
+{
+    switch (status) {
+    case 100: return "100 Continue";
+    case 200: return "200 OK";
+    case 201: return "201 Created";
+    case 204: return "204 No Content";
+    case 206: return "206 Partial Content";
+    case 304: return "304 Not Modified";
+    case 400: return "400 Bad Request";
+    case 404: return "404 Not Found";
+    case 405: return "405 Method Not Allowed";
+    case 409: return "409 Conflict";
+    case 412: return "412 Precondition Failed";
+    case 413: return "413 Content Too Large";
+    case 414: return "414 URI Too Long";
+    case 416: return "416 Range Not Satisfiable";
+    case 428: return "428 Precondition Required";
+    case 431: return "431 Request Header Fields Too Large";
+    case 501: return "501 Not Implemented";
+    case 505: return "505 HTTP Version Not Supported";
+    default:  return "500 Internal Server Error";
+    }
+}
+
+int http_format_date(time_t t, char* dst, size_t dst_size)
+{
+    struct tm tm;
+    if (!gmtime_r(&t, &tm) || tm.tm_year + 1900 < 0 || tm.tm_year + 1900 > 9999) {
+        return -1;
+    }
+    int n = snprintf(dst, dst_size, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+                     day_names[tm.tm_wday], tm.tm_mday, month_names[tm.tm_mon],
+                     tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    return n > 0 && (size_t)n < dst_size ? n : -1;
+}
+
+// Reads exactly n digits
+static int parse_digits(const char* s, int n, int* value)
+{
+    *value = 0;
+    for (int i = 0; i < n; i++) {
+        if (s[i] < '0' || s[i] > '9') {
+            return -1;
+        }
+        *value = *value * 10 + (s[i] - '0');
+    }
+    return 0;
+}
+
+int http_parse_date(const char* s, size_t len, time_t* t)
+{
+    // "Sun, 06 Nov 1994 08:49:37 GMT"
+    if (len != 29 || s[3] != ',' || s[4] != ' ' || s[7] != ' ' || s[11] != ' ' ||
+        s[16] != ' ' || s[19] != ':' || s[22] != ':' || memcmp(s + 25, " GMT", 4) != 0) {
+        return -1;
+    }
+
+    struct tm tm = {0};
+    int year;
+    tm.tm_mon = -1;
+    for (int i = 0; i < 12; i++) {
+        if (memcmp(s + 8, month_names[i], 3) == 0) {
+            tm.tm_mon = i;
+        }
+    }
+    if (tm.tm_mon < 0 ||
+        parse_digits(s + 5, 2, &tm.tm_mday) != 0 || parse_digits(s + 12, 4, &year) != 0 ||
+        parse_digits(s + 17, 2, &tm.tm_hour) != 0 || parse_digits(s + 20, 2, &tm.tm_min) != 0 ||
+        parse_digits(s + 23, 2, &tm.tm_sec) != 0) {
+        return -1;
+    }
+    if (tm.tm_mday < 1 || tm.tm_mday > 31 || tm.tm_hour > 23 || tm.tm_min > 59 || tm.tm_sec > 60) {
+        return -1;
+    }
+    tm.tm_year = year - 1900;
+    *t = timegm(&tm);
+    return 0;
+}
+
+// Weakly, a W/ prefix on either side is ignored; strongly, a weak tag never matches
+static int etag_match(const HttpHeader* h, const char* etag, int weak)
+{
+    int etag_weak = etag[0] == 'W' && etag[1] == '/';
+    if (etag_weak) {
+        etag += 2;
+    }
+    size_t etag_len = strlen(etag);
+
+    const char* p = h->value;
+    const char* end = h->value + h->value_len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+        if (*p == '*') {
+            return 1;
+        }
+        int tag_weak = end - p > 2 && p[0] == 'W' && p[1] == '/';
+        if (tag_weak) {
+            p += 2;
+        }
+        // An entity tag is a quoted string without escapes, so the closing quote ends it
+        if (*p != '"') {
+            return 0;
+        }
+        const char* close = memchr(p + 1, '"', end - p - 1);
+        if (!close) {
+            return 0;
+        }
+        if ((weak || (!tag_weak && !etag_weak)) &&
+            (size_t)(close + 1 - p) == etag_len && memcmp(p, etag, etag_len) == 0) {
+            return 1;
+        }
+        p = close + 1;
+    }
+    return 0;
+}
+
+int http_etag_match(const HttpHeader* h, const char* etag)
+{
+    return etag_match(h, etag, 1);
+}
+
+int http_etag_match_strong(const HttpHeader* h, const char* etag)
+{
+    return etag_match(h, etag, 0);
+}
+
+// Decimal number at *p, saturating instead of overflowing; -1 if there are no digits
+static long long parse_position(const char** p, const char* end)
+{
+    const char* start = *p;
+    long long v = 0;
+    for (; *p < end && **p >= '0' && **p <= '9'; (*p)++) {
+        int digit = **p - '0';
+        v = v > (LLONG_MAX - digit) / 10 ? LLONG_MAX : v * 10 + digit;
+    }
+    return *p == start ? -1 : v;
+}
+
+int http_parse_range(const HttpHeader* h, long long size, long long* first, long long* last)
+{
+    const char* p = h->value;
+    const char* end = h->value + h->value_len;
+    if (end - p < 6 || strncasecmp(p, "bytes=", 6) != 0) {
+        return 0;
+    }
+    p += 6;
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+
+    long long from = parse_position(&p, end);
+    if (p == end || *p != '-') {
+        return 0;
+    }
+    p++;
+    long long to = parse_position(&p, end);
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    // Anything left, a second range included, and the header is ignored
+    if (p != end || (from < 0 && to < 0) || (from >= 0 && to >= 0 && to < from)) {
+        return 0;
+    }
+
+    if (from < 0) {
+        // Suffix: the last to bytes
+        if (to == 0 || size == 0) {
+            return -1;
+        }
+        *first = to < size ? size - to : 0;
+        *last = size - 1;
+        return 1;
+    }
+    if (from >= size) {
+        return -1;
+    }
+    *first = from;
+    *last = to >= 0 && to < size ? to : size - 1;
+    return 1;
+}
@@ -0,0 +1,510 @@
+/*=================================================================================================
+ *
+ * 	@FILENAME:	      bsdhttp.h
+ * 	@BRIEF:    	      Incremental HTTP/1.x request parser for bsdbook server.
+ * 	@DESCRIPTION:	  Parses request line, headers and Content-Length/chunked bodies across
+ * 	                  partial reads without allocating memory.
+ * 	@AUTHOR		      Daniil (TwelveFacedJanus) Ermolaev.
+ * 	   | CONTACT:	  twofaced-janus@yandex.ru
+ *	@CREATED AT:	  10.16.26
+ *	@UPDATED_AT:	  10.16.26
+ *
+ *==================================================================================================*/
+
+#ifndef BSDHTTP_H_
+#define BSDHTTP_H_
+
+#include <stddef.h>
+#include <time.h>
+
+#define HTTP_MAX_HEADERS 32
+#define HTTP_MAX_HEADER_SIZE 16384
+#define HTTP_MAX_BODY_SIZE (8 * 1024 * 1024)
+#define HTTP_MAX_PATH 1024
+#define HTTP_MAX_CHUNK_LINE 1024
+// Chunk size lines and CRLFs a chunked body may spend on top of its decoded bytes
+#define HTTP_MAX_CHUNK_FRAMING(max_body) ((max_body) / 8 + HTTP_MAX_CHUNK_LINE)
+#define HTTP_DATE_SIZE 32
+
+#define HTTP_PARSE_INCOMPLETE 0
+#define HTTP_PARSE_DONE 1
+// Errors are the negated status code that should be answered
+#define HTTP_PARSE_BAD_REQUEST -400
+#define HTTP_PARSE_BODY_TOO_LARGE -413
+#define HTTP_PARSE_URI_TOO_LONG -414
+#define HTTP_PARSE_HEADER_TOO_LARGE -431
+#define HTTP_PARSE_NOT_IMPLEMENTED -501
+#define HTTP_PARSE_BAD_VERSION -505
+
+
+/*===============================================================================================
+ *
+ * 	@BRIEF:
+ * 		One request header.
+ * 	@DESCRIPTION:
+ * 		Points into the connection buffer, strings are not NUL-terminated.
+ * 	@PARAMETERS:
+ * 		HttpHeader.name      - const char*;
+ * 		HttpHeader.name_len  - size_t;
+ * 		HttpHeader.value     - const char*, leading and trailing whitespace removed;
+ * 		HttpHeader.value_len - size_t.
+ * 	@RETURN:
+ * 		None.
+ * 	@NOTES:
+ * 		None.
+ * 	@EXAMPLE:
+ * 		None.
+ * 	@UPDATES:
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *	 	      Struct has been created.
+ *
+ * =============================================================================================*/
+typedef struct HttpHeader
+{
+	const char* name;
+	size_t name_len;
+	const char* value;
+	size_t value_len;
+} HttpHeader;
+
+/*===============================================================================================
+ *
+ * 	@BRIEF:
+ * 		Parsed HTTP request.
+ * 	@DESCRIPTION:
+ * 		Filled by http_parse() once the whole request, including its body, is buffered.
+ * 		All pointers refer to the buffer that was passed to http_parse().
+ * 	@PARAMETERS:
+ * 		HttpRequest.method, method_len   - request method ("GET", "HEAD", ...);
+ * 		HttpRequest.path, path_len       - request target without the query string;
+ * 		HttpRequest.query, query_len     - text after '?', NULL if there is none;
+ * 		HttpRequest.version_minor        - 0 for HTTP/1.0, 1 for HTTP/1.1;
+ * 		HttpRequest.headers, header_count;
+ * 		HttpRequest.content_length       - declared body length, -1 if none;
+ * 		HttpRequest.chunked              - 1 if the body used chunked transfer encoding;
+ * 		HttpRequest.keep_alive           - 1 if the connection may be reused;
+ * 		HttpRequest.body, body_len       - decoded body;
+ * 		HttpRequest.consumed             - raw bytes the request occupied in the buffer.
+ * 	@RETURN:
+ * 		None.
+ * 	@NOTES:
+ * 		None.
+ * 	@EXAMPLE:
+ * 		None.
+ * 	@UPDATES:
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *	 	      Struct has been created.
+ *
+ * =============================================================================================*/
+typedef struct HttpRequest
+{
+	const char* method;
+	size_t method_len;
+	const char* path;
+	size_t path_len;
+	const char* query;
+	size_t query_len;
+	int version_minor;
+	HttpHeader headers[HTTP_MAX_HEADERS];
+	int header_count;
+	long long content_length;
+	int chunked;
+	int keep_alive;
+	const char* body;
+	size_t body_len;
+	size_t consumed;
+} HttpRequest;
+
+/*===============================================================================================
+ *
+ * 	@BRIEF:
+ * 		Resumable parser state, one per connection.
+ * 	@DESCRIPTION:
+ * 		Remembers how far the buffer has been examined, so each call only looks at bytes that
+ * 		arrived since the previous one. Chunked bodies are decoded in place.
+ * 	@PARAMETERS:
+ * 		HttpParser.state           - current parser state;
+ * 		HttpParser.scan            - offset where the header terminator search resumes;
+ * 		HttpParser.head_len        - size of request line and headers, 0 until complete;
+ * 		HttpParser.read_pos        - raw body bytes consumed so far;
+ * 		HttpParser.write_pos       - end of the decoded body;
+ * 		HttpParser.chunk_left      - bytes left in the current chunk;
+ * 		HttpParser.max_header      - header size limit;
+ * 		HttpParser.max_body        - body size limit;
+ * 		HttpParser.expect_continue - 1 if the client sent "Expect: 100-continue";
+ * 		HttpParser.head            - parsed request line and headers;
+ * 		HttpParser.head_base       - buffer the head pointers refer to.
+ * 	@RETURN:
+ * 		None.
+ * 	@NOTES:
+ * 		Reset with http_parser_init() after every request.
+ * 	@EXAMPLE:
+ * 		None.
+ * 	@UPDATES:
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *	 	      Struct has been created.
+ *
+ * =============================================================================================*/
+typedef struct HttpParser
+{
+	int state;
+	size_t scan;
+	size_t head_len;
+	size_t read_pos;
+	size_t write_pos;
+	unsigned long long chunk_left;
+	size_t max_header;
+	size_t max_body;
+	int expect_continue;
+	const char* head_base;
+	HttpRequest head;
+} HttpParser;
+
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Resets a parser before a new request.
+ *     @DESCRIPTION:
+ *          Sets the header and body size limits, zero selects the defaults.
+ *     @PARAMETERS:
+ *          - HttpParser* p: Parser to reset
+ *          - size_t max_header: Header limit (HTTP_MAX_HEADER_SIZE)
+ *          - size_t max_body: Body limit (HTTP_MAX_BODY_SIZE)
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          http_parser_init(&conn->parser, 0, 0);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void http_parser_init(HttpParser* p, size_t max_header, size_t max_body);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Feeds the buffered bytes of a connection to the parser.
+ *     @DESCRIPTION:
+ *          Call after every read with the whole buffer (the request starts at buf[0]). Work
+ *          done by earlier calls is not repeated. When the request is complete, req is filled
+ *          and req->consumed tells how many bytes to drop from the front of the buffer; any
+ *          bytes after that belong to the next pipelined request.
+ *     @PARAMETERS:
+ *          - HttpParser* p: Parser state
+ *          - char* buf: Connection buffer, modified in place when decoding chunked bodies
+ *          - size_t len: Bytes in the buffer
+ *          - HttpRequest* req: Filled when HTTP_PARSE_DONE is returned
+ *     @RETURN:
+ *          - HTTP_PARSE_DONE when a complete request is available
+ *          - HTTP_PARSE_INCOMPLETE when more bytes are needed
+ *          - HTTP_PARSE_* error (negated status code) for malformed or oversized requests
+ *     @NOTES:
+ *          - The buffer may be reallocated between calls
+ *          - Never allocates memory
+ *     @EXAMPLE:
+ *          ```c
+ *          HttpRequest req;
+ *          int rc = http_parse(&conn->parser, conn->in, conn->in_len, &req);
+ *          if (rc == HTTP_PARSE_DONE) {
+ *              handle_http_request_parsed(&conn->out, &req);
+ *          }
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int http_parse(HttpParser* p, char* buf, size_t len, HttpRequest* req);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Finds a request header by name.
+ *     @DESCRIPTION:
+ *          Case-insensitive lookup, returns the first match.
+ *     @PARAMETERS:
+ *          - const HttpRequest* req: Parsed request
+ *          - const char* name: Header name
+ *     @RETURN:
+ *          - const HttpHeader*: Matching header
+ *          - NULL if the header is absent
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          const HttpHeader* h = http_find_header(req, "If-None-Match");
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+const HttpHeader* http_find_header(const HttpRequest* req, const char* name);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Compares the request method.
+ *     @DESCRIPTION:
+ *          Methods are case-sensitive.
+ *     @PARAMETERS:
+ *          - const HttpRequest* req: Parsed request
+ *          - const char* method: Method to compare with
+ *     @RETURN:
+ *          - 1 if equal, 0 otherwise
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          if (http_method_is(req, "HEAD")) {
+ *              ...;
+ *          }
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int http_method_is(const HttpRequest* req, const char* method);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Percent-decodes a URL component into a NUL-terminated string.
+ *     @DESCRIPTION:
+ *          Decodes %XX escapes; '+' is decoded to a space when plus_is_space is set (query
+ *          strings).
+ *     @PARAMETERS:
+ *          - const char* src: Encoded text
+ *          - size_t src_len: Length of encoded text
+ *          - char* dst: Output buffer
+ *          - size_t dst_size: Size of output buffer
+ *          - int plus_is_space: 1 for query strings, 0 for paths
+ *     @RETURN:
+ *          - Decoded length on success
+ *          - -1 on malformed escape, embedded NUL or if dst is too small
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          char path[HTTP_MAX_PATH];
+ *          http_url_decode(req->path, req->path_len, path, sizeof(path), 0);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int http_url_decode(const char* src, size_t src_len, char* dst, size_t dst_size, int plus_is_space);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Reads a query string parameter.
+ *     @DESCRIPTION:
+ *          Finds the nth occurrence of name in a query string ("a=1&b=2&a=3") and
+ *          percent-decodes its value, '+' becoming a space. A parameter without '=' has an
+ *          empty value.
+ *     @PARAMETERS:
+ *          - const char* query: Query string without the '?', may be NULL
+ *          - size_t query_len: Length of query
+ *          - const char* name: Parameter name
+ *          - int nth: Occurrence to return, 0 for the first
+ *          - char* dst: Output buffer
+ *          - size_t dst_size: Size of output buffer
+ *     @RETURN:
+ *          - Decoded length on success
+ *          - -1 if the parameter is absent
+ *          - -2 if the value is malformed or does not fit in dst
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          char q[256];
+ *          for (int i = 0; http_query_get(req->query, req->query_len, "q", i, q, sizeof(q)) >= 0; i++) {
+ *              printf("q=%s\n", q);
+ *          }
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int http_query_get(const char* query, size_t query_len, const char* name, int nth, char* dst, size_t dst_size);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Returns the reason phrase for a status code.
+ *     @DESCRIPTION:
+ *          Used to answer parse errors, e.g. 431 -> "431 Request Header Fields Too Large".
+ *     @PARAMETERS:
+ *          - int status: Status code
+ *     @RETURN:
+ *          - const char*: Status line text
+ *     @NOTES:
+ *          - Unknown codes map to "500 Internal Server Error"
+ *     @EXAMPLE:
+ *          ```c
+ *          http_text_response(out, http_status_line(-rc), "Bad request\r\n");
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+const char* http_status_line(int status);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Formats a time as an HTTP date.
+ *     @DESCRIPTION:
+ *          Writes the IMF-fixdate form used by Last-Modified, e.g.
+ *          "Sun, 06 Nov 1994 08:49:37 GMT". Day and month names do not depend on the locale.
+ *     @PARAMETERS:
+ *          - time_t t: Time to format
+ *          - char* dst: Output buffer
+ *          - size_t dst_size: Size of dst, HTTP_DATE_SIZE is enough
+ *     @RETURN:
+ *          - Length of the date
+ *          - -1 if dst is too small or the year does not fit the format
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          char date[HTTP_DATE_SIZE];
+ *          http_format_date(st.st_mtime, date, sizeof(date));
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int http_format_date(time_t t, char* dst, size_t dst_size);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Parses an HTTP date.
+ *     @DESCRIPTION:
+ *          Accepts the IMF-fixdate form that http_format_date() writes and that current clients
+ *          send in If-Modified-Since.
+ *     @PARAMETERS:
+ *          - const char* s: Header value, not NUL-terminated
+ *          - size_t len: Length of s
+ *          - time_t* t: Parsed time
+ *     @RETURN:
+ *          - 0 on success, -1 if s is not a valid date
+ *     @NOTES:
+ *          - Obsolete RFC 850 and asctime() dates are rejected, callers then ignore the header
+ *     @EXAMPLE:
+ *          ```c
+ *          time_t since;
+ *          if (http_parse_date(h->value, h->value_len, &since) == 0) {
+ *              ...;
+ *          }
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int http_parse_date(const char* s, size_t len, time_t* t);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Checks an entity tag against an If-None-Match header.
+ *     @DESCRIPTION:
+ *          The header holds "*" or a comma separated list of entity tags. Tags are compared
+ *          weakly, as If-None-Match requires: a W/ prefix on either side is ignored.
+ *     @PARAMETERS:
+ *          - const HttpHeader* h: If-None-Match header
+ *          - const char* etag: Current entity tag, quotes included
+ *     @RETURN:
+ *          - 1 if the header matches etag, 0 otherwise
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          const HttpHeader* h = http_find_header(req, "If-None-Match");
+ *          if (h && http_etag_match(h, "\"1f-3a\"")) {
+ *              ...;
+ *          }
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int http_etag_match(const HttpHeader* h, const char* etag);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Checks an entity tag against an If-Match header.
+ *     @DESCRIPTION:
+ *          Like http_etag_match(), but tags are compared strongly, as If-Match requires: a weak
+ *          tag on either side never matches, so a write is not allowed on a tag that only says
+ *          two representations are equivalent.
+ *     @PARAMETERS:
+ *          - const HttpHeader* h: If-Match header
+ *          - const char* etag: Current entity tag, quotes included
+ *     @RETURN:
+ *          - 1 if the header is "*" or holds etag as a strong tag, 0 otherwise
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          const HttpHeader* h = http_find_header(req, "If-Match");
+ *          if (h && !http_etag_match_strong(h, "\"1f-3a\"")) {
+ *              ...;
+ *          }
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int http_etag_match_strong(const HttpHeader* h, const char* etag);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Parses a Range header.
+ *     @DESCRIPTION:
+ *          Understands one byte range: "bytes=first-last", "bytes=first-" or "bytes=-suffix".
+ *          last is clamped to the end of the representation.
+ *     @PARAMETERS:
+ *          - const HttpHeader* h: Range header
+ *          - long long size: Length of the representation
+ *          - long long* first: First byte of the range
+ *          - long long* last: Last byte of the range, inclusive
+ *     @RETURN:
+ *          - 1 if first and last were set
+ *          - 0 if the header is to be ignored: malformed, another unit or several ranges
+ *          - -1 if the range starts past the end, answered with 416
+ *     @NOTES:
+ *          - Serving the whole representation instead of several ranges is allowed by RFC 9110
+ *     @EXAMPLE:
+ *          ```c
+ *          long long first, last;
+ *          if (http_parse_range(h, st.st_size, &first, &last) == 1) {
+ *              outbuf_attach_file(out, fd, first, last - first + 1);
+ *          }
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int http_parse_range(const HttpHeader* h, long long size, long long* first, long long* last);
+
+#endif
@@ -0,0 +1,910 @@
+#include "./bsdcore.h"
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+#define INDEX_MAGIC "BSDINDX"
+// A directory modified this close to the scan may have changed within the same mtime tick
+#define INDEX_RACY_SEC 1
+
+#if defined(__APPLE__)
+#define MTIME_NSEC(st) ((int64_t)(st)->st_mtimespec.tv_nsec)
+#else
+#define MTIME_NSEC(st) ((int64_t)(st)->st_mtim.tv_nsec)
+#endif
+
+/*
+ * File layout: IndexHeader, IndexBook[books_count], IndexNote[notes_count],
+ * IndexTagLine[taglines_count], IndexTag[tags_count], uint32_t postings[postings_count], string
+ * pool. The pool starts with an empty string and every string in it is NUL-terminated.
+ */
+typedef struct IndexHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t books_count;
+    uint32_t notes_count;
+    uint32_t taglines_count;
+    uint32_t tags_count;
+    uint32_t postings_count;
+    uint32_t strings_len;
+    uint32_t reserved;
+    int64_t root_mtime_sec;
+    int64_t root_mtime_nsec;
+    int64_t built_at;
+} IndexHeader;
+
+// Tag dictionary entry, postings are tag line numbers sorted by book, note and line
+typedef struct IndexTag
+{
+    uint32_t name;
+    uint32_t first_posting;
+    uint32_t postings_count;
+    uint32_t reserved;
+} IndexTag;
+
+typedef struct BuildLine
+{
+    uint32_t line;
+    char* text;
+} BuildLine;
+
+typedef struct BuildNote
+{
+    char* name;
+    IndexNote rec;
+    BuildLine* lines;
+    int lines_count;
+    int lines_cap;
+} BuildNote;
+
+// One occurrence of a tag while the dictionary is being built
+typedef struct TagRef
+{
+    const char* name;
+    size_t len;
+    uint32_t tagline;
+} TagRef;
+
+typedef struct BuildBook
+{
+    char* name;
+    IndexBook rec;
+    BuildNote* notes;
+    int notes_count;
+    int notes_cap;
+} BuildBook;
+
+static struct
+{
+    char* root;
+    char* path;
+    void* map;
+    size_t map_len;
+    const IndexHeader* hdr;
+    const IndexBook* books;
+    const IndexNote* notes;
+    const IndexTagLine* taglines;
+    const IndexTag* tags;
+    const uint32_t* postings;
+    const char* strings;
+} idx;
+
+static int index_paths(void)
+{
+    if (idx.root) {
+        return 0;
+    }
+    char* root = get_default_books_path("/books");
+    if (!root || root[0] == '\0') {
+        return -1;
+    }
+    size_t len = strlen(root) + sizeof(BSDINDEX_FILE) + 1;
+    idx.path = malloc(len);
+    if (!idx.path) {
+        perror("malloc");
+        free(root);
+        return -1;
+    }
+    snprintf(idx.path, len, "%s/%s", root, BSDINDEX_FILE);
+    idx.root = root;
+    return 0;
+}
+
+static void unmap_index(void)
+{
+    if (idx.map) {
+        munmap(idx.map, idx.map_len);
+    }
+    idx.map = NULL;
+    idx.map_len = 0;
+    idx.hdr = NULL;
+    idx.books = NULL;
+    idx.notes = NULL;
+    idx.taglines = NULL;
+    idx.tags = NULL;
+    idx.postings = NULL;
+    idx.strings = NULL;
+}
+
+// Maps the index file; book ranges are checked here, the rest lazily where it is read
+static int map_index(void)
+{
+    unmap_index();
+
+    int fd = open(idx.path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(IndexHeader)) {
+        close(fd);
+        return -1;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    const IndexHeader* hdr = map;
+    size_t books_off = sizeof(IndexHeader);
+    size_t notes_off = books_off + (size_t)hdr->books_count * sizeof(IndexBook);
+    size_t taglines_off = notes_off + (size_t)hdr->notes_count * sizeof(IndexNote);
+    size_t tags_off = taglines_off + (size_t)hdr->taglines_count * sizeof(IndexTagLine);
+    size_t postings_off = tags_off + (size_t)hdr->tags_count * sizeof(IndexTag);
+    size_t strings_off = postings_off + (size_t)hdr->postings_count * sizeof(uint32_t);
+    const char* strings = (const char*)map + strings_off;
+    if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != BSDINDEX_VERSION ||
+        strings_off + hdr->strings_len != (size_t)st.st_size ||
+        hdr->strings_len == 0 || strings[hdr->strings_len - 1] != '\0') {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    const IndexBook* books = (const IndexBook*)((const char*)map + books_off);
+    const IndexNote* notes = (const IndexNote*)((const char*)map + notes_off);
+    for (uint32_t i = 0; i < hdr->books_count; i++) {
+        if (books[i].name >= hdr->strings_len ||
+            (uint64_t)books[i].first_note + books[i].notes_count > hdr->notes_count) {
+            munmap(map, st.st_size);
+            return -1;
+        }
+    }
+
+    idx.map = map;
+    idx.map_len = st.st_size;
+    idx.hdr = hdr;
+    idx.books = books;
+    idx.notes = notes;
+    idx.taglines = (const IndexTagLine*)((const char*)map + taglines_off);
+    idx.tags = (const IndexTag*)((const char*)map + tags_off);
+    idx.postings = (const uint32_t*)((const char*)map + postings_off);
+    idx.strings = strings;
+    return 0;
+}
+
+const char* index_name(uint32_t offset)
+{
+    return offset < idx.hdr->strings_len ? idx.strings + offset : "";
+}
+
+static const IndexBook* mapped_book(const char* name)
+{
+    if (!idx.map) {
+        return NULL;
+    }
+    int lo = 0, hi = (int)idx.hdr->books_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(index_name(idx.books[mid].name), name);
+        if (cmp == 0) return &idx.books[mid];
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+static const IndexNote* mapped_note(const IndexBook* book, const char* name)
+{
+    const IndexNote* notes = &idx.notes[book->first_note];
+    int lo = 0, hi = (int)book->notes_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(index_name(notes[mid].name), name);
+        if (cmp == 0) return &notes[mid];
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+static int is_tag_char(unsigned char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '_' || c == '-' || c == '/' || c >= 0x80;
+}
+
+// A tag is '#' followed by tag characters, every '#' starts a new one
+static const char* next_tag(const char* text, size_t* len)
+{
+    for (const char* p = strchr(text, '#'); p; p = strchr(p + 1, '#')) {
+        size_t n = 1;
+        while (is_tag_char((unsigned char)p[n])) n++;
+        if (n > 1) {
+            *len = n;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static int build_line_add(BuildNote* note, uint32_t line, char* text)
+{
+    if (!text) {
+        perror("strdup");
+        return -1;
+    }
+    if (note->lines_count == note->lines_cap) {
+        int cap = note->lines_cap ? note->lines_cap * 2 : 4;
+        BuildLine* lines = realloc(note->lines, cap * sizeof(BuildLine));
+        if (!lines) {
+            perror("realloc");
+            free(text);
+            return -1;
+        }
+        note->lines = lines;
+        note->lines_cap = cap;
+    }
+    note->lines[note->lines_count].line = line;
+    note->lines[note->lines_count].text = text;
+    note->lines_count++;
+    return 0;
+}
+
+typedef struct TagLineSink
+{
+    BuildNote* note;
+    int rc;
+} TagLineSink;
+
+static int keep_tag_line(const char* line, size_t len, uint32_t line_number, uint32_t patterns, void* ctx)
+{
+    TagLineSink* sink = ctx;
+    size_t tag_len;
+    (void)patterns;
+
+    char* text = strndup(line, len);
+    if (text && !next_tag(text, &tag_len)) {
+        free(text);
+        return 0;
+    }
+    // A failed allocation stops the scan
+    sink->rc = build_line_add(sink->note, line_number, text);
+    return sink->rc;
+}
+
+// Keeps the lines of a note that carry at least one tag
+static int read_tag_lines(int dir_fd, const char* file_name, BuildNote* note)
+{
+    static const char* const hash[] = { "#" };
+    ScanSet set;
+    scan_set_init(&set, hash, 1);
+
+    TagLineSink sink = { .note = note, .rc = 0 };
+    scan_file(&set, dir_fd, file_name, keep_tag_line, &sink);
+    return sink.rc;
+}
+
+static int book_is_current(const IndexBook* book, const struct stat* dir_st)
+{
+    return book->dir_mtime_sec == (int64_t)dir_st->st_mtime &&
+           book->dir_mtime_nsec == MTIME_NSEC(dir_st) &&
+           book->dir_mtime_sec < idx.hdr->built_at - INDEX_RACY_SEC;
+}
+
+static int note_is_current(const IndexNote* note, const struct stat* st)
+{
+    return note->size == (int64_t)st->st_size &&
+           note->mtime_sec == (int64_t)st->st_mtime &&
+           note->mtime_nsec == MTIME_NSEC(st) &&
+           note->mtime_sec < idx.hdr->built_at - INDEX_RACY_SEC;
+}
+
+// Copies the tag lines of an unchanged note from the mapped index
+static int copy_tag_lines(BuildNote* note, const IndexNote* old)
+{
+    if ((uint64_t)old->first_tagline + old->taglines_count > idx.hdr->taglines_count) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < old->taglines_count; i++) {
+        const IndexTagLine* tl = &idx.taglines[old->first_tagline + i];
+        if (build_line_add(note, tl->line, strdup(index_name(tl->text))) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int compare_build_notes(const void* a, const void* b)
+{
+    return strcmp(((const BuildNote*)a)->name, ((const BuildNote*)b)->name);
+}
+
+static int compare_build_books(const void* a, const void* b)
+{
+    return strcmp(((const BuildBook*)a)->name, ((const BuildBook*)b)->name);
+}
+
+static BuildNote* build_note_add(BuildBook* book, char* name)
+{
+    if (!name) {
+        perror("strdup");
+        return NULL;
+    }
+    if (book->notes_count == book->notes_cap) {
+        int cap = book->notes_cap ? book->notes_cap * 2 : 16;
+        BuildNote* notes = realloc(book->notes, cap * sizeof(BuildNote));
+        if (!notes) {
+            perror("realloc");
+            free(name);
+            return NULL;
+        }
+        book->notes = notes;
+        book->notes_cap = cap;
+    }
+    BuildNote* note = &book->notes[book->notes_count++];
+    memset(note, 0, sizeof(*note));
+    note->name = name;
+    return note;
+}
+
+/*
+ * Fills a book from the old index when its directory did not change, otherwise reads the
+ * directory. Tags are only counted for notes that are new or whose size or mtime moved.
+ */
+static int build_book(BuildBook* book, int root_fd, const struct stat* dir_st, int force)
+{
+    const IndexBook* old = mapped_book(book->name);
+    book->rec.dir_mtime_sec = dir_st->st_mtime;
+    book->rec.dir_mtime_nsec = MTIME_NSEC(dir_st);
+
+    if (old && !force && book_is_current(old, dir_st)) {
+        const IndexNote* notes = &idx.notes[old->first_note];
+        for (uint32_t i = 0; i < old->notes_count; i++) {
+            BuildNote* note = build_note_add(book, strdup(index_name(notes[i].name)));
+            if (!note) return -1;
+            note->rec = notes[i];
+            if (copy_tag_lines(note, &notes[i]) != 0) return -1;
+        }
+        return 0;
+    }
+
+    // A book removed during the scan is left empty, the root mtime moved so it goes next time
+    int dir_fd = openat(root_fd, book->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        return 0;
+    }
+    DIR* dir = fdopendir(dir_fd);
+    if (!dir) {
+        close(dir_fd);
+        return -1;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char* ext = strrchr(entry->d_name, '.');
+        struct stat st;
+        if (!ext || ext == entry->d_name || strcmp(ext, ".bdsb") != 0 ||
+            fstatat(dirfd(dir), entry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        BuildNote* note = build_note_add(book, strndup(entry->d_name, ext - entry->d_name));
+        if (!note) {
+            closedir(dir);
+            return -1;
+        }
+        note->rec.size = st.st_size;
+        note->rec.mtime_sec = st.st_mtime;
+        note->rec.mtime_nsec = MTIME_NSEC(&st);
+
+        const IndexNote* old_note = old ? mapped_note(old, note->name) : NULL;
+        int rc = old_note && note_is_current(old_note, &st)
+                     ? copy_tag_lines(note, old_note)
+                     : read_tag_lines(dirfd(dir), entry->d_name, note);
+        if (rc != 0) {
+            closedir(dir);
+            return -1;
+        }
+    }
+    closedir(dir);
+
+    qsort(book->notes, book->notes_count, sizeof(BuildNote), compare_build_notes);
+    return 0;
+}
+
+static void free_build(BuildBook* books, int count)
+{
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < books[i].notes_count; j++) {
+            for (int k = 0; k < books[i].notes[j].lines_count; k++) {
+                free(books[i].notes[j].lines[k].text);
+            }
+            free(books[i].notes[j].lines);
+            free(books[i].notes[j].name);
+        }
+        free(books[i].notes);
+        free(books[i].name);
+    }
+    free(books);
+}
+
+// Checks that the books directory still holds exactly the books that were indexed
+static int root_matches(const BuildBook* books, int count)
+{
+    DIR* dir = opendir(idx.root);
+    if (!dir) {
+        return 0;
+    }
+
+    int seen = 0;
+    int ok = 1;
+    struct dirent* entry;
+    while (ok && (entry = readdir(dir)) != NULL) {
+        struct stat st;
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            fstatat(dirfd(dir), entry->d_name, &st, 0) != 0 || !S_ISDIR(st.st_mode)) {
+            continue;
+        }
+        BuildBook key = { .name = entry->d_name };
+        ok = bsearch(&key, books, count, sizeof(BuildBook), compare_build_books) != NULL;
+        seen++;
+    }
+    closedir(dir);
+    return ok && seen == count;
+}
+
+static int compare_tag_refs(const void* a, const void* b)
+{
+    const TagRef* x = a;
+    const TagRef* y = b;
+    int cmp = memcmp(x->name, y->name, x->len < y->len ? x->len : y->len);
+    if (cmp == 0 && x->len != y->len) cmp = x->len < y->len ? -1 : 1;
+    if (cmp == 0 && x->tagline != y->tagline) cmp = x->tagline < y->tagline ? -1 : 1;
+    return cmp;
+}
+
+// Collects every (tag, tag line) pair, sorted by tag and then by tag line, without duplicates
+static TagRef* collect_tag_refs(const BuildBook* books, int books_count, size_t* count)
+{
+    TagRef* refs = NULL;
+    size_t refs_count = 0;
+    size_t refs_cap = 0;
+    uint32_t tagline = 0;
+    for (int i = 0; i < books_count; i++) {
+        for (int j = 0; j < books[i].notes_count; j++) {
+            const BuildNote* note = &books[i].notes[j];
+            for (int k = 0; k < note->lines_count; k++, tagline++) {
+                const char* p = note->lines[k].text;
+                size_t len;
+                while ((p = next_tag(p, &len)) != NULL) {
+                    if (refs_count == refs_cap) {
+                        size_t cap = refs_cap ? refs_cap * 2 : 256;
+                        TagRef* grown = realloc(refs, cap * sizeof(TagRef));
+                        if (!grown) {
+                            perror("realloc");
+                            free(refs);
+                            return NULL;
+                        }
+                        refs = grown;
+                        refs_cap = cap;
+                    }
+                    refs[refs_count++] = (TagRef){ .name = p, .len = len, .tagline = tagline };
+                    p += len;
+                }
+            }
+        }
+    }
+
+    if (refs_count > 0) {
+        qsort(refs, refs_count, sizeof(TagRef), compare_tag_refs);
+    }
+    size_t unique = 0;
+    for (size_t i = 0; i < refs_count; i++) {
+        if (unique == 0 || compare_tag_refs(&refs[unique - 1], &refs[i]) != 0) {
+            refs[unique++] = refs[i];
+        }
+    }
+    *count = unique;
+    return refs ? refs : malloc(1);
+}
+
+static int write_index(const BuildBook* books, int books_count, const struct stat* root_st, int64_t built_at)
+{
+    size_t refs_count = 0;
+    TagRef* refs = collect_tag_refs(books, books_count, &refs_count);
+    if (!refs) {
+        return -1;
+    }
+
+    size_t notes_count = 0;
+    size_t taglines_count = 0;
+    size_t tags_count = 0;
+    size_t strings_len = 1;
+    for (int i = 0; i < books_count; i++) {
+        strings_len += strlen(books[i].name) + 1;
+        for (int j = 0; j < books[i].notes_count; j++) {
+            strings_len += strlen(books[i].notes[j].name) + 1;
+            for (int k = 0; k < books[i].notes[j].lines_count; k++) {
+                strings_len += strlen(books[i].notes[j].lines[k].text) + 1;
+            }
+            taglines_count += books[i].notes[j].lines_count;
+        }
+        notes_count += books[i].notes_count;
+    }
+    for (size_t i = 0; i < refs_count; i++) {
+        if (i == 0 || refs[i].len != refs[i - 1].len || memcmp(refs[i].name, refs[i - 1].name, refs[i].len) != 0) {
+            strings_len += refs[i].len + 1;
+            tags_count++;
+        }
+    }
+    if (notes_count > UINT32_MAX || taglines_count > UINT32_MAX || refs_count > UINT32_MAX ||
+        strings_len > UINT32_MAX) {
+        free(refs);
+        return -1;
+    }
+
+    size_t size = sizeof(IndexHeader) + books_count * sizeof(IndexBook) +
+                  notes_count * sizeof(IndexNote) + taglines_count * sizeof(IndexTagLine) +
+                  tags_count * sizeof(IndexTag) + refs_count * sizeof(uint32_t) + strings_len;
+    char* image = calloc(1, size);
+    if (!image) {
+        perror("calloc");
+        free(refs);
+        return -1;
+    }
+
+    IndexHeader* hdr = (IndexHeader*)image;
+    IndexBook* out_books = (IndexBook*)(image + sizeof(IndexHeader));
+    IndexNote* out_notes = (IndexNote*)(out_books + books_count);
+    IndexTagLine* out_taglines = (IndexTagLine*)(out_notes + notes_count);
+    IndexTag* out_tags = (IndexTag*)(out_taglines + taglines_count);
+    uint32_t* out_postings = (uint32_t*)(out_tags + tags_count);
+    char* strings = (char*)(out_postings + refs_count);
+
+    memcpy(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic));
+    hdr->version = BSDINDEX_VERSION;
+    hdr->books_count = books_count;
+    hdr->notes_count = notes_count;
+    hdr->taglines_count = taglines_count;
+    hdr->tags_count = tags_count;
+    hdr->postings_count = refs_count;
+    hdr->strings_len = strings_len;
+    hdr->root_mtime_sec = root_st->st_mtime;
+    hdr->root_mtime_nsec = MTIME_NSEC(root_st);
+    hdr->built_at = built_at;
+
+    size_t pool = 1;
+    uint32_t note_pos = 0;
+    uint32_t tagline_pos = 0;
+    for (int i = 0; i < books_count; i++) {
+        out_books[i] = books[i].rec;
+        out_books[i].name = pool;
+        out_books[i].first_note = note_pos;
+        out_books[i].notes_count = books[i].notes_count;
+        out_books[i].reserved = 0;
+        size_t len = strlen(books[i].name) + 1;
+        memcpy(strings + pool, books[i].name, len);
+        pool += len;
+
+        for (int j = 0; j < books[i].notes_count; j++, note_pos++) {
+            const BuildNote* note = &books[i].notes[j];
+            out_notes[note_pos] = note->rec;
+            out_notes[note_pos].name = pool;
+            out_notes[note_pos].book = i;
+            out_notes[note_pos].first_tagline = tagline_pos;
+            out_notes[note_pos].taglines_count = note->lines_count;
+            len = strlen(note->name) + 1;
+            memcpy(strings + pool, note->name, len);
+            pool += len;
+
+            for (int k = 0; k < note->lines_count; k++, tagline_pos++) {
+                out_taglines[tagline_pos].note = note_pos;
+                out_taglines[tagline_pos].line = note->lines[k].line;
+                out_taglines[tagline_pos].text = pool;
+                len = strlen(note->lines[k].text) + 1;
+                memcpy(strings + pool, note->lines[k].text, len);
+                pool += len;
+            }
+        }
+    }
+
+    size_t tag_pos = 0;
+    for (size_t i = 0; i < refs_count; i++) {
+        if (i == 0 || refs[i].len != refs[i - 1].len || memcmp(refs[i].name, refs[i - 1].name, refs[i].len) != 0) {
+            out_tags[tag_pos].name = pool;
+            out_tags[tag_pos].first_posting = i;
+            memcpy(strings + pool, refs[i].name, refs[i].len);
+            pool += refs[i].len + 1;
+            tag_pos++;
+        }
+        out_tags[tag_pos - 1].postings_count++;
+        out_postings[i] = refs[i].tagline;
+    }
+    free(refs);
+
+    char tmp_path[1024];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", idx.path, (long)getpid());
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        free(image);
+        return -1;
+    }
+    if (write_all(fd, image, size) != 0 || rename(tmp_path, idx.path) != 0) {
+        perror("write index");
+        unlink(tmp_path);
+        close(fd);
+        free(image);
+        return -1;
+    }
+    free(image);
+
+    /*
+     * Writing the index changed the mtime of the books directory. Record the new mtime, but only
+     * if no book appeared or disappeared meanwhile; otherwise the next run rebuilds.
+     */
+    struct stat after;
+    if (root_matches(books, books_count) && stat(idx.root, &after) == 0) {
+        int64_t mtime[2] = { after.st_mtime, MTIME_NSEC(&after) };
+        if (pwrite(fd, mtime, sizeof(mtime), offsetof(IndexHeader, root_mtime_sec)) != sizeof(mtime)) {
+            perror("pwrite");
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+static int rebuild(const char* force_book, int force_all)
+{
+    int64_t built_at = time(NULL);
+    DIR* dir = opendir(idx.root);
+    if (!dir) {
+        perror("opendir");
+        return -1;
+    }
+
+    // Taken before reading, so a change made during the scan invalidates the result
+    struct stat root_st;
+    if (fstat(dirfd(dir), &root_st) != 0) {
+        closedir(dir);
+        return -1;
+    }
+
+    BuildBook* books = NULL;
+    int books_count = 0;
+    int books_cap = 0;
+    int rc = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat st;
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            fstatat(dirfd(dir), entry->d_name, &st, 0) != 0 || !S_ISDIR(st.st_mode)) {
+            continue;
+        }
+        if (books_count == books_cap) {
+            int cap = books_cap ? books_cap * 2 : 16;
+            BuildBook* grown = realloc(books, cap * sizeof(BuildBook));
+            if (!grown) {
+                perror("realloc");
+                rc = -1;
+                break;
+            }
+            books = grown;
+            books_cap = cap;
+        }
+        BuildBook* book = &books[books_count];
+        memset(book, 0, sizeof(*book));
+        book->name = strdup(entry->d_name);
+        if (!book->name) {
+            rc = -1;
+            break;
+        }
+        books_count++;
+        int force = force_all || (force_book && strcmp(force_book, entry->d_name) == 0);
+        if (build_book(book, dirfd(dir), &st, force) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+    closedir(dir);
+
+    if (rc == 0) {
+        qsort(books, books_count, sizeof(BuildBook), compare_build_books);
+        rc = write_index(books, books_count, &root_st, built_at);
+    }
+    free_build(books, books_count);
+    if (rc != 0) {
+        return -1;
+    }
+    return map_index();
+}
+
+int index_open(void)
+{
+    if (index_paths() != 0) {
+        return -1;
+    }
+    struct stat root_st;
+    if (stat(idx.root, &root_st) != 0) {
+        return -1;
+    }
+    if (!idx.map) {
+        map_index();
+    }
+    if (idx.map && idx.hdr->root_mtime_sec == (int64_t)root_st.st_mtime &&
+        idx.hdr->root_mtime_nsec == MTIME_NSEC(&root_st)) {
+        return 0;
+    }
+    return rebuild(NULL, 0);
+}
+
+const IndexBook* index_books(int* count)
+{
+    *count = 0;
+    if (index_open() != 0) {
+        return NULL;
+    }
+    *count = idx.hdr->books_count;
+    return idx.books;
+}
+
+const IndexNote* index_notes(const char* book_name, int* count)
+{
+    *count = 0;
+    if (index_open() != 0) {
+        return NULL;
+    }
+    const IndexBook* book = mapped_book(book_name);
+    if (!book) {
+        return NULL;
+    }
+
+    char book_path[1024];
+    struct stat dir_st;
+    snprintf(book_path, sizeof(book_path), "%s/%s", idx.root, book_name);
+    if (stat(book_path, &dir_st) != 0) {
+        return NULL;
+    }
+    if (!book_is_current(book, &dir_st)) {
+        if (rebuild(NULL, 0) != 0 || !(book = mapped_book(book_name))) {
+            return NULL;
+        }
+    }
+
+    *count = book->notes_count;
+    return &idx.notes[book->first_note];
+}
+
+int index_refresh_book(const char* book_name)
+{
+    if (index_open() != 0) {
+        return -1;
+    }
+    return rebuild(book_name, 0);
+}
+
+// Stats every indexed note, returns 1 if none changed since the index was built
+static int notes_are_current(void)
+{
+    int root_fd = open(idx.root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        return 0;
+    }
+
+    int current = 1;
+    for (uint32_t i = 0; current && i < idx.hdr->books_count; i++) {
+        const IndexBook* book = &idx.books[i];
+        struct stat st;
+        int dir_fd = openat(root_fd, index_name(book->name), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd < 0 || fstat(dir_fd, &st) != 0 || !book_is_current(book, &st)) {
+            current = 0;
+        }
+        for (uint32_t j = 0; current && j < book->notes_count; j++) {
+            const IndexNote* note = &idx.notes[book->first_note + j];
+            char file_name[1024];
+            snprintf(file_name, sizeof(file_name), "%s.bdsb", index_name(note->name));
+            current = fstatat(dir_fd, file_name, &st, 0) == 0 && note_is_current(note, &st);
+        }
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+    }
+    close(root_fd);
+    return current;
+}
+
+static int compare_postings(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+int index_find_tag(const char* tag, IndexTagVisitor visit, void* ctx)
+{
+    // Only '#' followed by tag characters can be answered from the dictionary
+    size_t tag_len = strlen(tag);
+    if (tag_len < 2 || tag[0] != '#') {
+        return -1;
+    }
+    for (size_t i = 1; i < tag_len; i++) {
+        if (!is_tag_char((unsigned char)tag[i])) return -1;
+    }
+
+    if (index_open() != 0) {
+        return -1;
+    }
+    if (!notes_are_current() && rebuild(NULL, 1) != 0) {
+        return -1;
+    }
+
+    /*
+     * A line contains the text "#todo" exactly when one of its tags starts with "#todo", so the
+     * answer is the union of the postings of all tags in the prefix range.
+     */
+    uint32_t lo = 0, hi = idx.hdr->tags_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (strcmp(index_name(idx.tags[mid].name), tag) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    uint32_t first = lo;
+    size_t total = 0;
+    for (hi = first; hi < idx.hdr->tags_count && strncmp(index_name(idx.tags[hi].name), tag, tag_len) == 0; hi++) {
+        if ((uint64_t)idx.tags[hi].first_posting + idx.tags[hi].postings_count > idx.hdr->postings_count) {
+            return -1;
+        }
+        total += idx.tags[hi].postings_count;
+    }
+
+    uint32_t* hits = malloc((total ? total : 1) * sizeof(uint32_t));
+    if (!hits) {
+        perror("malloc");
+        return -1;
+    }
+    size_t hits_count = 0;
+    for (uint32_t t = first; t < hi; t++) {
+        memcpy(hits + hits_count, idx.postings + idx.tags[t].first_posting,
+               idx.tags[t].postings_count * sizeof(uint32_t));
+        hits_count += idx.tags[t].postings_count;
+    }
+    if (hi - first > 1) {
+        qsort(hits, hits_count, sizeof(uint32_t), compare_postings);
+    }
+
+    int found = 0;
+    for (size_t i = 0; i < hits_count; i++) {
+        if (i > 0 && hits[i] == hits[i - 1]) {
+            continue;
+        }
+        if (hits[i] >= idx.hdr->taglines_count) {
+            continue;
+        }
+        const IndexTagLine* tl = &idx.taglines[hits[i]];
+        if (tl->note >= idx.hdr->notes_count || idx.notes[tl->note].book >= idx.hdr->books_count) {
+            continue;
+        }
+        const IndexNote* note = &idx.notes[tl->note];
+        visit(index_name(idx.books[note->book].name), index_name(note->name), tl->line, index_name(tl->text), ctx);
+        found++;
+    }
+    free(hits);
+    return found;
+}
+
+void index_close(void)
+{
+    unmap_index();
+}
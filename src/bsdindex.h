@@ -0,0 +1,322 @@
+/*=================================================================================================
+ *
+ * 	@FILENAME:	      bsdindex.h
+ * 	@BRIEF:    	      Persistent metadata index of the books directory.
+ * 	@DESCRIPTION:	  $HOME/books/.bsdindex keeps book names, note names, sizes, mtimes and a
+ * 	                  tag -> line postings index in a flat file that is mapped with mmap(), so
+ * 	                  CLI listings and tag searches do not have to walk the tree on every start.
+ * 	@AUTHOR		      Daniil (TwelveFacedJanus) Ermolaev.
+ * 	   | CONTACT:	  twofaced-janus@yandex.ru
+ *	@CREATED AT:	  10.16.26
+ *	@UPDATED_AT:	  10.16.26
+ *
+ *==================================================================================================*/
+
+#ifndef BSDINDEX_H_
+#define BSDINDEX_H_
+
+#include <stdint.h>
+
+#define BSDINDEX_FILE ".bsdindex"
+#define BSDINDEX_VERSION 2
+
+
+/*===============================================================================================
+ *
+ * 	@BRIEF:
+ * 		Book record of the index file.
+ * 	@DESCRIPTION:
+ * 		Books are sorted by name. The notes of a book are stored contiguously in the note
+ * 		table, sorted by name.
+ * 	@PARAMETERS:
+ * 		IndexBook.name           - uint32_t, offset of the name in the string pool;
+ * 		IndexBook.first_note     - uint32_t, index of the first note in the note table;
+ * 		IndexBook.notes_count    - uint32_t;
+ * 		IndexBook.reserved       - uint32_t, always 0;
+ * 		IndexBook.dir_mtime_sec  - int64_t, book directory mtime when it was scanned;
+ * 		IndexBook.dir_mtime_nsec - int64_t.
+ * 	@RETURN:
+ * 		None.
+ * 	@NOTES:
+ * 		The file uses host byte order, it is a cache and is rebuilt when unreadable.
+ * 	@EXAMPLE:
+ * 		None.
+ * 	@UPDATES:
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *	 	      Struct has been created.
+ *
+ * =============================================================================================*/
+typedef struct IndexBook
+{
+	uint32_t name;
+	uint32_t first_note;
+	uint32_t notes_count;
+	uint32_t reserved;
+	int64_t dir_mtime_sec;
+	int64_t dir_mtime_nsec;
+} IndexBook;
+
+/*===============================================================================================
+ *
+ * 	@BRIEF:
+ * 		Note record of the index file.
+ * 	@DESCRIPTION:
+ * 		Metadata of one .bdsb file and the range of its tagged lines.
+ * 	@PARAMETERS:
+ * 		IndexNote.name           - uint32_t, offset of the name (without .bdsb) in the string pool;
+ * 		IndexNote.book           - uint32_t, index of the book in the book table;
+ * 		IndexNote.first_tagline  - uint32_t, index of the first tagged line in the line table;
+ * 		IndexNote.taglines_count - uint32_t;
+ * 		IndexNote.size           - int64_t, file size in bytes;
+ * 		IndexNote.mtime_sec      - int64_t, file mtime;
+ * 		IndexNote.mtime_nsec     - int64_t.
+ * 	@RETURN:
+ * 		None.
+ * 	@NOTES:
+ * 		None.
+ * 	@EXAMPLE:
+ * 		None.
+ * 	@UPDATES:
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *	 	      Struct has been created.
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *	 	      Tag line counts replaced by the tagged line range.
+ *
+ * =============================================================================================*/
+typedef struct IndexNote
+{
+	uint32_t name;
+	uint32_t book;
+	uint32_t first_tagline;
+	uint32_t taglines_count;
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+} IndexNote;
+
+/*===============================================================================================
+ *
+ * 	@BRIEF:
+ * 		Tagged line record of the index file.
+ * 	@DESCRIPTION:
+ * 		A line of a note that contains at least one tag ('#' followed by letters, digits,
+ * 		'_', '-', '/' or non-ASCII bytes). The text is kept so tag queries never open notes.
+ * 	@PARAMETERS:
+ * 		IndexTagLine.note     - uint32_t, index of the note in the note table;
+ * 		IndexTagLine.line     - uint32_t, line number, starting at 1;
+ * 		IndexTagLine.text     - uint32_t, offset of the line (without newline) in the string pool;
+ * 		IndexTagLine.reserved - uint32_t, always 0.
+ * 	@RETURN:
+ * 		None.
+ * 	@NOTES:
+ * 		None.
+ * 	@EXAMPLE:
+ * 		None.
+ * 	@UPDATES:
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *	 	      Struct has been created.
+ *
+ * =============================================================================================*/
+typedef struct IndexTagLine
+{
+	uint32_t note;
+	uint32_t line;
+	uint32_t text;
+	uint32_t reserved;
+} IndexTagLine;
+
+typedef void (*IndexTagVisitor)(const char* book_name, const char* note_name, uint32_t line,
+                                const char* text, void* ctx);
+
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Maps the index, rebuilding it if it is missing or out of date.
+ *     @DESCRIPTION:
+ *          The index is valid while the mtime of the books directory matches the one recorded
+ *          in it. A rebuild is incremental: books whose directory mtime did not change are
+ *          copied from the old index, and tagged lines are only reread for notes whose size or
+ *          mtime changed. The new index is written to a temporary file and renamed
+ *          over the old one.
+ *     @PARAMETERS:
+ *          - None
+ *     @RETURN:
+ *          - 0 on success, -1 if the index is unavailable
+ *     @NOTES:
+ *          - Called implicitly by index_books() and index_notes()
+ *     @EXAMPLE:
+ *          ```c
+ *          if (index_open() != 0) {
+ *              // scan the directory instead
+ *          }
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int index_open(void);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Returns the book table of the index.
+ *     @DESCRIPTION:
+ *          Books are sorted by name. Names are read with index_name().
+ *     @PARAMETERS:
+ *          - int* count: Set to the number of books
+ *     @RETURN:
+ *          - const IndexBook*: Book table, valid until the next index call
+ *          - NULL if the index is unavailable
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          int count;
+ *          const IndexBook* books = index_books(&count);
+ *          for (int i = 0; books && i < count; i++) {
+ *              printf("%s\n", index_name(books[i].name));
+ *          }
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+const IndexBook* index_books(int* count);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Returns the notes of a book from the index.
+ *     @DESCRIPTION:
+ *          The book directory mtime is checked first and the book is rescanned if it moved,
+ *          so notes created or removed since the last run are seen.
+ *     @PARAMETERS:
+ *          - const char* book_name: Name of the book
+ *          - int* count: Set to the number of notes
+ *     @RETURN:
+ *          - const IndexNote*: Notes sorted by name, valid until the next index call
+ *          - NULL if the book does not exist or the index is unavailable
+ *     @NOTES:
+ *          - Edits that rewrite a note in place do not change the directory mtime; call
+ *            index_refresh_book() after them
+ *     @EXAMPLE:
+ *          ```c
+ *          int count;
+ *          const IndexNote* notes = index_notes("Programming", &count);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+const IndexNote* index_notes(const char* book_name, int* count);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Resolves a string pool offset.
+ *     @DESCRIPTION:
+ *          Used for IndexBook.name and IndexNote.name.
+ *     @PARAMETERS:
+ *          - uint32_t offset: Offset in the string pool
+ *     @RETURN:
+ *          - const char*: NUL-terminated name
+ *     @NOTES:
+ *          - Valid until the next index call
+ *     @EXAMPLE:
+ *          ```c
+ *          const char* name = index_name(notes[0].name);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+const char* index_name(uint32_t offset);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Rescans one book and rewrites the index.
+ *     @DESCRIPTION:
+ *          Stats every note of the book even when the directory mtime did not change.
+ *     @PARAMETERS:
+ *          - const char* book_name: Name of the book
+ *     @RETURN:
+ *          - 0 on success, -1 on error
+ *     @NOTES:
+ *          - Used after "bsdnotes edit", editors may rewrite a file in place
+ *     @EXAMPLE:
+ *          ```c
+ *          index_refresh_book("Programming");
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int index_refresh_book(const char* book_name);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Finds the lines containing a tag.
+ *     @DESCRIPTION:
+ *          Every note is checked against its recorded size and mtime first and the changed ones
+ *          are reread, so only stat() calls touch the tree when nothing changed. The lines of
+ *          all tags starting with the query are merged, which gives the same lines as a plain
+ *          substring search ("#todo" also finds "#todos"). Hits are visited ordered by book,
+ *          note and line.
+ *     @PARAMETERS:
+ *          - const char* tag: '#' followed by tag characters, e.g. "#todo"
+ *          - IndexTagVisitor visit: Called for every matching line
+ *          - void* ctx: Passed to visit
+ *     @RETURN:
+ *          - Number of matching lines
+ *          - -1 if the index is unavailable or tag is not a tag; scan the notes instead
+ *     @NOTES:
+ *          - Strings passed to visit are only valid during the call
+ *     @EXAMPLE:
+ *          ```c
+ *          static void print_hit(const char* book, const char* note, uint32_t line,
+ *                                const char* text, void* ctx)
+ *          {
+ *              printf("%s/%s:%u %s\n", book, note, line, text);
+ *          }
+ *
+ *          index_find_tag("#todo", print_hit, NULL);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int index_find_tag(const char* tag, IndexTagVisitor visit, void* ctx);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Unmaps the index.
+ *     @DESCRIPTION:
+ *          Pointers returned by earlier calls become invalid.
+ *     @PARAMETERS:
+ *          - None
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          index_close();
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void index_close(void);
+
+#endif
@@ -0,0 +1,333 @@
+#include "./bsdcore.h"
+
+#include <math.h>
+
+static const char hex_digits[] = "0123456789abcdef";
+
+void jsonw_init(JsonWriter* w, OutBuffer* out)
+{
+    w->out = out;
+    w->start = out->len;
+    w->headers = NULL;
+    w->flushed = 0;
+    w->failed = 0;
+    w->depth = 0;
+    w->has_items = 0;
+    w->after_key = 0;
+    w->len = 0;
+}
+
+void jsonw_headers(JsonWriter* w, const char* headers)
+{
+    w->headers = headers;
+}
+
+// Moves the staging buffer to out, jsonw_finish() puts the headers in front of the body
+static void flush(JsonWriter* w)
+{
+    if (w->failed || w->len == 0) {
+        return;
+    }
+    if (outbuf_append(w->out, w->buf, w->len) != 0) {
+        w->failed = 1;
+    }
+    w->flushed = 1;
+    w->len = 0;
+}
+
+static void put(JsonWriter* w, const char* data, size_t len)
+{
+    // After a failure the bytes are dropped, jsonw_finish() reports it
+    while (len > 0 && !w->failed) {
+        if (w->len == JSONW_CHUNK) {
+            flush(w);
+        }
+        size_t n = JSONW_CHUNK - w->len;
+        if (n > len) n = len;
+        memcpy(w->buf + w->len, data, n);
+        w->len += n;
+        data += n;
+        len -= n;
+    }
+}
+
+static void put_char(JsonWriter* w, char c)
+{
+    if (w->len == JSONW_CHUNK) {
+        flush(w);
+    }
+    if (!w->failed) {
+        w->buf[w->len++] = c;
+    }
+}
+
+// Comma before every value but the first of its array or object, none after a key
+static void before_value(JsonWriter* w)
+{
+    if (w->after_key) {
+        w->after_key = 0;
+        return;
+    }
+    if (w->depth > 0) {
+        uint64_t bit = 1ull << (w->depth - 1);
+        if (w->has_items & bit) {
+            put_char(w, ',');
+        }
+        w->has_items |= bit;
+    }
+}
+
+static void open_level(JsonWriter* w, char c)
+{
+    before_value(w);
+    if (w->depth == JSONW_MAX_DEPTH) {
+        w->failed = 1;
+        return;
+    }
+    put_char(w, c);
+    w->depth++;
+    w->has_items &= ~(1ull << (w->depth - 1));
+}
+
+static void close_level(JsonWriter* w, char c)
+{
+    if (w->depth == 0 || w->after_key) {
+        w->failed = 1;
+        return;
+    }
+    w->depth--;
+    put_char(w, c);
+}
+
+void jsonw_object_begin(JsonWriter* w)
+{
+    open_level(w, '{');
+}
+
+void jsonw_object_end(JsonWriter* w)
+{
+    close_level(w, '}');
+}
+
+void jsonw_array_begin(JsonWriter* w)
+{
+    open_level(w, '[');
+}
+
+void jsonw_array_end(JsonWriter* w)
+{
+    close_level(w, ']');
+}
+
+// Length of the valid UTF-8 sequence at s, 0 if it is not one
+static size_t utf8_sequence(const unsigned char* s, size_t len)
+{
+    unsigned char c = s[0];
+    size_t n;
+    uint32_t cp;
+    if (c >= 0xC2 && c <= 0xDF) {
+        n = 2;
+        cp = c & 0x1F;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        n = 3;
+        cp = c & 0x0F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        n = 4;
+        cp = c & 0x07;
+    } else {
+        return 0;
+    }
+    if (n > len) {
+        return 0;
+    }
+    for (size_t i = 1; i < n; i++) {
+        if ((s[i] & 0xC0) != 0x80) {
+            return 0;
+        }
+        cp = (cp << 6) | (s[i] & 0x3F);
+    }
+    // Overlong forms, surrogates and code points past U+10FFFF
+    if ((n == 3 && cp < 0x800) || (n == 4 && (cp < 0x10000 || cp > 0x10FFFF)) ||
+        (cp >= 0xD800 && cp <= 0xDFFF)) {
+        return 0;
+    }
+    return n;
+}
+
+static void put_escaped(JsonWriter* w, const char* s, size_t len)
+{
+    const unsigned char* p = (const unsigned char*)s;
+    put_char(w, '"');
+    size_t run = 0;
+    for (size_t i = 0; i < len; ) {
+        unsigned char c = p[i];
+        if (c >= 0x20 && c != '"' && c != '\\' && c < 0x80) {
+            i++;
+            continue;
+        }
+        size_t seq = c >= 0x80 ? utf8_sequence(p + i, len - i) : 0;
+        if (seq > 0) {
+            i += seq;
+            continue;
+        }
+
+        // Plain bytes since the last escape go out in one copy
+        put(w, s + run, i - run);
+        char esc[8] = { '\\', 0 };
+        size_t esc_len = 2;
+        switch (c) {
+        case '"': esc[1] = '"'; break;
+        case '\\': esc[1] = '\\'; break;
+        case '\n': esc[1] = 'n'; break;
+        case '\r': esc[1] = 'r'; break;
+        case '\t': esc[1] = 't'; break;
+        case '\b': esc[1] = 'b'; break;
+        case '\f': esc[1] = 'f'; break;
+        default:
+            if (c >= 0x80) {
+                memcpy(esc, "\\ufffd", 6);
+            } else {
+                memcpy(esc, "\\u00", 4);
+                esc[4] = hex_digits[c >> 4];
+                esc[5] = hex_digits[c & 0xF];
+            }
+            esc_len = 6;
+            break;
+        }
+        put(w, esc, esc_len);
+        i++;
+        run = i;
+    }
+    put(w, s + run, len - run);
+    put_char(w, '"');
+}
+
+void jsonw_key(JsonWriter* w, const char* key)
+{
+    before_value(w);
+    put_escaped(w, key, strlen(key));
+    put_char(w, ':');
+    w->after_key = 1;
+}
+
+void jsonw_string(JsonWriter* w, const char* s)
+{
+    jsonw_string_len(w, s, strlen(s));
+}
+
+void jsonw_string_len(JsonWriter* w, const char* s, size_t len)
+{
+    before_value(w);
+    put_escaped(w, s, len);
+}
+
+void jsonw_integer(JsonWriter* w, long long v)
+{
+    before_value(w);
+    char digits[24];
+    char* end = digits + sizeof(digits);
+    char* p = end;
+    unsigned long long u = v < 0 ? 0ull - (unsigned long long)v : (unsigned long long)v;
+    do {
+        *--p = (char)('0' + u % 10);
+        u /= 10;
+    } while (u > 0);
+    if (v < 0) {
+        *--p = '-';
+    }
+    put(w, p, end - p);
+}
+
+void jsonw_real(JsonWriter* w, double v)
+{
+    if (!isfinite(v)) {
+        jsonw_null(w);
+        return;
+    }
+    before_value(w);
+    char text[32];
+    int n = snprintf(text, sizeof(text), "%.17g", v);
+    put(w, text, n);
+    // Keep it a real for readers that tell 1 from 1.0
+    if (strpbrk(text, ".eE") == NULL) {
+        put(w, ".0", 2);
+    }
+}
+
+void jsonw_bool(JsonWriter* w, int v)
+{
+    before_value(w);
+    if (v) {
+        put(w, "true", 4);
+    } else {
+        put(w, "false", 5);
+    }
+}
+
+void jsonw_null(JsonWriter* w)
+{
+    before_value(w);
+    put(w, "null", 4);
+}
+
+void jsonw_abort(JsonWriter* w)
+{
+    if (w->out->len > w->start) {
+        w->out->len = w->start;
+    }
+    w->len = 0;
+    w->flushed = 0;
+    w->failed = 0;
+    w->depth = 0;
+    w->has_items = 0;
+    w->after_key = 0;
+}
+
+int jsonw_finish(JsonWriter* w)
+{
+    if (w->depth != 0 || w->after_key) {
+        w->failed = 1;
+    }
+
+    if (!w->failed && !w->flushed) {
+        // Whole body still staged: one response with a Content-Length
+        if (outbuf_printf(w->out,
+                          "HTTP/1.1 200 OK\r\n"
+                          "Content-Type: application/json\r\n"
+                          "%s"
+                          "Content-Length: %zu\r\n"
+                          "\r\n",
+                          w->headers ? w->headers : "", w->len) != 0 ||
+            outbuf_append(w->out, w->buf, w->len) != 0) {
+            w->failed = 1;
+        }
+    } else if (!w->failed) {
+        // The body is complete before anything is sent, so it always goes out with a Content-Length
+        flush(w);
+        char head[512];
+        size_t body_len = w->out->len - w->start;
+        int head_len = snprintf(head, sizeof(head),
+                                "HTTP/1.1 200 OK\r\n"
+                                "Content-Type: application/json\r\n"
+                                "%s"
+                                "Content-Length: %zu\r\n"
+                                "\r\n",
+                                w->headers ? w->headers : "", body_len);
+        // Grow by the header size, then slide the body behind it
+        if (!w->failed && head_len > 0 && (size_t)head_len < sizeof(head) &&
+            outbuf_append(w->out, head, head_len) == 0) {
+            char* body = w->out->data + w->start;
+            memmove(body + head_len, body, body_len);
+            memcpy(body, head, head_len);
+        } else {
+            w->failed = 1;
+        }
+    }
+
+    if (w->failed) {
+        jsonw_abort(w);
+        http_text_response(w->out, "500 Internal Server Error", "500 JSON Serialization Failed\r\n");
+        return -1;
+    }
+    return 0;
+}
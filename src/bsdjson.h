@@ -0,0 +1,271 @@
+/*=================================================================================================
+ *
+ * 	@FILENAME:	      bsdjson.h
+ * 	@BRIEF:    	      Streaming JSON writer for HTTP responses.
+ * 	@DESCRIPTION:	  Writes compact JSON straight into a response OutBuffer through a fixed
+ * 	                  staging buffer, without building a jansson tree or a serialized copy.
+ * 	                  Every body is sent with a Content-Length: a response is complete in its
+ * 	                  OutBuffer before any of it goes out, so chunked framing would gain nothing.
+ * 	@AUTHOR		      Daniil (TwelveFacedJanus) Ermolaev.
+ * 	   | CONTACT:	  twofaced-janus@yandex.ru
+ *	@CREATED AT:	  10.16.26
+ *	@UPDATED_AT:	  10.16.26
+ *
+ *==================================================================================================*/
+
+#ifndef BSDJSON_H_
+#define BSDJSON_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bsdserver.h"
+
+#define JSONW_CHUNK 16384
+#define JSONW_MAX_DEPTH 64
+
+
+/*===============================================================================================
+ *
+ * 	@BRIEF:
+ * 		State of one JSON response being written.
+ * 	@DESCRIPTION:
+ * 		Values are appended to buf. When it fills up, buf is moved to the OutBuffer, and
+ * 		jsonw_finish() puts the headers in front of the body, so memory use does not depend on
+ * 		the body size beyond the OutBuffer itself.
+ * 	@PARAMETERS:
+ * 		JsonWriter.out       - OutBuffer*, response buffer;
+ * 		JsonWriter.start     - size_t, offset of the response in out;
+ * 		JsonWriter.headers   - const char*, extra header lines, each ending with CRLF;
+ * 		JsonWriter.flushed   - int, 1 once part of the body was moved to out;
+ * 		JsonWriter.failed    - int, 1 after an allocation failure or a nesting error;
+ * 		JsonWriter.depth     - int, open arrays and objects;
+ * 		JsonWriter.has_items - uint64_t, bit d set when level d already holds a value;
+ * 		JsonWriter.after_key - int, 1 between a key and its value;
+ * 		JsonWriter.len       - size_t, bytes in buf;
+ * 		JsonWriter.buf       - char[JSONW_CHUNK], staging buffer.
+ * 	@RETURN:
+ * 		None.
+ * 	@NOTES:
+ * 		Lives on the stack of the request handler, set it up with jsonw_init().
+ * 	@EXAMPLE:
+ * 		```c
+ * 		JsonWriter w;
+ * 		jsonw_init(&w, out);
+ * 		jsonw_object_begin(&w);
+ * 		jsonw_key(&w, "name");
+ * 		jsonw_string(&w, "Programming");
+ * 		jsonw_object_end(&w);
+ * 		jsonw_finish(&w);
+ * 		```
+ * 	@UPDATES:
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *	 	      Struct has been created.
+ *
+ * =============================================================================================*/
+typedef struct JsonWriter
+{
+	OutBuffer* out;
+	size_t start;
+	const char* headers;
+	int flushed;
+	int failed;
+	int depth;
+	uint64_t has_items;
+	int after_key;
+	size_t len;
+	char buf[JSONW_CHUNK];
+} JsonWriter;
+
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Starts a 200 OK application/json response.
+ *     @DESCRIPTION:
+ *          Nothing is written to out until the staging buffer fills or jsonw_finish() is called.
+ *     @PARAMETERS:
+ *          - JsonWriter* w: Writer to set up
+ *          - OutBuffer* out: Response buffer
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          jsonw_init(&w, out);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FIX]:
+ *               The chunked parameter is gone, every body gets a Content-Length.
+ *
+ =========================================================================================*/
+void jsonw_init(JsonWriter* w, OutBuffer* out);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Adds header lines to the response.
+ *     @DESCRIPTION:
+ *          The lines are written after Content-Type, e.g. the ETag of a listing.
+ *     @PARAMETERS:
+ *          - JsonWriter* w: Writer, before the first value is written
+ *          - const char* headers: Header lines, each ending with "\r\n", NULL for none
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - headers is not copied, it must stay valid until jsonw_finish()
+ *     @EXAMPLE:
+ *          ```c
+ *          jsonw_headers(&w, "Cache-Control: no-cache\r\n");
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void jsonw_headers(JsonWriter* w, const char* headers);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Opens or closes an object or array.
+ *     @DESCRIPTION:
+ *          Separating commas are written automatically. Nesting deeper than JSONW_MAX_DEPTH
+ *          or unbalanced ends make jsonw_finish() fail.
+ *     @PARAMETERS:
+ *          - JsonWriter* w: Writer
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - Inside an object every value must be preceded by jsonw_key()
+ *     @EXAMPLE:
+ *          ```c
+ *          jsonw_array_begin(&w);
+ *          jsonw_integer(&w, 1);
+ *          jsonw_array_end(&w);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void jsonw_object_begin(JsonWriter* w);
+void jsonw_object_end(JsonWriter* w);
+void jsonw_array_begin(JsonWriter* w);
+void jsonw_array_end(JsonWriter* w);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Writes an object key.
+ *     @DESCRIPTION:
+ *          The key is escaped like a string value.
+ *     @PARAMETERS:
+ *          - JsonWriter* w: Writer
+ *          - const char* key: NUL-terminated key
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          jsonw_key(&w, "notes_count");
+ *          jsonw_integer(&w, 12);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void jsonw_key(JsonWriter* w, const char* key);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Writes a value.
+ *     @DESCRIPTION:
+ *          Strings are escaped as JSON requires. Bytes that are not valid UTF-8 are written as
+ *          U+FFFD, so note text in another encoding still produces valid JSON. Reals are
+ *          written with 17 significant digits, non-finite reals as null.
+ *     @PARAMETERS:
+ *          - JsonWriter* w: Writer
+ *          - const char* s / size_t len: String, jsonw_string() takes a NUL-terminated one
+ *          - long long v / double v / int v: Number or boolean
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          jsonw_string_len(&w, text, len);
+ *          jsonw_real(&w, 0.25);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void jsonw_string(JsonWriter* w, const char* s);
+void jsonw_string_len(JsonWriter* w, const char* s, size_t len);
+void jsonw_integer(JsonWriter* w, long long v);
+void jsonw_real(JsonWriter* w, double v);
+void jsonw_bool(JsonWriter* w, int v);
+void jsonw_null(JsonWriter* w);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Completes the response.
+ *     @DESCRIPTION:
+ *          If the whole body is still in the staging buffer, writes the headers with its
+ *          Content-Length and the body. Otherwise inserts the headers with the final
+ *          Content-Length in front of the body already in out.
+ *     @PARAMETERS:
+ *          - JsonWriter* w: Writer
+ *     @RETURN:
+ *          - 0 on success
+ *          - -1 if the writer failed, the partial response is replaced with a 500
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          return jsonw_finish(&w);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FIX]:
+ *               Large bodies get a Content-Length too instead of chunked encoding.
+ *
+ =========================================================================================*/
+int jsonw_finish(JsonWriter* w);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Drops the response written so far.
+ *     @DESCRIPTION:
+ *          Used when an error is found after writing started, an error response can be
+ *          written to out afterwards.
+ *     @PARAMETERS:
+ *          - JsonWriter* w: Writer
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          jsonw_abort(&w);
+ *          http_text_response(out, "400 Bad Request", "400 Bad Request\r\n");
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void jsonw_abort(JsonWriter* w);
+
+#endif
@@ -0,0 +1,256 @@
+#include "./bsdcore.h"
+
+#include <pthread.h>
+
+#define LINES_READ_CHUNK (1024 * 1024)
+
+typedef struct LinesSlot
+{
+    // "book/note", empty for a free slot
+    char key[512];
+    LineIndex* idx;
+    unsigned long long used;
+} LinesSlot;
+
+static struct
+{
+    pthread_mutex_t lock;
+    LinesSlot slots[LINES_CACHE_SLOTS];
+    size_t bytes;
+    unsigned long long tick;
+} kept = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static size_t index_bytes(const LineIndex* idx)
+{
+    return sizeof(LineIndex) + idx->newlines * sizeof(off_t);
+}
+
+static int same_file(const struct stat* a, const struct stat* b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtime == b->st_mtime && NOTE_MTIME_NSEC(a) == NOTE_MTIME_NSEC(b);
+}
+
+// "book/note", empty when the names do not fit
+static void make_key(char* key, size_t size, const char* book_name, const char* note_name)
+{
+    int n = snprintf(key, size, "%s/%s", book_name, note_name);
+    if (n < 0 || (size_t)n >= size) {
+        key[0] = '\0';
+    }
+}
+
+static LineIndex* index_new(size_t capacity, const struct stat* st)
+{
+    LineIndex* idx = malloc(sizeof(LineIndex) + capacity * sizeof(off_t));
+    if (!idx) {
+        perror("malloc");
+        return NULL;
+    }
+    idx->refs = 1;
+    idx->st = *st;
+    idx->newlines = 0;
+    idx->lines = 0;
+    return idx;
+}
+
+static void count_lines(LineIndex* idx)
+{
+    off_t size = idx->st.st_size;
+    int open_line = size > 0 && (idx->newlines == 0 || idx->nl[idx->newlines - 1] != size - 1);
+    idx->lines = idx->newlines + open_line;
+}
+
+static void slot_clear(LinesSlot* slot)
+{
+    if (slot->idx) {
+        kept.bytes -= index_bytes(slot->idx);
+        lines_release(slot->idx);
+    }
+    slot->idx = NULL;
+    slot->key[0] = '\0';
+}
+
+// Keeps idx under key in place of the previous index of the note, or of the least used ones
+static void keep(const char* key, LineIndex* idx)
+{
+    size_t bytes = index_bytes(idx);
+    if (key[0] == '\0' || bytes > LINES_CACHE_BYTES / 4) {
+        return;
+    }
+    pthread_mutex_lock(&kept.lock);
+    LinesSlot* slot = NULL;
+    for (int i = 0; i < LINES_CACHE_SLOTS; i++) {
+        if (strcmp(kept.slots[i].key, key) == 0) {
+            slot = &kept.slots[i];
+            break;
+        }
+    }
+    if (slot) {
+        slot_clear(slot);
+    }
+    while (!slot || kept.bytes + bytes > LINES_CACHE_BYTES) {
+        LinesSlot* victim = NULL;
+        for (int i = 0; i < LINES_CACHE_SLOTS; i++) {
+            LinesSlot* s = &kept.slots[i];
+            if (s == slot) {
+                continue;
+            }
+            if (!s->idx) {
+                if (!slot) {
+                    slot = s;
+                }
+                continue;
+            }
+            if (!victim || s->used < victim->used) {
+                victim = s;
+            }
+        }
+        if (slot && kept.bytes + bytes <= LINES_CACHE_BYTES) {
+            break;
+        }
+        slot_clear(victim);
+    }
+    __atomic_add_fetch(&idx->refs, 1, __ATOMIC_RELAXED);
+    snprintf(slot->key, sizeof(slot->key), "%s", key);
+    slot->idx = idx;
+    slot->used = ++kept.tick;
+    kept.bytes += bytes;
+    pthread_mutex_unlock(&kept.lock);
+}
+
+static LineIndex* build(int fd, const struct stat* st)
+{
+    size_t capacity = 1024;
+    LineIndex* idx = index_new(capacity, st);
+    char* buf = malloc(LINES_READ_CHUNK);
+    if (!idx || !buf) {
+        if (!buf) {
+            perror("malloc");
+        }
+        free(idx);
+        free(buf);
+        return NULL;
+    }
+    off_t offset = 0;
+    while (offset < st->st_size) {
+        ssize_t n = pread(fd, buf, LINES_READ_CHUNK, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            free(idx);
+            free(buf);
+            return NULL;
+        }
+        for (const char* p = buf; (p = memchr(p, '\n', buf + n - p)); p++) {
+            if (idx->newlines == capacity) {
+                capacity *= 2;
+                LineIndex* grown = realloc(idx, sizeof(LineIndex) + capacity * sizeof(off_t));
+                if (!grown) {
+                    perror("realloc");
+                    free(idx);
+                    free(buf);
+                    return NULL;
+                }
+                idx = grown;
+            }
+            idx->nl[idx->newlines++] = offset + (p - buf);
+        }
+        offset += n;
+    }
+    free(buf);
+    count_lines(idx);
+    return idx;
+}
+
+LineIndex* lines_get(const char* book_name, const char* note_name, int fd, const struct stat* st)
+{
+    char key[512];
+    make_key(key, sizeof(key), book_name, note_name);
+    if (key[0] != '\0') {
+        pthread_mutex_lock(&kept.lock);
+        for (int i = 0; i < LINES_CACHE_SLOTS; i++) {
+            LinesSlot* slot = &kept.slots[i];
+            if (slot->idx && strcmp(slot->key, key) == 0 && same_file(&slot->idx->st, st)) {
+                LineIndex* idx = slot->idx;
+                __atomic_add_fetch(&idx->refs, 1, __ATOMIC_RELAXED);
+                slot->used = ++kept.tick;
+                pthread_mutex_unlock(&kept.lock);
+                return idx;
+            }
+        }
+        pthread_mutex_unlock(&kept.lock);
+    }
+
+    LineIndex* idx = build(fd, st);
+    if (idx) {
+        keep(key, idx);
+    }
+    return idx;
+}
+
+LineIndex* lines_apply(const char* book_name, const char* note_name, const LineIndex* old,
+                       const NoteEdit* edits, size_t count, const struct stat* st)
+{
+    size_t capacity = old->newlines;
+    for (size_t i = 0; i < count; i++) {
+        for (const char* p = edits[i].text; (p = memchr(p, '\n', edits[i].text + edits[i].text_len - p)); p++) {
+            capacity++;
+        }
+    }
+    LineIndex* idx = index_new(capacity, st);
+    if (!idx) {
+        return NULL;
+    }
+
+    // Newlines of the old note before offset move by delta, those in replaced bytes are gone
+    size_t next = 0;
+    off_t delta = 0;
+    for (size_t i = 0; i < count; i++) {
+        const NoteEdit* e = &edits[i];
+        while (next < old->newlines && old->nl[next] < e->offset) {
+            idx->nl[idx->newlines++] = old->nl[next++] + delta;
+        }
+        while (next < old->newlines && old->nl[next] < e->offset + e->length) {
+            next++;
+        }
+        for (const char* p = e->text; (p = memchr(p, '\n', e->text + e->text_len - p)); p++) {
+            idx->nl[idx->newlines++] = e->offset + delta + (p - e->text);
+        }
+        delta += (off_t)e->text_len - e->length;
+    }
+    while (next < old->newlines) {
+        idx->nl[idx->newlines++] = old->nl[next++] + delta;
+    }
+    count_lines(idx);
+
+    char key[512];
+    make_key(key, sizeof(key), book_name, note_name);
+    keep(key, idx);
+    return idx;
+}
+
+off_t lines_offset(const LineIndex* idx, size_t line)
+{
+    if (line == 0 || line > idx->lines + 1) {
+        return -1;
+    }
+    if (line == 1) {
+        return 0;
+    }
+    // Past the last newline only the end of a note without a final newline is left
+    return line - 2 < idx->newlines ? idx->nl[line - 2] + 1 : idx->st.st_size;
+}
+
+void lines_release(LineIndex* idx)
+{
+    if (!idx) {
+        return;
+    }
+    if (__atomic_sub_fetch(&idx->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(idx);
+    }
+}
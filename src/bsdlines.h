@@ -0,0 +1,176 @@
+/*=================================================================================================
+ *
+ * 	@FILENAME:	      bsdlines.h
+ * 	@BRIEF:    	      Line offsets of notes.
+ * 	@DESCRIPTION:	  Keeps the offsets of the newlines of recently edited notes, so a line number
+ * 	                  is turned into a byte offset without reading the note up to it. An edit
+ * 	                  shifts the offsets of the old index instead of rescanning the new note.
+ * 	@AUTHOR		      Daniil (TwelveFacedJanus) Ermolaev.
+ * 	   | CONTACT:	  twofaced-janus@yandex.ru
+ *	@CREATED AT:	  10.16.26
+ *	@UPDATED_AT:	  10.16.26
+ *
+ *==================================================================================================*/
+
+#ifndef BSDLINES_H_
+#define BSDLINES_H_
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "bsdwrite.h"
+
+// Notes whose index is kept
+#define LINES_CACHE_SLOTS 64
+// Bytes all kept indexes may take, 8 per line
+#define LINES_CACHE_BYTES (32 * 1024 * 1024)
+
+
+/*===============================================================================================
+ *
+ * 	@BRIEF:
+ * 		Line index of one version of a note.
+ * 	@DESCRIPTION:
+ * 		Offsets of every '\n' of the note, in order. Line 1 starts at 0, line k at the byte after
+ * 		newline k - 1. A last line without a newline is a line too.
+ * 	@PARAMETERS:
+ * 		LineIndex.refs     - int, references, changed atomically;
+ * 		LineIndex.st       - struct stat, the note it describes;
+ * 		LineIndex.lines    - size_t, number of lines;
+ * 		LineIndex.newlines - size_t, entries of nl;
+ * 		LineIndex.nl       - off_t[], newline offsets.
+ * 	@RETURN:
+ * 		None.
+ * 	@NOTES:
+ * 		Read only, release it with lines_release().
+ * 	@EXAMPLE:
+ * 		```c
+ * 		LineIndex* idx = lines_get("Programming", "C_Tips", fd, &st);
+ * 		off_t at = lines_offset(idx, 12);
+ * 		lines_release(idx);
+ * 		```
+ * 	@UPDATES:
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *	 	      Struct has been created.
+ *
+ * =============================================================================================*/
+typedef struct LineIndex
+{
+	int refs;
+	struct stat st;
+	size_t lines;
+	size_t newlines;
+	off_t nl[];
+} LineIndex;
+
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Returns the line index of a note.
+ *     @DESCRIPTION:
+ *          Served from the kept indexes when one matches the note's inode, size and mtime,
+ *          otherwise built by reading the note and kept.
+ *     @PARAMETERS:
+ *          - const char* book_name: Name of the book
+ *          - const char* note_name: Name of the note without .bdsb
+ *          - int fd: The note, opened with open_note()
+ *          - const struct stat* st: Its fstat()
+ *     @RETURN:
+ *          - LineIndex*: Index with a reference for the caller
+ *          - NULL if out of memory or the note cannot be read
+ *     @NOTES:
+ *          - Thread-safe
+ *     @EXAMPLE:
+ *          ```c
+ *          LineIndex* idx = lines_get("Programming", "C_Tips", fd, &st);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+LineIndex* lines_get(const char* book_name, const char* note_name, int fd, const struct stat* st);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Derives the line index of a note after edits.
+ *     @DESCRIPTION:
+ *          Newlines before, between and after the edits are shifted, those in replaced bytes
+ *          dropped and those in the new text added; the note is not read. The result is kept
+ *          for the next lines_get().
+ *     @PARAMETERS:
+ *          - const char* book_name: Name of the book
+ *          - const char* note_name: Name of the note without .bdsb
+ *          - const LineIndex* old: Index of the note the edits were applied to
+ *          - const NoteEdit* edits: Edits sorted by offset, not overlapping
+ *          - size_t count: Number of edits
+ *          - const struct stat* st: fstat() of the edited note
+ *     @RETURN:
+ *          - LineIndex*: New index with a reference for the caller
+ *          - NULL if out of memory
+ *     @NOTES:
+ *          - Thread-safe
+ *     @EXAMPLE:
+ *          ```c
+ *          LineIndex* next = lines_apply("Programming", "C_Tips", idx, edits, 2, &new_st);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+LineIndex* lines_apply(const char* book_name, const char* note_name, const LineIndex* old,
+                       const NoteEdit* edits, size_t count, const struct stat* st);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Returns the offset where a line starts.
+ *     @DESCRIPTION:
+ *          Line lines + 1 starts at the end of the note, so text can be appended.
+ *     @PARAMETERS:
+ *          - const LineIndex* idx: Index of the note
+ *          - size_t line: Line number, from 1 to idx->lines + 1
+ *     @RETURN:
+ *          - off_t: Offset of the first byte of the line
+ *          - -1 if there is no such line
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          off_t first = lines_offset(idx, 10);
+ *          off_t end = lines_offset(idx, 13);  // lines 10 to 12
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+off_t lines_offset(const LineIndex* idx, size_t line);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Drops a reference to a line index.
+ *     @DESCRIPTION:
+ *          The index is freed with its last reference. Accepts NULL.
+ *     @PARAMETERS:
+ *          - LineIndex* idx: Index to release
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - Thread-safe
+ *     @EXAMPLE:
+ *          ```c
+ *          lines_release(idx);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void lines_release(LineIndex* idx);
+
+#endif
@@ -0,0 +1,345 @@
+#include "./bsdcore.h"
+
+#include <pthread.h>
+
+#define SHARD_BUCKETS 256
+
+typedef struct CacheEntry
+{
+    char* key;
+    uint32_t hash;
+    size_t cost;
+    NoteBody* body;
+    struct CacheEntry* bucket_next;
+    // Most recently used first
+    struct CacheEntry* lru_prev;
+    struct CacheEntry* lru_next;
+} CacheEntry;
+
+typedef struct Shard
+{
+    pthread_mutex_t lock;
+    CacheEntry* buckets[SHARD_BUCKETS];
+    CacheEntry* lru_head;
+    CacheEntry* lru_tail;
+    size_t bytes;
+    size_t entries;
+    // Moves on every invalidation, a fill only lands if it did not move since the lookup
+    unsigned long long epoch;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long invalidations;
+} Shard;
+
+static struct
+{
+    size_t budget;
+    size_t shard_budget;
+    char* root;
+    Shard shards[NOTECACHE_SHARDS];
+} cache = {
+    .shards = { [0 ... NOTECACHE_SHARDS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER } },
+};
+
+static uint32_t hash_key(const char* key)
+{
+    uint32_t h = 2166136261u;
+    for (; *key; key++) {
+        h = (h ^ (unsigned char)*key) * 16777619u;
+    }
+    return h;
+}
+
+// "book/note", empty when the names do not fit
+static void make_key(char* key, size_t size, const char* book_name, const char* note_name)
+{
+    int n = snprintf(key, size, "%s/%s", book_name, note_name);
+    if (n < 0 || (size_t)n >= size) {
+        key[0] = '\0';
+    }
+}
+
+static Shard* shard_of(uint32_t hash)
+{
+    // The low bits pick the bucket inside the shard
+    return &cache.shards[(hash >> 24) % NOTECACHE_SHARDS];
+}
+
+static void lru_unlink(Shard* s, CacheEntry* e)
+{
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else s->lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else s->lru_tail = e->lru_prev;
+}
+
+static void lru_push_front(Shard* s, CacheEntry* e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = s->lru_head;
+    if (s->lru_head) s->lru_head->lru_prev = e;
+    else s->lru_tail = e;
+    s->lru_head = e;
+}
+
+// Returns the link pointing at the entry of key, or at the end of its bucket
+static CacheEntry** find_entry(Shard* s, const char* key, uint32_t hash)
+{
+    CacheEntry** link = &s->buckets[hash % SHARD_BUCKETS];
+    while (*link && ((*link)->hash != hash || strcmp((*link)->key, key) != 0)) {
+        link = &(*link)->bucket_next;
+    }
+    return link;
+}
+
+// Unlinks and frees an entry, the body lives on while responses hold it; shard lock held
+static void remove_entry(Shard* s, CacheEntry** link)
+{
+    CacheEntry* e = *link;
+    *link = e->bucket_next;
+    lru_unlink(s, e);
+    s->bytes -= e->cost;
+    s->entries--;
+    notecache_release(e->body);
+    free(e->key);
+    free(e);
+}
+
+// With the inotify catalog running, changed notes are invalidated as they change
+static int changes_are_pushed(void)
+{
+#if defined(__linux__)
+    return catalog_ready();
+#else
+    return 0;
+#endif
+}
+
+static int same_file(const struct stat* a, const struct stat* b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtime == b->st_mtime && NOTE_MTIME_NSEC(a) == NOTE_MTIME_NSEC(b);
+}
+
+void notecache_init(size_t budget)
+{
+    if (budget > 0 && !cache.root) {
+        char* root = get_default_books_path("/books");
+        if (!root || root[0] == '\0') {
+            return;
+        }
+        cache.root = root;
+    }
+    cache.shard_budget = budget / NOTECACHE_SHARDS;
+    cache.budget = budget;
+}
+
+NoteBody* notecache_get(const char* book_name, const char* note_name, unsigned long long* ticket)
+{
+    *ticket = 0;
+    char key[512];
+    make_key(key, sizeof(key), book_name, note_name);
+    if (cache.budget == 0 || key[0] == '\0') {
+        return NULL;
+    }
+
+    uint32_t hash = hash_key(key);
+    Shard* s = shard_of(hash);
+    pthread_mutex_lock(&s->lock);
+    CacheEntry** link = find_entry(s, key, hash);
+    NoteBody* body = NULL;
+    if (*link) {
+        body = (*link)->body;
+        __atomic_add_fetch(&body->refs, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (body && !changes_are_pushed()) {
+        char note_path[1024];
+        struct stat st;
+        snprintf(note_path, sizeof(note_path), "%s/%s/%s.bdsb", cache.root, book_name, note_name);
+        if (stat(note_path, &st) != 0 || !same_file(&st, &body->st)) {
+            notecache_release(body);
+            notecache_invalidate(book_name, note_name);
+            body = NULL;
+        }
+    }
+
+    pthread_mutex_lock(&s->lock);
+    if (body) {
+        // Checked again, the entry may have gone while the lock was dropped
+        link = find_entry(s, key, hash);
+        if (*link) {
+            lru_unlink(s, *link);
+            lru_push_front(s, *link);
+        }
+        s->hits++;
+    } else {
+        s->misses++;
+        *ticket = s->epoch;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return body;
+}
+
+NoteBody* notecache_fill(const char* book_name, const char* note_name, int fd,
+                         const struct stat* st, unsigned long long ticket)
+{
+    char key[512];
+    make_key(key, sizeof(key), book_name, note_name);
+    if (cache.budget == 0 || key[0] == '\0' || st->st_size > NOTECACHE_MAX_NOTE) {
+        return NULL;
+    }
+
+    size_t size = st->st_size;
+    NoteBody* body = malloc(sizeof(NoteBody) + size + 1);
+    if (!body) {
+        perror("malloc");
+        return NULL;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, body->data + done, size - done, done);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            // Truncated under us: the file is changing, let the caller stream it
+            free(body);
+            return NULL;
+        }
+        done += n;
+    }
+    body->data[size] = '\0';
+    body->len = size;
+    body->st = *st;
+    body->refs = 1;
+
+    size_t cost = sizeof(CacheEntry) + sizeof(NoteBody) + size + 1 + strlen(key) + 1;
+    if (cost > cache.shard_budget) {
+        return body;
+    }
+    CacheEntry* e = malloc(sizeof(CacheEntry));
+    char* key_copy = strdup(key);
+    if (!e || !key_copy) {
+        perror("malloc");
+        free(e);
+        free(key_copy);
+        return body;
+    }
+    e->key = key_copy;
+    e->hash = hash_key(key);
+    e->cost = cost;
+    e->body = body;
+
+    Shard* s = shard_of(e->hash);
+    pthread_mutex_lock(&s->lock);
+    if (s->epoch != ticket) {
+        // Invalidated while it was being read, what was read may be stale already
+        pthread_mutex_unlock(&s->lock);
+        free(e->key);
+        free(e);
+        return body;
+    }
+    CacheEntry** link = find_entry(s, key, e->hash);
+    if (*link) {
+        remove_entry(s, link);
+    }
+    while (s->lru_tail && s->bytes + cost > cache.shard_budget) {
+        remove_entry(s, find_entry(s, s->lru_tail->key, s->lru_tail->hash));
+        s->evictions++;
+    }
+    link = find_entry(s, key, e->hash);
+    e->bucket_next = NULL;
+    *link = e;
+    lru_push_front(s, e);
+    s->bytes += cost;
+    s->entries++;
+    __atomic_add_fetch(&body->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&s->lock);
+    return body;
+}
+
+// Drops every entry of a shard whose key starts with prefix; shard lock held
+static void drop_prefix(Shard* s, const char* prefix, size_t prefix_len)
+{
+    for (int i = 0; i < SHARD_BUCKETS; i++) {
+        CacheEntry** link = &s->buckets[i];
+        while (*link) {
+            if (strncmp((*link)->key, prefix, prefix_len) == 0) {
+                remove_entry(s, link);
+                s->invalidations++;
+            } else {
+                link = &(*link)->bucket_next;
+            }
+        }
+    }
+}
+
+void notecache_invalidate(const char* book_name, const char* note_name)
+{
+    if (cache.budget == 0) {
+        return;
+    }
+
+    if (book_name && note_name) {
+        char key[512];
+        make_key(key, sizeof(key), book_name, note_name);
+        if (key[0] == '\0') {
+            return;
+        }
+        uint32_t hash = hash_key(key);
+        Shard* s = shard_of(hash);
+        pthread_mutex_lock(&s->lock);
+        CacheEntry** link = find_entry(s, key, hash);
+        if (*link) {
+            remove_entry(s, link);
+            s->invalidations++;
+        }
+        s->epoch++;
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+
+    // A whole book, or everything: the notes are spread over all shards
+    char prefix[300];
+    int prefix_len = book_name ? snprintf(prefix, sizeof(prefix), "%s/", book_name) : 0;
+    if (prefix_len < 0 || (size_t)prefix_len >= sizeof(prefix)) {
+        return;
+    }
+    for (int i = 0; i < NOTECACHE_SHARDS; i++) {
+        Shard* s = &cache.shards[i];
+        pthread_mutex_lock(&s->lock);
+        drop_prefix(s, prefix, prefix_len);
+        s->epoch++;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+void notecache_release(NoteBody* body)
+{
+    if (!body) {
+        return;
+    }
+    if (__atomic_sub_fetch(&body->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(body);
+    }
+}
+
+void notecache_stats(NoteCacheStats* st)
+{
+    memset(st, 0, sizeof(*st));
+    st->budget = cache.budget;
+    for (int i = 0; i < NOTECACHE_SHARDS; i++) {
+        Shard* s = &cache.shards[i];
+        pthread_mutex_lock(&s->lock);
+        st->bytes += s->bytes;
+        st->entries += s->entries;
+        st->hits += s->hits;
+        st->misses += s->misses;
+        st->evictions += s->evictions;
+        st->invalidations += s->invalidations;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
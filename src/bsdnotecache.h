@@ -0,0 +1,259 @@
+/*=================================================================================================
+ *
+ * 	@FILENAME:	      bsdnotecache.h
+ * 	@BRIEF:    	      In-memory cache of note bodies for the HTTP server.
+ * 	@DESCRIPTION:	  Keeps recently read notes in memory, split into shards with their own lock
+ * 	                  and LRU list, within a byte budget. With the inotify catalog running, notes
+ * 	                  are dropped when the catalog sees them change and a hit makes no system
+ * 	                  call; elsewhere a hit is checked against the note's inode, size and mtime.
+ * 	@AUTHOR		      Daniil (TwelveFacedJanus) Ermolaev.
+ * 	   | CONTACT:	  twofaced-janus@yandex.ru
+ *	@CREATED AT:	  10.16.26
+ *	@UPDATED_AT:	  10.16.26
+ *
+ *==================================================================================================*/
+
+#ifndef BSDNOTECACHE_H_
+#define BSDNOTECACHE_H_
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#define NOTECACHE_SHARDS 16
+#define NOTECACHE_DEFAULT_BYTES (64 * 1024 * 1024)
+// Larger notes are sent with sendfile() and never cached
+#define NOTECACHE_MAX_NOTE (1024 * 1024)
+
+
+/*===============================================================================================
+ *
+ * 	@BRIEF:
+ * 		Cached note body.
+ * 	@DESCRIPTION:
+ * 		Reference counted like CompressedBody: the cache holds one reference while the note is
+ * 		cached and each caller that got it from notecache_get() or notecache_fill() another.
+ * 	@PARAMETERS:
+ * 		NoteBody.refs - int, references, changed atomically;
+ * 		NoteBody.st   - struct stat, the note's stat when it was read;
+ * 		NoteBody.len  - size_t, length of data;
+ * 		NoteBody.data - char[], note text followed by a NUL.
+ * 	@RETURN:
+ * 		None.
+ * 	@NOTES:
+ * 		Read only, release it with notecache_release().
+ * 	@EXAMPLE:
+ * 		```c
+ * 		NoteBody* body = notecache_get("Programming", "C_Tips", &ticket);
+ * 		if (body) {
+ * 		    outbuf_append(out, body->data, body->len);
+ * 		    notecache_release(body);
+ * 		}
+ * 		```
+ * 	@UPDATES:
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *	 	      Struct has been created.
+ *
+ * =============================================================================================*/
+typedef struct NoteBody
+{
+	int refs;
+	struct stat st;
+	size_t len;
+	char data[];
+} NoteBody;
+
+/*===============================================================================================
+ *
+ * 	@BRIEF:
+ * 		Note cache counters.
+ * 	@DESCRIPTION:
+ * 		Sums over all shards, filled by notecache_stats().
+ * 	@PARAMETERS:
+ * 		NoteCacheStats.budget        - size_t, byte budget, 0 when the cache is off;
+ * 		NoteCacheStats.bytes         - size_t, bytes held by the cached notes;
+ * 		NoteCacheStats.entries       - size_t, cached notes;
+ * 		NoteCacheStats.hits          - lookups answered from memory;
+ * 		NoteCacheStats.misses        - lookups that had to read the note;
+ * 		NoteCacheStats.evictions     - notes dropped to stay within the budget;
+ * 		NoteCacheStats.invalidations - notes dropped because they changed.
+ * 	@RETURN:
+ * 		None.
+ * 	@NOTES:
+ * 		None.
+ * 	@EXAMPLE:
+ * 		```c
+ * 		NoteCacheStats st;
+ * 		notecache_stats(&st);
+ * 		```
+ * 	@UPDATES:
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *	 	      Struct has been created.
+ *
+ * =============================================================================================*/
+typedef struct NoteCacheStats
+{
+	size_t budget;
+	size_t bytes;
+	size_t entries;
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long evictions;
+	unsigned long long invalidations;
+} NoteCacheStats;
+
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Turns the note cache on.
+ *     @DESCRIPTION:
+ *          The budget is split evenly between the shards. Until this is called, and after it is
+ *          called with 0, every lookup misses and nothing is cached.
+ *     @PARAMETERS:
+ *          - size_t budget: Bytes the cached notes may take, 0 to turn the cache off
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - Call it before catalog_start() and the server threads
+ *     @EXAMPLE:
+ *          ```c
+ *          notecache_init(NOTECACHE_DEFAULT_BYTES);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void notecache_init(size_t budget);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Looks up a note.
+ *     @DESCRIPTION:
+ *          A hit moves the note to the front of its shard's LRU list. When the catalog does not
+ *          watch the books, the note is first stat()ed and dropped if it changed.
+ *     @PARAMETERS:
+ *          - const char* book_name: Name of the book
+ *          - const char* note_name: Name of the note without .bdsb
+ *          - unsigned long long* ticket: Set on a miss, pass it to notecache_fill()
+ *     @RETURN:
+ *          - NoteBody*: Cached note with a new reference
+ *          - NULL on a miss
+ *     @NOTES:
+ *          - Thread-safe
+ *     @EXAMPLE:
+ *          ```c
+ *          unsigned long long ticket;
+ *          NoteBody* body = notecache_get("Programming", "C_Tips", &ticket);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+NoteBody* notecache_get(const char* book_name, const char* note_name, unsigned long long* ticket);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Reads a note after a miss and caches it.
+ *     @DESCRIPTION:
+ *          Reads the whole note from fd. The note is cached unless it changed since the lookup
+ *          that gave the ticket, so a read racing with a change never outlives the change.
+ *     @PARAMETERS:
+ *          - const char* book_name: Name of the book
+ *          - const char* note_name: Name of the note without .bdsb
+ *          - int fd: Note opened with open_note(), left open
+ *          - const struct stat* st: Its fstat()
+ *          - unsigned long long ticket: From the notecache_get() that missed
+ *     @RETURN:
+ *          - NoteBody*: Note read into memory, with a reference for the caller
+ *          - NULL if the cache is off, the note is over NOTECACHE_MAX_NOTE or cannot be read
+ *     @NOTES:
+ *          - Thread-safe
+ *     @EXAMPLE:
+ *          ```c
+ *          body = notecache_fill("Programming", "C_Tips", fd, &st, ticket);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+NoteBody* notecache_fill(const char* book_name, const char* note_name, int fd,
+                         const struct stat* st, unsigned long long ticket);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Drops changed notes from the cache.
+ *     @DESCRIPTION:
+ *          Called by the catalog for every inotify event on a note or book.
+ *     @PARAMETERS:
+ *          - const char* book_name: Name of the book, NULL for every note
+ *          - const char* note_name: Name of the note without .bdsb, NULL for the whole book
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - Thread-safe
+ *     @EXAMPLE:
+ *          ```c
+ *          notecache_invalidate("Programming", "C_Tips");
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void notecache_invalidate(const char* book_name, const char* note_name);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Drops a reference to a cached note.
+ *     @DESCRIPTION:
+ *          The body is freed with its last reference. Accepts NULL.
+ *     @PARAMETERS:
+ *          - NoteBody* body: Note to release
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - Thread-safe
+ *     @EXAMPLE:
+ *          ```c
+ *          notecache_release(body);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void notecache_release(NoteBody* body);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Reads the cache counters.
+ *     @DESCRIPTION:
+ *          Each shard is read under its lock, the sums are not one atomic snapshot.
+ *     @PARAMETERS:
+ *          - NoteCacheStats* st: Filled with the counters
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - Served by GET /stats/cache
+ *     @EXAMPLE:
+ *          ```c
+ *          NoteCacheStats st;
+ *          notecache_stats(&st);
+ *          printf("%llu hits\n", st.hits);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void notecache_stats(NoteCacheStats* st);
+
+#endif
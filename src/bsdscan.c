@@ -0,0 +1,356 @@
+#include "./bsdcore.h"
+
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define SCAN_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SCAN_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+typedef struct ScanKernel
+{
+    const char* name;
+    // First candidate position in [from, to), to if there is none; len bounds the reads
+    size_t (*find)(const ScanSet* set, const unsigned char* buf, size_t from, size_t to, size_t len);
+    size_t (*newlines)(const unsigned char* buf, size_t len);
+} ScanKernel;
+
+int scan_set_init(ScanSet* set, const char* const* patterns, int count)
+{
+    memset(set, 0, sizeof(*set));
+    if (count < 1 || count > SCAN_MAX_PATTERNS) {
+        return -1;
+    }
+
+    set->pairs = 1;
+    for (int i = 0; i < count; i++) {
+        set->patterns[i] = patterns[i];
+        set->lengths[i] = strlen(patterns[i]);
+        if (set->lengths[i] == 0) {
+            return -1;
+        }
+        if (set->lengths[i] < 2) {
+            set->pairs = 0;
+        }
+        set->by_first[(unsigned char)patterns[i][0]] |= 1u << i;
+    }
+    set->count = count;
+
+    for (int i = 0; i < count; i++) {
+        unsigned char b0 = patterns[i][0];
+        unsigned char b1 = set->pairs ? patterns[i][1] : 0;
+        int known = 0;
+        for (int f = 0; f < set->filters_count && !known; f++) {
+            known = set->filter0[f] == b0 && set->filter1[f] == b1;
+        }
+        if (known) {
+            continue;
+        }
+        if (set->filters_count == SCAN_MAX_FILTERS) {
+            // Too many distinct prefixes for the vector filter, use the byte table
+            set->filters_count = 0;
+            set->pairs = 0;
+            break;
+        }
+        set->filter0[set->filters_count] = b0;
+        set->filter1[set->filters_count] = b1;
+        set->filters_count++;
+    }
+    return 0;
+}
+
+static int filter_match(const ScanSet* set, const unsigned char* buf, size_t i, size_t len)
+{
+    if (set->filters_count == 0) {
+        return set->by_first[buf[i]] != 0;
+    }
+    for (int f = 0; f < set->filters_count; f++) {
+        if (buf[i] == set->filter0[f] &&
+            (!set->pairs || (i + 1 < len && buf[i + 1] == set->filter1[f]))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static uint32_t match_at(const ScanSet* set, const unsigned char* buf, size_t i, size_t len)
+{
+    uint32_t hit = 0;
+    for (uint32_t m = set->by_first[buf[i]]; m; m &= m - 1) {
+        int k = __builtin_ctz(m);
+        if (set->lengths[k] <= len - i && memcmp(buf + i, set->patterns[k], set->lengths[k]) == 0) {
+            hit |= 1u << k;
+        }
+    }
+    return hit;
+}
+
+static size_t find_scalar(const ScanSet* set, const unsigned char* buf, size_t from, size_t to, size_t len)
+{
+    // Usual case, every pattern starts with the same byte ('#' for tags): let memchr() skip
+    int one_first = set->filters_count > 0;
+    for (int f = 1; f < set->filters_count; f++) {
+        one_first = one_first && set->filter0[f] == set->filter0[0];
+    }
+    if (one_first) {
+        const unsigned char* p = buf + from;
+        while ((p = memchr(p, set->filter0[0], buf + to - p)) != NULL) {
+            if (filter_match(set, buf, p - buf, len)) {
+                return p - buf;
+            }
+            p++;
+        }
+        return to;
+    }
+    for (size_t i = from; i < to; i++) {
+        if (filter_match(set, buf, i, len)) {
+            return i;
+        }
+    }
+    return to;
+}
+
+static size_t newlines_scalar(const unsigned char* buf, size_t len)
+{
+    size_t count = 0;
+    const unsigned char* end = buf + len;
+    for (const unsigned char* p = buf; (p = memchr(p, '\n', end - p)) != NULL; p++) {
+        count++;
+    }
+    return count;
+}
+
+static const ScanKernel scalar_kernel = { "scalar", find_scalar, newlines_scalar };
+
+#if defined(SCAN_HAVE_SSE2)
+static size_t find_sse2(const ScanSet* set, const unsigned char* buf, size_t from, size_t to, size_t len)
+{
+    int n = set->filters_count;
+    if (n == 0) {
+        return find_scalar(set, buf, from, to, len);
+    }
+
+    __m128i f0[SCAN_MAX_FILTERS], f1[SCAN_MAX_FILTERS];
+    for (int f = 0; f < n; f++) {
+        f0[f] = _mm_set1_epi8((char)set->filter0[f]);
+        f1[f] = _mm_set1_epi8((char)set->filter1[f]);
+    }
+
+    // With pairs the second load reads one byte further
+    size_t i = from;
+    for (; i < to && i + 16 + set->pairs <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(buf + i));
+        __m128i b = set->pairs ? _mm_loadu_si128((const __m128i*)(buf + i + 1)) : a;
+        __m128i m = _mm_setzero_si128();
+        for (int f = 0; f < n; f++) {
+            __m128i e = _mm_cmpeq_epi8(a, f0[f]);
+            if (set->pairs) e = _mm_and_si128(e, _mm_cmpeq_epi8(b, f1[f]));
+            m = _mm_or_si128(m, e);
+        }
+        unsigned bits = (unsigned)_mm_movemask_epi8(m);
+        if (bits) {
+            size_t c = i + __builtin_ctz(bits);
+            return c < to ? c : to;
+        }
+    }
+    for (; i < to; i++) {
+        if (filter_match(set, buf, i, len)) {
+            return i;
+        }
+    }
+    return to;
+}
+
+static size_t newlines_sse2(const unsigned char* buf, size_t len)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(buf + i));
+        count += __builtin_popcount((unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(a, nl)));
+    }
+    return count + newlines_scalar(buf + i, len - i);
+}
+
+static const ScanKernel sse2_kernel = { "sse2", find_sse2, newlines_sse2 };
+#endif
+
+#if defined(SCAN_HAVE_AVX2)
+__attribute__((target("avx2")))
+static size_t find_avx2(const ScanSet* set, const unsigned char* buf, size_t from, size_t to, size_t len)
+{
+    int n = set->filters_count;
+    if (n == 0) {
+        return find_scalar(set, buf, from, to, len);
+    }
+
+    __m256i f0[SCAN_MAX_FILTERS], f1[SCAN_MAX_FILTERS];
+    for (int f = 0; f < n; f++) {
+        f0[f] = _mm256_set1_epi8((char)set->filter0[f]);
+        f1[f] = _mm256_set1_epi8((char)set->filter1[f]);
+    }
+
+    size_t i = from;
+    for (; i < to && i + 32 + set->pairs <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(buf + i));
+        __m256i b = set->pairs ? _mm256_loadu_si256((const __m256i*)(buf + i + 1)) : a;
+        __m256i m = _mm256_setzero_si256();
+        for (int f = 0; f < n; f++) {
+            __m256i e = _mm256_cmpeq_epi8(a, f0[f]);
+            if (set->pairs) e = _mm256_and_si256(e, _mm256_cmpeq_epi8(b, f1[f]));
+            m = _mm256_or_si256(m, e);
+        }
+        unsigned bits = (unsigned)_mm256_movemask_epi8(m);
+        if (bits) {
+            size_t c = i + __builtin_ctz(bits);
+            return c < to ? c : to;
+        }
+    }
+    for (; i < to; i++) {
+        if (filter_match(set, buf, i, len)) {
+            return i;
+        }
+    }
+    return to;
+}
+
+__attribute__((target("avx2")))
+static size_t newlines_avx2(const unsigned char* buf, size_t len)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(buf + i));
+        count += __builtin_popcount((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, nl)));
+    }
+    return count + newlines_scalar(buf + i, len - i);
+}
+
+static const ScanKernel avx2_kernel = { "avx2", find_avx2, newlines_avx2 };
+#endif
+
+static const ScanKernel* kernel;
+
+static const ScanKernel* scan_kernel(void)
+{
+    const ScanKernel* k = __atomic_load_n(&kernel, __ATOMIC_ACQUIRE);
+    if (k) {
+        return k;
+    }
+
+    k = &scalar_kernel;
+#if defined(SCAN_HAVE_SSE2)
+    k = &sse2_kernel;
+#endif
+#if defined(SCAN_HAVE_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        k = &avx2_kernel;
+    }
+#endif
+
+    const char* force = getenv("BSDSCAN_KERNEL");
+    if (force && strcmp(force, "scalar") == 0) {
+        k = &scalar_kernel;
+    }
+#if defined(SCAN_HAVE_SSE2)
+    if (force && strcmp(force, "sse2") == 0) {
+        k = &sse2_kernel;
+    }
+#endif
+
+    // Every thread computes the same answer, racing here is harmless
+    __atomic_store_n(&kernel, k, __ATOMIC_RELEASE);
+    return k;
+}
+
+const char* scan_kernel_name(void)
+{
+    return scan_kernel()->name;
+}
+
+size_t scan_buffer(const ScanSet* set, const char* text, size_t len, ScanVisitor visit, void* ctx)
+{
+    const unsigned char* buf = (const unsigned char*)text;
+    const ScanKernel* k = scan_kernel();
+    size_t reported = 0;
+    size_t from = 0;
+    // Start of the first line whose newlines are not counted yet
+    size_t line_pos = 0;
+    uint32_t line = 1;
+
+    while (from < len) {
+        size_t cand = k->find(set, buf, from, len, len);
+        if (cand >= len) {
+            break;
+        }
+        uint32_t hit = match_at(set, buf, cand, len);
+        if (!hit) {
+            from = cand + 1;
+            continue;
+        }
+
+        line += k->newlines(buf + line_pos, cand - line_pos);
+        size_t start = cand;
+        while (start > line_pos && buf[start - 1] != '\n') {
+            start--;
+        }
+        const unsigned char* nl = memchr(buf + cand, '\n', len - cand);
+        size_t end = nl ? (size_t)(nl - buf) : len;
+
+        // Collect the other patterns of the same line before reporting it
+        for (size_t p = cand + 1; (p = k->find(set, buf, p, end, len)) < end; p++) {
+            hit |= match_at(set, buf, p, len);
+        }
+
+        reported++;
+        if (visit(text + start, end - start, line, hit, ctx) != 0 || end >= len) {
+            break;
+        }
+        line++;
+        line_pos = from = end + 1;
+    }
+    return reported;
+}
+
+long scan_file(const ScanSet* set, int dir_fd, const char* file_name, ScanVisitor visit, void* ctx)
+{
+    int fd = openat(dir_fd, file_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+
+    long found = 0;
+    size_t size = st.st_size;
+    if (size > 0 && size <= SCAN_READ_MAX) {
+        char buf[SCAN_READ_MAX];
+        size_t got = 0;
+        ssize_t n;
+        while (got < size && (n = read(fd, buf + got, size - got)) > 0) {
+            got += n;
+        }
+        found = scan_buffer(set, buf, got, visit, ctx);
+    } else if (size > 0) {
+        void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+        found = scan_buffer(set, map, size, visit, ctx);
+        munmap(map, size);
+    }
+    close(fd);
+    return found;
+}
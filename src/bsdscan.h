@@ -0,0 +1,179 @@
+/*=================================================================================================
+ *
+ * 	@FILENAME:	      bsdscan.h
+ * 	@BRIEF:    	      Multi-pattern line scanner for tag and text search.
+ * 	@DESCRIPTION:	  Finds the lines of a buffer or file that contain any of a set of patterns.
+ * 	                  Candidate positions and newlines are located with SSE2/AVX2 (chosen at
+ * 	                  run time) or a scalar fallback, whole files are scanned through mmap().
+ * 	@AUTHOR		      Daniil (TwelveFacedJanus) Ermolaev.
+ * 	   | CONTACT:	  twofaced-janus@yandex.ru
+ *	@CREATED AT:	  10.16.26
+ *	@UPDATED_AT:	  10.16.26
+ *
+ *==================================================================================================*/
+
+#ifndef BSDSCAN_H_
+#define BSDSCAN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCAN_MAX_PATTERNS 32
+#define SCAN_MAX_FILTERS 8
+// Files up to this size are read() instead of mapped
+#define SCAN_READ_MAX (64 * 1024)
+
+
+/*===============================================================================================
+ *
+ * 	@BRIEF:
+ * 		Compiled pattern set.
+ * 	@DESCRIPTION:
+ * 		Candidates are filtered on the first two bytes of every pattern (or the first byte
+ * 		when a pattern is one byte long) and then verified with memcmp(). Up to
+ * 		SCAN_MAX_FILTERS distinct filters are checked with SIMD, larger sets use a byte table.
+ * 	@PARAMETERS:
+ * 		ScanSet.patterns, lengths - patterns, not copied;
+ * 		ScanSet.count             - number of patterns;
+ * 		ScanSet.pairs             - 1 if filters use two bytes;
+ * 		ScanSet.filters_count     - distinct filters, 0 selects the table;
+ * 		ScanSet.filter0, filter1  - first and second byte of each filter;
+ * 		ScanSet.by_first          - patterns starting with each byte, as a bit mask.
+ * 	@RETURN:
+ * 		None.
+ * 	@NOTES:
+ * 		Filled by scan_set_init().
+ * 	@EXAMPLE:
+ * 		None.
+ * 	@UPDATES:
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *	 	      Struct has been created.
+ *
+ * =============================================================================================*/
+typedef struct ScanSet
+{
+	const char* patterns[SCAN_MAX_PATTERNS];
+	size_t lengths[SCAN_MAX_PATTERNS];
+	int count;
+	int pairs;
+	int filters_count;
+	unsigned char filter0[SCAN_MAX_FILTERS];
+	unsigned char filter1[SCAN_MAX_FILTERS];
+	uint32_t by_first[256];
+} ScanSet;
+
+/*
+ * Called once per matching line. patterns has bit i set when patterns[i] occurs in the line.
+ * line is not NUL-terminated and excludes the newline. Return non-zero to stop the scan.
+ */
+typedef int (*ScanVisitor)(const char* line, size_t len, uint32_t line_number, uint32_t patterns, void* ctx);
+
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Compiles a pattern set.
+ *     @DESCRIPTION:
+ *          Builds the candidate filters and the first byte table.
+ *     @PARAMETERS:
+ *          - ScanSet* set: Set to fill
+ *          - const char* const* patterns: NUL-terminated patterns, kept by reference
+ *          - int count: Number of patterns, 1 to SCAN_MAX_PATTERNS
+ *     @RETURN:
+ *          - 0 on success, -1 if count is out of range or a pattern is empty
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          const char* tags[] = { "#todo", "#link" };
+ *          ScanSet set;
+ *          scan_set_init(&set, tags, 2);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int scan_set_init(ScanSet* set, const char* const* patterns, int count);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Reports the lines of a buffer that contain any pattern.
+ *     @DESCRIPTION:
+ *          Lines are numbered from 1 whatever their length. Each matching line is reported
+ *          once, with all patterns it contains.
+ *     @PARAMETERS:
+ *          - const ScanSet* set: Compiled patterns
+ *          - const char* buf: Text
+ *          - size_t len: Text length
+ *          - ScanVisitor visit: Called for every matching line
+ *          - void* ctx: Passed to visit
+ *     @RETURN:
+ *          - Number of matching lines reported
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          scan_buffer(&set, text, text_len, print_line, NULL);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+size_t scan_buffer(const ScanSet* set, const char* buf, size_t len, ScanVisitor visit, void* ctx);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Reports the lines of a regular file that contain any pattern.
+ *     @DESCRIPTION:
+ *          Small files are read into a buffer, larger ones are mapped with mmap() and
+ *          MADV_SEQUENTIAL.
+ *     @PARAMETERS:
+ *          - const ScanSet* set: Compiled patterns
+ *          - int dir_fd: Directory file_name is relative to, or AT_FDCWD
+ *          - const char* file_name: File to scan
+ *          - ScanVisitor visit: Called for every matching line
+ *          - void* ctx: Passed to visit
+ *     @RETURN:
+ *          - Number of matching lines reported
+ *          - -1 if the file cannot be opened or is not a regular file
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          scan_file(&set, dirfd(dir), "note.bdsb", print_line, NULL);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+long scan_file(const ScanSet* set, int dir_fd, const char* file_name, ScanVisitor visit, void* ctx);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Names the scan kernel in use.
+ *     @DESCRIPTION:
+ *          Chosen on first use from the CPU features: "avx2", "sse2" or "scalar".
+ *     @PARAMETERS:
+ *          - None
+ *     @RETURN:
+ *          - const char*: Kernel name
+ *     @NOTES:
+ *          - The BSDSCAN_KERNEL environment variable ("scalar", "sse2") forces a slower kernel
+ *     @EXAMPLE:
+ *          ```c
+ *          printf("scanner: %s\n", scan_kernel_name());
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+const char* scan_kernel_name(void);
+
+#endif
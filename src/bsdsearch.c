@@ -0,0 +1,499 @@
+#include "./bsdcore.h"
+
+#include <pthread.h>
+
+typedef struct SearchBook
+{
+    const char* name;
+    size_t first_task;
+    size_t tasks_count;
+} SearchBook;
+
+typedef struct SearchTask
+{
+    union {
+        size_t offset;      // in the name pool while listing
+        const char* ptr;
+    } name;
+    uint32_t book;
+    // d_type did not tell, check with fstatat() before scanning
+    int check_type;
+    // Set by the worker that scanned the note
+    int worker;
+    int error;
+    int done;
+    size_t first_hit;
+    size_t hits_count;
+} SearchTask;
+
+typedef struct SearchHit
+{
+    uint32_t line;
+    uint32_t patterns;
+    size_t text;
+    size_t len;
+} SearchHit;
+
+typedef struct SearchWorker
+{
+    pthread_mutex_t lock;
+    // Tasks [lo, hi) not taken yet, pop from lo, thieves take from hi
+    size_t lo;
+    size_t hi;
+    struct SearchRun* run;
+    int id;
+    pthread_t thread;
+    int started;
+
+    // Directory of the last book, consecutive tasks are mostly in the same book
+    uint32_t book;
+    int book_fd;
+
+    SearchTask* task;
+    SearchHit* hits;
+    size_t hits_count;
+    size_t hits_cap;
+    char* text;
+    size_t text_len;
+    size_t text_cap;
+    int out_of_memory;
+
+    // Keeps the locks of neighbouring workers in different cache lines
+    char pad[64];
+} SearchWorker;
+
+typedef struct SearchRun
+{
+    ScanSet set;
+    size_t max_hits;
+    int books_fd;
+    SearchBook* books;
+    size_t books_count;
+    SearchTask* tasks;
+    size_t tasks_count;
+    SearchWorker* workers;
+    int workers_count;
+
+    // With max_hits: tasks [0, frontier) are done and hold frontier_hits lines. Once that
+    // reaches max_hits, no task after cutoff can be reported and those are skipped.
+    pthread_mutex_t frontier_lock;
+    size_t frontier;
+    size_t frontier_hits;
+    size_t cutoff;
+} SearchRun;
+
+// Appends len bytes and a NUL to a growable buffer, returns the offset or (size_t)-1
+static size_t pool_add(char** pool, size_t* len, size_t* cap, const char* data, size_t data_len)
+{
+    if (*len + data_len + 1 > *cap) {
+        size_t new_cap = *cap ? *cap : 4096;
+        while (*len + data_len + 1 > new_cap) {
+            new_cap *= 2;
+        }
+        char* grown = realloc(*pool, new_cap);
+        if (!grown) {
+            return (size_t)-1;
+        }
+        *pool = grown;
+        *cap = new_cap;
+    }
+    size_t offset = *len;
+    memcpy(*pool + offset, data, data_len);
+    (*pool)[offset + data_len] = '\0';
+    *len += data_len + 1;
+    return offset;
+}
+
+static int compare_books(const void* a, const void* b)
+{
+    return strcmp(((const SearchBook*)a)->name, ((const SearchBook*)b)->name);
+}
+
+static int compare_tasks(const void* a, const void* b)
+{
+    return strcmp(((const SearchTask*)a)->name.ptr, ((const SearchTask*)b)->name.ptr);
+}
+
+static int list_books(SearchRun* run, char** pool)
+{
+    DIR* dir = fdopendir(dup(run->books_fd));
+    if (!dir) {
+        return -1;
+    }
+
+    size_t pool_len = 0, pool_cap = 0, books_cap = 0;
+    size_t* offsets = NULL;
+    struct dirent* entry;
+    struct stat st;
+    while ((entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            fstatat(run->books_fd, entry->d_name, &st, 0) != 0 || !S_ISDIR(st.st_mode)) {
+            continue;
+        }
+        if (run->books_count == books_cap) {
+            books_cap = books_cap ? books_cap * 2 : 64;
+            size_t* grown = realloc(offsets, books_cap * sizeof(*offsets));
+            if (!grown) {
+                goto fail;
+            }
+            offsets = grown;
+        }
+        size_t offset = pool_add(pool, &pool_len, &pool_cap, entry->d_name, strlen(entry->d_name));
+        if (offset == (size_t)-1) {
+            goto fail;
+        }
+        offsets[run->books_count++] = offset;
+    }
+    closedir(dir);
+
+    run->books = calloc(run->books_count ? run->books_count : 1, sizeof(*run->books));
+    if (!run->books) {
+        free(offsets);
+        return -1;
+    }
+    for (size_t i = 0; i < run->books_count; i++) {
+        run->books[i].name = *pool + offsets[i];
+    }
+    free(offsets);
+    qsort(run->books, run->books_count, sizeof(*run->books), compare_books);
+    return 0;
+
+fail:
+    closedir(dir);
+    free(offsets);
+    return -1;
+}
+
+static int list_notes(SearchRun* run, char** pool)
+{
+    size_t pool_len = 0, pool_cap = 0, tasks_cap = 0;
+    for (size_t b = 0; b < run->books_count; b++) {
+        SearchBook* book = &run->books[b];
+        book->first_task = run->tasks_count;
+
+        int fd = openat(run->books_fd, book->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DIR* dir = fd >= 0 ? fdopendir(fd) : NULL;
+        if (!dir) {
+            perror("Unable to open book directory");
+            if (fd >= 0) close(fd);
+            continue;
+        }
+
+        struct dirent* entry;
+        while ((entry = readdir(dir))) {
+            int check_type = 1;
+#ifdef DT_UNKNOWN
+            if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK) {
+                if (entry->d_type != DT_REG) {
+                    continue;
+                }
+                check_type = 0;
+            }
+#endif
+            if (run->tasks_count == tasks_cap) {
+                tasks_cap = tasks_cap ? tasks_cap * 2 : 1024;
+                SearchTask* grown = realloc(run->tasks, tasks_cap * sizeof(*run->tasks));
+                if (!grown) {
+                    closedir(dir);
+                    return -1;
+                }
+                run->tasks = grown;
+            }
+            size_t offset = pool_add(pool, &pool_len, &pool_cap, entry->d_name, strlen(entry->d_name));
+            if (offset == (size_t)-1) {
+                closedir(dir);
+                return -1;
+            }
+            SearchTask* task = &run->tasks[run->tasks_count++];
+            memset(task, 0, sizeof(*task));
+            task->name.offset = offset;
+            task->book = (uint32_t)b;
+            task->check_type = check_type;
+            task->worker = -1;
+        }
+        closedir(dir);
+        book->tasks_count = run->tasks_count - book->first_task;
+    }
+
+    // The pool no longer moves, sort the notes of each book by name
+    for (size_t i = 0; i < run->tasks_count; i++) {
+        run->tasks[i].name.ptr = *pool + run->tasks[i].name.offset;
+    }
+    for (size_t b = 0; b < run->books_count; b++) {
+        qsort(run->tasks + run->books[b].first_task, run->books[b].tasks_count,
+              sizeof(*run->tasks), compare_tasks);
+    }
+    return 0;
+}
+
+static int collect_hit(const char* line, size_t len, uint32_t line_number, uint32_t patterns, void* ctx)
+{
+    SearchWorker* worker = ctx;
+    SearchTask* task = worker->task;
+
+    if (worker->hits_count == worker->hits_cap) {
+        size_t new_cap = worker->hits_cap ? worker->hits_cap * 2 : 256;
+        SearchHit* grown = realloc(worker->hits, new_cap * sizeof(*worker->hits));
+        if (!grown) {
+            worker->out_of_memory = 1;
+            return 1;
+        }
+        worker->hits = grown;
+        worker->hits_cap = new_cap;
+    }
+    size_t text = pool_add(&worker->text, &worker->text_len, &worker->text_cap, line, len);
+    if (text == (size_t)-1) {
+        worker->out_of_memory = 1;
+        return 1;
+    }
+
+    SearchHit* hit = &worker->hits[worker->hits_count++];
+    hit->line = line_number;
+    hit->patterns = patterns;
+    hit->text = text;
+    hit->len = len;
+    task->hits_count++;
+
+    // No single note needs more than max_hits lines, even if it is the first one reported
+    return worker->run->max_hits && task->hits_count >= worker->run->max_hits;
+}
+
+static int take_task(SearchWorker* self, size_t* task)
+{
+    pthread_mutex_lock(&self->lock);
+    if (self->lo < self->hi) {
+        *task = self->lo++;
+        pthread_mutex_unlock(&self->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    // Steal the second half of what another worker has left, it will not reach it soon
+    SearchRun* run = self->run;
+    for (int k = 1; k < run->workers_count; k++) {
+        SearchWorker* victim = &run->workers[(self->id + k) % run->workers_count];
+        pthread_mutex_lock(&victim->lock);
+        size_t left = victim->hi - victim->lo;
+        if (left == 0) {
+            pthread_mutex_unlock(&victim->lock);
+            continue;
+        }
+        size_t hi = victim->hi;
+        size_t mid = hi - (left + 1) / 2;
+        victim->hi = mid;
+        pthread_mutex_unlock(&victim->lock);
+
+        pthread_mutex_lock(&self->lock);
+        self->lo = mid + 1;
+        self->hi = hi;
+        pthread_mutex_unlock(&self->lock);
+        *task = mid;
+        return 1;
+    }
+    return 0;
+}
+
+static void advance_frontier(SearchRun* run)
+{
+    // Whoever holds the lock advances past our task too, or a later finisher will
+    if (pthread_mutex_trylock(&run->frontier_lock) != 0) {
+        return;
+    }
+    while (run->frontier < run->tasks_count &&
+           __atomic_load_n(&run->tasks[run->frontier].done, __ATOMIC_ACQUIRE)) {
+        run->frontier_hits += run->tasks[run->frontier].hits_count;
+        run->frontier++;
+        if (run->frontier_hits >= run->max_hits) {
+            __atomic_store_n(&run->cutoff, run->frontier - 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&run->frontier_lock);
+}
+
+static void run_task(SearchWorker* worker, SearchTask* task)
+{
+    SearchRun* run = worker->run;
+    if ((size_t)(task - run->tasks) > __atomic_load_n(&run->cutoff, __ATOMIC_RELAXED)) {
+        return;
+    }
+    task->worker = worker->id;
+    task->first_hit = worker->hits_count;
+
+    if (worker->book_fd < 0 || worker->book != task->book) {
+        if (worker->book_fd >= 0) {
+            close(worker->book_fd);
+        }
+        worker->book = task->book;
+        worker->book_fd = openat(run->books_fd, run->books[task->book].name,
+                                 O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (worker->book_fd < 0) {
+        task->error = errno;
+        return;
+    }
+
+    struct stat st;
+    if (task->check_type &&
+        (fstatat(worker->book_fd, task->name.ptr, &st, 0) != 0 || !S_ISREG(st.st_mode))) {
+        return;
+    }
+
+    worker->task = task;
+    errno = 0;
+    if (scan_file(&run->set, worker->book_fd, task->name.ptr, collect_hit, worker) < 0) {
+        task->error = errno ? errno : EIO;
+    }
+}
+
+static void* search_worker(void* arg)
+{
+    SearchWorker* worker = arg;
+    SearchRun* run = worker->run;
+    size_t task;
+    while (!worker->out_of_memory && take_task(worker, &task)) {
+        run_task(worker, &run->tasks[task]);
+        if (run->max_hits) {
+            __atomic_store_n(&run->tasks[task].done, 1, __ATOMIC_RELEASE);
+            advance_frontier(run);
+        }
+    }
+    // Leave nothing behind for the others if memory ran out
+    if (worker->out_of_memory) {
+        pthread_mutex_lock(&worker->lock);
+        worker->lo = worker->hi;
+        pthread_mutex_unlock(&worker->lock);
+    }
+    return NULL;
+}
+
+static int thread_count(int threads, size_t tasks_count)
+{
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+    if (threads > SEARCH_MAX_THREADS) {
+        threads = SEARCH_MAX_THREADS;
+    }
+    size_t useful = (tasks_count + SEARCH_MIN_NOTES_PER_THREAD - 1) / SEARCH_MIN_NOTES_PER_THREAD;
+    if ((size_t)threads > useful) {
+        threads = useful > 0 ? (int)useful : 1;
+    }
+    return threads;
+}
+
+static long report_hits(SearchRun* run, SearchVisitor visit, void* ctx)
+{
+    long reported = 0;
+    for (size_t t = 0; t < run->tasks_count; t++) {
+        const SearchTask* task = &run->tasks[t];
+        if (task->error) {
+            errno = task->error;
+            perror("Unable to open note file");
+            continue;
+        }
+        if (task->worker < 0) {
+            continue;
+        }
+
+        const SearchWorker* worker = &run->workers[task->worker];
+        const char* book_name = run->books[task->book].name;
+        for (size_t h = task->first_hit; h < task->first_hit + task->hits_count; h++) {
+            const SearchHit* hit = &worker->hits[h];
+            reported++;
+            if (visit(book_name, task->name.ptr, hit->line, worker->text + hit->text, hit->len,
+                      hit->patterns, ctx) != 0 ||
+                (run->max_hits && (size_t)reported >= run->max_hits)) {
+                return reported;
+            }
+        }
+    }
+    return reported;
+}
+
+long search_notes(const char* const* patterns, int count, int threads, size_t max_hits,
+                  SearchVisitor visit, void* ctx)
+{
+    SearchRun run;
+    memset(&run, 0, sizeof(run));
+    if (scan_set_init(&run.set, patterns, count) != 0) {
+        return -1;
+    }
+    run.max_hits = max_hits;
+    run.cutoff = (size_t)-1;
+
+    char* default_books_path = get_default_books_path("/books");
+    run.books_fd = default_books_path ? open(default_books_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+    free(default_books_path);
+    if (run.books_fd < 0) {
+        perror("Unable to open 'books' directory");
+        return -1;
+    }
+
+    pthread_mutex_init(&run.frontier_lock, NULL);
+    long reported = -1;
+    char* book_names = NULL;
+    char* note_names = NULL;
+    if (list_books(&run, &book_names) != 0 || list_notes(&run, &note_names) != 0) {
+        perror("Unable to list notes");
+        goto out;
+    }
+
+    run.workers_count = thread_count(threads, run.tasks_count);
+    run.workers = calloc(run.workers_count, sizeof(*run.workers));
+    if (!run.workers) {
+        perror("calloc");
+        goto out;
+    }
+    for (int i = 0; i < run.workers_count; i++) {
+        SearchWorker* worker = &run.workers[i];
+        pthread_mutex_init(&worker->lock, NULL);
+        worker->lo = run.tasks_count * i / run.workers_count;
+        worker->hi = run.tasks_count * (i + 1) / run.workers_count;
+        worker->run = &run;
+        worker->id = i;
+        worker->book_fd = -1;
+    }
+
+    // The caller is worker 0; a slice whose thread failed to start is stolen by the others
+    for (int i = 1; i < run.workers_count; i++) {
+        run.workers[i].started = pthread_create(&run.workers[i].thread, NULL, search_worker, &run.workers[i]) == 0;
+    }
+    search_worker(&run.workers[0]);
+
+    int out_of_memory = run.workers[0].out_of_memory;
+    for (int i = 1; i < run.workers_count; i++) {
+        if (run.workers[i].started) {
+            pthread_join(run.workers[i].thread, NULL);
+        }
+        out_of_memory |= run.workers[i].out_of_memory;
+    }
+
+    if (out_of_memory) {
+        errno = ENOMEM;
+        perror("Search aborted");
+    } else {
+        reported = report_hits(&run, visit, ctx);
+    }
+
+    for (int i = 0; i < run.workers_count; i++) {
+        SearchWorker* worker = &run.workers[i];
+        if (worker->book_fd >= 0) {
+            close(worker->book_fd);
+        }
+        free(worker->hits);
+        free(worker->text);
+        pthread_mutex_destroy(&worker->lock);
+    }
+    free(run.workers);
+
+out:
+    pthread_mutex_destroy(&run.frontier_lock);
+    free(run.tasks);
+    free(run.books);
+    free(note_names);
+    free(book_names);
+    close(run.books_fd);
+    return reported;
+}
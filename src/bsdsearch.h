@@ -0,0 +1,78 @@
+/*=================================================================================================
+ *
+ * 	@FILENAME:	      bsdsearch.h
+ * 	@BRIEF:    	      Parallel text search over all notes.
+ * 	@DESCRIPTION:	  Spreads the note files of every book over a pool of threads that steal work
+ * 	                  from each other, so one huge book is shared by all cores, and reports the
+ * 	                  matching lines in book, note and line order whatever thread found them.
+ * 	@AUTHOR		      Daniil (TwelveFacedJanus) Ermolaev.
+ * 	   | CONTACT:	  twofaced-janus@yandex.ru
+ *	@CREATED AT:	  10.16.26
+ *	@UPDATED_AT:	  10.16.26
+ *
+ *==================================================================================================*/
+
+#ifndef BSDSEARCH_H_
+#define BSDSEARCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SEARCH_MAX_THREADS 64
+// Below this many notes per thread, starting another thread costs more than it saves
+#define SEARCH_MIN_NOTES_PER_THREAD 16
+
+/*
+ * Called once per matching line, in book, note and line order. note_name is the file name.
+ * text is the line without its newline, NUL-terminated and len bytes long. patterns has bit i
+ * set when patterns[i] occurs in the line. Return non-zero to stop the search.
+ */
+typedef int (*SearchVisitor)(const char* book_name, const char* note_name, uint32_t line,
+                             const char* text, size_t len, uint32_t patterns, void* ctx);
+
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Finds the lines of all notes that contain any of the patterns.
+ *     @DESCRIPTION:
+ *          Lists the regular files of every book directory under $HOME/books and gives each
+ *          thread an equal slice of them. A thread that runs out of notes takes the second half
+ *          of the remaining slice of another thread. Each note is scanned with scan_file(), its
+ *          hits are kept per note and handed to visit once all threads are done, sorted by book
+ *          name, note name and line, so the output does not depend on the thread count.
+ *     @PARAMETERS:
+ *          - const char* const* patterns: Patterns, as for scan_set_init()
+ *          - int count: Number of patterns, 1 to SCAN_MAX_PATTERNS
+ *          - int threads: Threads to use including the caller, 0 for one per online CPU
+ *          - size_t max_hits: Stop after this many lines, 0 for no limit
+ *          - SearchVisitor visit: Called for every matching line
+ *          - void* ctx: Passed to visit
+ *     @RETURN:
+ *          - Number of lines passed to visit
+ *          - -1 if the patterns are invalid, the books directory cannot be read or memory ran out
+ *     @NOTES:
+ *          - Notes that cannot be read are reported with perror() and skipped
+ *          - Matching lines are copied until the search ends, a search for a very common
+ *            pattern without max_hits holds the matching text of the whole corpus
+ *     @EXAMPLE:
+ *          ```c
+ *          static int print_hit(const char* book, const char* note, uint32_t line,
+ *                               const char* text, size_t len, uint32_t patterns, void* ctx)
+ *          {
+ *              printf("%s/%s:%u %s\n", book, note, line, text);
+ *              return 0;
+ *          }
+ *
+ *          const char* query = "TODO";
+ *          search_notes(&query, 1, 0, 0, print_hit, NULL);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+long search_notes(const char* const* patterns, int count, int threads, size_t max_hits,
+                  SearchVisitor visit, void* ctx);
+
+#endif
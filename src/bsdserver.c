@@ -0,0 +1,1133 @@
+#include "./bsdcore.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <netinet/tcp.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#else
+#include <sys/event.h>
+#include <sys/uio.h>
+#endif
+
+#include <pthread.h>
+
+#define POLLER_IN  1
+#define POLLER_OUT 2
+
+#if defined(SO_REUSEPORT_LB)
+#define SERVER_REUSEPORT SO_REUSEPORT_LB
+#elif defined(SO_REUSEPORT)
+#define SERVER_REUSEPORT SO_REUSEPORT
+#endif
+
+typedef enum ConnState
+{
+    CONN_READING,
+    CONN_WRITING,
+    CONN_CLOSED
+} ConnState;
+
+typedef struct Conn
+{
+    int fd;
+    ConnState state;
+    int close_after;
+    int sent_continue;
+    long long last_active_ms;
+    // Event stream: no more requests are read, changes are pushed as they happen
+    int streaming;
+    unsigned long long event_seq;
+    char* in;
+    size_t in_len;
+    size_t in_cap;
+    HttpParser parser;
+    OutBuffer out;
+    // Idle list, least recently active first
+    struct Conn* idle_prev;
+    struct Conn* idle_next;
+    struct Conn* next_dead;
+    struct Conn* stream_prev;
+    struct Conn* stream_next;
+    // Request answered by the slow-request threads; later requests wait until it is back
+    struct SlowJob* job;
+    // Input is full while the job is pending, reading resumes when it is back
+    int paused;
+} Conn;
+
+typedef struct Worker
+{
+    int id;
+    int listen_fd;
+    int pfd;
+    int max_connections;
+    int idle_timeout_ms;
+    size_t max_body;
+    size_t max_input;
+    long long now_ms;
+    pthread_t thread;
+    Conn* idle_head;
+    Conn* idle_tail;
+    Conn* dead;
+    Conn* streams;
+    // Written by the change log when there is something to push to the streams, and when a job is done
+    int wake_fd[2];
+    // Jobs the slow-request threads finished for this worker's connections
+    pthread_mutex_t done_lock;
+    struct SlowJob* done;
+    WorkerStats stats;
+} Worker;
+
+typedef struct SlowJob
+{
+    struct SlowJob* next;
+    Worker* worker;
+    // Only touched by the worker thread, NULL once the connection is closed
+    Conn* conn;
+    // The request points into raw, a copy of its bytes, so the connection may keep reading
+    HttpRequest req;
+    char* raw;
+    OutBuffer out;
+} SlowJob;
+
+// Requests that would stall an event loop, see http_request_blocks()
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    SlowJob* head;
+    SlowJob* tail;
+} slow = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+typedef struct PollEvent
+{
+    void* ptr;
+    int flags;
+} PollEvent;
+
+static int outbuf_reserve(OutBuffer* out, size_t len)
+{
+    if (out->len + len > out->cap) {
+        size_t cap = out->cap ? out->cap : 1024;
+        while (cap < out->len + len) {
+            cap *= 2;
+        }
+        char* data_new = realloc(out->data, cap);
+        if (!data_new) {
+            perror("realloc");
+            return -1;
+        }
+        out->data = data_new;
+        out->cap = cap;
+    }
+    return 0;
+}
+
+int outbuf_append(OutBuffer* out, const void* data, size_t len)
+{
+    if (outbuf_reserve(out, len) != 0) {
+        return -1;
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+    return 0;
+}
+
+int outbuf_printf(OutBuffer* out, const char* fmt, ...)
+{
+    va_list args;
+    char small[512];
+
+    va_start(args, fmt);
+    int n = vsnprintf(small, sizeof(small), fmt, args);
+    va_end(args);
+    if (n < 0) {
+        return -1;
+    }
+    if ((size_t)n < sizeof(small)) {
+        return outbuf_append(out, small, n);
+    }
+
+    // Formatted text did not fit, render it again straight into the buffer
+    if (outbuf_reserve(out, n + 1) != 0) {
+        return -1;
+    }
+    va_start(args, fmt);
+    vsnprintf(out->data + out->len, n + 1, fmt, args);
+    va_end(args);
+    out->len += n;
+    return 0;
+}
+
+int http_text_response(OutBuffer* out, const char* status, const char* body)
+{
+    size_t body_len = strlen(body);
+    if (outbuf_printf(out,
+                      "HTTP/1.1 %s\r\n"
+                      "Content-Type: text/plain\r\n"
+                      "Content-Length: %zu\r\n"
+                      "\r\n",
+                      status, body_len) != 0) {
+        return -1;
+    }
+    return outbuf_append(out, body, body_len);
+}
+
+int outbuf_attach_file(OutBuffer* out, int fd, off_t offset, off_t length)
+{
+    if (out->has_file) {
+        return -1;
+    }
+    out->has_file = 1;
+    out->file_fd = fd;
+    out->file_off = offset;
+    out->file_len = length;
+    return 0;
+}
+
+void outbuf_drop_body(OutBuffer* out, size_t start)
+{
+    if (out->len > start) {
+        char* head_end = memmem(out->data + start, out->len - start, "\r\n\r\n", 4);
+        if (head_end) {
+            out->len = head_end + 4 - out->data;
+        }
+    }
+    if (out->has_file) {
+        close(out->file_fd);
+        out->has_file = 0;
+    }
+}
+
+void outbuf_free(OutBuffer* out)
+{
+    if (out->has_file) {
+        close(out->file_fd);
+    }
+    free(out->data);
+    memset(out, 0, sizeof(*out));
+}
+
+/*
+ * Sends up to len bytes of a file straight from the page cache. Returns the number of bytes
+ * sent, or -1 with errno set (EAGAIN when a non-blocking socket is full).
+ */
+static ssize_t send_file_chunk(int sock, int fd, off_t offset, off_t len)
+{
+    size_t chunk = len > SERVER_SENDFILE_CHUNK ? SERVER_SENDFILE_CHUNK : (size_t)len;
+#if defined(__linux__)
+    return sendfile(sock, fd, &offset, chunk);
+#elif defined(__FreeBSD__)
+    off_t sent = 0;
+    if (sendfile(fd, sock, offset, chunk, NULL, &sent, 0) < 0 && sent == 0) {
+        return -1;
+    }
+    return sent;
+#else
+    char buf[16384];
+    ssize_t n = pread(fd, buf, chunk < sizeof(buf) ? chunk : sizeof(buf), offset);
+    if (n <= 0) {
+        return n;
+    }
+    return write(sock, buf, n);
+#endif
+}
+
+static int outbuf_send_file(int sock, OutBuffer* out, unsigned long long* bytes_out)
+{
+    while (out->file_len > 0) {
+        ssize_t n = send_file_chunk(sock, out->file_fd, out->file_off, out->file_len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            // File shrank under us, the response can no longer be framed
+            errno = EIO;
+            return -1;
+        }
+        out->file_off += n;
+        out->file_len -= n;
+        if (bytes_out) {
+            __atomic_fetch_add(bytes_out, n, __ATOMIC_RELAXED);
+        }
+    }
+    close(out->file_fd);
+    out->has_file = 0;
+    return 1;
+}
+
+int outbuf_write_all(int fd, OutBuffer* out)
+{
+    if (write_all(fd, out->data + out->sent, out->len - out->sent) != 0) {
+        return -1;
+    }
+    out->sent = out->len;
+    if (out->has_file && outbuf_send_file(fd, out, NULL) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+int write_all(int fd, const void* data, size_t len)
+{
+    const char* p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Thin poller layer: epoll on Linux, kqueue on the BSDs.
+ */
+static int poller_create(void)
+{
+#if defined(__linux__)
+    return epoll_create1(0);
+#else
+    return kqueue();
+#endif
+}
+
+static int poller_set(int pfd, int fd, void* ptr, int events, int add)
+{
+#if defined(__linux__)
+    struct epoll_event ev;
+    ev.events = ((events & POLLER_IN) ? EPOLLIN : 0) | ((events & POLLER_OUT) ? EPOLLOUT : 0);
+    ev.data.ptr = ptr;
+    return epoll_ctl(pfd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+#else
+    (void)add;
+    struct kevent ch[2];
+    EV_SET(&ch[0], fd, EVFILT_READ, EV_ADD | ((events & POLLER_IN) ? EV_ENABLE : EV_DISABLE), 0, 0, ptr);
+    EV_SET(&ch[1], fd, EVFILT_WRITE, EV_ADD | ((events & POLLER_OUT) ? EV_ENABLE : EV_DISABLE), 0, 0, ptr);
+    return kevent(pfd, ch, 2, NULL, 0, NULL);
+#endif
+}
+
+static int poller_wait(int pfd, PollEvent* out, int max, int timeout_ms)
+{
+#if defined(__linux__)
+    struct epoll_event evs[SERVER_MAX_EVENTS];
+    if (max > SERVER_MAX_EVENTS) {
+        max = SERVER_MAX_EVENTS;
+    }
+    int n = epoll_wait(pfd, evs, max, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        out[i].ptr = evs[i].data.ptr;
+        out[i].flags = 0;
+        // Errors and hang-ups are reported as readable so read() surfaces them
+        if (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+            out[i].flags |= POLLER_IN;
+        }
+        if (evs[i].events & EPOLLOUT) {
+            out[i].flags |= POLLER_OUT;
+        }
+    }
+    return n;
+#else
+    struct kevent evs[SERVER_MAX_EVENTS];
+    struct timespec ts, *tsp = NULL;
+    if (max > SERVER_MAX_EVENTS) {
+        max = SERVER_MAX_EVENTS;
+    }
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        tsp = &ts;
+    }
+    int n = kevent(pfd, NULL, 0, evs, max, tsp);
+    for (int i = 0; i < n; i++) {
+        out[i].ptr = evs[i].udata;
+        out[i].flags = (evs[i].filter == EVFILT_WRITE) ? POLLER_OUT : POLLER_IN;
+    }
+    return n;
+#endif
+}
+
+static Worker* workers_all = NULL;
+static int workers_count = 0;
+
+static void stat_add(unsigned long long* counter, unsigned long long v)
+{
+    __atomic_fetch_add(counter, v, __ATOMIC_RELAXED);
+}
+
+static long long monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static Conn* conn_new(int fd, size_t max_body)
+{
+    Conn* conn = calloc(1, sizeof(Conn));
+    if (!conn) {
+        return NULL;
+    }
+    conn->in = malloc(BUFFER_SIZE);
+    if (!conn->in) {
+        free(conn);
+        return NULL;
+    }
+    conn->in_cap = BUFFER_SIZE;
+    conn->fd = fd;
+    conn->state = CONN_READING;
+    http_parser_init(&conn->parser, 0, max_body);
+    return conn;
+}
+
+static void job_free(SlowJob* job)
+{
+    outbuf_free(&job->out);
+    free(job->raw);
+    free(job);
+}
+
+static void* slow_loop(void* arg)
+{
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&slow.lock);
+        while (!slow.head) {
+            pthread_cond_wait(&slow.cond, &slow.lock);
+        }
+        SlowJob* job = slow.head;
+        slow.head = job->next;
+        if (!slow.head) {
+            slow.tail = NULL;
+        }
+        pthread_mutex_unlock(&slow.lock);
+
+        handle_http_request_parsed(&job->out, &job->req);
+
+        Worker* w = job->worker;
+        pthread_mutex_lock(&w->done_lock);
+        job->next = w->done;
+        w->done = job;
+        pthread_mutex_unlock(&w->done_lock);
+        char byte = 1;
+        // A full pipe means the worker has a wakeup pending already
+        if (write(w->wake_fd[1], &byte, 1) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("write");
+        }
+    }
+    return NULL;
+}
+
+static int slow_start(int count)
+{
+    for (int i = 0; i < count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, slow_loop, NULL) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+// Queues a copy of the request; the connection reads on but answers nothing until it is done
+static int job_submit(Worker* w, Conn* conn, const HttpRequest* req)
+{
+    SlowJob* job = calloc(1, sizeof(SlowJob));
+    char* raw = job ? malloc(req->consumed ? req->consumed : 1) : NULL;
+    if (!raw) {
+        free(job);
+        return -1;
+    }
+    memcpy(raw, conn->in, req->consumed);
+
+    // Every pointer of the request lies in the consumed bytes
+    job->req = *req;
+#define REBASE(p) ((p) ? raw + ((p) - conn->in) : NULL)
+    job->req.method = REBASE(req->method);
+    job->req.path = REBASE(req->path);
+    job->req.query = REBASE(req->query);
+    job->req.body = REBASE(req->body);
+    for (int i = 0; i < req->header_count; i++) {
+        job->req.headers[i].name = REBASE(req->headers[i].name);
+        job->req.headers[i].value = REBASE(req->headers[i].value);
+    }
+#undef REBASE
+    job->raw = raw;
+    job->worker = w;
+    job->conn = conn;
+    conn->job = job;
+
+    pthread_mutex_lock(&slow.lock);
+    if (slow.tail) {
+        slow.tail->next = job;
+    } else {
+        slow.head = job;
+    }
+    slow.tail = job;
+    pthread_cond_signal(&slow.cond);
+    pthread_mutex_unlock(&slow.lock);
+    return 0;
+}
+
+static void conn_free(Conn* conn)
+{
+    outbuf_free(&conn->out);
+    free(conn->in);
+    free(conn);
+}
+
+static void idle_unlink(Worker* w, Conn* conn)
+{
+    if (conn->idle_prev) {
+        conn->idle_prev->idle_next = conn->idle_next;
+    } else if (w->idle_head == conn) {
+        w->idle_head = conn->idle_next;
+    }
+    if (conn->idle_next) {
+        conn->idle_next->idle_prev = conn->idle_prev;
+    } else if (w->idle_tail == conn) {
+        w->idle_tail = conn->idle_prev;
+    }
+    conn->idle_prev = conn->idle_next = NULL;
+}
+
+// Moves the connection to the tail of the idle list, so expiry only ever looks at the head
+static void conn_touch(Worker* w, Conn* conn)
+{
+    conn->last_active_ms = w->now_ms;
+    if (w->idle_tail == conn) {
+        return;
+    }
+    idle_unlink(w, conn);
+    conn->idle_prev = w->idle_tail;
+    if (w->idle_tail) {
+        w->idle_tail->idle_next = conn;
+    } else {
+        w->idle_head = conn;
+    }
+    w->idle_tail = conn;
+}
+
+static void stream_unlink(Worker* w, Conn* conn)
+{
+    if (conn->stream_prev) {
+        conn->stream_prev->stream_next = conn->stream_next;
+    } else {
+        w->streams = conn->stream_next;
+    }
+    if (conn->stream_next) {
+        conn->stream_next->stream_prev = conn->stream_prev;
+    }
+    conn->stream_prev = conn->stream_next = NULL;
+    __atomic_fetch_sub(&w->stats.streams, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Connections are closed immediately but freed only after the current batch of events,
+ * because kqueue may still report a second filter for the same descriptor.
+ */
+static void conn_close(Worker* w, Conn* conn)
+{
+    if (conn->state == CONN_CLOSED) {
+        return;
+    }
+    idle_unlink(w, conn);
+    if (conn->streaming) {
+        stream_unlink(w, conn);
+    }
+    if (conn->job) {
+        // The job is freed when it comes back
+        conn->job->conn = NULL;
+        conn->job = NULL;
+    }
+    close(conn->fd);
+    conn->state = CONN_CLOSED;
+    conn->next_dead = w->dead;
+    w->dead = conn;
+    __atomic_fetch_sub(&w->stats.active, 1, __ATOMIC_RELAXED);
+}
+
+// Returns 1 when the whole response has been flushed, 0 if the socket is full, -1 on error
+static int conn_flush(Worker* w, Conn* conn)
+{
+    OutBuffer* out = &conn->out;
+    while (out->sent < out->len) {
+        ssize_t n = write(conn->fd, out->data + out->sent, out->len - out->sent);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        out->sent += n;
+        stat_add(&w->stats.bytes_out, n);
+    }
+    if (out->has_file) {
+        int rc = outbuf_send_file(conn->fd, out, &w->stats.bytes_out);
+        if (rc != 1) {
+            return rc;
+        }
+    }
+    // Everything is on the wire, reuse the buffer for the next responses
+    out->len = 0;
+    out->sent = 0;
+    return 1;
+}
+
+static void conn_drop_input(Conn* conn, size_t len)
+{
+    memmove(conn->in, conn->in + len, conn->in_len - len);
+    conn->in_len -= len;
+    // Give back memory borrowed for a large request once it is gone
+    if (conn->in_len == 0 && conn->in_cap > BUFFER_SIZE) {
+        char* in = realloc(conn->in, BUFFER_SIZE);
+        if (in) {
+            conn->in = in;
+            conn->in_cap = BUFFER_SIZE;
+        }
+    }
+}
+
+/*
+ * Answers every complete request already buffered, in arrival order, so pipelined requests
+ * are served back to back. Stops once enough output is queued to apply backpressure, or
+ * when a file body is attached since later responses must follow it on the wire.
+ */
+static void conn_process(Worker* w, Conn* conn)
+{
+    if (conn->streaming) {
+        // Nothing more is expected from an event stream client
+        conn->in_len = 0;
+        return;
+    }
+    while (!conn->close_after && !conn->job && !conn->out.has_file && conn->out.len < SERVER_MAX_PIPELINE_BYTES) {
+        HttpRequest req;
+        int rc = http_parse(&conn->parser, conn->in, conn->in_len, &req);
+        if (rc == HTTP_PARSE_INCOMPLETE && conn->in_len >= w->max_input) {
+            // Reading stops at a full buffer, a request that still does not fit never will
+            rc = HTTP_PARSE_BODY_TOO_LARGE;
+        }
+        if (rc == HTTP_PARSE_INCOMPLETE) {
+            if (conn->parser.expect_continue && !conn->sent_continue) {
+                outbuf_printf(&conn->out, "HTTP/1.1 100 Continue\r\n\r\n");
+                conn->sent_continue = 1;
+            }
+            break;
+        }
+        if (rc < 0) {
+            // Framing is lost after a malformed request, answer and hang up
+            http_text_response(&conn->out, http_status_line(-rc), "Malformed or oversized request\r\n");
+            conn->close_after = 1;
+            break;
+        }
+
+        conn->close_after = !req.keep_alive;
+        // A scan over every note is answered by the slow-request threads, not this event loop
+        int deferred = http_request_blocks(&req) && job_submit(w, conn, &req) == 0;
+        if (!deferred) {
+            handle_http_request_parsed(&conn->out, &req);
+            stat_add(&w->stats.requests, 1);
+        }
+
+        conn_drop_input(conn, req.consumed);
+        http_parser_init(&conn->parser, 0, w->max_body);
+        conn->sent_continue = 0;
+
+        if (conn->out.stream) {
+            conn->out.stream = 0;
+            conn->streaming = 1;
+            conn->event_seq = conn->out.stream_seq;
+            conn->stream_next = w->streams;
+            if (w->streams) {
+                w->streams->stream_prev = conn;
+            }
+            w->streams = conn;
+            __atomic_fetch_add(&w->stats.streams, 1, __ATOMIC_RELAXED);
+            conn->in_len = 0;
+            break;
+        }
+    }
+}
+
+static void conn_advance(Worker* w, Conn* conn)
+{
+    while (conn->state != CONN_CLOSED) {
+        conn_process(w, conn);
+        if (conn->out.len == 0 && !conn->out.has_file) {
+            break;
+        }
+
+        int rc = conn_flush(w, conn);
+        if (rc < 0) {
+            conn_close(w, conn);
+            return;
+        }
+        if (rc == 0) {
+            // Peer is slow: stop reading until it drains what we have queued
+            if (conn->state != CONN_WRITING) {
+                conn->state = CONN_WRITING;
+                if (poller_set(w->pfd, conn->fd, conn, POLLER_OUT, 0) < 0) {
+                    conn_close(w, conn);
+                }
+            }
+            return;
+        }
+        if (conn->close_after && !conn->job) {
+            conn_close(w, conn);
+            return;
+        }
+    }
+
+    if (conn->state == CONN_WRITING) {
+        conn->state = CONN_READING;
+        if (poller_set(w->pfd, conn->fd, conn, POLLER_IN, 0) < 0) {
+            conn_close(w, conn);
+        }
+    }
+}
+
+static void conn_on_writable(Worker* w, Conn* conn)
+{
+    conn_touch(w, conn);
+    conn_advance(w, conn);
+}
+
+static void conn_on_readable(Worker* w, Conn* conn)
+{
+    if (conn->paused) {
+        // Only errors and hang-ups are reported while reading is paused
+        conn_close(w, conn);
+        return;
+    }
+    conn_touch(w, conn);
+    while (1) {
+        if (conn->in_len == conn->in_cap) {
+            // Grow for large headers or bodies, the parser enforces the actual limits
+            size_t cap = conn->in_cap * 2;
+            if (cap > w->max_input) {
+                cap = w->max_input;
+            }
+            char* in = cap > conn->in_cap ? realloc(conn->in, cap) : NULL;
+            if (!in) {
+                break;
+            }
+            conn->in = in;
+            conn->in_cap = cap;
+        }
+
+        ssize_t n = read(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                conn_close(w, conn);
+                return;
+            }
+            break;
+        }
+        if (n == 0) {
+            conn_close(w, conn);
+            return;
+        }
+        conn->in_len += n;
+    }
+    conn_advance(w, conn);
+    // Nothing is parsed until the job is back, a full buffer would be reported readable forever
+    if (conn->state == CONN_READING && conn->job && conn->in_len == conn->in_cap) {
+        if (poller_set(w->pfd, conn->fd, conn, 0, 0) < 0) {
+            conn_close(w, conn);
+            return;
+        }
+        conn->paused = 1;
+    }
+}
+
+// Sends what was queued on an event stream, dropping clients that cannot keep up
+static void stream_push(Worker* w, Conn* conn)
+{
+    if (conn->out.len - conn->out.sent > SERVER_MAX_STREAM_BACKLOG) {
+        conn_close(w, conn);
+        return;
+    }
+    conn_touch(w, conn);
+    conn_advance(w, conn);
+}
+
+static void push_changes(Worker* w)
+{
+    char drain[64];
+    while (read(w->wake_fd[0], drain, sizeof(drain)) > 0) {
+    }
+    for (Conn* conn = w->streams; conn; ) {
+        Conn* next = conn->stream_next;
+        size_t len = conn->out.len;
+        write_change_events(&conn->out, &conn->event_seq);
+        if (conn->out.len != len) {
+            stream_push(w, conn);
+        }
+        conn = next;
+    }
+}
+
+// Queues the answers of finished jobs behind the responses their connections already had
+// Reading paused by conn_on_readable() is needed again once the job is back
+static int conn_resume(Worker* w, Conn* conn)
+{
+    if (!conn->paused) {
+        return 0;
+    }
+    conn->paused = 0;
+    return poller_set(w->pfd, conn->fd, conn, POLLER_IN, 0);
+}
+
+static void finish_jobs(Worker* w)
+{
+    pthread_mutex_lock(&w->done_lock);
+    SlowJob* job = w->done;
+    w->done = NULL;
+    pthread_mutex_unlock(&w->done_lock);
+
+    while (job) {
+        SlowJob* next = job->next;
+        Conn* conn = job->conn;
+        if (conn) {
+            conn->job = NULL;
+            stat_add(&w->stats.requests, 1);
+            if (conn_resume(w, conn) < 0 || outbuf_append(&conn->out, job->out.data, job->out.len) != 0) {
+                conn_close(w, conn);
+            } else {
+                conn_touch(w, conn);
+                conn_advance(w, conn);
+            }
+        }
+        job_free(job);
+        job = next;
+    }
+}
+
+static void expire_idle(Worker* w)
+{
+    while (w->idle_head && w->now_ms - w->idle_head->last_active_ms >= w->idle_timeout_ms) {
+        Conn* conn = w->idle_head;
+        if (conn->job) {
+            // Waiting for its answer is not idling
+            conn_touch(w, conn);
+            continue;
+        }
+        if (conn->streaming) {
+            // A comment line keeps proxies from timing the stream out and finds dead peers
+            outbuf_printf(&conn->out, ": ping\n\n");
+            stream_push(w, conn);
+            continue;
+        }
+        stat_add(&w->stats.timed_out, 1);
+        conn_close(w, conn);
+    }
+}
+
+static void accept_clients(Worker* w)
+{
+    while (1) {
+        int client_socket = accept(w->listen_fd, NULL, NULL);
+        if (client_socket < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+
+        if (w->stats.active >= w->max_connections || set_nonblocking(client_socket) < 0) {
+            close(client_socket);
+            stat_add(&w->stats.rejected, 1);
+            continue;
+        }
+        // Headers written before a sendfile() body must not wait for the client's delayed ACK
+        int one = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        Conn* conn = conn_new(client_socket, w->max_body);
+        if (!conn) {
+            close(client_socket);
+            stat_add(&w->stats.rejected, 1);
+            continue;
+        }
+        if (poller_set(w->pfd, client_socket, conn, POLLER_IN, 1) < 0) {
+            perror("poller_set");
+            close(client_socket);
+            conn_free(conn);
+            continue;
+        }
+        conn_touch(w, conn);
+        stat_add(&w->stats.accepted, 1);
+        __atomic_fetch_add(&w->stats.active, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static int open_listener(int port, int reuseport)
+{
+    struct sockaddr_in address;
+    int opt = 1;
+
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd < 0) {
+        perror("socket failed");
+        return -1;
+    }
+
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+        perror("setsockopt");
+        close(server_fd);
+        return -1;
+    }
+
+#if defined(SERVER_REUSEPORT)
+    // Every worker binds its own socket and the kernel spreads connections between them
+    if (reuseport && setsockopt(server_fd, SOL_SOCKET, SERVER_REUSEPORT, &opt, sizeof(opt))) {
+        perror("setsockopt(SO_REUSEPORT)");
+        close(server_fd);
+        return -1;
+    }
+#else
+    (void)reuseport;
+#endif
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("bind failed");
+        close(server_fd);
+        return -1;
+    }
+
+    if (listen(server_fd, SERVER_BACKLOG) < 0 || set_nonblocking(server_fd) < 0) {
+        perror("listen");
+        close(server_fd);
+        return -1;
+    }
+    return server_fd;
+}
+
+static void* worker_loop(void* arg)
+{
+    Worker* w = arg;
+    PollEvent events[SERVER_MAX_EVENTS];
+    // Wake up often enough to expire idle connections roughly on time
+    int tick_ms = w->idle_timeout_ms < 1000 ? w->idle_timeout_ms : 1000;
+
+    while (1) {
+        int n = poller_wait(w->pfd, events, SERVER_MAX_EVENTS, tick_ms);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poller_wait");
+            break;
+        }
+        w->now_ms = monotonic_ms();
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].ptr == NULL) {
+                accept_clients(w);
+                continue;
+            }
+            if (events[i].ptr == w->wake_fd) {
+                push_changes(w);
+                finish_jobs(w);
+                continue;
+            }
+
+            Conn* conn = events[i].ptr;
+            if ((events[i].flags & POLLER_IN) && conn->state == CONN_READING) {
+                conn_on_readable(w, conn);
+            }
+            if ((events[i].flags & POLLER_OUT) && conn->state == CONN_WRITING) {
+                conn_on_writable(w, conn);
+            }
+        }
+
+        expire_idle(w);
+        while (w->dead) {
+            Conn* next = w->dead->next_dead;
+            conn_free(w->dead);
+            w->dead = next;
+        }
+    }
+    return NULL;
+}
+
+json_t* server_stats_to_json(void)
+{
+    json_t* root = json_array();
+    if (!root) return NULL;
+
+    for (int i = 0; i < workers_count; i++) {
+        WorkerStats* st = &workers_all[i].stats;
+        json_t* worker_obj = json_object();
+        if (!worker_obj) {
+            json_decref(root);
+            return NULL;
+        }
+
+        json_object_set_new(worker_obj, "worker", json_integer(i));
+        json_object_set_new(worker_obj, "accepted", json_integer(__atomic_load_n(&st->accepted, __ATOMIC_RELAXED)));
+        json_object_set_new(worker_obj, "rejected", json_integer(__atomic_load_n(&st->rejected, __ATOMIC_RELAXED)));
+        json_object_set_new(worker_obj, "requests", json_integer(__atomic_load_n(&st->requests, __ATOMIC_RELAXED)));
+        json_object_set_new(worker_obj, "bytes_out", json_integer(__atomic_load_n(&st->bytes_out, __ATOMIC_RELAXED)));
+        json_object_set_new(worker_obj, "timed_out", json_integer(__atomic_load_n(&st->timed_out, __ATOMIC_RELAXED)));
+        json_object_set_new(worker_obj, "active", json_integer(__atomic_load_n(&st->active, __ATOMIC_RELAXED)));
+        json_object_set_new(worker_obj, "streams", json_integer(__atomic_load_n(&st->streams, __ATOMIC_RELAXED)));
+
+        json_array_append_new(root, worker_obj);
+    }
+
+    return root;
+}
+
+int run_http_server_cfg(const ServerConfig* cfg)
+{
+    int port = (cfg && cfg->port > 0) ? cfg->port : PORT;
+    int max_connections = (cfg && cfg->max_connections > 0) ? cfg->max_connections : SERVER_MAX_CONNECTIONS;
+    int count = (cfg && cfg->workers > 0) ? cfg->workers : 1;
+    int idle_timeout_ms = (cfg && cfg->idle_timeout_ms > 0) ? cfg->idle_timeout_ms : SERVER_IDLE_TIMEOUT_MS;
+    size_t max_body = (cfg && cfg->max_body_bytes > 0) ? cfg->max_body_bytes : HTTP_MAX_BODY_SIZE;
+    size_t note_cache = (cfg && cfg->note_cache_bytes > 0) ? cfg->note_cache_bytes : NOTECACHE_DEFAULT_BYTES;
+    int commit_window_us = (cfg && cfg->commit_window_us != 0) ? cfg->commit_window_us : WRITE_DEFAULT_WINDOW_US;
+
+#if !defined(SERVER_REUSEPORT)
+    if (count > 1) {
+        fprintf(stderr, "SO_REUSEPORT is not supported here, running a single worker\n");
+        count = 1;
+    }
+#endif
+    if (count > SERVER_MAX_WORKERS) {
+        count = SERVER_MAX_WORKERS;
+    }
+
+    // Peers that disconnect mid-response must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Hot notes are served from memory, the catalog's inotify events keep them current
+    notecache_init(note_cache == SERVER_NOTE_CACHE_OFF ? 0 : note_cache);
+    // Concurrent saves share their syncs
+    write_set_window(commit_window_us);
+    write_set_syncfs(cfg && cfg->commit_syncfs);
+    // Bulk changes a crash interrupted are finished before anything is served
+    if (bulk_recover() < 0) {
+        perror("bulk_recover");
+    }
+
+    // Listings are answered from memory; without the catalog they scan the disk as before
+    if (catalog_start() != 0) {
+        fprintf(stderr, "Catalog unavailable, listings will read the books directory\n");
+    }
+    // /search reads whatever index this thread last swapped in
+    if (terms_start() != 0) {
+        fprintf(stderr, "Search index will not be refreshed\n");
+    }
+
+    Worker* workers = calloc(count, sizeof(Worker));
+    if (!workers) {
+        perror("calloc");
+        return -1;
+    }
+
+    int ready = 0;
+    for (; ready < count; ready++) {
+        Worker* w = &workers[ready];
+        w->id = ready;
+        w->max_connections = max_connections / count > 0 ? max_connections / count : 1;
+        w->idle_timeout_ms = idle_timeout_ms;
+        w->max_body = max_body;
+        // Room for a full header, the largest body and its chunked framing
+        w->max_input = HTTP_MAX_HEADER_SIZE + max_body + HTTP_MAX_CHUNK_FRAMING(max_body) + BUFFER_SIZE;
+        w->now_ms = monotonic_ms();
+        pthread_mutex_init(&w->done_lock, NULL);
+        w->listen_fd = open_listener(port, count > 1);
+        if (w->listen_fd < 0) {
+            break;
+        }
+        w->pfd = poller_create();
+        // The listener is registered with a NULL cookie, clients with their Conn
+        if (w->pfd < 0 || poller_set(w->pfd, w->listen_fd, NULL, POLLER_IN, 1) < 0) {
+            perror("poller_create");
+            close(w->listen_fd);
+            if (w->pfd >= 0) {
+                close(w->pfd);
+            }
+            break;
+        }
+        // ... and the wake pipe with its own address
+        if (pipe(w->wake_fd) < 0 || set_nonblocking(w->wake_fd[0]) < 0 || set_nonblocking(w->wake_fd[1]) < 0 ||
+            poller_set(w->pfd, w->wake_fd[0], w->wake_fd, POLLER_IN, 1) < 0 || changes_add_waker(w->wake_fd[1]) < 0) {
+            perror("pipe");
+            close(w->listen_fd);
+            close(w->pfd);
+            break;
+        }
+    }
+    if (ready < count) {
+        for (int i = 0; i < ready; i++) {
+            close(workers[i].pfd);
+            close(workers[i].listen_fd);
+        }
+        free(workers);
+        return -1;
+    }
+
+    if (slow_start(SERVER_SLOW_THREADS) != 0) {
+        fprintf(stderr, "Slow-request threads unavailable\n");
+        return -1;
+    }
+
+    workers_all = workers;
+    workers_count = count;
+    printf("BSDBook HTTP server running on port %d with %d worker(s)\n", port, count);
+
+    // Worker 0 runs in the calling thread
+    for (int i = 1; i < count; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+    }
+    worker_loop(&workers[0]);
+    return -1;
+}
@@ -0,0 +1,454 @@
+/*=================================================================================================
+ *
+ * 	@FILENAME:	      bsdserver.h
+ * 	@BRIEF:    	      Event-driven HTTP front end for bsdbook server.
+ * 	@DESCRIPTION:	  Non-blocking connection handling on top of epoll (Linux) or kqueue (BSD).
+ * 	@AUTHOR		      Daniil (TwelveFacedJanus) Ermolaev.
+ * 	   | CONTACT:	  twofaced-janus@yandex.ru
+ *	@CREATED AT:	  10.16.26
+ *	@UPDATED_AT:	  10.16.26
+ *
+ *==================================================================================================*/
+
+#ifndef BSDSERVER_H_
+#define BSDSERVER_H_
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <jansson.h>
+
+#define SERVER_BACKLOG 1024
+#define SERVER_MAX_EVENTS 256
+#define SERVER_MAX_CONNECTIONS 16384
+#define SERVER_MAX_WORKERS 256
+#define SERVER_IDLE_TIMEOUT_MS 5000
+#define SERVER_MAX_PIPELINE_BYTES (256 * 1024)
+// Threads answering scans and writes off the event loops; each write waiting for its group holds one
+#define SERVER_SLOW_THREADS 64
+#define SERVER_SENDFILE_CHUNK (1 << 30)
+// An event stream client this far behind is dropped, it resyncs when it reconnects
+#define SERVER_MAX_STREAM_BACKLOG (1024 * 1024)
+// ServerConfig.note_cache_bytes value that turns the note cache off, 0 means the default
+#define SERVER_NOTE_CACHE_OFF ((size_t)-1)
+// ServerConfig.commit_window_us value for no group commit window, 0 means the default
+#define SERVER_COMMIT_WINDOW_NONE (-1)
+
+
+/*===============================================================================================
+ *
+ * 	@BRIEF:
+ * 		Growable output buffer used to build HTTP responses.
+ * 	@DESCRIPTION:
+ * 		Request handlers append response bytes here instead of writing to the socket, so the
+ * 		event loop can flush them without blocking. A file range may follow the bytes, it is
+ * 		sent with sendfile() without being copied through user space.
+ * 	@PARAMETERS:
+ * 		OutBuffer.data     - char*;
+ * 		OutBuffer.len      - size_t, bytes stored;
+ * 		OutBuffer.cap      - size_t, bytes allocated;
+ * 		OutBuffer.sent     - size_t, bytes already flushed to the socket;
+ * 		OutBuffer.has_file - int, 1 if a file body follows the bytes;
+ * 		OutBuffer.file_fd  - int, descriptor of the file body (owned by the buffer);
+ * 		OutBuffer.file_off - off_t, next file offset to send;
+ * 		OutBuffer.file_len - off_t, file bytes left to send;
+ * 		OutBuffer.stream     - int, set by a handler that keeps the connection open as an event
+ * 		                       stream after this response;
+ * 		OutBuffer.stream_seq - unsigned long long, last change already written to the stream.
+ * 	@RETURN:
+ * 		None.
+ * 	@NOTES:
+ * 		Zero-initialized OutBuffer is valid and empty.
+ * 	@EXAMPLE:
+ * 		```c
+ * 		OutBuffer out = {0};
+ * 		outbuf_printf(&out, "HTTP/1.1 200 OK\r\n\r\n");
+ * 		outbuf_free(&out);
+ * 		```
+ * 	@UPDATES:
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *	 	      Struct has been created.
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *	 	      File bodies sent with sendfile().
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *	 	      Added stream and stream_seq fields.
+ *
+ * =============================================================================================*/
+typedef struct OutBuffer
+{
+	char* data;
+	size_t len;
+	size_t cap;
+	size_t sent;
+	int has_file;
+	int file_fd;
+	off_t file_off;
+	off_t file_len;
+	int stream;
+	unsigned long long stream_seq;
+} OutBuffer;
+
+/*===============================================================================================
+ *
+ * 	@BRIEF:
+ * 		Server configuration.
+ * 	@DESCRIPTION:
+ * 		Passed to run_http_server_cfg(). Zero fields fall back to defaults.
+ * 	@PARAMETERS:
+ * 		ServerConfig.port            - int, TCP port (PORT by default);
+ * 		ServerConfig.max_connections - int, simultaneous clients (SERVER_MAX_CONNECTIONS);
+ * 		ServerConfig.workers         - int, event loop threads (1 by default);
+ * 		ServerConfig.idle_timeout_ms - int, keep-alive idle timeout (SERVER_IDLE_TIMEOUT_MS);
+ * 		ServerConfig.max_body_bytes  - size_t, request body limit (HTTP_MAX_BODY_SIZE);
+ * 		ServerConfig.note_cache_bytes - size_t, note cache budget (NOTECACHE_DEFAULT_BYTES),
+ * 		                               SERVER_NOTE_CACHE_OFF turns the cache off;
+ * 		ServerConfig.commit_window_us - int, group commit window of writes (WRITE_DEFAULT_WINDOW_US),
+ * 		                               SERVER_COMMIT_WINDOW_NONE syncs without waiting;
+ * 		ServerConfig.commit_syncfs    - int, 1 to sync write groups with syncfs() (write_set_syncfs()).
+ * 	@RETURN:
+ * 		None.
+ * 	@NOTES:
+ * 		None.
+ * 	@EXAMPLE:
+ * 		```c
+ * 		ServerConfig cfg = { .port = 8081 };
+ * 		run_http_server_cfg(&cfg);
+ * 		```
+ * 	@UPDATES:
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *	 	      Struct has been created.
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *	 	      Added workers field.
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *	 	      Added idle_timeout_ms field.
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *	 	      Added max_body_bytes field.
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *	 	      Added note_cache_bytes field.
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *	 	      Added commit_window_us field.
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *	 	      Added commit_syncfs field.
+ *
+ * =============================================================================================*/
+typedef struct ServerConfig
+{
+	int port;
+	int max_connections;
+	int workers;
+	int idle_timeout_ms;
+	size_t max_body_bytes;
+	size_t note_cache_bytes;
+	int commit_window_us;
+	int commit_syncfs;
+} ServerConfig;
+
+/*===============================================================================================
+ *
+ * 	@BRIEF:
+ * 		Per-worker server counters.
+ * 	@DESCRIPTION:
+ * 		Every worker thread updates its own counters; they are read by the /stats endpoint.
+ * 	@PARAMETERS:
+ * 		WorkerStats.accepted  - connections accepted;
+ * 		WorkerStats.rejected  - connections dropped because the worker was full;
+ * 		WorkerStats.requests  - requests answered;
+ * 		WorkerStats.bytes_out - response bytes written;
+ * 		WorkerStats.timed_out - keep-alive connections closed for being idle;
+ * 		WorkerStats.active    - connections currently open;
+ * 		WorkerStats.streams   - of those, event streams.
+ * 	@RETURN:
+ * 		None.
+ * 	@NOTES:
+ * 		Updated with relaxed atomics, values are approximate while the server is busy.
+ * 	@EXAMPLE:
+ * 		None.
+ * 	@UPDATES:
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *	 	      Struct has been created.
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *	 	      Added streams field.
+ *
+ * =============================================================================================*/
+typedef struct WorkerStats
+{
+	unsigned long long accepted;
+	unsigned long long rejected;
+	unsigned long long requests;
+	unsigned long long bytes_out;
+	unsigned long long timed_out;
+	long long active;
+	long long streams;
+} WorkerStats;
+
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Appends bytes to an output buffer.
+ *     @DESCRIPTION:
+ *          Grows the buffer geometrically when needed.
+ *     @PARAMETERS:
+ *          - OutBuffer* out: Destination buffer
+ *          - const void* data: Bytes to append
+ *          - size_t len: Number of bytes
+ *     @RETURN:
+ *          - 0 on success, -1 if memory could not be allocated
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          outbuf_append(&out, "\r\n", 2);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int outbuf_append(OutBuffer* out, const void* data, size_t len);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          printf-style append to an output buffer.
+ *     @DESCRIPTION:
+ *          Formats directly into the spare capacity of the buffer.
+ *     @PARAMETERS:
+ *          - OutBuffer* out: Destination buffer
+ *          - const char* fmt: printf format
+ *     @RETURN:
+ *          - 0 on success, -1 on error
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          outbuf_printf(&out, "Content-Length: %zu\r\n", len);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int outbuf_printf(OutBuffer* out, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Attaches a file range as the body that follows the buffered bytes.
+ *     @DESCRIPTION:
+ *          The range is sent with sendfile() after the buffered header, so the body is never
+ *          copied into user space. The buffer takes ownership of the descriptor.
+ *     @PARAMETERS:
+ *          - OutBuffer* out: Response buffer
+ *          - int fd: Open file descriptor
+ *          - off_t offset: First byte to send
+ *          - off_t length: Number of bytes to send
+ *     @RETURN:
+ *          - 0 on success, -1 if a file is already attached
+ *     @NOTES:
+ *          - The descriptor is closed once sent or when the buffer is freed
+ *     @EXAMPLE:
+ *          ```c
+ *          outbuf_printf(out, "HTTP/1.1 200 OK\r\nContent-Length: %lld\r\n\r\n", (long long)st.st_size);
+ *          outbuf_attach_file(out, fd, 0, st.st_size);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int outbuf_attach_file(OutBuffer* out, int fd, off_t offset, off_t length);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Removes the body of the last response in a buffer.
+ *     @DESCRIPTION:
+ *          Keeps the status line and headers of the response that starts at offset start,
+ *          drops the bytes after them and any attached file. Used to answer HEAD requests.
+ *     @PARAMETERS:
+ *          - OutBuffer* out: Response buffer
+ *          - size_t start: Offset where the response begins
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - Content-Length is left untouched, as HEAD requires
+ *     @EXAMPLE:
+ *          ```c
+ *          size_t start = out->len;
+ *          handle_note_content_request_buf(out, path);
+ *          outbuf_drop_body(out, start);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void outbuf_drop_body(OutBuffer* out, size_t start);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Releases memory owned by an output buffer.
+ *     @DESCRIPTION:
+ *          Leaves the buffer zeroed so it can be reused.
+ *     @PARAMETERS:
+ *          - OutBuffer* out: Buffer to release
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          outbuf_free(&out);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void outbuf_free(OutBuffer* out);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Appends a complete text/plain response.
+ *     @DESCRIPTION:
+ *          Writes the status line, Content-Type, Content-Length and the body.
+ *     @PARAMETERS:
+ *          - OutBuffer* out: Response buffer
+ *          - const char* status: Status code and reason, e.g. "404 Not Found"
+ *          - const char* body: Response body
+ *     @RETURN:
+ *          - 0 on success, -1 on error
+ *     @NOTES:
+ *          - Content-Length is required for keep-alive connections
+ *     @EXAMPLE:
+ *          ```c
+ *          http_text_response(out, "404 Not Found", "404 Not Found\r\n");
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int http_text_response(OutBuffer* out, const char* status, const char* body);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Writes the whole buffer to a blocking descriptor.
+ *     @DESCRIPTION:
+ *          Retries short writes and EINTR.
+ *     @PARAMETERS:
+ *          - int fd: Destination descriptor
+ *          - const void* data: Bytes to write
+ *          - size_t len: Number of bytes
+ *     @RETURN:
+ *          - 0 on success, -1 on error
+ *     @NOTES:
+ *          - Used by the blocking handle_http_request() path
+ *     @EXAMPLE:
+ *          ```c
+ *          write_all(client_socket, out.data, out.len);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int write_all(int fd, const void* data, size_t len);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Writes an output buffer, including its file body, to a blocking descriptor.
+ *     @DESCRIPTION:
+ *          Sends the buffered bytes with write_all() and the attached file with sendfile().
+ *     @PARAMETERS:
+ *          - int fd: Destination socket
+ *          - OutBuffer* out: Buffer to send
+ *     @RETURN:
+ *          - 0 on success, -1 on error
+ *     @NOTES:
+ *          - Used by the blocking handle_http_request() path
+ *     @EXAMPLE:
+ *          ```c
+ *          outbuf_write_all(client_socket, &out);
+ *          outbuf_free(&out);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int outbuf_write_all(int fd, OutBuffer* out);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Runs the event-driven HTTP server.
+ *     @DESCRIPTION:
+ *          Creates a non-blocking listener and multiplexes every client in one thread with
+ *          epoll (Linux) or kqueue (BSD). Each connection owns a small read/write state machine:
+ *          bytes are fed to an incremental http_parse() until the request is complete, the
+ *          response is built with handle_http_request_parsed() and flushed as the socket
+ *          becomes writable, so a slow client never blocks the others.
+ *          With cfg->workers > 1 every worker thread binds its own SO_REUSEPORT listener and
+ *          runs its own event loop, the kernel balances new connections between them.
+ *          HTTP/1.1 connections are kept alive and pipelined requests are answered in order;
+ *          connections without traffic for cfg->idle_timeout_ms are closed.
+ *          Requests http_request_blocks() flags are answered by SERVER_SLOW_THREADS threads;
+ *          their connection keeps reading and answers its next requests once the result is in.
+ *     @PARAMETERS:
+ *          - const ServerConfig* cfg: Server configuration, NULL for defaults
+ *     @RETURN:
+ *          - Does not return on success, -1 on error
+ *     @NOTES:
+ *          - Ignores SIGPIPE for the whole process
+ *          - Worker 0 runs in the calling thread
+ *     @EXAMPLE:
+ *          ```c
+ *          ServerConfig cfg = { .port = PORT, .workers = 4 };
+ *          return run_http_server_cfg(&cfg);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *               SO_REUSEPORT worker pool.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FEATURE]:
+ *               Keep-alive and request pipelining.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FIX]:
+ *               Scans over every note no longer run on the event loops.
+ *
+ =========================================================================================*/
+int run_http_server_cfg(const ServerConfig* cfg);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Converts per-worker counters to JSON.
+ *     @DESCRIPTION:
+ *          Returns an array with one object per worker: accepted, rejected, requests,
+ *          bytes_out, timed_out and active.
+ *     @PARAMETERS:
+ *          - None
+ *     @RETURN:
+ *          - json_t*: JSON array, empty if the server is not running
+ *          - NULL if error occurs
+ *     @NOTES:
+ *          - Served by the /stats endpoint
+ *          - Caller is responsible for freeing the returned JSON object
+ *     @EXAMPLE:
+ *          ```c
+ *          json_t* stats = server_stats_to_json();
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+json_t* server_stats_to_json(void);
+
+#endif
@@ -0,0 +1,1620 @@
+#include "./bsdcore.h"
+
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define TERMS_MAGIC "BSDTERM"
+// A note modified this close to the build may change again within the same mtime tick
+#define TERMS_RACY_SEC 1
+#define BM25_K1 1.2
+#define BM25_B 0.75
+// How often the refresher looks for changes when no change woke it
+#define TERMS_POLL_MS 5000
+
+#if defined(__APPLE__)
+#define MTIME_NSEC(st) ((int64_t)(st)->st_mtimespec.tv_nsec)
+#else
+#define MTIME_NSEC(st) ((int64_t)(st)->st_mtim.tv_nsec)
+#endif
+
+/*
+ * File layout: TermsHeader, TermsBook[books_count], TermsNote[notes_count],
+ * TermsTerm[terms_count], string pool, postings. Books, notes and terms are sorted by name.
+ *
+ * The postings of a term list the notes containing it in note order. Each note is
+ * varint(note - previous note), varint(tf), varint(n) and n bytes of positions: tf pairs of
+ * varint(word position - previous), varint(line - previous), both starting from 0 in every
+ * note. The length prefix lets queries skip positions they do not need.
+ */
+typedef struct TermsHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t books_count;
+    uint32_t notes_count;
+    uint32_t terms_count;
+    uint32_t strings_len;
+    uint32_t reserved;
+    uint64_t postings_len;
+    uint64_t total_tokens;
+    int64_t built_at;
+} TermsHeader;
+
+typedef struct TermsBook
+{
+    uint32_t name;
+    uint32_t first_note;
+    uint32_t notes_count;
+    uint32_t reserved;
+} TermsBook;
+
+typedef struct TermsNote
+{
+    uint32_t name;
+    uint32_t book;
+    uint32_t tokens;
+    uint32_t reserved;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} TermsNote;
+
+typedef struct TermsTerm
+{
+    uint32_t name;
+    uint32_t df;
+    uint32_t postings_len;
+    uint32_t reserved;
+    uint64_t postings;
+} TermsTerm;
+
+typedef struct ByteBuf
+{
+    unsigned char* data;
+    size_t len;
+    size_t cap;
+} ByteBuf;
+
+typedef struct BuildBook
+{
+    char* name;
+    uint32_t first_note;
+    uint32_t notes_count;
+} BuildBook;
+
+typedef struct BuildNote
+{
+    char* name;
+    TermsNote rec;
+    // Note of the old index whose postings are reused, UINT32_MAX to tokenize the file
+    uint32_t old;
+} BuildNote;
+
+// Postings of a word seen in a new or changed note, encoded as in the file
+typedef struct FreshTerm
+{
+    size_t name;
+    uint32_t hash;
+    uint32_t df;
+    uint32_t last_note;
+    ByteBuf postings;
+} FreshTerm;
+
+typedef struct Occurrence
+{
+    uint32_t term;
+    uint32_t pos;
+    uint32_t line;
+} Occurrence;
+
+typedef struct Build
+{
+    BuildBook* books;
+    uint32_t books_count;
+    uint32_t books_cap;
+    BuildNote* notes;
+    uint32_t notes_count;
+    uint32_t notes_cap;
+
+    FreshTerm* fresh;
+    uint32_t fresh_count;
+    uint32_t fresh_cap;
+    // Open addressing, fresh index + 1, 0 is empty
+    uint32_t* table;
+    uint32_t table_cap;
+    ByteBuf names;
+
+    Occurrence* occ;
+    size_t occ_count;
+    size_t occ_cap;
+    ByteBuf scratch;
+} Build;
+
+typedef struct DocReader
+{
+    const unsigned char* p;
+    const unsigned char* end;
+    uint32_t note;
+    uint32_t tf;
+    const unsigned char* pos;
+    uint32_t pos_len;
+} DocReader;
+
+// One mapping of the index file; never changes, a refresh maps the new file and swaps it in
+typedef struct TermsMap
+{
+    void* map;
+    size_t map_len;
+    const TermsHeader* hdr;
+    const TermsBook* books;
+    const TermsNote* notes;
+    const TermsTerm* terms;
+    const char* strings;
+    const unsigned char* postings;
+    // The current pointer and every query running on it
+    int refs;
+} TermsMap;
+
+static struct
+{
+    char* root;
+    char* path;
+    // Only held to take or swap the current mapping
+    pthread_mutex_t lock;
+    TermsMap* current;
+    // One build at a time
+    pthread_mutex_t update_lock;
+    int refresher;
+} tindex = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .update_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int buf_reserve(ByteBuf* buf, size_t extra)
+{
+    if (buf->len + extra <= buf->cap) {
+        return 0;
+    }
+    size_t cap = buf->cap ? buf->cap : 64;
+    while (cap < buf->len + extra) {
+        cap *= 2;
+    }
+    unsigned char* grown = realloc(buf->data, cap);
+    if (!grown) {
+        perror("realloc");
+        return -1;
+    }
+    buf->data = grown;
+    buf->cap = cap;
+    return 0;
+}
+
+static int buf_append(ByteBuf* buf, const void* data, size_t len)
+{
+    if (buf_reserve(buf, len) != 0) {
+        return -1;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+static int buf_varint(ByteBuf* buf, uint32_t value)
+{
+    if (buf_reserve(buf, 5) != 0) {
+        return -1;
+    }
+    while (value >= 0x80) {
+        buf->data[buf->len++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    buf->data[buf->len++] = (unsigned char)value;
+    return 0;
+}
+
+// Returns 0 and advances *p, or -1 if the varint is truncated or too long
+static int get_varint(const unsigned char** p, const unsigned char* end, uint32_t* value)
+{
+    uint32_t v = 0;
+    for (int shift = 0; shift < 35 && *p < end; shift += 7) {
+        unsigned char c = *(*p)++;
+        v |= (uint32_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *value = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int doc_next(DocReader* r)
+{
+    uint32_t delta;
+    if (r->p >= r->end ||
+        get_varint(&r->p, r->end, &delta) != 0 ||
+        get_varint(&r->p, r->end, &r->tf) != 0 ||
+        get_varint(&r->p, r->end, &r->pos_len) != 0 ||
+        r->pos_len > (size_t)(r->end - r->p)) {
+        return 0;
+    }
+    r->note += delta;
+    r->pos = r->p;
+    r->p += r->pos_len;
+    return 1;
+}
+
+static int is_word_byte(unsigned char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+/*
+ * Finds the next word in [*p, end), counting the newlines skipped in *line. Returns its
+ * length, or 0 at the end of the text.
+ */
+static size_t next_word(const char** p, const char* end, const char** word, uint32_t* line)
+{
+    const char* s = *p;
+    while (s < end && !is_word_byte((unsigned char)*s)) {
+        if (*s == '\n') (*line)++;
+        s++;
+    }
+    const char* e = s;
+    while (e < end && is_word_byte((unsigned char)*e)) e++;
+    *word = s;
+    *p = e;
+    return e - s;
+}
+
+static void lower_word(char* dst, const char* word, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        char c = word[i];
+        dst[i] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+    }
+    dst[len] = '\0';
+}
+
+static int terms_paths(void)
+{
+    pthread_mutex_lock(&tindex.lock);
+    if (tindex.root) {
+        pthread_mutex_unlock(&tindex.lock);
+        return 0;
+    }
+    char* root = get_default_books_path("/books");
+    if (!root || root[0] == '\0') {
+        free(root);
+        pthread_mutex_unlock(&tindex.lock);
+        return -1;
+    }
+    size_t len = strlen(root) + sizeof(BSDTERMS_FILE) + 1;
+    tindex.path = malloc(len);
+    if (!tindex.path) {
+        perror("malloc");
+        free(root);
+        pthread_mutex_unlock(&tindex.lock);
+        return -1;
+    }
+    snprintf(tindex.path, len, "%s/%s", root, BSDTERMS_FILE);
+    tindex.root = root;
+    pthread_mutex_unlock(&tindex.lock);
+    return 0;
+}
+
+// Maps the index file; table ranges are checked here, postings as they are decoded
+static TermsMap* map_terms(void)
+{
+    int fd = open(tindex.path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TermsHeader)) {
+        close(fd);
+        return NULL;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const TermsHeader* hdr = map;
+    size_t books_off = sizeof(TermsHeader);
+    size_t notes_off = books_off + (size_t)hdr->books_count * sizeof(TermsBook);
+    size_t terms_off = notes_off + (size_t)hdr->notes_count * sizeof(TermsNote);
+    size_t strings_off = terms_off + (size_t)hdr->terms_count * sizeof(TermsTerm);
+    size_t postings_off = strings_off + hdr->strings_len;
+    const char* strings = (const char*)map + strings_off;
+    if (memcmp(hdr->magic, TERMS_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != BSDTERMS_VERSION ||
+        postings_off + hdr->postings_len != (uint64_t)st.st_size ||
+        hdr->strings_len == 0 || strings[hdr->strings_len - 1] != '\0') {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    const TermsBook* books = (const TermsBook*)((const char*)map + books_off);
+    const TermsNote* notes = (const TermsNote*)((const char*)map + notes_off);
+    const TermsTerm* terms = (const TermsTerm*)((const char*)map + terms_off);
+    for (uint32_t i = 0; i < hdr->books_count; i++) {
+        if (books[i].name >= hdr->strings_len ||
+            (uint64_t)books[i].first_note + books[i].notes_count > hdr->notes_count) {
+            munmap(map, st.st_size);
+            return NULL;
+        }
+    }
+    for (uint32_t i = 0; i < hdr->notes_count; i++) {
+        if (notes[i].name >= hdr->strings_len || notes[i].book >= hdr->books_count) {
+            munmap(map, st.st_size);
+            return NULL;
+        }
+    }
+
+    TermsMap* m = malloc(sizeof(*m));
+    if (!m) {
+        perror("malloc");
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    m->map = map;
+    m->map_len = st.st_size;
+    m->hdr = hdr;
+    m->books = books;
+    m->notes = notes;
+    m->terms = terms;
+    m->strings = strings;
+    m->postings = (const unsigned char*)map + postings_off;
+    m->refs = 1;
+    return m;
+}
+
+// Takes a reference to the current mapping, NULL while there is none
+static TermsMap* acquire_terms(void)
+{
+    pthread_mutex_lock(&tindex.lock);
+    TermsMap* m = tindex.current;
+    if (m) {
+        m->refs++;
+    }
+    pthread_mutex_unlock(&tindex.lock);
+    return m;
+}
+
+// The last reference unmaps; a renamed-over file stays readable until then
+static void release_terms(TermsMap* m)
+{
+    if (!m) {
+        return;
+    }
+    pthread_mutex_lock(&tindex.lock);
+    int last = --m->refs == 0;
+    pthread_mutex_unlock(&tindex.lock);
+    if (last) {
+        munmap(m->map, m->map_len);
+        free(m);
+    }
+}
+
+// Makes m current, queries still on the old mapping keep it until they finish
+static void swap_terms(TermsMap* m)
+{
+    pthread_mutex_lock(&tindex.lock);
+    TermsMap* old = tindex.current;
+    tindex.current = m;
+    pthread_mutex_unlock(&tindex.lock);
+    release_terms(old);
+}
+
+static const char* terms_name(const TermsMap* m, uint32_t offset)
+{
+    return offset < m->hdr->strings_len ? m->strings + offset : "";
+}
+
+// Postings of a mapped term, empty if they point outside the file
+static void term_reader(const TermsMap* m, const TermsTerm* term, DocReader* r)
+{
+    memset(r, 0, sizeof(*r));
+    if (term->postings <= m->hdr->postings_len &&
+        term->postings_len <= m->hdr->postings_len - term->postings) {
+        r->p = m->postings + term->postings;
+        r->end = r->p + term->postings_len;
+    }
+}
+
+static const TermsTerm* find_term(const TermsMap* m, const char* word)
+{
+    uint32_t lo = 0, hi = m->hdr->terms_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(terms_name(m, m->terms[mid].name), word);
+        if (cmp == 0) return &m->terms[mid];
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+static uint32_t old_note(const TermsMap* m, const char* book_name, const char* note_name)
+{
+    uint32_t lo = 0, hi = m->hdr->books_count;
+    const TermsBook* book = NULL;
+    while (lo < hi && !book) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(terms_name(m, m->books[mid].name), book_name);
+        if (cmp == 0) book = &m->books[mid];
+        else if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    if (!book) {
+        return UINT32_MAX;
+    }
+    lo = book->first_note;
+    hi = book->first_note + book->notes_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(terms_name(m, m->notes[mid].name), note_name);
+        if (cmp == 0) return mid;
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return UINT32_MAX;
+}
+
+static int note_is_current(const TermsMap* m, const TermsNote* note, const TermsNote* now)
+{
+    return note->size == now->size &&
+           note->mtime_sec == now->mtime_sec &&
+           note->mtime_nsec == now->mtime_nsec &&
+           note->mtime_sec < m->hdr->built_at - TERMS_RACY_SEC;
+}
+
+static int compare_build_books(const void* a, const void* b)
+{
+    return strcmp(((const BuildBook*)a)->name, ((const BuildBook*)b)->name);
+}
+
+static int compare_build_notes(const void* a, const void* b)
+{
+    return strcmp(((const BuildNote*)a)->name, ((const BuildNote*)b)->name);
+}
+
+static int list_book(Build* b, int root_fd, uint32_t book_pos)
+{
+    BuildBook* book = &b->books[book_pos];
+    book->first_note = b->notes_count;
+
+    // A book removed meanwhile is indexed empty
+    int dir_fd = openat(root_fd, book->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR* dir = dir_fd >= 0 ? fdopendir(dir_fd) : NULL;
+    if (!dir) {
+        if (dir_fd >= 0) close(dir_fd);
+        return 0;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char* ext = strrchr(entry->d_name, '.');
+        struct stat st;
+        if (!ext || ext == entry->d_name || strcmp(ext, ".bdsb") != 0 ||
+            fstatat(dirfd(dir), entry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (b->notes_count == b->notes_cap) {
+            uint32_t cap = b->notes_cap ? b->notes_cap * 2 : 256;
+            BuildNote* grown = realloc(b->notes, cap * sizeof(BuildNote));
+            if (!grown) {
+                perror("realloc");
+                closedir(dir);
+                return -1;
+            }
+            b->notes = grown;
+            b->notes_cap = cap;
+        }
+        BuildNote* note = &b->notes[b->notes_count];
+        memset(note, 0, sizeof(*note));
+        note->name = strndup(entry->d_name, ext - entry->d_name);
+        if (!note->name) {
+            perror("strndup");
+            closedir(dir);
+            return -1;
+        }
+        note->rec.book = book_pos;
+        note->rec.size = st.st_size;
+        note->rec.mtime_sec = st.st_mtime;
+        note->rec.mtime_nsec = MTIME_NSEC(&st);
+        note->old = UINT32_MAX;
+        b->notes_count++;
+    }
+    closedir(dir);
+
+    book->notes_count = b->notes_count - book->first_note;
+    if (book->notes_count > 1) {
+        qsort(b->notes + book->first_note, book->notes_count, sizeof(BuildNote), compare_build_notes);
+    }
+    return 0;
+}
+
+static int list_tree(Build* b, int root_fd)
+{
+    DIR* dir = fdopendir(dup(root_fd));
+    if (!dir) {
+        perror("opendir");
+        return -1;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat st;
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            fstatat(dirfd(dir), entry->d_name, &st, 0) != 0 || !S_ISDIR(st.st_mode)) {
+            continue;
+        }
+        if (b->books_count == b->books_cap) {
+            uint32_t cap = b->books_cap ? b->books_cap * 2 : 16;
+            BuildBook* grown = realloc(b->books, cap * sizeof(BuildBook));
+            if (!grown) {
+                perror("realloc");
+                closedir(dir);
+                return -1;
+            }
+            b->books = grown;
+            b->books_cap = cap;
+        }
+        BuildBook* book = &b->books[b->books_count];
+        memset(book, 0, sizeof(*book));
+        book->name = strdup(entry->d_name);
+        if (!book->name) {
+            perror("strdup");
+            closedir(dir);
+            return -1;
+        }
+        b->books_count++;
+    }
+    closedir(dir);
+
+    if (b->books_count > 1) {
+        qsort(b->books, b->books_count, sizeof(BuildBook), compare_build_books);
+    }
+    for (uint32_t i = 0; i < b->books_count; i++) {
+        if (list_book(b, root_fd, i) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static uint32_t hash_word(const char* word, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)word[i]) * 16777619u;
+    }
+    return h;
+}
+
+static int grow_table(Build* b)
+{
+    uint32_t cap = b->table_cap ? b->table_cap * 2 : 4096;
+    uint32_t* table = calloc(cap, sizeof(uint32_t));
+    if (!table) {
+        perror("calloc");
+        return -1;
+    }
+    for (uint32_t i = 0; i < b->fresh_count; i++) {
+        uint32_t slot = b->fresh[i].hash & (cap - 1);
+        while (table[slot]) slot = (slot + 1) & (cap - 1);
+        table[slot] = i + 1;
+    }
+    free(b->table);
+    b->table = table;
+    b->table_cap = cap;
+    return 0;
+}
+
+// Returns the fresh term of a lowercased word, adding it if needed, or UINT32_MAX
+static uint32_t intern_word(Build* b, const char* word, size_t len)
+{
+    if ((b->fresh_count + 1) * 4 >= b->table_cap * 3 && grow_table(b) != 0) {
+        return UINT32_MAX;
+    }
+    uint32_t h = hash_word(word, len);
+    uint32_t slot = h & (b->table_cap - 1);
+    for (; b->table[slot]; slot = (slot + 1) & (b->table_cap - 1)) {
+        const FreshTerm* t = &b->fresh[b->table[slot] - 1];
+        const char* name = (const char*)b->names.data + t->name;
+        if (t->hash == h && strncmp(name, word, len) == 0 && name[len] == '\0') {
+            return b->table[slot] - 1;
+        }
+    }
+
+    if (b->fresh_count == b->fresh_cap) {
+        uint32_t cap = b->fresh_cap ? b->fresh_cap * 2 : 1024;
+        FreshTerm* grown = realloc(b->fresh, cap * sizeof(FreshTerm));
+        if (!grown) {
+            perror("realloc");
+            return UINT32_MAX;
+        }
+        b->fresh = grown;
+        b->fresh_cap = cap;
+    }
+    FreshTerm* t = &b->fresh[b->fresh_count];
+    memset(t, 0, sizeof(*t));
+    t->name = b->names.len;
+    t->hash = h;
+    const char nul = '\0';
+    if (buf_append(&b->names, word, len) != 0 || buf_append(&b->names, &nul, 1) != 0) {
+        return UINT32_MAX;
+    }
+    b->table[slot] = ++b->fresh_count;
+    return b->fresh_count - 1;
+}
+
+static int compare_occurrences(const void* a, const void* b)
+{
+    const Occurrence* x = a;
+    const Occurrence* y = b;
+    if (x->term != y->term) return x->term < y->term ? -1 : 1;
+    return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+// Appends the words of one note to the fresh postings
+static int add_note_words(Build* b, uint32_t note_pos, const char* text, size_t len)
+{
+    BuildNote* note = &b->notes[note_pos];
+    const char* p = text;
+    const char* end = text + len;
+    const char* word;
+    size_t word_len;
+    uint32_t line = 1;
+    uint32_t pos = 0;
+    char lower[TERMS_MAX_TERM + 1];
+
+    b->occ_count = 0;
+    while ((word_len = next_word(&p, end, &word, &line)) > 0) {
+        if (word_len > TERMS_MAX_TERM) {
+            pos++;
+            continue;
+        }
+        lower_word(lower, word, word_len);
+        uint32_t term = intern_word(b, lower, word_len);
+        if (term == UINT32_MAX) {
+            return -1;
+        }
+        if (b->occ_count == b->occ_cap) {
+            size_t cap = b->occ_cap ? b->occ_cap * 2 : 1024;
+            Occurrence* grown = realloc(b->occ, cap * sizeof(Occurrence));
+            if (!grown) {
+                perror("realloc");
+                return -1;
+            }
+            b->occ = grown;
+            b->occ_cap = cap;
+        }
+        b->occ[b->occ_count++] = (Occurrence){ .term = term, .pos = pos++, .line = line };
+    }
+    note->rec.tokens = pos;
+
+    if (b->occ_count > 1) {
+        qsort(b->occ, b->occ_count, sizeof(Occurrence), compare_occurrences);
+    }
+    for (size_t i = 0; i < b->occ_count; ) {
+        uint32_t term = b->occ[i].term;
+        FreshTerm* t = &b->fresh[term];
+        uint32_t prev_pos = 0, prev_line = 0, tf = 0;
+        b->scratch.len = 0;
+        for (; i < b->occ_count && b->occ[i].term == term; i++, tf++) {
+            if (buf_varint(&b->scratch, b->occ[i].pos - prev_pos) != 0 ||
+                buf_varint(&b->scratch, b->occ[i].line - prev_line) != 0) {
+                return -1;
+            }
+            prev_pos = b->occ[i].pos;
+            prev_line = b->occ[i].line;
+        }
+        if (buf_varint(&t->postings, note_pos - t->last_note) != 0 ||
+            buf_varint(&t->postings, tf) != 0 ||
+            buf_varint(&t->postings, (uint32_t)b->scratch.len) != 0 ||
+            buf_append(&t->postings, b->scratch.data, b->scratch.len) != 0) {
+            return -1;
+        }
+        t->last_note = note_pos;
+        t->df++;
+    }
+    return 0;
+}
+
+static int read_note_words(Build* b, uint32_t note_pos, int dir_fd)
+{
+    char file_name[1024];
+    snprintf(file_name, sizeof(file_name), "%s.bdsb", b->notes[note_pos].name);
+    int fd = openat(dir_fd, file_name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        // Gone since it was listed, index it empty
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    int rc = add_note_words(b, note_pos, map, st.st_size);
+    munmap(map, st.st_size);
+    return rc;
+}
+
+typedef struct SortedFresh
+{
+    const char* name;
+    uint32_t term;
+} SortedFresh;
+
+static int compare_sorted_fresh(const void* a, const void* b)
+{
+    return strcmp(((const SortedFresh*)a)->name, ((const SortedFresh*)b)->name);
+}
+
+static int buf_string(ByteBuf* strings, const char* s, uint32_t* offset)
+{
+    *offset = (uint32_t)strings->len;
+    return buf_append(strings, s, strlen(s) + 1);
+}
+
+// Copies one note of a postings list, renumbered, after the previous one written
+static int put_doc(ByteBuf* out, const DocReader* r, uint32_t note, uint32_t* last_note)
+{
+    if (buf_varint(out, note - *last_note) != 0 ||
+        buf_varint(out, r->tf) != 0 ||
+        buf_varint(out, r->pos_len) != 0 ||
+        buf_append(out, r->pos, r->pos_len) != 0) {
+        return -1;
+    }
+    *last_note = note;
+    return 0;
+}
+
+/*
+ * Merges the postings kept from the old index with the fresh ones term by term. Both lists are
+ * sorted by name and old note numbers map to increasing new ones, so each term is one merge.
+ */
+static int merge_terms(Build* b, const TermsMap* m, const uint32_t* old_to_new, ByteBuf* terms_out,
+                       ByteBuf* strings, ByteBuf* postings)
+{
+    SortedFresh* sorted = malloc((b->fresh_count ? b->fresh_count : 1) * sizeof(SortedFresh));
+    if (!sorted) {
+        perror("malloc");
+        return -1;
+    }
+    for (uint32_t i = 0; i < b->fresh_count; i++) {
+        sorted[i].name = (const char*)b->names.data + b->fresh[i].name;
+        sorted[i].term = i;
+    }
+    if (b->fresh_count > 1) {
+        qsort(sorted, b->fresh_count, sizeof(SortedFresh), compare_sorted_fresh);
+    }
+
+    uint32_t old_count = m ? m->hdr->terms_count : 0;
+    uint32_t i = 0, j = 0;
+    int rc = 0;
+    while (rc == 0 && (i < old_count || j < b->fresh_count)) {
+        const TermsTerm* old = i < old_count ? &m->terms[i] : NULL;
+        const FreshTerm* fresh = j < b->fresh_count ? &b->fresh[sorted[j].term] : NULL;
+        int cmp = !old ? 1 : !fresh ? -1 : strcmp(terms_name(m, old->name), sorted[j].name);
+        const char* name = cmp <= 0 ? terms_name(m, old->name) : sorted[j].name;
+
+        DocReader a, f;
+        memset(&a, 0, sizeof(a));
+        memset(&f, 0, sizeof(f));
+        if (cmp <= 0) {
+            term_reader(m, old, &a);
+            i++;
+        }
+        if (cmp >= 0) {
+            f.p = fresh->postings.data;
+            f.end = f.p + fresh->postings.len;
+            j++;
+        }
+
+        TermsTerm term = { .postings = postings->len };
+        uint32_t last_note = 0;
+        // Next kept old note, renumbered; UINT32_MAX once the list is done
+        uint32_t a_note = UINT32_MAX;
+        while (doc_next(&a)) {
+            if (a.note < m->hdr->notes_count && old_to_new[a.note] != UINT32_MAX) {
+                a_note = old_to_new[a.note];
+                break;
+            }
+        }
+        int f_more = doc_next(&f);
+        while (rc == 0 && (a_note != UINT32_MAX || f_more)) {
+            if (a_note != UINT32_MAX && (!f_more || a_note < f.note)) {
+                rc = put_doc(postings, &a, a_note, &last_note);
+                a_note = UINT32_MAX;
+                while (doc_next(&a)) {
+                    if (a.note < m->hdr->notes_count && old_to_new[a.note] != UINT32_MAX) {
+                        a_note = old_to_new[a.note];
+                        break;
+                    }
+                }
+            } else {
+                rc = put_doc(postings, &f, f.note, &last_note);
+                f_more = doc_next(&f);
+            }
+            term.df++;
+        }
+
+        if (rc == 0 && term.df > 0) {
+            if (postings->len - term.postings > UINT32_MAX) {
+                rc = -1;
+                break;
+            }
+            term.postings_len = (uint32_t)(postings->len - term.postings);
+            rc = buf_string(strings, name, &term.name);
+            if (rc == 0) {
+                rc = buf_append(terms_out, &term, sizeof(term));
+            }
+        }
+    }
+    free(sorted);
+    return rc;
+}
+
+static int write_terms(Build* b, const TermsMap* m, const uint32_t* old_to_new, int64_t built_at)
+{
+    ByteBuf books = {0}, notes = {0}, terms = {0}, strings = {0}, postings = {0};
+    const char nul = '\0';
+    uint64_t total_tokens = 0;
+    int rc = buf_append(&strings, &nul, 1);
+
+    for (uint32_t i = 0; rc == 0 && i < b->books_count; i++) {
+        TermsBook book = { .first_note = b->books[i].first_note, .notes_count = b->books[i].notes_count };
+        rc = buf_string(&strings, b->books[i].name, &book.name);
+        if (rc == 0) rc = buf_append(&books, &book, sizeof(book));
+    }
+    for (uint32_t i = 0; rc == 0 && i < b->notes_count; i++) {
+        TermsNote note = b->notes[i].rec;
+        total_tokens += note.tokens;
+        rc = buf_string(&strings, b->notes[i].name, &note.name);
+        if (rc == 0) rc = buf_append(&notes, &note, sizeof(note));
+    }
+    if (rc == 0) {
+        rc = merge_terms(b, m, old_to_new, &terms, &strings, &postings);
+    }
+    if (rc == 0 && strings.len > UINT32_MAX) {
+        rc = -1;
+    }
+
+    char tmp_path[1024];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", tindex.path, (long)getpid());
+    int fd = rc == 0 ? open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+    if (fd >= 0) {
+        TermsHeader hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, TERMS_MAGIC, sizeof(hdr.magic));
+        hdr.version = BSDTERMS_VERSION;
+        hdr.books_count = b->books_count;
+        hdr.notes_count = b->notes_count;
+        hdr.terms_count = (uint32_t)(terms.len / sizeof(TermsTerm));
+        hdr.strings_len = (uint32_t)strings.len;
+        hdr.postings_len = postings.len;
+        hdr.total_tokens = total_tokens;
+        hdr.built_at = built_at;
+
+        if (write_all(fd, &hdr, sizeof(hdr)) != 0 ||
+            write_all(fd, books.data, books.len) != 0 ||
+            write_all(fd, notes.data, notes.len) != 0 ||
+            write_all(fd, terms.data, terms.len) != 0 ||
+            write_all(fd, strings.data, strings.len) != 0 ||
+            write_all(fd, postings.data, postings.len) != 0 ||
+            rename(tmp_path, tindex.path) != 0) {
+            perror("write term index");
+            unlink(tmp_path);
+            rc = -1;
+        }
+        close(fd);
+    } else {
+        rc = -1;
+    }
+
+    free(books.data);
+    free(notes.data);
+    free(terms.data);
+    free(strings.data);
+    free(postings.data);
+    return rc;
+}
+
+static void free_build(Build* b)
+{
+    for (uint32_t i = 0; i < b->books_count; i++) {
+        free(b->books[i].name);
+    }
+    for (uint32_t i = 0; i < b->notes_count; i++) {
+        free(b->notes[i].name);
+    }
+    for (uint32_t i = 0; i < b->fresh_count; i++) {
+        free(b->fresh[i].postings.data);
+    }
+    free(b->books);
+    free(b->notes);
+    free(b->fresh);
+    free(b->table);
+    free(b->names.data);
+    free(b->occ);
+    free(b->scratch.data);
+}
+
+// Builds the index from the current mapping and swaps the result in; one build runs at a time
+static int update_terms(void)
+{
+    pthread_mutex_lock(&tindex.update_lock);
+    TermsMap* m = acquire_terms();
+    int64_t built_at = time(NULL);
+    int root_fd = open(tindex.root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        release_terms(m);
+        pthread_mutex_unlock(&tindex.update_lock);
+        return -1;
+    }
+
+    Build b;
+    memset(&b, 0, sizeof(b));
+    uint32_t* old_to_new = NULL;
+    int rc = list_tree(&b, root_fd);
+
+    // Reuse the postings of every note whose size and mtime did not move
+    uint32_t kept = 0;
+    if (rc == 0 && m) {
+        old_to_new = malloc((m->hdr->notes_count ? m->hdr->notes_count : 1) * sizeof(uint32_t));
+        if (!old_to_new) {
+            perror("malloc");
+            rc = -1;
+        }
+        for (uint32_t i = 0; rc == 0 && i < m->hdr->notes_count; i++) {
+            old_to_new[i] = UINT32_MAX;
+        }
+        for (uint32_t i = 0; rc == 0 && i < b.notes_count; i++) {
+            BuildNote* note = &b.notes[i];
+            uint32_t old = old_note(m, b.books[note->rec.book].name, note->name);
+            if (old != UINT32_MAX && note_is_current(m, &m->notes[old], &note->rec)) {
+                note->old = old;
+                note->rec.tokens = m->notes[old].tokens;
+                old_to_new[old] = i;
+                kept++;
+            }
+        }
+    }
+
+    int changed = !m || kept != b.notes_count || kept != m->hdr->notes_count ||
+                  b.books_count != m->hdr->books_count;
+    for (uint32_t i = 0; rc == 0 && !changed && i < b.books_count; i++) {
+        changed = strcmp(b.books[i].name, terms_name(m, m->books[i].name)) != 0;
+    }
+
+    if (rc == 0 && changed) {
+        int dir_fd = -1;
+        uint32_t dir_book = UINT32_MAX;
+        for (uint32_t i = 0; rc == 0 && i < b.notes_count; i++) {
+            if (b.notes[i].old != UINT32_MAX) {
+                continue;
+            }
+            if (b.notes[i].rec.book != dir_book) {
+                if (dir_fd >= 0) close(dir_fd);
+                dir_book = b.notes[i].rec.book;
+                dir_fd = openat(root_fd, b.books[dir_book].name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            }
+            if (dir_fd >= 0) {
+                rc = read_note_words(&b, i, dir_fd);
+            }
+        }
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+        if (rc == 0) {
+            rc = write_terms(&b, m, old_to_new, built_at);
+        }
+    }
+    close(root_fd);
+    free(old_to_new);
+    free_build(&b);
+    release_terms(m);
+
+    if (rc == 0 && changed) {
+        TermsMap* fresh = map_terms();
+        if (fresh) {
+            swap_terms(fresh);
+        } else {
+            rc = -1;
+        }
+    }
+    pthread_mutex_unlock(&tindex.update_lock);
+    return rc == 0 ? 0 : -1;
+}
+
+// Maps the file a previous run left behind, without building
+static int load_terms(void)
+{
+    pthread_mutex_lock(&tindex.update_lock);
+    pthread_mutex_lock(&tindex.lock);
+    int have = tindex.current != NULL;
+    pthread_mutex_unlock(&tindex.lock);
+    if (!have) {
+        TermsMap* m = map_terms();
+        if (m) {
+            swap_terms(m);
+            have = 1;
+        }
+    }
+    pthread_mutex_unlock(&tindex.update_lock);
+    return have ? 0 : -1;
+}
+
+int terms_open(int refresh)
+{
+    if (terms_paths() != 0) {
+        return TERMS_UNAVAILABLE;
+    }
+    if (load_terms() == 0 && !refresh) {
+        return 0;
+    }
+    return update_terms() == 0 ? 0 : TERMS_UNAVAILABLE;
+}
+
+void terms_close(void)
+{
+    swap_terms(NULL);
+}
+
+/* Queries */
+
+typedef struct QueryItem
+{
+    int negate;
+    // Words [first, first + count) of the query, more than one is a phrase
+    int first;
+    int count;
+} QueryItem;
+
+typedef struct Query
+{
+    char words[TERMS_MAX_QUERY_TERMS][TERMS_MAX_TERM + 1];
+    int words_count;
+    QueryItem items[TERMS_MAX_QUERY_TERMS];
+    int items_count;
+    // Items of clause c are [clause_start[c], clause_start[c + 1]), clauses are ORed
+    int clause_start[TERMS_MAX_QUERY_TERMS + 1];
+    int clauses_count;
+} Query;
+
+typedef struct DocHit
+{
+    uint32_t note;
+    uint32_t tf;
+    uint32_t line;
+    uint32_t pos_len;
+    const unsigned char* pos;
+} DocHit;
+
+typedef struct WordList
+{
+    DocHit* docs;
+    uint32_t count;
+    double idf;
+} WordList;
+
+typedef struct NoteMatch
+{
+    uint32_t note;
+    uint32_t line;
+} NoteMatch;
+
+typedef struct Ranked
+{
+    uint32_t note;
+    uint32_t line;
+    double score;
+} Ranked;
+
+static int add_query_item(Query* q, const char* text, size_t len, int negate)
+{
+    const char* p = text;
+    const char* word;
+    size_t word_len;
+    uint32_t line = 0;
+    QueryItem item = { .negate = negate, .first = q->words_count, .count = 0 };
+    while ((word_len = next_word(&p, text + len, &word, &line)) > 0) {
+        if (q->words_count == TERMS_MAX_QUERY_TERMS || word_len > TERMS_MAX_TERM) {
+            return -1;
+        }
+        lower_word(q->words[q->words_count++], word, word_len);
+        item.count++;
+    }
+    if (item.count > 0) {
+        q->items[q->items_count++] = item;
+    }
+    return 0;
+}
+
+static void close_clause(Query* q)
+{
+    if (q->items_count > q->clause_start[q->clauses_count]) {
+        q->clause_start[++q->clauses_count] = q->items_count;
+    }
+}
+
+static int parse_query(const char* text, Query* q)
+{
+    memset(q, 0, sizeof(*q));
+    const char* p = text;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+        if (!*p) {
+            break;
+        }
+
+        int negate = 0;
+        if (*p == '-') {
+            negate = 1;
+            p++;
+        }
+        const char* start;
+        const char* end;
+        if (*p == '"') {
+            start = ++p;
+            end = strchr(p, '"');
+            if (!end) end = p + strlen(p);
+            p = *end ? end + 1 : end;
+        } else {
+            start = p;
+            while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') p++;
+            end = p;
+            if (!negate && end - start == 2 && memcmp(start, "OR", 2) == 0) {
+                close_clause(q);
+                continue;
+            }
+        }
+        if (add_query_item(q, start, end - start, negate) != 0) {
+            return -1;
+        }
+    }
+    close_clause(q);
+
+    // Every alternative needs something to find, exclusions alone would list everything
+    for (int c = 0; c < q->clauses_count; c++) {
+        int positive = 0;
+        for (int i = q->clause_start[c]; i < q->clause_start[c + 1]; i++) {
+            positive |= !q->items[i].negate;
+        }
+        if (!positive) {
+            return -1;
+        }
+    }
+    return q->clauses_count > 0 ? 0 : -1;
+}
+
+// Decodes the note list of a word, with tf and the first line for each note
+static int load_word(const TermsMap* m, const char* word, WordList* list)
+{
+    memset(list, 0, sizeof(*list));
+    const TermsTerm* term = find_term(m, word);
+    if (!term) {
+        return 0;
+    }
+    list->docs = malloc((term->df ? term->df : 1) * sizeof(DocHit));
+    if (!list->docs) {
+        perror("malloc");
+        return -1;
+    }
+
+    DocReader r;
+    term_reader(m, term, &r);
+    while (list->count < term->df && doc_next(&r)) {
+        if (r.note >= m->hdr->notes_count) {
+            break;
+        }
+        const unsigned char* p = r.pos;
+        uint32_t pos, line = 0;
+        get_varint(&p, r.pos + r.pos_len, &pos);
+        get_varint(&p, r.pos + r.pos_len, &line);
+        list->docs[list->count++] = (DocHit){ .note = r.note, .tf = r.tf, .line = line,
+                                              .pos_len = r.pos_len, .pos = r.pos };
+    }
+
+    double n = m->hdr->notes_count;
+    list->idf = log(1.0 + (n - list->count + 0.5) / (list->count + 0.5));
+    return 0;
+}
+
+static const DocHit* find_doc(const WordList* list, uint32_t note)
+{
+    uint32_t lo = 0, hi = list->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (list->docs[mid].note == note) return &list->docs[mid];
+        if (list->docs[mid].note < note) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+// Decodes word positions and their lines, returns the count or -1
+static int64_t decode_positions(const DocHit* doc, uint32_t* pos, uint32_t* lines)
+{
+    const unsigned char* p = doc->pos;
+    const unsigned char* end = doc->pos + doc->pos_len;
+    uint32_t prev_pos = 0, prev_line = 0;
+    for (uint32_t i = 0; i < doc->tf; i++) {
+        uint32_t dp, dl;
+        if (get_varint(&p, end, &dp) != 0 || get_varint(&p, end, &dl) != 0) {
+            return -1;
+        }
+        prev_pos += dp;
+        prev_line += dl;
+        pos[i] = prev_pos;
+        if (lines) lines[i] = prev_line;
+    }
+    return doc->tf;
+}
+
+static int has_position(const uint32_t* pos, uint32_t count, uint32_t want)
+{
+    uint32_t lo = 0, hi = count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (pos[mid] == want) return 1;
+        if (pos[mid] < want) lo = mid + 1;
+        else hi = mid;
+    }
+    return 0;
+}
+
+/*
+ * Returns the line of the first occurrence of the phrase in a note, 0 if it does not occur.
+ * docs[k] is the note entry of the k-th phrase word.
+ */
+static uint32_t phrase_line(const DocHit* const* docs, int count)
+{
+    uint32_t max_tf = 0;
+    for (int k = 0; k < count; k++) {
+        if (docs[k]->tf > max_tf) max_tf = docs[k]->tf;
+    }
+    uint32_t* first_pos = malloc(max_tf * sizeof(uint32_t));
+    uint32_t* first_lines = malloc(max_tf * sizeof(uint32_t));
+    uint32_t* other = malloc(max_tf * sizeof(uint32_t));
+    uint32_t line = 0;
+    if (!first_pos || !first_lines || !other || decode_positions(docs[0], first_pos, first_lines) < 0) {
+        goto out;
+    }
+
+    // Starts still possible after checking the words so far
+    uint32_t starts = docs[0]->tf;
+    for (int k = 1; k < count && starts > 0; k++) {
+        if (decode_positions(docs[k], other, NULL) < 0) {
+            starts = 0;
+            break;
+        }
+        uint32_t kept = 0;
+        for (uint32_t s = 0; s < starts; s++) {
+            if (has_position(other, docs[k]->tf, first_pos[s] + k)) {
+                first_pos[kept] = first_pos[s];
+                first_lines[kept] = first_lines[s];
+                kept++;
+            }
+        }
+        starts = kept;
+    }
+    if (starts > 0) {
+        line = first_lines[0];
+    }
+
+out:
+    free(first_pos);
+    free(first_lines);
+    free(other);
+    return line;
+}
+
+/*
+ * Line of the first match of a query item in a note, 0 if the item does not occur there.
+ * word_list[w] is the list of query word w.
+ */
+static uint32_t item_line(const QueryItem* item, const WordList* const* word_list, uint32_t note)
+{
+    const DocHit* docs[TERMS_MAX_QUERY_TERMS];
+    for (int k = 0; k < item->count; k++) {
+        docs[k] = find_doc(word_list[item->first + k], note);
+        if (!docs[k]) {
+            return 0;
+        }
+    }
+    return item->count == 1 ? docs[0]->line : phrase_line(docs, item->count);
+}
+
+static int add_match(NoteMatch** matches, size_t* count, size_t* cap, uint32_t note, uint32_t line)
+{
+    if (*count == *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 256;
+        NoteMatch* grown = realloc(*matches, new_cap * sizeof(NoteMatch));
+        if (!grown) {
+            perror("realloc");
+            return -1;
+        }
+        *matches = grown;
+        *cap = new_cap;
+    }
+    (*matches)[(*count)++] = (NoteMatch){ .note = note, .line = line };
+    return 0;
+}
+
+static int compare_matches(const void* a, const void* b)
+{
+    const NoteMatch* x = a;
+    const NoteMatch* y = b;
+    if (x->note != y->note) return x->note < y->note ? -1 : 1;
+    return x->line < y->line ? -1 : x->line > y->line;
+}
+
+// Ranked order: higher score first, then book and note order
+static int ranked_before(const Ranked* a, const Ranked* b)
+{
+    return a->score > b->score || (a->score == b->score && a->note < b->note);
+}
+
+static int compare_ranked(const void* a, const void* b)
+{
+    return ranked_before(a, b) ? -1 : ranked_before(b, a) ? 1 : 0;
+}
+
+// Min-heap of the best hits so far, the worst kept hit at the root
+static void heap_push(Ranked* heap, size_t* count, size_t limit, Ranked hit)
+{
+    size_t i;
+    if (*count < limit) {
+        i = (*count)++;
+        while (i > 0 && ranked_before(&heap[(i - 1) / 2], &hit)) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = hit;
+        return;
+    }
+    if (!ranked_before(&hit, &heap[0])) {
+        return;
+    }
+    i = 0;
+    while (1) {
+        size_t child = 2 * i + 1;
+        if (child >= *count) break;
+        if (child + 1 < *count && ranked_before(&heap[child], &heap[child + 1])) child++;
+        if (!ranked_before(&hit, &heap[child])) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = hit;
+}
+
+long terms_search(const char* query, int refresh, size_t limit, TermsVisitor visit, void* ctx)
+{
+    Query* q = malloc(sizeof(Query));
+    if (!q) {
+        perror("malloc");
+        return TERMS_UNAVAILABLE;
+    }
+    if (parse_query(query, q) != 0) {
+        free(q);
+        return TERMS_BAD_QUERY;
+    }
+    if (refresh && terms_open(1) != 0) {
+        free(q);
+        return TERMS_UNAVAILABLE;
+    }
+    // The lock is only held to take the reference, the search runs on a mapping nobody changes
+    TermsMap* m = acquire_terms();
+    if (!m) {
+        free(q);
+        return TERMS_NOT_READY;
+    }
+
+    // One list per distinct word
+    WordList lists[TERMS_MAX_QUERY_TERMS];
+    const WordList* word_list[TERMS_MAX_QUERY_TERMS];
+    int positive[TERMS_MAX_QUERY_TERMS] = {0};
+    int lists_count = 0;
+    long total = TERMS_UNAVAILABLE;
+    NoteMatch* matches = NULL;
+    size_t matches_count = 0, matches_cap = 0;
+    Ranked* heap = NULL;
+
+    for (int w = 0; w < q->words_count; w++) {
+        int found = -1;
+        for (int v = 0; v < w && found < 0; v++) {
+            if (strcmp(q->words[v], q->words[w]) == 0) found = word_list[v] - lists;
+        }
+        if (found < 0) {
+            if (load_word(m, q->words[w], &lists[lists_count]) != 0) {
+                goto out;
+            }
+            found = lists_count++;
+        }
+        word_list[w] = &lists[found];
+    }
+    for (int i = 0; i < q->items_count; i++) {
+        for (int k = 0; k < q->items[i].count && !q->items[i].negate; k++) {
+            positive[word_list[q->items[i].first + k] - lists] = 1;
+        }
+    }
+
+    for (int c = 0; c < q->clauses_count; c++) {
+        // Walk the notes of the rarest word of the clause, check the other items by lookup
+        const WordList* driver = NULL;
+        for (int i = q->clause_start[c]; i < q->clause_start[c + 1]; i++) {
+            const QueryItem* item = &q->items[i];
+            for (int k = 0; k < item->count && !item->negate; k++) {
+                const WordList* list = word_list[item->first + k];
+                if (!driver || list->count < driver->count) driver = list;
+            }
+        }
+        for (uint32_t d = 0; driver && d < driver->count; d++) {
+            uint32_t note = driver->docs[d].note;
+            uint32_t line = UINT32_MAX;
+            int ok = 1;
+            for (int i = q->clause_start[c]; ok && i < q->clause_start[c + 1]; i++) {
+                const QueryItem* item = &q->items[i];
+                uint32_t at = item_line(item, word_list, note);
+                if (item->negate) {
+                    ok = at == 0;
+                } else {
+                    ok = at != 0;
+                    if (at < line) line = at;
+                }
+            }
+            if (ok && add_match(&matches, &matches_count, &matches_cap, note, line) != 0) {
+                goto out;
+            }
+        }
+    }
+
+    // A note matching several alternatives is listed once, at its first line
+    if (matches_count > 1) {
+        qsort(matches, matches_count, sizeof(NoteMatch), compare_matches);
+    }
+    size_t unique = 0;
+    for (size_t i = 0; i < matches_count; i++) {
+        if (unique == 0 || matches[unique - 1].note != matches[i].note) {
+            matches[unique++] = matches[i];
+        }
+    }
+
+    heap = malloc((limit ? limit : 1) * sizeof(Ranked));
+    if (!heap) {
+        perror("malloc");
+        goto out;
+    }
+    size_t heap_count = 0;
+    double avg_tokens = m->hdr->notes_count
+                            ? (double)m->hdr->total_tokens / m->hdr->notes_count : 1.0;
+    if (avg_tokens <= 0) {
+        avg_tokens = 1.0;
+    }
+    for (size_t i = 0; limit > 0 && i < unique; i++) {
+        double tokens = m->notes[matches[i].note].tokens;
+        double score = 0;
+        for (int l = 0; l < lists_count; l++) {
+            const DocHit* doc = positive[l] ? find_doc(&lists[l], matches[i].note) : NULL;
+            if (doc) {
+                double tf = doc->tf;
+                score += lists[l].idf * tf * (BM25_K1 + 1) /
+                         (tf + BM25_K1 * (1 - BM25_B + BM25_B * tokens / avg_tokens));
+            }
+        }
+        Ranked hit = { .note = matches[i].note, .line = matches[i].line, .score = score };
+        heap_push(heap, &heap_count, limit, hit);
+    }
+
+    if (heap_count > 1) {
+        qsort(heap, heap_count, sizeof(Ranked), compare_ranked);
+    }
+    for (size_t i = 0; i < heap_count; i++) {
+        const TermsNote* note = &m->notes[heap[i].note];
+        visit(terms_name(m, m->books[note->book].name), terms_name(m, note->name), heap[i].score,
+              heap[i].line, ctx);
+    }
+    total = (long)unique;
+
+out:
+    for (int l = 0; l < lists_count; l++) {
+        free(lists[l].docs);
+    }
+    free(matches);
+    free(heap);
+    free(q);
+    release_terms(m);
+    return total;
+}
+
+// Builds once, then again after every change; changes nobody reported are found by polling
+static void* refresh_loop(void* arg)
+{
+    int wake_fd = *(int*)arg;
+    unsigned long long built = 0;
+    int ok = 0;
+    for (;;) {
+        /*
+         * The catalog sees every create, delete and close-after-write through inotify, so while
+         * its generation stands still no note changed and the notes need not be stat()ed again.
+         */
+        unsigned long long generation = catalog_ready() ? catalog_generation() : 0;
+#if defined(__linux__)
+        int refresh = !ok || generation == 0 || generation != built;
+#else
+        int refresh = 1;
+#endif
+        if (refresh) {
+            ok = update_terms() == 0;
+            if (ok) {
+                built = generation;
+            }
+        }
+
+        struct pollfd pfd = { .fd = wake_fd, .events = POLLIN };
+        if (poll(&pfd, 1, TERMS_POLL_MS) > 0) {
+            char drain[64];
+            while (read(wake_fd, drain, sizeof(drain)) > 0) {
+            }
+        }
+    }
+    return NULL;
+}
+
+int terms_start(void)
+{
+    static int wake_fd[2] = { -1, -1 };
+    if (terms_paths() != 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&tindex.lock);
+    int running = tindex.refresher;
+    tindex.refresher = 1;
+    pthread_mutex_unlock(&tindex.lock);
+    if (running) {
+        return 0;
+    }
+
+    // The index a previous run left answers queries until the first refresh is done
+    load_terms();
+
+    if (pipe(wake_fd) < 0) {
+        perror("pipe");
+        goto fail;
+    }
+    if (fcntl(wake_fd[0], F_SETFL, O_NONBLOCK) < 0 || fcntl(wake_fd[1], F_SETFL, O_NONBLOCK) < 0 ||
+        fcntl(wake_fd[0], F_SETFD, FD_CLOEXEC) < 0 || fcntl(wake_fd[1], F_SETFD, FD_CLOEXEC) < 0 ||
+        changes_add_waker(wake_fd[1]) < 0) {
+        perror("fcntl");
+        close(wake_fd[0]);
+        close(wake_fd[1]);
+        goto fail;
+    }
+    // The waker cannot be removed again, its pipe stays open if the thread does not start
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, refresh_loop, &wake_fd[0]) != 0) {
+        perror("pthread_create");
+        goto fail;
+    }
+    pthread_detach(thread);
+    return 0;
+
+fail:
+    pthread_mutex_lock(&tindex.lock);
+    tindex.refresher = 0;
+    pthread_mutex_unlock(&tindex.lock);
+    return -1;
+}
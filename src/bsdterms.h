@@ -0,0 +1,161 @@
+/*=================================================================================================
+ *
+ * 	@FILENAME:	      bsdterms.h
+ * 	@BRIEF:    	      Persistent full-text word index of all notes.
+ * 	@DESCRIPTION:	  $HOME/books/.bsdterms maps every word of every note to the notes, word
+ * 	                  positions and lines it occurs at. It is mapped with mmap() and answers
+ * 	                  boolean and phrase queries ranked with BM25 without reading the notes.
+ * 	@AUTHOR		      Daniil (TwelveFacedJanus) Ermolaev.
+ * 	   | CONTACT:	  twofaced-janus@yandex.ru
+ *	@CREATED AT:	  10.16.26
+ *	@UPDATED_AT:	  10.16.26
+ *
+ *==================================================================================================*/
+
+#ifndef BSDTERMS_H_
+#define BSDTERMS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BSDTERMS_FILE ".bsdterms"
+#define BSDTERMS_VERSION 1
+// Longer words (hashes, base64) are skipped but still take a position
+#define TERMS_MAX_TERM 64
+#define TERMS_MAX_QUERY_TERMS 32
+
+#define TERMS_UNAVAILABLE -1
+#define TERMS_BAD_QUERY -2
+#define TERMS_NOT_READY -3
+
+/*
+ * Called for each of the best matching notes, best first. note_name is without .bdsb, line is
+ * the first line where a query word or phrase occurs.
+ */
+typedef void (*TermsVisitor)(const char* book_name, const char* note_name, double score,
+                             uint32_t line, void* ctx);
+
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Maps the word index, building or updating it first if asked.
+ *     @DESCRIPTION:
+ *          With refresh set, every .bdsb file is listed and compared with the size and mtime
+ *          recorded in the index. Only new or changed notes are read and tokenized; the postings
+ *          of unchanged notes are copied from the old index. The new index is written to a
+ *          temporary file and renamed over the old one, nothing is written when no note changed.
+ *     @PARAMETERS:
+ *          - int refresh: 1 to check the notes for changes, 0 to use the index as it is
+ *     @RETURN:
+ *          - 0 on success, TERMS_UNAVAILABLE on error
+ *     @NOTES:
+ *          - Words are runs of ASCII letters and digits and non-ASCII bytes, ASCII is lowercased
+ *          - Thread-safe; one build runs at a time, queries keep the mapping they started on
+ *     @EXAMPLE:
+ *          ```c
+ *          terms_open(1);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FIX]:
+ *               A refresh swaps in a new mapping instead of replacing the one queries read.
+ *
+ =========================================================================================*/
+int terms_open(int refresh);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Runs a full-text query.
+ *     @DESCRIPTION:
+ *          Words are ANDed. "OR" between words or groups gives alternatives ("a b OR c" is
+ *          (a AND b) OR c), a leading '-' excludes a word or phrase, double quotes make a
+ *          phrase that must occur as consecutive words. Matching notes are ranked with BM25
+ *          over the query words they contain, ties go to book and note order.
+ *     @PARAMETERS:
+ *          - const char* query: Query text
+ *          - int refresh: 1 to refresh the index first, 0 to search the current mapping
+ *          - size_t limit: Number of best notes passed to visit
+ *          - TermsVisitor visit: Called for each of the best notes
+ *          - void* ctx: Passed to visit
+ *     @RETURN:
+ *          - Number of matching notes, which may be more than limit
+ *          - TERMS_UNAVAILABLE if the index cannot be built or read
+ *          - TERMS_BAD_QUERY if the query has no word to look for or too many words
+ *          - TERMS_NOT_READY if refresh is 0 and no index was mapped yet
+ *     @NOTES:
+ *          - Strings passed to visit are only valid during the call
+ *          - Thread-safe; the lock is held only to take a reference to the current mapping
+ *     @EXAMPLE:
+ *          ```c
+ *          static void print_hit(const char* book, const char* note, double score,
+ *                                uint32_t line, void* ctx)
+ *          {
+ *              printf("%.3f %s/%s:%u\n", score, book, note, line);
+ *          }
+ *
+ *          terms_search("kernel \"page cache\" -draft", 1, 10, print_hit, NULL);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FIX]:
+ *               Searches a reference to an immutable mapping, refresh 0 never builds.
+ *
+ =========================================================================================*/
+long terms_search(const char* query, int refresh, size_t limit, TermsVisitor visit, void* ctx);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Keeps the word index current on a thread of its own.
+ *     @DESCRIPTION:
+ *          Maps the index a previous run left behind, then starts a thread that refreshes it
+ *          as terms_open(1) would and swaps the new mapping in. The thread wakes on every change
+ *          recorded by bsdchanges and every few seconds otherwise. While the catalog watches the
+ *          tree, a wakeup that did not move catalog_generation() costs nothing.
+ *     @PARAMETERS:
+ *          - None
+ *     @RETURN:
+ *          - 0 on success or if the thread is running already, -1 on error
+ *     @NOTES:
+ *          - Call it after catalog_start(); terms_search(query, 0, ...) then never builds
+ *     @EXAMPLE:
+ *          ```c
+ *          if (terms_start() != 0) {
+ *              fprintf(stderr, "Search index will not be refreshed\n");
+ *          }
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int terms_start(void);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Unmaps the word index.
+ *     @DESCRIPTION:
+ *          The next call maps it again. Queries running on the mapping keep it until they end.
+ *     @PARAMETERS:
+ *          - None
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          terms_close();
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void terms_close(void);
+
+#endif
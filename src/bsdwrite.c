@@ -0,0 +1,1610 @@
+#include "./bsdcore.h"
+
+#include <pthread.h>
+#include <sys/file.h>
+
+typedef struct SyncWaiter
+{
+    // File to flush, -1 for none
+    int file_fd;
+    // Directory to flush, where from is renamed to to once the file is flushed
+    int dir_fd;
+    const char* from;
+    const char* to;
+    // errno of the first step that failed
+    int err;
+    int done;
+} SyncWaiter;
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // Signalled when a writer joins the group being filled
+    pthread_cond_t joined;
+    int window_us;
+    // One syncfs() per filesystem instead of an fsync() per file and directory
+    int syncfs;
+    // Group being filled, taken whole by the writer that syncs it
+    SyncWaiter* group[WRITE_MAX_GROUP];
+    size_t count;
+    // Size of the last group synced
+    size_t last_count;
+    int syncing;
+    unsigned long long writes;
+    unsigned long long groups;
+    unsigned long long syncs;
+} commit = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .joined = PTHREAD_COND_INITIALIZER,
+    .window_us = WRITE_DEFAULT_WINDOW_US,
+};
+
+// Temporary files of one process never collide, other processes have another pid
+static unsigned long long temp_counter;
+
+// Writers of one note take the same stripe, unrelated notes rarely share one
+static pthread_mutex_t note_locks[WRITE_NOTE_LOCKS] = {
+    [0 ... WRITE_NOTE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static size_t note_lock_index(const char* book_name, const char* note_name)
+{
+    // FNV-1a over "book/note"
+    uint32_t h = 2166136261u;
+    for (const char* p = book_name; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    h = (h ^ '/') * 16777619u;
+    for (const char* p = note_name; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    return h % WRITE_NOTE_LOCKS;
+}
+
+static int bulk_fenced(const char* book_name);
+
+// With the inotify catalog running, it records the change when it sees it
+static int changes_are_pushed(void)
+{
+#if defined(__linux__)
+    return catalog_ready();
+#else
+    return 0;
+#endif
+}
+
+// Whether one sync of an earlier member of the group also covers this one
+static int shares_sync(const struct stat* st, dev_t dev, ino_t ino, int whole_fs)
+{
+    return st->st_dev == dev && (whole_fs || st->st_ino == ino);
+}
+
+// Flushes the files or the directories of a group, returns the number of syncs made
+static unsigned long long sync_members(SyncWaiter** group, size_t n, int dirs, int whole_fs)
+{
+    dev_t devs[WRITE_MAX_GROUP];
+    ino_t inos[WRITE_MAX_GROUP];
+    int errs[WRITE_MAX_GROUP];
+    size_t synced = 0;
+    for (size_t i = 0; i < n; i++) {
+        SyncWaiter* w = group[i];
+        int fd = dirs ? w->dir_fd : w->file_fd;
+        if (fd < 0 || w->err) {
+            continue;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            w->err = errno;
+            continue;
+        }
+        size_t j = 0;
+        while (j < synced && !shares_sync(&st, devs[j], inos[j], whole_fs)) {
+            j++;
+        }
+        if (j == synced) {
+            devs[synced] = st.st_dev;
+            inos[synced] = st.st_ino;
+#if defined(__linux__)
+            if (whole_fs) {
+                // Also flushes unrelated writers, and an error may belong to any file of the filesystem
+                errs[synced] = syncfs(fd) == 0 ? 0 : errno;
+            } else
+#endif
+            {
+                errs[synced] = fsync(fd) == 0 ? 0 : errno;
+            }
+            synced++;
+        }
+        w->err = errs[j];
+    }
+    return synced;
+}
+
+static unsigned long long run_group(SyncWaiter** group, size_t n, int whole_fs)
+{
+    // Text first, so a rename never makes a note visible before its text is on disk
+    unsigned long long syncs = sync_members(group, n, 0, whole_fs);
+    for (size_t i = 0; i < n; i++) {
+        SyncWaiter* w = group[i];
+        if (w->from && !w->err && renameat(w->dir_fd, w->from, w->dir_fd, w->to) != 0) {
+            w->err = errno;
+        }
+    }
+    return syncs + sync_members(group, n, 1, whole_fs);
+}
+
+// Joins the group being filled with n waiters and returns once all are synced, 0 or the first errno
+static int commit_wait(SyncWaiter* ws, size_t n)
+{
+    pthread_mutex_lock(&commit.lock);
+    size_t queued = 0;
+    // Groups are synced in order, the last waiter is done once all are
+    while (!ws[n - 1].done) {
+        while (queued < n && commit.count < WRITE_MAX_GROUP) {
+            commit.group[commit.count++] = &ws[queued++];
+            pthread_cond_signal(&commit.joined);
+        }
+        if (commit.syncing || queued == 0) {
+            pthread_cond_wait(&commit.cond, &commit.lock);
+            continue;
+        }
+
+        // The first writer to find no sync running syncs for the whole group
+        commit.syncing = 1;
+        if (queued == n && commit.window_us > 0 && commit.count < commit.last_count) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            long nsec = deadline.tv_nsec + (long)(commit.window_us % 1000000) * 1000;
+            deadline.tv_sec += commit.window_us / 1000000 + nsec / 1000000000;
+            deadline.tv_nsec = nsec % 1000000000;
+            // A group as large as the last one has everyone who was writing, waiting on only adds latency
+            while (commit.count < commit.last_count &&
+                   pthread_cond_timedwait(&commit.joined, &commit.lock, &deadline) == 0) {
+            }
+        }
+        SyncWaiter* group[WRITE_MAX_GROUP];
+        size_t count = commit.count;
+        memcpy(group, commit.group, count * sizeof(*group));
+        commit.count = 0;
+        commit.last_count = count;
+        int whole_fs = commit.syncfs;
+        // Writers that found the group full may start the next one
+        pthread_cond_broadcast(&commit.cond);
+        pthread_mutex_unlock(&commit.lock);
+
+        unsigned long long syncs = run_group(group, count, whole_fs);
+
+        pthread_mutex_lock(&commit.lock);
+        for (size_t i = 0; i < count; i++) {
+            group[i]->done = 1;
+        }
+        commit.syncing = 0;
+        commit.writes += count;
+        commit.groups++;
+        commit.syncs += syncs;
+        pthread_cond_broadcast(&commit.cond);
+    }
+    pthread_mutex_unlock(&commit.lock);
+    for (size_t i = 0; i < n; i++) {
+        if (ws[i].err) {
+            return ws[i].err;
+        }
+    }
+    return 0;
+}
+
+// Opens the books directory, or the book book_name in it
+static int open_dir(const char* book_name)
+{
+    char* root = get_default_books_path("/books");
+    if (!root || root[0] == '\0') {
+        errno = ENOENT;
+        return -1;
+    }
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", root, book_name ? book_name : "");
+    free(root);
+    return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+void write_set_window(int window_us)
+{
+    pthread_mutex_lock(&commit.lock);
+    commit.window_us = window_us > 0 ? window_us : 0;
+    pthread_mutex_unlock(&commit.lock);
+}
+
+void write_set_syncfs(int on)
+{
+    pthread_mutex_lock(&commit.lock);
+#if defined(__linux__)
+    commit.syncfs = on != 0;
+#else
+    (void)on;
+#endif
+    pthread_mutex_unlock(&commit.lock);
+}
+
+// Writes the new text of a note to fd, 0 or -1 with errno
+typedef int (*NoteFill)(int fd, const void* arg);
+
+static int fill_data(int fd, const void* arg)
+{
+    const NoteEdit* all = arg;
+    return write_all(fd, all->text, all->text_len);
+}
+
+typedef struct PatchSource
+{
+    int fd;
+    off_t size;
+    const NoteEdit* edits;
+    size_t count;
+} PatchSource;
+
+// Copies length bytes of src at offset to the end of dst, in the kernel where it can
+static int copy_span(int src_fd, off_t offset, int dst_fd, off_t length)
+{
+#if defined(__linux__)
+    while (length > 0) {
+        ssize_t n = copy_file_range(src_fd, &offset, dst_fd, NULL, (size_t)length, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // Across filesystems or on old kernels the bytes go through user space
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                break;
+            }
+            if (n == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        length -= n;
+    }
+#endif
+    char buf[64 * 1024];
+    while (length > 0) {
+        ssize_t n = pread(src_fd, buf, length < (off_t)sizeof(buf) ? (size_t)length : sizeof(buf), offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        if (write_all(dst_fd, buf, (size_t)n) != 0) {
+            return -1;
+        }
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static int fill_patch(int fd, const void* arg)
+{
+    const PatchSource* src = arg;
+    off_t at = 0;
+    for (size_t i = 0; i < src->count; i++) {
+        const NoteEdit* e = &src->edits[i];
+        if (copy_span(src->fd, at, fd, e->offset - at) != 0 || write_all(fd, e->text, e->text_len) != 0) {
+            return -1;
+        }
+        at = e->offset + e->length;
+    }
+    return copy_span(src->fd, at, fd, src->size - at);
+}
+
+// Fills a temporary file, syncs it and renames it over the note
+static int replace_note(const char* book_name, const char* note_name, NoteFill fill, const void* arg,
+                        struct stat* st)
+{
+    if (!is_valid_name(book_name) || !is_valid_name(note_name)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (bulk_fenced(book_name)) {
+        errno = EBUSY;
+        return -1;
+    }
+    int dir_fd = open_dir(book_name);
+    if (dir_fd < 0) {
+        return -1;
+    }
+
+    char file_name[512];
+    char temp_name[600];
+    snprintf(file_name, sizeof(file_name), "%s.bdsb", note_name);
+    // Hidden and without the .bdsb ending, listings and the catalog skip it
+    snprintf(temp_name, sizeof(temp_name), ".%s.%ld.%llu", file_name, (long)getpid(),
+             __atomic_add_fetch(&temp_counter, 1, __ATOMIC_RELAXED));
+    int fd = openat(dir_fd, temp_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        int err = errno;
+        close(dir_fd);
+        errno = err;
+        return -1;
+    }
+
+    // A replaced note keeps its permissions
+    struct stat old_st;
+    int created = fstatat(dir_fd, file_name, &old_st, 0) != 0;
+    int err = 0;
+    if (!created && fchmod(fd, old_st.st_mode & 07777) != 0) {
+        err = errno;
+    }
+    if (!err && fill(fd, arg) != 0) {
+        err = errno;
+    }
+    /*
+     * Closing a descriptor opened for writing is an IN_CLOSE_WRITE under the name the file has
+     * by then; the writer is closed while that is still the temporary name and the file is
+     * synced through a read-only descriptor.
+     */
+    int sync_fd = err ? -1 : openat(dir_fd, temp_name, O_RDONLY | O_CLOEXEC);
+    if (!err && sync_fd < 0) {
+        err = errno;
+    }
+    if (close(fd) != 0 && !err) {
+        err = errno;
+    }
+    if (!err) {
+        SyncWaiter w = { .file_fd = sync_fd, .dir_fd = dir_fd, .from = temp_name, .to = file_name };
+        err = commit_wait(&w, 1);
+    }
+    // After a failure the note is untouched, only the temporary file has to go
+    if (err) {
+        unlinkat(dir_fd, temp_name, 0);
+    } else if (st && fstat(sync_fd, st) != 0) {
+        err = errno;
+    }
+    if (sync_fd >= 0) {
+        close(sync_fd);
+    }
+    close(dir_fd);
+
+    notecache_invalidate(book_name, note_name);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    if (!changes_are_pushed()) {
+        changes_record(created ? CHANGE_NOTE_CREATED : CHANGE_NOTE_MODIFIED, book_name, note_name, NULL, NULL);
+    }
+    return created;
+}
+
+int write_note_durable(const char* book_name, const char* note_name, const void* data, size_t len,
+                       struct stat* st)
+{
+    NoteEdit all = { .text = data, .text_len = len };
+    return replace_note(book_name, note_name, fill_data, &all, st);
+}
+
+int patch_note_durable(const char* book_name, const char* note_name, int src_fd, const NoteEdit* edits,
+                       size_t count, struct stat* st)
+{
+    struct stat src_st;
+    if (fstat(src_fd, &src_st) != 0) {
+        return -1;
+    }
+    off_t at = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (edits[i].offset < at || edits[i].length < 0 || edits[i].offset + edits[i].length > src_st.st_size) {
+            errno = EINVAL;
+            return -1;
+        }
+        at = edits[i].offset + edits[i].length;
+    }
+    PatchSource src = { .fd = src_fd, .size = src_st.st_size, .edits = edits, .count = count };
+    return replace_note(book_name, note_name, fill_patch, &src, st);
+}
+
+int delete_note_durable(const char* book_name, const char* note_name)
+{
+    if (!is_valid_name(book_name) || !is_valid_name(note_name)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (bulk_fenced(book_name)) {
+        errno = EBUSY;
+        return -1;
+    }
+    int dir_fd = open_dir(book_name);
+    if (dir_fd < 0) {
+        return -1;
+    }
+    char file_name[512];
+    snprintf(file_name, sizeof(file_name), "%s.bdsb", note_name);
+    int err = 0;
+    if (unlinkat(dir_fd, file_name, 0) != 0) {
+        err = errno;
+    } else {
+        SyncWaiter w = { .file_fd = -1, .dir_fd = dir_fd };
+        err = commit_wait(&w, 1);
+        notecache_invalidate(book_name, note_name);
+        if (!changes_are_pushed()) {
+            changes_record(CHANGE_NOTE_DELETED, book_name, note_name, NULL, NULL);
+        }
+    }
+    close(dir_fd);
+    errno = err;
+    return err ? -1 : 0;
+}
+
+int create_book_durable(const char* book_name)
+{
+    if (!is_valid_name(book_name)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (bulk_fenced(book_name)) {
+        errno = EBUSY;
+        return -1;
+    }
+    int root_fd = open_dir(NULL);
+    if (root_fd < 0) {
+        return -1;
+    }
+    int err = 0;
+    if (mkdirat(root_fd, book_name, 0755) != 0) {
+        err = errno;
+    } else {
+        SyncWaiter w = { .file_fd = -1, .dir_fd = root_fd };
+        err = commit_wait(&w, 1);
+        if (!changes_are_pushed()) {
+            changes_record(CHANGE_BOOK_CREATED, book_name, NULL, NULL, NULL);
+        }
+    }
+    close(root_fd);
+    errno = err;
+    return err ? -1 : 0;
+}
+
+int delete_book_durable(const char* book_name)
+{
+    if (!is_valid_name(book_name)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (bulk_fenced(book_name)) {
+        errno = EBUSY;
+        return -1;
+    }
+    int root_fd = open_dir(NULL);
+    if (root_fd < 0) {
+        return -1;
+    }
+    int err = 0;
+    struct stat st;
+    if (fstatat(root_fd, book_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        err = errno;
+    } else if (!S_ISDIR(st.st_mode)) {
+        err = ENOENT;
+    } else {
+        char* root = get_default_books_path("/books");
+        char book_path[1024];
+        snprintf(book_path, sizeof(book_path), "%s/%s", root, book_name);
+        if (root[0] != '\0') {
+            free(root);
+        }
+        if (delete_folder_recursive(book_path) != 0) {
+            err = errno ? errno : EIO;
+        } else {
+            SyncWaiter w = { .file_fd = -1, .dir_fd = root_fd };
+            err = commit_wait(&w, 1);
+        }
+        // Even a partly deleted book has lost notes
+        notecache_invalidate(book_name, NULL);
+        if (!changes_are_pushed()) {
+            changes_record(CHANGE_BOOK_DELETED, book_name, NULL, NULL, NULL);
+        }
+    }
+    close(root_fd);
+    errno = err;
+    return err ? -1 : 0;
+}
+
+// Operation that created a note, none for notes that were there before
+#define BULK_NO_ORIGIN ((size_t)-1)
+
+// A book or a note as the operations before the current one leave it
+typedef struct BulkName
+{
+    // "book" or "book/note", NULL for a free slot
+    char* key;
+    int exists;
+    // Books count their creations and deletions; a note is only known for the book it was seen in
+    unsigned gen;
+    // Books only: the directory, -1 until needed
+    int fd;
+    int touched;
+    // Notes only: the file the name holds and the operation that created it
+    dev_t dev;
+    ino_t ino;
+    size_t origin;
+} BulkName;
+
+// What replaying one operation from the intent needs to tell whether it was done
+typedef struct BulkStep
+{
+    // Created notes: the file in the books directory holding the text until it is renamed
+    char temp[600];
+    // Deleted and moved notes: the file the operation takes away, done once the name holds no other
+    dev_t dev;
+    ino_t ino;
+    size_t origin;
+} BulkStep;
+
+typedef struct BulkState
+{
+    BulkName* names;
+    size_t cap;
+    int root_fd;
+    const char* root;
+    // Books whose directory the operations changed
+    BulkName** touched;
+    size_t touched_count;
+    int root_touched;
+} BulkState;
+
+// A bulk change that stopped part way; its books take no other writes until it is finished
+typedef struct BulkFence
+{
+    struct BulkFence* next;
+    char* intent;
+    char** books;
+    size_t books_count;
+} BulkFence;
+
+static struct
+{
+    pthread_mutex_t lock;
+    BulkFence* list;
+} fences = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int bulk_recover_one(const char* name);
+
+static void bulk_fence_free(BulkFence* f)
+{
+    for (size_t i = 0; i < f->books_count; i++) {
+        free(f->books[i]);
+    }
+    free(f->books);
+    free(f->intent);
+    free(f);
+}
+
+static int bulk_fence_names(const BulkFence* f, const char* book_name)
+{
+    for (size_t i = 0; i < f->books_count; i++) {
+        if (!book_name || strcmp(f->books[i], book_name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void bulk_fence_add(const char* intent, const BulkOp* ops, size_t count)
+{
+    BulkFence* f = calloc(1, sizeof(BulkFence));
+    if (f) {
+        f->intent = strdup(intent);
+        f->books = calloc(2 * count + 1, sizeof(char*));
+    }
+    for (size_t i = 0; f && f->books && i < 2 * count; i++) {
+        const char* book = i % 2 ? ops[i / 2].to_book : ops[i / 2].book;
+        if (book && !bulk_fence_names(f, book) && (f->books[f->books_count] = strdup(book)) != NULL) {
+            f->books_count++;
+        }
+    }
+    if (!f || !f->intent || !f->books) {
+        // Without the fence the books are only finished by the next bulk_recover()
+        if (f) {
+            bulk_fence_free(f);
+        }
+        return;
+    }
+    pthread_mutex_lock(&fences.lock);
+    BulkFence* known = fences.list;
+    while (known && strcmp(known->intent, intent) != 0) {
+        known = known->next;
+    }
+    if (!known) {
+        f->next = fences.list;
+        fences.list = f;
+    }
+    pthread_mutex_unlock(&fences.lock);
+    if (known) {
+        bulk_fence_free(f);
+    }
+}
+
+// 1 while an unfinished bulk change names the book, or any book if book_name is NULL
+static int bulk_fenced(const char* book_name)
+{
+    pthread_mutex_lock(&fences.lock);
+    int fenced = 0;
+    for (BulkFence* f = fences.list; f && !fenced; f = f->next) {
+        fenced = bulk_fence_names(f, book_name);
+    }
+    pthread_mutex_unlock(&fences.lock);
+    return fenced;
+}
+
+int bulk_finish(const char* book_name)
+{
+    pthread_mutex_lock(&fences.lock);
+    size_t count = 0;
+    for (BulkFence* f = fences.list; f; f = f->next) {
+        count += bulk_fence_names(f, book_name);
+    }
+    char** names = count ? calloc(count, sizeof(char*)) : NULL;
+    size_t n = 0;
+    for (BulkFence* f = fences.list; names && f; f = f->next) {
+        if (bulk_fence_names(f, book_name) && (names[n] = strdup(f->intent)) != NULL) {
+            n++;
+        }
+    }
+    pthread_mutex_unlock(&fences.lock);
+
+    int root_fd = n ? open_dir(NULL) : -1;
+    for (size_t i = 0; i < n; i++) {
+        // Replayed as after a crash; one another thread is replaying is left to it
+        bulk_recover_one(names[i]);
+        struct stat st;
+        if (root_fd >= 0 && fstatat(root_fd, names[i], &st, AT_SYMLINK_NOFOLLOW) != 0 && errno == ENOENT) {
+            pthread_mutex_lock(&fences.lock);
+            for (BulkFence** f = &fences.list; *f; f = &(*f)->next) {
+                if (strcmp((*f)->intent, names[i]) == 0) {
+                    BulkFence* done = *f;
+                    *f = done->next;
+                    bulk_fence_free(done);
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&fences.lock);
+        }
+        free(names[i]);
+    }
+    free(names);
+    if (root_fd >= 0) {
+        close(root_fd);
+    }
+    if (bulk_fenced(book_name)) {
+        errno = EBUSY;
+        return -1;
+    }
+    return 0;
+}
+
+// Sizes the name table for count operations and opens the books directory
+static int bulk_init(BulkState* b, char* root, size_t count)
+{
+    *b = (BulkState){ .root_fd = -1, .root = root };
+    b->cap = 16;
+    // Every operation names at most two books and two notes, kept under half full
+    while (b->cap < 8 * count) {
+        b->cap *= 2;
+    }
+    b->names = calloc(b->cap, sizeof(BulkName));
+    b->touched = calloc(2 * count, sizeof(BulkName*));
+    if (!b->names || !b->touched) {
+        return ENOMEM;
+    }
+    b->root_fd = open_dir(NULL);
+    return b->root_fd < 0 ? errno : 0;
+}
+
+static BulkName* bulk_name(BulkState* b, const char* book_name, const char* note_name)
+{
+    char key[512];
+    if (snprintf(key, sizeof(key), note_name ? "%s/%s" : "%s", book_name, note_name) >= (int)sizeof(key)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    // FNV-1a, probed linearly
+    uint32_t h = 2166136261u;
+    for (const char* p = key; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    size_t i = h & (b->cap - 1);
+    while (b->names[i].key && strcmp(b->names[i].key, key) != 0) {
+        i = (i + 1) & (b->cap - 1);
+    }
+    BulkName* n = &b->names[i];
+    if (!n->key) {
+        n->key = strdup(key);
+        if (!n->key) {
+            return NULL;
+        }
+        n->exists = -1;
+        n->fd = -1;
+        n->origin = BULK_NO_ORIGIN;
+    }
+    return n;
+}
+
+static int bulk_book_exists(BulkState* b, BulkName* book)
+{
+    if (book->exists < 0) {
+        struct stat st;
+        book->exists = fstatat(b->root_fd, book->key, &st, 0) == 0 && S_ISDIR(st.st_mode);
+    }
+    return book->exists;
+}
+
+static int bulk_book_fd(BulkState* b, BulkName* book)
+{
+    if (book->fd < 0) {
+        book->fd = openat(b->root_fd, book->key, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    return book->fd;
+}
+
+static int bulk_note_exists(BulkState* b, BulkName* book, BulkName* note, const char* file_name)
+{
+    if (!bulk_book_exists(b, book)) {
+        return 0;
+    }
+    if (note->exists >= 0 && note->gen == book->gen) {
+        return note->exists;
+    }
+    // A book made or emptied by these operations has only the notes they put in it
+    note->gen = book->gen;
+    struct stat st;
+    int fd = book->gen ? -1 : bulk_book_fd(b, book);
+    note->exists = fd >= 0 && fstatat(fd, file_name, &st, 0) == 0 && S_ISREG(st.st_mode);
+    if (note->exists) {
+        note->dev = st.st_dev;
+        note->ino = st.st_ino;
+        note->origin = BULK_NO_ORIGIN;
+    }
+    return note->exists;
+}
+
+static void bulk_touch(BulkState* b, BulkName* book)
+{
+    if (!book->touched) {
+        book->touched = 1;
+        b->touched[b->touched_count++] = book;
+    }
+}
+
+// Checks one operation against the state the earlier ones leave and applies it to that state
+static int bulk_check(BulkState* b, const BulkOp* op, size_t index, BulkStep* step)
+{
+    int note_op = op->type == BULK_CREATE_NOTE || op->type == BULK_DELETE_NOTE || op->type == BULK_MOVE_NOTE;
+    if (!is_valid_name(op->book) || (note_op && !is_valid_name(op->note)) ||
+        (op->type == BULK_MOVE_NOTE && (!is_valid_name(op->to_book) || !is_valid_name(op->to_note)))) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (bulk_fenced(op->book) || (op->type == BULK_MOVE_NOTE && bulk_fenced(op->to_book))) {
+        errno = EBUSY;
+        return -1;
+    }
+    BulkName* book = bulk_name(b, op->book, NULL);
+    if (!book) {
+        return -1;
+    }
+    char file_name[512];
+    snprintf(file_name, sizeof(file_name), "%s.bdsb", note_op ? op->note : "");
+    BulkName* note = note_op ? bulk_name(b, op->book, op->note) : NULL;
+    if (note_op && !note) {
+        return -1;
+    }
+
+    switch (op->type) {
+    case BULK_CREATE_BOOK:
+    case BULK_DELETE_BOOK: {
+        int create = op->type == BULK_CREATE_BOOK;
+        if (bulk_book_exists(b, book) == create) {
+            errno = create ? EEXIST : ENOENT;
+            return -1;
+        }
+        book->exists = create;
+        book->gen++;
+        b->root_touched = 1;
+        bulk_touch(b, book);
+        return 0;
+    }
+    case BULK_CREATE_NOTE:
+        if (!bulk_book_exists(b, book)) {
+            errno = ENOENT;
+            return -1;
+        }
+        if (bulk_note_exists(b, book, note, file_name)) {
+            errno = EEXIST;
+            return -1;
+        }
+        note->exists = 1;
+        note->origin = index;
+        bulk_touch(b, book);
+        return 0;
+    case BULK_DELETE_NOTE:
+        if (!bulk_note_exists(b, book, note, file_name)) {
+            errno = ENOENT;
+            return -1;
+        }
+        note->exists = 0;
+        step->dev = note->dev;
+        step->ino = note->ino;
+        step->origin = note->origin;
+        bulk_touch(b, book);
+        return 0;
+    case BULK_MOVE_NOTE: {
+        if (!bulk_note_exists(b, book, note, file_name)) {
+            errno = ENOENT;
+            return -1;
+        }
+        BulkName* to_book = bulk_name(b, op->to_book, NULL);
+        BulkName* to_note = to_book ? bulk_name(b, op->to_book, op->to_note) : NULL;
+        if (!to_note) {
+            return -1;
+        }
+        char to_file[512];
+        snprintf(to_file, sizeof(to_file), "%s.bdsb", op->to_note);
+        if (!bulk_book_exists(b, to_book)) {
+            errno = ENOENT;
+            return -1;
+        }
+        // Moving a note onto itself would replace it with itself
+        if (bulk_note_exists(b, to_book, to_note, to_file)) {
+            errno = EEXIST;
+            return -1;
+        }
+        note->exists = 0;
+        to_note->exists = 1;
+        step->dev = to_note->dev = note->dev;
+        step->ino = to_note->ino = note->ino;
+        step->origin = to_note->origin = note->origin;
+        bulk_touch(b, book);
+        bulk_touch(b, to_book);
+        return 0;
+    }
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+}
+
+// Writes the text of a created note to a temporary file in the books directory
+static int bulk_write_text(BulkState* b, const BulkOp* op, BulkStep* step)
+{
+    snprintf(step->temp, sizeof(step->temp), ".%s.bdsb.%ld.%llu", op->note, (long)getpid(),
+             __atomic_add_fetch(&temp_counter, 1, __ATOMIC_RELAXED));
+    int fd = openat(b->root_fd, step->temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        step->temp[0] = '\0';
+        return -1;
+    }
+    struct stat st;
+    int err = write_all(fd, op->text, op->text_len) == 0 && fstat(fd, &st) == 0 ? 0 : errno;
+    if (close(fd) != 0 && !err) {
+        err = errno;
+    }
+    if (err) {
+        unlinkat(b->root_fd, step->temp, 0);
+        step->temp[0] = '\0';
+        errno = err;
+        return -1;
+    }
+    step->dev = st.st_dev;
+    step->ino = st.st_ino;
+    return 0;
+}
+
+// 1 if the note file_name in dir_fd is still the file the step expects to take away
+static int bulk_still_there(int dir_fd, const char* file_name, const BulkStep* step)
+{
+    struct stat st;
+    return fstatat(dir_fd, file_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && st.st_dev == step->dev &&
+           st.st_ino == step->ino;
+}
+
+/*
+ * Gives the file at from the name to unless something else took that name since the check, which
+ * fails with EEXIST. Where the kernel cannot rename without replacing, the file is linked and
+ * unlinked; a link an interrupted attempt left behind is the step's own file and only unlinked.
+ */
+static int bulk_move(int from_fd, const char* from, int to_fd, const char* to, const BulkStep* step)
+{
+#if defined(__linux__) && defined(RENAME_NOREPLACE)
+    if (renameat2(from_fd, from, to_fd, to, RENAME_NOREPLACE) == 0) {
+        return 0;
+    }
+    if (errno != EINVAL && errno != ENOSYS && errno != EEXIST) {
+        return -1;
+    }
+#endif
+    if (linkat(from_fd, from, to_fd, to, 0) != 0 && (errno != EEXIST || !bulk_still_there(to_fd, to, step))) {
+        return -1;
+    }
+    return unlinkat(from_fd, from, 0);
+}
+
+// Locks the stripes of every note the operations name, all of them if a book goes, in stripe order
+static void bulk_lock_notes(const BulkOp* ops, size_t count, unsigned char* held)
+{
+    memset(held, 0, WRITE_NOTE_LOCKS);
+    for (size_t i = 0; i < count; i++) {
+        if (ops[i].type == BULK_DELETE_BOOK) {
+            memset(held, 1, WRITE_NOTE_LOCKS);
+            break;
+        }
+        if (ops[i].book && ops[i].note) {
+            held[note_lock_index(ops[i].book, ops[i].note)] = 1;
+        }
+        if (ops[i].to_book && ops[i].to_note) {
+            held[note_lock_index(ops[i].to_book, ops[i].to_note)] = 1;
+        }
+    }
+    for (size_t i = 0; i < WRITE_NOTE_LOCKS; i++) {
+        if (held[i]) {
+            pthread_mutex_lock(&note_locks[i]);
+        }
+    }
+}
+
+static void bulk_unlock_notes(const unsigned char* held)
+{
+    for (size_t i = WRITE_NOTE_LOCKS; i-- > 0;) {
+        if (held[i]) {
+            pthread_mutex_unlock(&note_locks[i]);
+        }
+    }
+}
+
+/*
+ * Carries out one checked operation unless an earlier attempt already did, so replaying an
+ * intent after a crash finishes the operations without repeating any. A created note is done
+ * once its temporary file is gone, a deleted or moved one once its name no longer holds the
+ * file the check saw there.
+ */
+static int bulk_do(BulkState* b, const BulkOp* op, BulkStep* step)
+{
+    BulkName* book = bulk_name(b, op->book, NULL);
+    if (!book) {
+        return -1;
+    }
+    char file_name[512];
+    snprintf(file_name, sizeof(file_name), "%s.bdsb", op->note ? op->note : "");
+    switch (op->type) {
+    case BULK_CREATE_BOOK:
+        return mkdirat(b->root_fd, op->book, 0755) == 0 || errno == EEXIST ? 0 : -1;
+    case BULK_DELETE_BOOK: {
+        if (book->fd >= 0) {
+            close(book->fd);
+            book->fd = -1;
+        }
+        struct stat st;
+        if (fstatat(b->root_fd, op->book, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            return errno == ENOENT ? 0 : -1;
+        }
+        char book_path[1024];
+        snprintf(book_path, sizeof(book_path), "%s/%s", b->root, op->book);
+        int rc = delete_folder_recursive(book_path);
+        notecache_invalidate(op->book, NULL);
+        return rc;
+    }
+    case BULK_CREATE_NOTE: {
+        struct stat st;
+        if (fstatat(b->root_fd, step->temp, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            step->temp[0] = '\0';
+            return errno == ENOENT ? 0 : -1;
+        }
+        int dir_fd = bulk_book_fd(b, book);
+        if (dir_fd < 0 || bulk_move(b->root_fd, step->temp, dir_fd, file_name, step) != 0) {
+            return -1;
+        }
+        step->temp[0] = '\0';
+        notecache_invalidate(op->book, op->note);
+        return 0;
+    }
+    case BULK_DELETE_NOTE: {
+        // A replay may find the book already deleted by a later operation, and the note with it
+        int dir_fd = bulk_book_fd(b, book);
+        if (dir_fd < 0) {
+            return errno == ENOENT ? 0 : -1;
+        }
+        int rc = bulk_still_there(dir_fd, file_name, step) ? unlinkat(dir_fd, file_name, 0) : 0;
+        notecache_invalidate(op->book, op->note);
+        return rc;
+    }
+    case BULK_MOVE_NOTE: {
+        BulkName* to_book = bulk_name(b, op->to_book, NULL);
+        char to_file[512];
+        snprintf(to_file, sizeof(to_file), "%s.bdsb", op->to_note);
+        int from_fd = bulk_book_fd(b, book);
+        if (from_fd < 0) {
+            return errno == ENOENT ? 0 : -1;
+        }
+        int to_fd = to_book ? bulk_book_fd(b, to_book) : -1;
+        if (to_fd < 0) {
+            return -1;
+        }
+        int rc = bulk_still_there(from_fd, file_name, step) ? bulk_move(from_fd, file_name, to_fd, to_file, step) : 0;
+        notecache_invalidate(op->book, op->note);
+        notecache_invalidate(op->to_book, op->to_note);
+        return rc;
+    }
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+static void bulk_change(Change* c, const BulkOp* op)
+{
+    static const int types[] = {
+        [BULK_CREATE_BOOK] = CHANGE_BOOK_CREATED,
+        [BULK_DELETE_BOOK] = CHANGE_BOOK_DELETED,
+        [BULK_CREATE_NOTE] = CHANGE_NOTE_CREATED,
+        [BULK_DELETE_NOTE] = CHANGE_NOTE_DELETED,
+        [BULK_MOVE_NOTE] = CHANGE_NOTE_RENAMED,
+    };
+    int move = op->type == BULK_MOVE_NOTE;
+    *c = (Change){
+        .type = types[op->type],
+        .book = (char*)(move ? op->to_book : op->book),
+        .note = (char*)(move ? op->to_note : op->note),
+        .from_book = (char*)(move ? op->book : NULL),
+        .from_note = (char*)(move ? op->note : NULL),
+    };
+}
+
+// Temporary files still named by steps are removed unless a pending intent needs them
+static void bulk_free(BulkState* b, BulkStep* steps, size_t count, int keep_temps)
+{
+    for (size_t i = 0; steps && !keep_temps && i < count; i++) {
+        if (steps[i].temp[0]) {
+            unlinkat(b->root_fd, steps[i].temp, 0);
+        }
+    }
+    for (size_t i = 0; b->names && i < b->cap; i++) {
+        // Free slots are zeroed, only named ones hold a descriptor
+        if (b->names[i].key && b->names[i].fd >= 0) {
+            close(b->names[i].fd);
+        }
+        free(b->names[i].key);
+    }
+    free(b->names);
+    free(b->touched);
+    free(steps);
+    if (b->root_fd >= 0) {
+        close(b->root_fd);
+    }
+}
+
+// Moves waiters whose sync an earlier one already covers to the end and returns how many are left
+// in front; a large bulk change then fits in one group instead of hundreds
+static size_t drop_shared_syncs(SyncWaiter* ws, size_t n, int dirs)
+{
+    pthread_mutex_lock(&commit.lock);
+    int whole_fs = commit.syncfs;
+    pthread_mutex_unlock(&commit.lock);
+    size_t kept = 0;
+    dev_t* devs = malloc(n * sizeof(dev_t));
+    ino_t* inos = malloc(n * sizeof(ino_t));
+    if (!devs || !inos) {
+        free(devs);
+        free(inos);
+        return n;
+    }
+    for (size_t i = 0; i < n; i++) {
+        struct stat st = {0};
+        size_t j = 0;
+        if (fstat(dirs ? ws[i].dir_fd : ws[i].file_fd, &st) == 0) {
+            while (j < kept && !shares_sync(&st, devs[j], inos[j], whole_fs)) {
+                j++;
+            }
+        } else {
+            // Kept, commit_wait() reports the error
+            j = kept;
+        }
+        if (j == kept) {
+            devs[kept] = st.st_dev;
+            inos[kept] = st.st_ino;
+            SyncWaiter w = ws[kept];
+            ws[kept++] = ws[i];
+            ws[i] = w;
+        }
+    }
+    free(devs);
+    free(inos);
+    return kept;
+}
+
+// One sync for each directory that changed, shared with other writers
+static int bulk_sync_dirs(BulkState* b)
+{
+    SyncWaiter* dirs = calloc(b->touched_count + 1, sizeof(SyncWaiter));
+    if (!dirs) {
+        return ENOMEM;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < b->touched_count; i++) {
+        // Deleted books have nothing left to sync
+        int fd = bulk_book_fd(b, b->touched[i]);
+        if (fd >= 0) {
+            dirs[n++] = (SyncWaiter){ .file_fd = -1, .dir_fd = fd };
+        }
+    }
+    if (b->root_touched) {
+        dirs[n++] = (SyncWaiter){ .file_fd = -1, .dir_fd = b->root_fd };
+    }
+    int err = n > 0 ? commit_wait(dirs, drop_shared_syncs(dirs, n, 1)) : 0;
+    free(dirs);
+    return err;
+}
+
+/*
+ * Writes the operations to an intent file in the books directory, next to the change journal,
+ * and syncs it with the directory that holds it and the temporary files. It is written under
+ * another name and renamed, so recovery never finds a half written intent of a live writer.
+ * Returns the intent locked, recovery leaves it alone until it is closed.
+ */
+static int bulk_write_intent(BulkState* b, const BulkOp* ops, const BulkStep* steps, size_t count,
+                             char* name, size_t size)
+{
+    char new_name[256];
+    snprintf(name, size, "%s%ld.%llu", BULK_INTENT_PREFIX, (long)getpid(),
+             __atomic_add_fetch(&temp_counter, 1, __ATOMIC_RELAXED));
+    snprintf(new_name, sizeof(new_name), "%s%s", name, BULK_INTENT_NEW);
+    int fd = openat(b->root_fd, new_name, O_RDWR | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    int err = flock(fd, LOCK_EX) == 0 ? 0 : errno;
+
+    // Names hold no tabs or newlines, is_valid_name() refuses control bytes
+    OutBuffer text = {0};
+    int rc = outbuf_printf(&text, "%s\n", BULK_INTENT_MAGIC);
+    for (size_t i = 0; rc == 0 && i < count; i++) {
+        const BulkOp* op = &ops[i];
+        rc = outbuf_printf(&text, "%d\t%s\t%s\t%s\t%s\t%s\t%llu\t%llu\n", op->type, op->book,
+                           op->note ? op->note : "", op->to_book ? op->to_book : "",
+                           op->to_note ? op->to_note : "", steps[i].temp,
+                           (unsigned long long)steps[i].dev, (unsigned long long)steps[i].ino);
+    }
+    if (rc == 0) {
+        rc = outbuf_printf(&text, "end\n");
+    }
+    if (!err && rc != 0) {
+        err = ENOMEM;
+    }
+    if (!err && write_all(fd, text.data, text.len) != 0) {
+        err = errno;
+    }
+    outbuf_free(&text);
+
+    int renamed = 0;
+    if (!err) {
+        renamed = renameat(b->root_fd, new_name, b->root_fd, name) == 0;
+        err = renamed ? 0 : errno;
+    }
+    if (!err) {
+        SyncWaiter w = { .file_fd = fd, .dir_fd = b->root_fd };
+        err = commit_wait(&w, 1);
+    }
+    if (err) {
+        unlinkat(b->root_fd, renamed ? name : new_name, 0);
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Carries out operations from..count-1 and sets *done to the number carried out. After a book
+ * deletion everything so far is synced and a mark appended to the intent, so a replay starts
+ * after it and never deletes a book the later operations created again.
+ */
+static int bulk_run(BulkState* b, const BulkOp* ops, BulkStep* steps, size_t from, size_t count,
+                    int intent_fd, size_t* done)
+{
+    for (size_t i = from; i < count; i++) {
+        if (bulk_do(b, &ops[i], &steps[i]) != 0) {
+            *done = i;
+            if (!errno) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        if (ops[i].type == BULK_DELETE_BOOK && i + 1 < count) {
+            char mark[64];
+            int len = snprintf(mark, sizeof(mark), "mark %zu\n", i + 1);
+            int err = bulk_sync_dirs(b);
+            if (!err && write_all(intent_fd, mark, len) != 0) {
+                err = errno;
+            }
+            if (!err) {
+                SyncWaiter w = { .file_fd = intent_fd, .dir_fd = -1 };
+                err = commit_wait(&w, 1);
+            }
+            if (err) {
+                *done = i + 1;
+                errno = err;
+                return -1;
+            }
+        }
+    }
+    *done = count;
+    return 0;
+}
+
+// Journals the operations of a finished bulk change in one run
+static void bulk_journal(const BulkOp* ops, size_t count)
+{
+    if (changes_are_pushed()) {
+        return;
+    }
+    Change* list = calloc(count, sizeof(Change));
+    for (size_t i = 0; list && i < count; i++) {
+        bulk_change(&list[i], &ops[i]);
+    }
+    if (list) {
+        changes_record_many(list, count);
+    }
+    free(list);
+}
+
+int bulk_apply(const BulkOp* ops, size_t count, size_t* failed, size_t* applied)
+{
+    *failed = count;
+    *applied = 0;
+    if (count == 0) {
+        return 0;
+    }
+    // Changes an earlier failure left part way are finished first, or their books refused below
+    bulk_finish(NULL);
+    // Single writes to the same notes wait until the operations are done or given up
+    unsigned char held[WRITE_NOTE_LOCKS];
+    bulk_lock_notes(ops, count, held);
+    char* root = get_default_books_path("/books");
+    BulkState b;
+    int err = bulk_init(&b, root, count);
+    BulkStep* steps = calloc(count, sizeof(BulkStep));
+    if (!err && !steps) {
+        err = ENOMEM;
+    }
+
+    // Nothing is changed unless every operation can be carried out
+    for (size_t i = 0; !err && i < count; i++) {
+        if (bulk_check(&b, &ops[i], i, &steps[i]) != 0) {
+            err = errno ? errno : EINVAL;
+            *failed = i;
+        }
+    }
+
+    // Created notes are files before any name points at them, the texts synced in one group
+    size_t texts = 0;
+    for (size_t i = 0; !err && i < count; i++) {
+        if (ops[i].type == BULK_CREATE_NOTE) {
+            if (bulk_write_text(&b, &ops[i], &steps[i]) != 0) {
+                err = errno;
+                *failed = i;
+            }
+            texts += ops[i].text_len > 0;
+        } else if (steps[i].origin != BULK_NO_ORIGIN) {
+            // A note made by these operations is the temporary file written for it
+            steps[i].dev = steps[steps[i].origin].dev;
+            steps[i].ino = steps[steps[i].origin].ino;
+        }
+    }
+    if (!err && texts > 0) {
+        SyncWaiter* waiters = calloc(texts, sizeof(SyncWaiter));
+        size_t n = 0;
+        for (size_t i = 0; waiters && i < count; i++) {
+            if (steps[i].temp[0] && ops[i].text_len > 0) {
+                waiters[n] = (SyncWaiter){ .file_fd = openat(b.root_fd, steps[i].temp, O_RDONLY | O_CLOEXEC),
+                                           .dir_fd = -1 };
+                if (waiters[n++].file_fd < 0) {
+                    err = errno;
+                }
+            }
+        }
+        if (!waiters) {
+            err = ENOMEM;
+        } else if (!err) {
+            err = commit_wait(waiters, drop_shared_syncs(waiters, n, 0));
+        }
+        for (size_t i = 0; waiters && i < n; i++) {
+            if (waiters[i].file_fd >= 0) {
+                close(waiters[i].file_fd);
+            }
+        }
+        free(waiters);
+    }
+
+    // From here on the operations are finished, now or by bulk_recover() after a crash
+    char intent[256];
+    int intent_fd = err ? -1 : bulk_write_intent(&b, ops, steps, count, intent, sizeof(intent));
+    if (!err && intent_fd < 0) {
+        err = errno;
+    }
+    int pending = 0;
+    if (!err) {
+        size_t done;
+        if (bulk_run(&b, ops, steps, 0, count, intent_fd, &done) != 0) {
+            err = errno;
+            *failed = done;
+        }
+        // A book deletion that failed may have taken part of the book
+        *applied = done + (err && done < count && ops[done].type == BULK_DELETE_BOOK);
+        int sync_err = bulk_sync_dirs(&b);
+        if (!err && sync_err) {
+            err = sync_err;
+        }
+        if (!err) {
+            bulk_journal(ops, count);
+            // A crash before the intent is gone replays operations that are all done already
+            unlinkat(b.root_fd, intent, 0);
+        } else if (*applied == 0) {
+            // Nothing was changed, the bulk change is dropped as if the check had refused it
+            unlinkat(b.root_fd, intent, 0);
+        } else {
+            // The intent and the texts it names stay, its books are fenced until it is finished
+            pending = 1;
+            bulk_fence_add(intent, ops, count);
+        }
+        close(intent_fd);
+    }
+
+    bulk_free(&b, steps, count, pending);
+    bulk_unlock_notes(held);
+    // Rolled forward before returning when the error has gone away, as a replay would
+    if (pending && bulk_finish(NULL) == 0) {
+        err = 0;
+        *failed = count;
+        *applied = count;
+    }
+    if (root[0] != '\0') {
+        free(root);
+    }
+    errno = err;
+    return err ? -1 : 0;
+}
+
+// Reads an intent into ops and steps, whose names point into text; returns 1 if it is complete
+static int bulk_parse_intent(char* text, BulkOp** ops_out, BulkStep** steps_out, size_t* count_out,
+                             size_t* from)
+{
+    size_t lines = 0;
+    for (char* p = text; *p; p++) {
+        lines += *p == '\n';
+    }
+    BulkOp* ops = calloc(lines + 1, sizeof(BulkOp));
+    BulkStep* steps = calloc(lines + 1, sizeof(BulkStep));
+    *ops_out = ops;
+    *steps_out = steps;
+    *count_out = 0;
+    *from = 0;
+    if (!ops || !steps) {
+        return -1;
+    }
+
+    int complete = 0;
+    int first = 1;
+    char* save = NULL;
+    // A line without its newline was torn by the crash and is left out
+    for (char* line = text; line && *line; line = save) {
+        char* eol = strchr(line, '\n');
+        if (!eol) {
+            break;
+        }
+        *eol = '\0';
+        save = eol + 1;
+        if (first) {
+            if (strcmp(line, BULK_INTENT_MAGIC) != 0) {
+                return 0;
+            }
+            first = 0;
+            continue;
+        }
+        if (complete) {
+            unsigned long long mark;
+            if (sscanf(line, "mark %llu", &mark) == 1 && mark <= *count_out) {
+                *from = (size_t)mark;
+            }
+            continue;
+        }
+        if (strcmp(line, "end") == 0) {
+            complete = 1;
+            continue;
+        }
+
+        char* fields[8];
+        int n = 0;
+        for (char* f = line; n < 8; n++) {
+            fields[n] = f;
+            char* tab = strchr(f, '\t');
+            if (!tab) {
+                n++;
+                break;
+            }
+            *tab = '\0';
+            f = tab + 1;
+        }
+        if (n != 8) {
+            return -1;
+        }
+        BulkOp* op = &ops[*count_out];
+        BulkStep* step = &steps[*count_out];
+        op->type = atoi(fields[0]);
+        op->book = fields[1];
+        op->note = fields[2][0] ? fields[2] : NULL;
+        op->to_book = fields[3][0] ? fields[3] : NULL;
+        op->to_note = fields[4][0] ? fields[4] : NULL;
+        snprintf(step->temp, sizeof(step->temp), "%s", fields[5]);
+        step->dev = (dev_t)strtoull(fields[6], NULL, 10);
+        step->ino = (ino_t)strtoull(fields[7], NULL, 10);
+        if (op->type < BULK_CREATE_BOOK || op->type > BULK_MOVE_NOTE || !is_valid_name(op->book)) {
+            return -1;
+        }
+        (*count_out)++;
+    }
+    return complete;
+}
+
+// Finishes or discards the intent name, 1 if it was finished, 0 if skipped or discarded
+static int bulk_recover_one(const char* name)
+{
+    char* root = get_default_books_path("/books");
+    BulkState b = { .root_fd = -1, .root = root };
+    int dir_fd = open_dir(NULL);
+    int fd = dir_fd < 0 ? -1 : openat(dir_fd, name, O_RDWR | O_APPEND | O_CLOEXEC);
+    // A locked intent belongs to a bulk change still running
+    if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+        if (root[0] != '\0') {
+            free(root);
+        }
+        return 0;
+    }
+
+    struct stat st;
+    char* text = fstat(fd, &st) == 0 ? malloc((size_t)st.st_size + 1) : NULL;
+    ssize_t len = text ? pread(fd, text, (size_t)st.st_size, 0) : -1;
+    BulkOp* ops = NULL;
+    BulkStep* steps = NULL;
+    size_t count = 0;
+    size_t from = 0;
+    int complete = -1;
+    if (len >= 0) {
+        text[len] = '\0';
+        size_t name_len = strlen(name);
+        int renamed = name_len < strlen(BULK_INTENT_NEW) ||
+                      strcmp(name + name_len - strlen(BULK_INTENT_NEW), BULK_INTENT_NEW) != 0;
+        complete = bulk_parse_intent(text, &ops, &steps, &count, &from);
+        // Operations start only once the intent is complete and has its final name
+        if (complete > 0 && !renamed) {
+            complete = 0;
+        }
+    }
+
+    int err = complete < 0 ? EINVAL : bulk_init(&b, root, count);
+    close(dir_fd);
+    int recovered = 0;
+    unsigned char held[WRITE_NOTE_LOCKS];
+    bulk_lock_notes(ops, count, held);
+    if (!err && complete) {
+        for (size_t i = 0; i < count; i++) {
+            BulkName* book = bulk_name(&b, ops[i].book, NULL);
+            BulkName* to_book = ops[i].to_book ? bulk_name(&b, ops[i].to_book, NULL) : NULL;
+            if (!book || (ops[i].to_book && !to_book)) {
+                err = ENOMEM;
+                break;
+            }
+            bulk_touch(&b, book);
+            if (to_book) {
+                bulk_touch(&b, to_book);
+            }
+            b.root_touched |= ops[i].note == NULL;
+        }
+        size_t done;
+        if (!err && bulk_run(&b, ops, steps, from, count, fd, &done) != 0) {
+            err = errno;
+        }
+        if (!err) {
+            err = bulk_sync_dirs(&b);
+        }
+        if (!err) {
+            bulk_journal(ops, count);
+            recovered = 1;
+        }
+    }
+    if (err) {
+        fprintf(stderr, "Bulk change %s not recovered: %s\n", name, strerror(err));
+        if (complete > 0) {
+            bulk_fence_add(name, ops, count);
+        }
+    } else {
+        // Finished, or never started and only its temporary files are left
+        unlinkat(b.root_fd, name, 0);
+    }
+    bulk_free(&b, steps, count, err != 0 || complete);
+    bulk_unlock_notes(held);
+    close(fd);
+    free(ops);
+    free(text);
+    if (root[0] != '\0') {
+        free(root);
+    }
+    return recovered;
+}
+
+int bulk_recover(void)
+{
+    int dir_fd = open_dir(NULL);
+    if (dir_fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    DIR* dir = fdopendir(dir_fd);
+    if (!dir) {
+        close(dir_fd);
+        return -1;
+    }
+    char** names = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, BULK_INTENT_PREFIX, strlen(BULK_INTENT_PREFIX)) != 0) {
+            continue;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 16;
+            char** grown = realloc(names, cap * sizeof(char*));
+            if (!grown) {
+                break;
+            }
+            names = grown;
+        }
+        names[count] = strdup(entry->d_name);
+        count += names[count] != NULL;
+    }
+    closedir(dir);
+
+    int recovered = 0;
+    for (size_t i = 0; i < count; i++) {
+        recovered += bulk_recover_one(names[i]);
+        free(names[i]);
+    }
+    free(names);
+    return recovered;
+}
+
+void write_lock_note(const char* book_name, const char* note_name)
+{
+    pthread_mutex_lock(&note_locks[note_lock_index(book_name, note_name)]);
+}
+
+void write_unlock_note(const char* book_name, const char* note_name)
+{
+    pthread_mutex_unlock(&note_locks[note_lock_index(book_name, note_name)]);
+}
+
+void write_stats(WriteStats* st)
+{
+    pthread_mutex_lock(&commit.lock);
+    st->window_us = commit.window_us;
+    st->writes = commit.writes;
+    st->groups = commit.groups;
+    st->syncs = commit.syncs;
+    pthread_mutex_unlock(&commit.lock);
+}
@@ -0,0 +1,544 @@
+/*=================================================================================================
+ *
+ * 	@FILENAME:	      bsdwrite.h
+ * 	@BRIEF:    	      Crash-safe writes of notes and books.
+ * 	@DESCRIPTION:	  A note is written to a temporary file next to it and renamed over it, so a
+ * 	                  crash leaves either the old or the new text. The syncs that make a write
+ * 	                  durable are shared: writers arriving within a short window join one group,
+ * 	                  and one of them syncs for all, so many concurrent saves cost a few syncs.
+ * 	@AUTHOR		      Daniil (TwelveFacedJanus) Ermolaev.
+ * 	   | CONTACT:	  twofaced-janus@yandex.ru
+ *	@CREATED AT:	  10.16.26
+ *	@UPDATED_AT:	  10.16.26
+ *
+ *==================================================================================================*/
+
+#ifndef BSDWRITE_H_
+#define BSDWRITE_H_
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+// How long the first writer of a group waits for others to join
+#define WRITE_DEFAULT_WINDOW_US 1000
+// Writers in one group; later ones wait for the next
+#define WRITE_MAX_GROUP 256
+// Locks notes are hashed to by write_lock_note()
+#define WRITE_NOTE_LOCKS 64
+
+// Operations of bulk_apply()
+#define BULK_CREATE_BOOK 1
+#define BULK_DELETE_BOOK 2
+#define BULK_CREATE_NOTE 3
+#define BULK_DELETE_NOTE 4
+#define BULK_MOVE_NOTE   5
+
+// Intents of bulk changes not yet finished, in the books directory next to CHANGES_JOURNAL_FILE
+#define BULK_INTENT_PREFIX ".bsdbulk."
+// Suffix of an intent still being written
+#define BULK_INTENT_NEW ".new"
+// First line of an intent
+#define BULK_INTENT_MAGIC "bsdbulk 1"
+
+
+/*===============================================================================================
+ *
+ * 	@BRIEF:
+ * 		Group commit counters.
+ * 	@DESCRIPTION:
+ * 		Filled by write_stats(). writes / groups is the average group size.
+ * 	@PARAMETERS:
+ * 		WriteStats.window_us - int, current window;
+ * 		WriteStats.writes    - durable writes, deletes and book changes completed;
+ * 		WriteStats.groups    - groups synced;
+ * 		WriteStats.syncs     - fsync() and syncfs() calls made for them.
+ * 	@RETURN:
+ * 		None.
+ * 	@NOTES:
+ * 		None.
+ * 	@EXAMPLE:
+ * 		```c
+ * 		WriteStats st;
+ * 		write_stats(&st);
+ * 		```
+ * 	@UPDATES:
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *	 	      Struct has been created.
+ *
+ * =============================================================================================*/
+typedef struct WriteStats
+{
+	int window_us;
+	unsigned long long writes;
+	unsigned long long groups;
+	unsigned long long syncs;
+} WriteStats;
+
+/*===============================================================================================
+ *
+ * 	@BRIEF:
+ * 		One change to the text of a note.
+ * 	@DESCRIPTION:
+ * 		Replaces length bytes at offset with text. A length of 0 inserts, an empty text deletes.
+ * 	@PARAMETERS:
+ * 		NoteEdit.offset   - off_t, first byte replaced, in the note before any edit;
+ * 		NoteEdit.length   - off_t, bytes replaced;
+ * 		NoteEdit.text     - const char*, new bytes, not NUL-terminated;
+ * 		NoteEdit.text_len - size_t, their number.
+ * 	@RETURN:
+ * 		None.
+ * 	@NOTES:
+ * 		None.
+ * 	@EXAMPLE:
+ * 		```c
+ * 		NoteEdit e = { .offset = 120, .length = 5, .text = "fixed", .text_len = 5 };
+ * 		```
+ * 	@UPDATES:
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *	 	      Struct has been created.
+ *
+ * =============================================================================================*/
+typedef struct NoteEdit
+{
+	off_t offset;
+	off_t length;
+	const char* text;
+	size_t text_len;
+} NoteEdit;
+
+/*===============================================================================================
+ *
+ * 	@BRIEF:
+ * 		One operation of a bulk change.
+ * 	@DESCRIPTION:
+ * 		BULK_CREATE_BOOK and BULK_DELETE_BOOK use book. BULK_CREATE_NOTE creates note in book
+ * 		with text, or empty; BULK_DELETE_NOTE deletes it; BULK_MOVE_NOTE renames it to to_note
+ * 		in to_book.
+ * 	@PARAMETERS:
+ * 		BulkOp.type     - int, BULK_*;
+ * 		BulkOp.book     - const char*, book;
+ * 		BulkOp.note     - const char*, note without .bdsb, NULL for book operations;
+ * 		BulkOp.to_book  - const char*, book a note is moved to;
+ * 		BulkOp.to_note  - const char*, its name there;
+ * 		BulkOp.text     - const char*, text of a created note, not NUL-terminated;
+ * 		BulkOp.text_len - size_t, its length, 0 for an empty note.
+ * 	@RETURN:
+ * 		None.
+ * 	@NOTES:
+ * 		None.
+ * 	@EXAMPLE:
+ * 		```c
+ * 		BulkOp op = { .type = BULK_MOVE_NOTE, .book = "Inbox", .note = "a",
+ * 		              .to_book = "Archive", .to_note = "a" };
+ * 		```
+ * 	@UPDATES:
+ *	 10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *	 	      Struct has been created.
+ *
+ * =============================================================================================*/
+typedef struct BulkOp
+{
+	int type;
+	const char* book;
+	const char* note;
+	const char* to_book;
+	const char* to_note;
+	const char* text;
+	size_t text_len;
+} BulkOp;
+
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Sets the group commit window.
+ *     @DESCRIPTION:
+ *          The first writer of a group waits up to this long before syncing, so writers that
+ *          arrive meanwhile share its syncs. It stops waiting once the group is as large as the
+ *          last one. With 0 only writers that arrive while a sync is running are grouped.
+ *     @PARAMETERS:
+ *          - int window_us: Microseconds, 0 for no wait
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - A lone writer after a busy period waits the whole window once
+ *          - WRITE_DEFAULT_WINDOW_US until this is called
+ *     @EXAMPLE:
+ *          ```c
+ *          write_set_window(2000);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void write_set_window(int window_us);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Makes each group flush whole filesystems.
+ *     @DESCRIPTION:
+ *          By default a group calls fsync() once per distinct file and once per distinct
+ *          directory. When on, it calls syncfs() once per filesystem instead, which costs one
+ *          call for any number of writers but also flushes everything else dirty on that
+ *          filesystem, and may report another file's error as a failure of the write.
+ *     @PARAMETERS:
+ *          - int on: 1 for syncfs(), 0 for fsync()
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - Linux only, ignored elsewhere
+ *          - Off until this is called
+ *     @EXAMPLE:
+ *          ```c
+ *          write_set_syncfs(1);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void write_set_syncfs(int on);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Creates or replaces a note, durably.
+ *     @DESCRIPTION:
+ *          Writes the text to a hidden temporary file in the book, syncs it, renames it over
+ *          the note and syncs the book directory. Readers see the old note or the new one,
+ *          never a partial write. Drops the note from the note cache and records the change.
+ *     @PARAMETERS:
+ *          - const char* book_name: Name of an existing book
+ *          - const char* note_name: Name of the note without .bdsb
+ *          - const void* data: New text
+ *          - size_t len: Its length
+ *          - struct stat* st: Set to the new note's stat, may be NULL
+ *     @RETURN:
+ *          - 1 if the note was created, 0 if it was replaced
+ *          - -1 with errno set: EINVAL for a bad name, ENOENT if the book does not exist
+ *     @NOTES:
+ *          - Blocks until the write is durable, up to the window plus two syncs
+ *          - On Linux a group is flushed with syncfs(), which also flushes whatever else is dirty
+ *            on the filesystem of the books
+ *          - Thread-safe
+ *     @EXAMPLE:
+ *          ```c
+ *          const char* text = "#todo read K&R\n";
+ *          write_note_durable("Programming", "C_Tips", text, strlen(text), NULL);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int write_note_durable(const char* book_name, const char* note_name, const void* data, size_t len,
+                       struct stat* st);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Applies edits to a note, durably.
+ *     @DESCRIPTION:
+ *          Like write_note_durable(), but the new text is the note read from src_fd with the edits
+ *          applied. The bytes between the edits are copied file to file by the kernel, with
+ *          copy_file_range() on Linux, which shares the blocks on filesystems that can.
+ *     @PARAMETERS:
+ *          - const char* book_name: Name of the book
+ *          - const char* note_name: Name of the note without .bdsb
+ *          - int src_fd: The current note, opened for reading
+ *          - const NoteEdit* edits: Edits sorted by offset, not overlapping
+ *          - size_t count: Number of edits
+ *          - struct stat* st: Set to the new note's stat, may be NULL
+ *     @RETURN:
+ *          - 0 if the note was replaced, 1 if it had been deleted meanwhile and was created
+ *          - -1 with errno set, EINVAL for unsorted, overlapping or out of range edits
+ *     @NOTES:
+ *          - Hold write_lock_note() from reading the note to here, or a concurrent save is lost
+ *          - Thread-safe
+ *     @EXAMPLE:
+ *          ```c
+ *          NoteEdit e = { .offset = 0, .length = 0, .text = "# Title\n", .text_len = 8 };
+ *          patch_note_durable("Programming", "C_Tips", fd, &e, 1, &st);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int patch_note_durable(const char* book_name, const char* note_name, int src_fd, const NoteEdit* edits,
+                       size_t count, struct stat* st);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Applies many book and note operations as one.
+ *     @DESCRIPTION:
+ *          Every operation is first checked against the books as the operations before it leave
+ *          them; if one cannot be carried out nothing is changed. The created notes are then
+ *          written to temporary files, their texts synced in one group, and the whole list
+ *          written and synced as an intent file (BULK_INTENT_PREFIX) in the books directory.
+ *          The operations are carried out in order through directory descriptors opened once
+ *          per book, every book directory that changed synced once, in one group with other
+ *          writers, the changes journaled in one run with consecutive numbers and the intent
+ *          removed.
+ *     @PARAMETERS:
+ *          - const BulkOp* ops: Operations, in order
+ *          - size_t count: Number of operations
+ *          - size_t* failed: Set to the index of the operation that failed, or count
+ *          - size_t* applied: Set to the number of operations carried out, 0 if one was refused
+ *     @RETURN:
+ *          - 0 once all operations are durable
+ *          - -1 with errno set: EINVAL for a bad name or type, ENOENT for a missing book or note,
+ *            EEXIST for one that would be created twice, EBUSY for a book an unfinished bulk
+ *            change holds, or the I/O error that stopped them
+ *     @NOTES:
+ *          - Once the intent is written the change is finished. After an error part way through
+ *            it is replayed at once; if that fails too its books are fenced, and writes to them
+ *            fail with EBUSY until bulk_finish() gets it done. After a crash bulk_recover()
+ *            finishes it
+ *          - Holds the write_lock_note() locks of every note it names, all of them if it
+ *            deletes a book, so single writes of this process cannot interleave
+ *          - Created and moved notes never replace a note another process put there since the
+ *            check, the operation fails with EEXIST instead
+ *          - Thread-safe
+ *     @EXAMPLE:
+ *          ```c
+ *          BulkOp ops[] = {
+ *              { .type = BULK_CREATE_BOOK, .book = "Archive" },
+ *              { .type = BULK_MOVE_NOTE, .book = "Inbox", .note = "a", .to_book = "Archive", .to_note = "a" },
+ *              { .type = BULK_DELETE_BOOK, .book = "Inbox" },
+ *          };
+ *          size_t failed, applied;
+ *          if (bulk_apply(ops, 3, &failed, &applied) != 0) {
+ *              fprintf(stderr, "operation %zu: %s\n", failed + 1, strerror(errno));
+ *          }
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FIX]:
+ *               Takes the note locks and never renames over a note created since the check.
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [FIX]:
+ *               Rolls forward before returning, or fences the books it left part way.
+ *
+ =========================================================================================*/
+int bulk_apply(const BulkOp* ops, size_t count, size_t* failed, size_t* applied);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Finishes bulk changes a crash or an I/O error interrupted.
+ *     @DESCRIPTION:
+ *          Replays every intent left in the books directory. An operation that was already
+ *          carried out is recognised and skipped: a created note by its temporary file being
+ *          gone, a deleted or moved one by its name no longer holding the file the check saw,
+ *          and book deletions by a mark written to the intent once they were synced. Replayed
+ *          changes are synced, journaled and the intent removed. An intent that was never
+ *          completed is discarded with its temporary files, none of its operations ran.
+ *     @PARAMETERS:
+ *          - None
+ *     @RETURN:
+ *          - Number of bulk changes finished
+ *          - -1 if the books directory cannot be read
+ *     @NOTES:
+ *          - Intents of bulk changes still running in this or another process are left alone
+ *          - An intent that fails again stays for the next call
+ *          - Called when the server starts and before `bsdnotes bulk`
+ *     @EXAMPLE:
+ *          ```c
+ *          if (bulk_recover() > 0) {
+ *              printf("Finished interrupted bulk changes\n");
+ *          }
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int bulk_recover(void);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Finishes the fenced bulk changes that name a book.
+ *     @DESCRIPTION:
+ *          A bulk change that stopped part way and could not be replayed at once fences its
+ *          books: write_note_durable(), patch_note_durable(), delete_note_durable(),
+ *          create_book_durable(), delete_book_durable() and bulk_apply() refuse them with EBUSY.
+ *          This replays such changes from their intents as bulk_recover() would and lifts the
+ *          fence of each one that is done.
+ *     @PARAMETERS:
+ *          - const char* book_name: Book to free, NULL for all fenced bulk changes
+ *     @RETURN:
+ *          - 0 if no unfinished bulk change names the book any more, -1 with errno EBUSY otherwise
+ *     @NOTES:
+ *          - Takes note locks, call it without holding one
+ *          - Thread-safe
+ *     @EXAMPLE:
+ *          ```c
+ *          if (bulk_finish("Inbox") != 0) {
+ *              // 503, retry later
+ *          }
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int bulk_finish(const char* book_name);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Serialises the writers of a note.
+ *     @DESCRIPTION:
+ *          Held from checking a note's ETag to replacing it, so two conditional writes based
+ *          on one version cannot both succeed. Notes are hashed to WRITE_NOTE_LOCKS locks.
+ *     @PARAMETERS:
+ *          - const char* book_name: Name of the book
+ *          - const char* note_name: Name of the note without .bdsb
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - Covers the threads of this process only, not the command line
+ *          - Hold one note lock at a time, two notes may share a lock
+ *          - bulk_apply() takes these locks itself, do not hold one around it
+ *     @EXAMPLE:
+ *          ```c
+ *          write_lock_note("Programming", "C_Tips");
+ *          // check If-Match, patch
+ *          write_unlock_note("Programming", "C_Tips");
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void write_lock_note(const char* book_name, const char* note_name);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Releases the lock taken by write_lock_note().
+ *     @DESCRIPTION:
+ *          Must be called with the same names.
+ *     @PARAMETERS:
+ *          - const char* book_name: Name of the book
+ *          - const char* note_name: Name of the note without .bdsb
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - None
+ *     @EXAMPLE:
+ *          ```c
+ *          write_unlock_note("Programming", "C_Tips");
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void write_unlock_note(const char* book_name, const char* note_name);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Deletes a note, durably.
+ *     @DESCRIPTION:
+ *          Unlinks the note and syncs the book directory with the current group.
+ *     @PARAMETERS:
+ *          - const char* book_name: Name of the book
+ *          - const char* note_name: Name of the note without .bdsb
+ *     @RETURN:
+ *          - 0 on success
+ *          - -1 with errno set, ENOENT if there is no such note
+ *     @NOTES:
+ *          - Thread-safe
+ *     @EXAMPLE:
+ *          ```c
+ *          delete_note_durable("Programming", "C_Tips");
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int delete_note_durable(const char* book_name, const char* note_name);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Creates a book, durably.
+ *     @DESCRIPTION:
+ *          Unlike create_book() it prints nothing, for use by the server.
+ *     @PARAMETERS:
+ *          - const char* book_name: Name of the book
+ *     @RETURN:
+ *          - 0 on success
+ *          - -1 with errno set, EEXIST if the book exists
+ *     @NOTES:
+ *          - Thread-safe
+ *     @EXAMPLE:
+ *          ```c
+ *          create_book_durable("Programming");
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int create_book_durable(const char* book_name);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Deletes a book and its notes, durably.
+ *     @DESCRIPTION:
+ *          Removes the book directory recursively, then syncs the books directory.
+ *     @PARAMETERS:
+ *          - const char* book_name: Name of the book
+ *     @RETURN:
+ *          - 0 on success
+ *          - -1 with errno set, ENOENT if there is no such book
+ *     @NOTES:
+ *          - A crash halfway leaves some of the notes
+ *          - Thread-safe
+ *     @EXAMPLE:
+ *          ```c
+ *          delete_book_durable("Programming");
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+int delete_book_durable(const char* book_name);
+
+/* ==============================================================================================
+ *
+ *     @BRIEF:
+ *          Reads the group commit counters.
+ *     @DESCRIPTION:
+ *          Read under the group lock, the counters are consistent with each other.
+ *     @PARAMETERS:
+ *          - WriteStats* st: Filled with the counters
+ *     @RETURN:
+ *          - None
+ *     @NOTES:
+ *          - Served by GET /stats/writes
+ *     @EXAMPLE:
+ *          ```c
+ *          WriteStats st;
+ *          write_stats(&st);
+ *          printf("%llu writes in %llu groups\n", st.writes, st.groups);
+ *          ```
+ *     @UPDATES:
+ *      10.16.26 - [ Daniil (TwelveFacedJanus) Ermolaev ] - [NEW]:
+ *               Function created.
+ *
+ =========================================================================================*/
+void write_stats(WriteStats* st);
+
+#endif
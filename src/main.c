@@ -69,6 +69,125 @@ void show_tui() {
     endwin();
 }
 
+// One line of a bulk file, in the words of the create and delete commands: 1, 0 for a blank
+// or comment line, -1 if it is not an operation
+static int parse_bulk_line(char* line, BulkOp* op) {
+    char* words[7];
+    int count = 0;
+    char* save = NULL;
+    for (char* w = strtok_r(line, " \t\r\n", &save); w; w = strtok_r(NULL, " \t\r\n", &save)) {
+        if (count == 7) {
+            return -1;
+        }
+        words[count++] = w;
+    }
+    if (count == 0 || words[0][0] == '#') {
+        return 0;
+    }
+    *op = (BulkOp){0};
+    int book = count == 3 && strcmp(words[1], "book") == 0;
+    int note = count == 4 && strcmp(words[1], "note") == 0;
+    if (strcmp(words[0], "create") == 0 && (book || note)) {
+        op->type = book ? BULK_CREATE_BOOK : BULK_CREATE_NOTE;
+    } else if (strcmp(words[0], "delete") == 0 && (book || note)) {
+        op->type = book ? BULK_DELETE_BOOK : BULK_DELETE_NOTE;
+    } else if (strcmp(words[0], "move") == 0 && count == 6 && strcmp(words[1], "note") == 0) {
+        op->type = BULK_MOVE_NOTE;
+        op->to_book = words[4];
+        op->to_note = words[5];
+    } else {
+        return -1;
+    }
+    op->book = words[2];
+    op->note = book ? NULL : words[3];
+    return 1;
+}
+
+// bulk [FILE]: every operation of the file, or of stdin, as one
+static int run_bulk(const char* file_name) {
+    FILE* fp = file_name ? fopen(file_name, "r") : stdin;
+    if (!fp) {
+        printf("Cannot open %s: %s\n", file_name, strerror(errno));
+        return 1;
+    }
+    BulkOp* ops = NULL;
+    size_t* line_numbers = NULL;
+    char** lines = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    size_t line_number = 0;
+    int rc = 0;
+    // Six names and three words fit easily
+    char buf[4096];
+    while (fgets(buf, sizeof(buf), fp)) {
+        line_number++;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 256;
+            BulkOp* grown_ops = realloc(ops, cap * sizeof(BulkOp));
+            ops = grown_ops ? grown_ops : ops;
+            size_t* grown_numbers = realloc(line_numbers, cap * sizeof(size_t));
+            line_numbers = grown_numbers ? grown_numbers : line_numbers;
+            char** grown_lines = realloc(lines, cap * sizeof(char*));
+            lines = grown_lines ? grown_lines : lines;
+            if (!grown_ops || !grown_numbers || !grown_lines) {
+                perror("realloc");
+                rc = 1;
+                break;
+            }
+        }
+        // The operations point into the line, it is kept until they are applied
+        char* line = strdup(buf);
+        if (!line) {
+            perror("strdup");
+            rc = 1;
+            break;
+        }
+        int parsed = parse_bulk_line(line, &ops[count]);
+        if (parsed < 0) {
+            printf("Line %zu: unknown operation\n", line_number);
+            free(line);
+            rc = 1;
+            break;
+        }
+        if (parsed == 0) {
+            free(line);
+            continue;
+        }
+        line_numbers[count] = line_number;
+        lines[count++] = line;
+    }
+    if (file_name) {
+        fclose(fp);
+    }
+
+    size_t failed;
+    size_t applied;
+    // An earlier run may have been interrupted, its operations come first
+    int recovered = rc == 0 ? bulk_recover() : 0;
+    if (recovered > 0) {
+        printf("%d interrupted bulk change(s) finished.\n", recovered);
+    }
+    if (rc == 0 && bulk_apply(ops, count, &failed, &applied) != 0) {
+        if (failed < count) {
+            printf("Line %zu: %s\n", line_numbers[failed], strerror(errno));
+        } else {
+            printf("Bulk change failed: %s\n", strerror(errno));
+        }
+        printf("%zu of %zu operations applied%s.\n", applied, count,
+               applied > 0 ? ", the rest follows on the next start" : "");
+        rc = 1;
+    } else if (rc == 0) {
+        printf("%zu operations applied!\n", count);
+    }
+    for (size_t i = 0; i < count; i++) {
+        free(lines[i]);
+    }
+    free(lines);
+    free(line_numbers);
+    free(ops);
+    return rc;
+}
+
 int main(int argc, char* argv[]) {
     if (argc < 2) {
         show_welcome_and_help();
@@ -82,7 +201,28 @@ int main(int argc, char* argv[]) {
     }
 
     if (argc >= 2 && strcmp(argv[1], "--server") == 0) {
-        return run_http_server();
+        ServerConfig cfg = { .port = PORT, .workers = 1 };
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+                cfg.workers = atoi(argv[++i]);
+            } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+                cfg.port = atoi(argv[++i]);
+            } else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc) {
+                cfg.idle_timeout_ms = atoi(argv[++i]) * 1000;
+            } else if (strcmp(argv[i], "--note-cache") == 0 && i + 1 < argc) {
+                long mb = atol(argv[++i]);
+                cfg.note_cache_bytes = mb > 0 ? (size_t)mb * 1024 * 1024 : SERVER_NOTE_CACHE_OFF;
+            } else if (strcmp(argv[i], "--commit-window") == 0 && i + 1 < argc) {
+                int us = atoi(argv[++i]);
+                cfg.commit_window_us = us > 0 ? us : SERVER_COMMIT_WINDOW_NONE;
+            } else if (strcmp(argv[i], "--commit-syncfs") == 0) {
+                cfg.commit_syncfs = 1;
+            } else {
+                show_welcome_and_help();
+                return 1;
+            }
+        }
+        return run_http_server_cfg(&cfg);
     }
 
     if (strcmp(argv[1], "install") == 0) {
@@ -93,15 +233,19 @@ int main(int argc, char* argv[]) {
             char book_path[1024];
             snprintf(book_path, sizeof(book_path), "%s/%s", default_books_path, argv[3]);
             free(default_books_path);
-            if (delete_folder_recursive(book_path) == 0)
+            if (delete_folder_recursive(book_path) == 0) {
+                changes_record(CHANGE_BOOK_DELETED, argv[3], NULL, NULL, NULL);
                 printf("Book has been deleted!\n");
+            }
         } else if (argc >= 5 && strcmp(argv[2], "note") == 0) {
             char* default_books_path = get_default_books_path("/books");
             char note_path[1024];
             snprintf(note_path, sizeof(note_path), "%s/%s/%s.bdsb", default_books_path, argv[3], argv[4]);
             free(default_books_path);
-            if (remove(note_path) == 0)
+            if (remove(note_path) == 0) {
+                changes_record(CHANGE_NOTE_DELETED, argv[3], argv[4], NULL, NULL);
                 printf("Note has been deleted!\n");
+            }
         }
     } else if (argc >= 3 && strcmp(argv[1], "create") == 0) {
         if (strcmp(argv[2], "book") == 0 && argc >= 4) {
@@ -109,6 +253,8 @@ int main(int argc, char* argv[]) {
         } else if (strcmp(argv[2], "note") == 0 && argc >= 5) {
             create_note(argv[3], argv[4]);
         }
+    } else if (strcmp(argv[1], "bulk") == 0) {
+        return run_bulk(argc >= 3 && strcmp(argv[2], "-") != 0 ? argv[2] : NULL);
     } else if (strcmp(argv[1], "show") == 0) {
         if (argc >= 3 && strcmp(argv[2], "todos") == 0) {
             show_todos();
@@ -117,6 +263,8 @@ int main(int argc, char* argv[]) {
         } else if (argc >= 3) {
             print_notes_from_book(argv[2]);
         }
+    } else if (strcmp(argv[1], "find") == 0 && argc >= 3) {
+        find_notes(argv[2]);
     } else if (strcmp(argv[1], "books") == 0) {
         get_books();
     } else if (strcmp(argv[1], "edit") == 0 && argc >= 4) {
@@ -124,9 +272,22 @@ int main(int argc, char* argv[]) {
         char note_path[1024];
         snprintf(note_path, sizeof(note_path), "%s/%s/%s.bdsb", default_books_path, argv[2], argv[3]);
         free(default_books_path);
+        // The editor cannot tell us what it did, the note's stat before and after can
+        struct stat before, after;
+        int existed = stat(note_path, &before) == 0;
         char command[1024];
         snprintf(command, sizeof(command), "nvim %s", note_path);
         system(command); // Open the note in NeoVim
+        int exists = stat(note_path, &after) == 0;
+        if (existed && !exists) {
+            changes_record(CHANGE_NOTE_DELETED, argv[2], argv[3], NULL, NULL);
+        } else if (!existed && exists) {
+            changes_record(CHANGE_NOTE_CREATED, argv[2], argv[3], NULL, NULL);
+        } else if (exists && (before.st_ino != after.st_ino || before.st_size != after.st_size ||
+                              before.st_mtime != after.st_mtime)) {
+            changes_record(CHANGE_NOTE_MODIFIED, argv[2], argv[3], NULL, NULL);
+        }
+        index_refresh_book(argv[2]); // Editors may rewrite the note in place
     } else {
         show_welcome_and_help();
     }